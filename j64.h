@@ -17,6 +17,8 @@
 
 #ifdef J64_DEBUG
 #include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
 #define j64__assert(x) assert(x)
 #else
 #define j64__assert(x)
@@ -37,12 +39,169 @@
 #define J64_FREE free
 #endif
 
+#if defined(J64_REFCOUNT_ATOMIC) && !defined(J64_REFCOUNT)
+#define J64_REFCOUNT
+#endif /* J64_REFCOUNT_ATOMIC */
+
+#if (defined(J64_IO_URING) || defined(J64_GZIP) || defined(J64_ZSTD)) && \
+    !defined(J64_FILE_IO)
+#define J64_FILE_IO
+#endif /* J64_IO_URING || J64_GZIP || J64_ZSTD */
+
 #define J64__MIN(a, b) ((a) < (b) ? (a) : (b))
+#define J64__MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#if defined(__GNUC__) || defined(__clang__)
+#define J64__PREFETCH(p) __builtin_prefetch(p)
+#define J64__COUNT(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#else
+#define J64__PREFETCH(p) ((void)(p))
+#define J64__COUNT(p, n) (*(p) += (n))
+#endif /* __GNUC__ || __clang__ */
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef J64_ALLOC_STATS
+/*
+ * Allocation counters. With J64_ALLOC_STATS defined, every J64_MALLOC,
+ * J64_REALLOC and J64_FREE call in the library goes through a wrapper
+ * that counts it before calling the allocator configured above. The
+ * counters are global. With GCC or Clang each is updated atomically, so
+ * threads such as the one behind j64_inflate_read may allocate at the
+ * same time, but reading or resetting them while others allocate gives
+ * counters from different moments.
+ */
+struct j64_alloc_stats {
+	size_t	nmalloc;
+	size_t	nrealloc;	/* realloc of NULL counts as malloc */
+	size_t	nfree;
+	size_t	bytes;		/* requested by malloc and realloc */
+};
+
+J64_STATIC_API struct j64_alloc_stats j64__alloc_stats;
+
+J64_API void *
+j64__counted_malloc(size_t size)
+{
+	void *p = J64_MALLOC(size);
+
+	if (p != NULL) {
+		J64__COUNT(&j64__alloc_stats.nmalloc, 1);
+		J64__COUNT(&j64__alloc_stats.bytes, size);
+	}
+
+	return p;
+}
+
+J64_API void *
+j64__counted_realloc(void *ptr, size_t size)
+{
+	void *p = J64_REALLOC(ptr, size);
+
+	if (p != NULL) {
+		if (ptr != NULL)
+			J64__COUNT(&j64__alloc_stats.nrealloc, 1);
+		else
+			J64__COUNT(&j64__alloc_stats.nmalloc, 1);
+		J64__COUNT(&j64__alloc_stats.bytes, size);
+	}
+
+	return p;
+}
+
+J64_API void
+j64__counted_free(void *ptr)
+{
+	if (ptr != NULL)
+		J64__COUNT(&j64__alloc_stats.nfree, 1);
+	J64_FREE(ptr);
+}
+
+#undef J64_MALLOC
+#undef J64_REALLOC
+#undef J64_FREE
+#define J64_MALLOC	j64__counted_malloc
+#define J64_REALLOC	j64__counted_realloc
+#define J64_FREE	j64__counted_free
+
+J64_API void
+j64_alloc_stats_get(struct j64_alloc_stats *out)
+{
+	*out = j64__alloc_stats;
+}
+
+J64_API void
+j64_alloc_stats_reset(void)
+{
+	memset(&j64__alloc_stats, 0, sizeof(j64__alloc_stats));
+}
+#endif /* J64_ALLOC_STATS */
+
+/*
+ * Tracing. With J64_TRACE defined, parsing, encoding, box allocation and
+ * container growth add their calls, clock ticks and bytes to global
+ * counters, read with j64_trace_get. Ticks come from J64_TRACE_CLOCK,
+ * the time stamp counter on x86 by default. Without J64_TRACE the trace
+ * points compile to nothing. As with the allocation counters, each
+ * counter is updated atomically with GCC or Clang, but a read is not a
+ * snapshot while other threads are working.
+ */
+#ifdef J64_TRACE
+#ifndef J64_TRACE_CLOCK
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define J64_TRACE_CLOCK()	((uint64_t)__builtin_ia32_rdtsc())
+#else
+#include <time.h>
+#define J64_TRACE_CLOCK()	((uint64_t)clock())
+#endif
+#endif /* J64_TRACE_CLOCK */
+
+struct j64_trace_phase {
+	uint64_t	calls;
+	uint64_t	ticks;
+	uint64_t	bytes;
+};
+
+struct j64_trace {
+	struct j64_trace_phase	parse;	/* bytes of input */
+	struct j64_trace_phase	encode;	/* bytes of output */
+	struct j64_trace_phase	alloc;	/* bytes of new boxes */
+	struct j64_trace_phase	grow;	/* bytes of grown boxes and stacks */
+};
+
+J64_STATIC_API struct j64_trace j64__trace;
+
+J64_API void
+j64__trace_add(struct j64_trace_phase *phase, uint64_t t0, size_t bytes)
+{
+	J64__COUNT(&phase->calls, 1);
+	J64__COUNT(&phase->ticks, J64_TRACE_CLOCK() - t0);
+	J64__COUNT(&phase->bytes, bytes);
+}
+
+J64_API void
+j64_trace_get(struct j64_trace *out)
+{
+	*out = j64__trace;
+}
+
+J64_API void
+j64_trace_reset(void)
+{
+	memset(&j64__trace, 0, sizeof(j64__trace));
+}
+
+#define J64__TRACE_BEGIN(t0)		((t0) = J64_TRACE_CLOCK())
+#define J64__TRACE_END(phase, t0, n)	j64__trace_add(&j64__trace.phase, (t0), (n))
+#else
+#define J64__TRACE_BEGIN(t0)		((t0) = 0)
+#define J64__TRACE_END(phase, t0, n)	((void)(t0), (void)(n))
+#endif /* J64_TRACE */
+
 /* J64 union type for different types of accesses */
 typedef union {
 	uint64_t	w;
@@ -76,6 +235,7 @@ typedef union {
 
 /* Forward declaration */
 J64_API void j64_free(j64_t);
+J64_API void j64_release(j64_t);
 
 /*
  * Literal subtype constants and functions
@@ -97,6 +257,21 @@ J64_API void j64_free(j64_t);
 
 #define J64_TYPE_LIT_GET(j)	((j).w & J64__TYPE_LIT_MASK)
 
+/*
+ * Constant words for literals. These and the other *_W macros below are
+ * constant expressions, usable in static initializers and case labels:
+ *
+ *	static const j64_t k = { J64_INT_W(42) };
+ */
+#define J64_UNDEF_W		((uint64_t)J64_TYPE_LIT_UNDEF)
+#define J64_NULL_W		((uint64_t)J64_TYPE_LIT_NULL)
+#define J64_FALSE_W		((uint64_t)J64_TYPE_LIT_FALSE)
+#define J64_TRUE_W		((uint64_t)J64_TYPE_LIT_TRUE)
+#define J64_BOOL_W(b)		((b) ? J64_TRUE_W : J64_FALSE_W)
+#define J64_ESTR_W		((uint64_t)J64_TYPE_LIT_ESTR)
+#define J64_EARR_W		((uint64_t)J64_TYPE_LIT_EARR)
+#define J64_EOBJ_W		((uint64_t)J64_TYPE_LIT_EOBJ)
+
 J64_API j64_t
 j64_undef(void)
 {
@@ -260,6 +435,9 @@ j64_eobj_encode(char *buf, size_t len)
 #define J64_INT_MIN             (-0x1fffffffffffffffLL - 1)
 #define J64_INT_MAX             (0x1fffffffffffffffLL)
 
+/* Constant word for an integer between J64_INT_MIN and J64_INT_MAX */
+#define J64_INT_W(i)		(((uint64_t)(int64_t)(i) << J64__INT_OFFS) | J64_TYPE_INT0)
+
 J64_API j64_t
 j64_int(int64_t i)
 {
@@ -267,8 +445,7 @@ j64_int(int64_t i)
 
 	j64__assert(J64_INT_MIN <= i && i <= J64_INT_MAX);
 
-	j.i = i << J64__INT_OFFS;
-	j.w |= J64_TYPE_INT0;
+	j.w = J64_INT_W(i);
 
 	return j;
 }
@@ -287,6 +464,31 @@ j64_int_get(j64_t j)
 	return j.i >> J64__INT_OFFS;
 }
 
+/* Longest encoding of an integer, J64_INT_MIN */
+#define J64_INT_ENCODE_MAX	20
+
+J64_API size_t
+j64_int_encode(j64_t j, char *buf, size_t len)
+{
+	char tmp[J64_INT_ENCODE_MAX];
+	int64_t i;
+	uint64_t u;
+	size_t n = sizeof(tmp);
+
+	i = j64_int_get(j);
+	u = i < 0 ? 0 - (uint64_t)i : (uint64_t)i;
+	do {
+		tmp[--n] = (char)('0' + u % 10);
+		u /= 10;
+	} while (u != 0);
+	if (i < 0)
+		tmp[--n] = '-';
+
+	len = J64__MIN(len, sizeof(tmp) - n);
+	memcpy(buf, &tmp[n], len);
+	return len;
+}
+
 /*
  * Floats
  */
@@ -295,6 +497,12 @@ j64_int_get(j64_t j)
 #define J64__FLOAT_OFFS 3
 #define J64__FLOAT_MASK 0xfffffffffffffff8
 
+/*
+ * Constant word for a float given its IEEE 754 bit pattern,
+ * since C has no constant expression for the bits of a double.
+ */
+#define J64_FLOAT_BITS_W(bits)	(((uint64_t)(bits) & J64__FLOAT_MASK) | J64_TYPE_FLOAT)
+
 J64_API j64_t
 j64_float(double f)
 {
@@ -321,6 +529,45 @@ j64_float_get(j64_t j)
 	return j.f;
 }
 
+/* Longest encoding of a float, such as -2.2250738585072014e-308 */
+#define J64_FLOAT_ENCODE_MAX	24
+
+/*
+ * Encodes a float with the fewest digits, from 15 to 17, that decode
+ * back to the same value. Integral values get a ".0" so that they decode
+ * as floats again, and infinities and NaNs, which JSON lacks, are null.
+ */
+J64_API size_t
+j64_float_encode(j64_t j, char *buf, size_t len)
+{
+	char tmp[32];
+	double f;
+	size_t n;
+	int prec;
+
+	f = j64_float_get(j);
+	if (f - f != 0.0)
+		return j64_null_encode(buf, len);
+
+	for (prec = 15; prec < 17; prec++) {
+		sprintf(tmp, "%.*g", prec, f);
+		if (j64_float(strtod(tmp, NULL)).w == j.w)
+			break;
+	}
+	if (prec == 17)
+		sprintf(tmp, "%.17g", f);
+
+	n = strlen(tmp);
+	if (strcspn(tmp, ".e") == n) {
+		tmp[n++] = '.';
+		tmp[n++] = '0';
+	}
+
+	len = J64__MIN(len, n);
+	memcpy(buf, tmp, len);
+	return len;
+}
+
 /*
  * Immediate string constants and functions
  */
@@ -331,6 +578,20 @@ j64_float_get(j64_t j)
 
 #define J64_ISTR_LEN_MAX	7
 
+/*
+ * Constant word for an immediate string of LEN characters, with unused
+ * characters given as 0. Like j64_istr, assumes a little-endian word.
+ *
+ *	static const j64_t key_id = { J64_ISTR_W(2, 'i', 'd', 0, 0, 0, 0, 0) };
+ */
+#define J64__ISTR_C(c, n)	((uint64_t)(unsigned char)(c) << (8 * (n)))
+#define J64_ISTR_W(len, c1, c2, c3, c4, c5, c6, c7)				\
+	(J64__ISTR_C(c1, 1) | J64__ISTR_C(c2, 2) | J64__ISTR_C(c3, 3) |	\
+	 J64__ISTR_C(c4, 4) | J64__ISTR_C(c5, 5) | J64__ISTR_C(c6, 6) |	\
+	 J64__ISTR_C(c7, 7) |							\
+	 (((uint64_t)(len) << J64__ISTR_LEN_OFFS) & J64__ISTR_LEN_MASK) |	\
+	 J64_TYPE_ISTR)
+
 J64_API j64_t
 j64_istr(const void *buf, size_t len)
 {
@@ -369,6 +630,282 @@ j64_istr_get(j64_t j, void *buf, size_t len)
 	return n;
 }
 
+/*
+ * Box header flags, kept in the top bits of the length or capacity
+ * field of a box header, which valid lengths and capacities never reach.
+ */
+
+/* Segmented array layout */
+#define J64__HDR_SEG		(SIZE_MAX ^ (SIZE_MAX >> 1))
+/* Statically allocated, read-only box that is never freed */
+#define J64__HDR_STATIC		((SIZE_MAX >> 1) ^ (SIZE_MAX >> 2))
+/* Sealed object layout */
+#define J64__HDR_SEALED		((SIZE_MAX >> 2) ^ (SIZE_MAX >> 3))
+
+#define J64__HDR_FLAGS		(J64__HDR_SEG | J64__HDR_STATIC | J64__HDR_SEALED)
+#define J64__HDR_SIZE(n)	((n) & ~J64__HDR_FLAGS)
+
+/* Every box header starts with its length or capacity and flags */
+#define J64__BOX_PTR(j)		((void *)((j).p & (uintptr_t)J64__PTR_MASK))
+#define J64__BOX_FLAGS(hdr)	(*(const size_t *)(hdr) & J64__HDR_FLAGS)
+#define J64__BOX_IS_STATIC(hdr)	((J64__BOX_FLAGS(hdr) & J64__HDR_STATIC) != 0)
+
+J64_API int
+j64__is_box(j64_t j)
+{
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BSTR:
+	case J64_TYPE_BARR:
+	case J64_TYPE_OBJ:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Reference counting
+ *
+ * With J64_REFCOUNT defined, every heap box carries a reference count in
+ * the word before its header. j64_retain shares a box in O(1) and
+ * j64_release drops a reference, freeing the box and releasing its
+ * elements with the last one. Shared arrays must be made unique with
+ * j64_barr_unshare before they are modified (copy-on-write).
+ *
+ * Counts are updated non-atomically unless J64_REFCOUNT_ATOMIC is also
+ * defined, which is needed to share boxes between threads.
+ *
+ * Without J64_REFCOUNT every box has exactly one owner, and releasing a
+ * box frees it along with its elements.
+ */
+
+#ifdef J64_REFCOUNT
+#define J64__REF_WORDS		1
+#define J64__REF(hdr)		(&((j64_t *)(hdr) - 1)->w)
+#ifdef J64_REFCOUNT_ATOMIC
+#define J64__REF_INC(rp)	__atomic_add_fetch((rp), 1, __ATOMIC_RELAXED)
+#define J64__REF_DEC(rp)	__atomic_sub_fetch((rp), 1, __ATOMIC_ACQ_REL)
+#define J64__REF_LOAD(rp)	__atomic_load_n((rp), __ATOMIC_ACQUIRE)
+#else
+#define J64__REF_INC(rp)	(++*(rp))
+#define J64__REF_DEC(rp)	(--*(rp))
+#define J64__REF_LOAD(rp)	(*(rp))
+#endif /* J64_REFCOUNT_ATOMIC */
+#else
+#define J64__REF_WORDS		0
+#endif /* J64_REFCOUNT */
+
+/*
+ * Encoding cache
+ *
+ * With J64_ENCODE_CACHE defined, every heap box also carries a cache word,
+ * in the word before the reference count if there is one. The word holds
+ * either a pointer to the encoded text of the box, kept when the box is
+ * encoded and copied on later encodings instead of formatting it again,
+ * or the time the box was last modified.
+ *
+ * Time is a global clock that every modification through a setter,
+ * reallocation or j64_cache_drop advances. A box cannot know its parents,
+ * so a cached text is only used after checking that no box below it was
+ * modified since the text was made; the check reads one word per nested
+ * box and formats nothing. A stale text is replaced by the next encoding.
+ *
+ * Only boxes in the top J64_ENCODE_CACHE_DEPTH levels whose text takes
+ * at least J64_ENCODE_CACHE_MIN bytes are cached, which bounds the extra
+ * memory to that many copies of the document. Static boxes are not cached.
+ *
+ * Several threads may encode the same document as long as none modifies
+ * it: texts are published with compare-and-swap. With J64_REFCOUNT_ATOMIC,
+ * a stale text is kept until its box is modified or freed, since another
+ * thread may still be reading it; otherwise the encoding that replaces it
+ * frees it and must not run alongside another.
+ */
+
+#ifdef J64_ENCODE_CACHE
+#ifndef J64_ENCODE_CACHE_DEPTH
+#define J64_ENCODE_CACHE_DEPTH	4
+#endif /* J64_ENCODE_CACHE_DEPTH */
+#ifndef J64_ENCODE_CACHE_MIN
+#define J64_ENCODE_CACHE_MIN	64
+#endif /* J64_ENCODE_CACHE_MIN */
+
+#define J64__CACHE_WORDS	1
+#define J64__CACHE(hdr)		(&((j64_t *)(hdr) - J64__REF_WORDS - 1)->w)
+
+/* A cache word is a text pointer, or a modification time with the low bit set */
+#define J64__CACHE_IS_TIME(w)	(((w) & 1) != 0)
+#define J64__CACHE_TIME(t)	((uint64_t)(t) << 1 | 1)
+#define J64__CACHE_PTR(w)	((struct j64__cache *)(uintptr_t)(w))
+
+#if defined(__GNUC__) || defined(__clang__)
+#define J64__CACHE_LOAD(wp)	__atomic_load_n((wp), __ATOMIC_ACQUIRE)
+#define J64__CACHE_CAS(wp, o, n)						\
+	__atomic_compare_exchange_n((wp), &(o), (n), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define J64__CACHE_NOW()	__atomic_load_n(&j64__cache_clock, __ATOMIC_RELAXED)
+#define J64__CACHE_TICK()	__atomic_add_fetch(&j64__cache_clock, 1, __ATOMIC_RELAXED)
+#else
+#define J64__CACHE_LOAD(wp)	(*(wp))
+#define J64__CACHE_CAS(wp, o, n)	(*(wp) == (o) ? (*(wp) = (n), 1) : ((o) = *(wp), 0))
+#define J64__CACHE_NOW()	(j64__cache_clock)
+#define J64__CACHE_TICK()	(++j64__cache_clock)
+#endif /* __GNUC__ || __clang__ */
+
+J64_STATIC_API uint64_t j64__cache_clock;
+#else
+#define J64__CACHE_WORDS	0
+#endif /* J64_ENCODE_CACHE */
+
+/* Size of the words before a box header */
+#define J64__BOX_PREFIX		((J64__REF_WORDS + J64__CACHE_WORDS) * sizeof(j64_t))
+
+struct j64__cache {
+	uint64_t	made;	/* clock when the text was made, plus one */
+	uint64_t	mtime;	/* last modification of the box before that */
+	size_t		len;
+	char		buf[1];
+};
+
+/* Records a modification of a box, dropping its cached text */
+J64_API void
+j64__cache_drop(void *hdr)
+{
+#ifdef J64_ENCODE_CACHE
+	uint64_t w = *J64__CACHE(hdr);
+
+	*J64__CACHE(hdr) = J64__CACHE_TIME(J64__CACHE_TICK());
+	if (w != 0 && !J64__CACHE_IS_TIME(w))
+		J64_FREE(J64__CACHE_PTR(w));
+#else
+	(void)hdr;
+#endif /* J64_ENCODE_CACHE */
+}
+
+J64_API void *
+j64__box_alloc(size_t size)
+{
+	uint64_t t0;
+	char *p;
+
+	if (SIZE_MAX - J64__BOX_PREFIX < size)
+		return NULL;
+
+	J64__TRACE_BEGIN(t0);
+	p = (char *)J64_MALLOC(J64__BOX_PREFIX + size);
+	J64__TRACE_END(alloc, t0, size);
+	if (p == NULL)
+		return NULL;
+	p += J64__BOX_PREFIX;
+
+#ifdef J64_REFCOUNT
+	*J64__REF(p) = 1;
+#endif /* J64_REFCOUNT */
+#ifdef J64_ENCODE_CACHE
+	*J64__CACHE(p) = 0;
+#endif /* J64_ENCODE_CACHE */
+
+	return p;
+}
+
+J64_API void *
+j64__box_realloc(void *hdr, size_t size)
+{
+	uint64_t t0;
+	char *p;
+
+	if (SIZE_MAX - J64__BOX_PREFIX < size)
+		return NULL;
+
+	j64__cache_drop(hdr);
+	J64__TRACE_BEGIN(t0);
+	p = (char *)J64_REALLOC((char *)hdr - J64__BOX_PREFIX, J64__BOX_PREFIX + size);
+	J64__TRACE_END(grow, t0, size);
+	if (p == NULL)
+		return NULL;
+
+	return p + J64__BOX_PREFIX;
+}
+
+J64_API void
+j64__box_free(void *hdr)
+{
+#ifdef J64_ENCODE_CACHE
+	uint64_t w = *J64__CACHE(hdr);
+
+	if (w != 0 && !J64__CACHE_IS_TIME(w))
+		J64_FREE(J64__CACHE_PTR(w));
+#endif /* J64_ENCODE_CACHE */
+	J64_FREE((char *)hdr - J64__BOX_PREFIX);
+}
+
+/*
+ * Drops a reference to a box.
+ * Returns 1 if it was the last one and the box should be freed, 0 otherwise.
+ */
+J64_API int
+j64__box_unref(void *hdr)
+{
+	if (J64__BOX_IS_STATIC(hdr))
+		return 0;
+#ifdef J64_REFCOUNT
+	return J64__REF_DEC(J64__REF(hdr)) == 0;
+#else
+	return 1;
+#endif /* J64_REFCOUNT */
+}
+
+J64_API int
+j64__box_is_shared(void *hdr)
+{
+#ifdef J64_REFCOUNT
+	return !J64__BOX_IS_STATIC(hdr) && J64__REF_LOAD(J64__REF(hdr)) > 1;
+#else
+	(void)hdr;
+	return 0;
+#endif /* J64_REFCOUNT */
+}
+
+#ifdef J64_REFCOUNT
+/*
+ * Shares a value by adding a reference to it.
+ * Returns the same value, which must be released separately.
+ */
+J64_API j64_t
+j64_retain(j64_t j)
+{
+	void *hdr;
+
+	if (!j64__is_box(j))
+		return j;
+
+	hdr = J64__BOX_PTR(j);
+	if (!J64__BOX_IS_STATIC(hdr))
+		J64__REF_INC(J64__REF(hdr));
+
+	return j;
+}
+#endif /* J64_REFCOUNT */
+
+/*
+ * Returns 1 if a boxed value has more than one reference, 0 otherwise.
+ */
+J64_API int
+j64_is_shared(j64_t j)
+{
+	return j64__is_box(j) && j64__box_is_shared(J64__BOX_PTR(j));
+}
+
+/*
+ * Records that a box was modified in place by other means than the
+ * setters, dropping its cached encoding and invalidating those of its
+ * ancestors. Without J64_ENCODE_CACHE this does nothing.
+ */
+J64_API void
+j64_cache_drop(j64_t j)
+{
+	if (j64__is_box(j) && !J64__BOX_IS_STATIC(J64__BOX_PTR(j)))
+		j64__cache_drop(J64__BOX_PTR(j));
+}
+
 /*
  * Boxed string
  */
@@ -381,6 +918,33 @@ struct j64__bstr_hdr {
 #define J64__BSTR_HDR(j)	((struct j64__bstr_hdr *)((j).p & (uintptr_t)J64__PTR_MASK))
 #define J64__BSTR_HDR_SIZEOF	(offsetof(struct j64__bstr_hdr, buf))
 
+/*
+ * Static boxed strings live in read-only storage and need no allocation:
+ *
+ *	static J64_STATIC_BSTR(greeting, 12) = { J64_STATIC_LEN(12), "hello, world" };
+ *	j64_t j = j64_bstr_static(&greeting);
+ *
+ * The buffer has room for the terminating NUL of a string literal, which
+ * C++ requires. Freeing a static box is a no-op.
+ */
+#define J64_STATIC_BSTR(name, n)						\
+	const struct { size_t len; uint8_t buf[(n) + 1]; } name
+#define J64_STATIC_LEN(n)	((size_t)(n) | J64__HDR_STATIC)
+
+J64_API j64_t
+j64_bstr_static(const void *hdr)
+{
+	j64_t j = J64__INIT;
+
+	j64__assert(hdr != NULL);
+	j64__assert((((const struct j64__bstr_hdr *)hdr)->len & J64__HDR_STATIC) != 0);
+
+	j.p = (uintptr_t)hdr;
+	j.w |= J64_TYPE_BSTR;
+
+	return j;
+}
+
 J64_API j64_t
 j64_bstr(const void *buf, size_t len)
 {
@@ -389,8 +953,9 @@ j64_bstr(const void *buf, size_t len)
 
 	j64__assert(buf != NULL);
 	j64__assert(len < SIZE_MAX - J64__BSTR_HDR_SIZEOF);
+	j64__assert(len == J64__HDR_SIZE(len));
 
-	hdr = J64_MALLOC(J64__BSTR_HDR_SIZEOF + len);
+	hdr = (struct j64__bstr_hdr *)j64__box_alloc(J64__BSTR_HDR_SIZEOF + len);
 	if (hdr == NULL)
 		return j64_undef();
 
@@ -416,7 +981,7 @@ j64_bstr_len(j64_t j)
 	j64__assert(j64_is_bstr(j));
 	hdr = J64__BSTR_HDR(j);
 
-	return hdr->len;
+	return J64__HDR_SIZE(hdr->len);
 }
 
 J64_API size_t
@@ -439,71 +1004,429 @@ J64_API void
 j64_bstr_free(j64_t j)
 {
 	j64__assert(j64_is_bstr(j));
-	J64_FREE(J64__BSTR_HDR(j));
+	if (j64__box_unref(J64__BSTR_HDR(j)))
+		j64__box_free(J64__BSTR_HDR(j));
 }
 
 /*
- * Boxed array
+ * Strings
+ *
+ * Strings have a canonical representation by length: the empty string
+ * literal, an immediate string up to J64_ISTR_LEN_MAX bytes, and a boxed
+ * string beyond that. Object keys are always kept in canonical form, so
+ * that short keys compare and hash as single words.
  */
 
-struct j64__barr_hdr {
-	size_t	cap;
-	j64_t	buf;
-};
-
-#define J64__BARR_HDR(j)	((struct j64__barr_hdr *)((j).p & (uintptr_t)J64__PTR_MASK))
-#define J64__BARR_HDR_SIZEOF	(offsetof(struct j64__barr_hdr, buf))
-#define J64__BARR_HDR_CAP_MAX	((SIZE_MAX - J64__BARR_HDR_SIZEOF) / sizeof(j64_t))
-
-#define J64_BARR_CAP_MAX	J64__BARR_HDR_CAP_MAX
-
 J64_API j64_t
-j64_barr_alloc(size_t cap)
+j64_str(const void *buf, size_t len)
 {
-	j64_t j = J64__INIT;
-	struct j64__barr_hdr *hdr;
-	size_t i;
-
-	/* Overflow check */
-	if (J64__BARR_HDR_CAP_MAX < cap)
-		return j64_undef();
-
-	hdr = malloc(J64__BARR_HDR_SIZEOF + cap * sizeof(j64_t));
-	if (hdr == NULL)
-		return j64_undef();
-
-	hdr->cap = cap;
-	/* TODO: remove initialization? */
-	for (i = 0; i < cap; i++)
-		(&hdr->buf)[i] = j64_undef();
-
-	j.p = (uintptr_t)hdr;
-	j.w |= J64_TYPE_BARR;
-
-	return j;
+	if (len == 0)
+		return j64_estr();
+	if (len <= J64_ISTR_LEN_MAX)
+		return j64_istr(buf, len);
+	return j64_bstr(buf, len);
 }
 
 J64_API int
-j64_is_barr(j64_t j)
+j64_is_str(j64_t j)
 {
-	return J64_TYPE_GET(j) == J64_TYPE_BARR;
+	return j64_is_istr(j) || j64_is_bstr(j) || j64_is_estr(j);
 }
 
-/*
- * Reallocates an array with a new capacity.
- * If the new capacity is smaller than the old one,
- * truncates the array WITHOUT freeing the values
- * at the end of the old array.
- *
+J64_API size_t
+j64_str_len(j64_t j)
+{
+	j64__assert(j64_is_str(j));
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_ISTR:
+		return j64_istr_len(j);
+	case J64_TYPE_BSTR:
+		return j64_bstr_len(j);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Returns a pointer to the bytes of a string. Immediate strings are
+ * stored in the word itself, so the pointer is only valid as long as
+ * the word pointed to by JP.
+ */
+J64_API const uint8_t *
+j64_str_ptr(const j64_t *jp)
+{
+	j64__assert(jp != NULL);
+	j64__assert(j64_is_str(*jp));
+
+	switch (J64_TYPE_GET(*jp)) {
+	case J64_TYPE_ISTR:
+		return &jp->b[1];
+	case J64_TYPE_BSTR:
+		return &J64__BSTR_HDR(*jp)->buf;
+	default:
+		return (const uint8_t *)"";
+	}
+}
+
+/*
+ * Returns the canonical form of a string without allocating:
+ * boxed strings short enough to be immediate are converted.
+ */
+J64_API j64_t
+j64__str_canon(j64_t j)
+{
+	size_t len;
+
+	if (!j64_is_bstr(j))
+		return j;
+
+	len = j64_bstr_len(j);
+	if (len == 0)
+		return j64_estr();
+	if (len <= J64_ISTR_LEN_MAX)
+		return j64_istr(&J64__BSTR_HDR(j)->buf, len);
+
+	return j;
+}
+
+/* Compares two canonical strings */
+J64_API int
+j64__str_eq(j64_t a, j64_t b)
+{
+	size_t len;
+
+	if (a.w == b.w)
+		return 1;
+	if (!j64_is_bstr(a) || !j64_is_bstr(b))
+		return 0;
+
+	len = j64_bstr_len(a);
+	return len == j64_bstr_len(b) &&
+	    memcmp(&J64__BSTR_HDR(a)->buf, &J64__BSTR_HDR(b)->buf, len) == 0;
+}
+
+#define J64__HASH_K1	0x9e3779b97f4a7c15ULL
+#define J64__HASH_K2	0xd6e8feb86659fd93ULL
+
+J64_API uint64_t
+j64__hash_mix(uint64_t h)
+{
+	h ^= h >> 32;
+	h *= J64__HASH_K2;
+	h ^= h >> 32;
+	h *= J64__HASH_K2;
+	h ^= h >> 32;
+
+	return h;
+}
+
+J64_API uint64_t
+j64__hash_bytes(const uint8_t *p, size_t len, uint64_t seed)
+{
+	uint64_t h, w;
+
+	h = seed ^ ((uint64_t)len * J64__HASH_K1);
+	for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		h = (h ^ j64__hash_mix(w)) * J64__HASH_K1;
+	}
+
+	w = 0;
+	memcpy(&w, p, len);
+
+	return j64__hash_mix(h ^ w);
+}
+
+/* Hashes a canonical string, immediate strings as a single word */
+J64_API uint64_t
+j64__str_hash(j64_t j, uint64_t seed)
+{
+	if (j64_is_bstr(j))
+		return j64__hash_bytes(&J64__BSTR_HDR(j)->buf, j64_bstr_len(j), seed);
+
+	return j64__hash_mix(j.w ^ seed);
+}
+
+/*
+ * Boxed array
+ *
+ * Arrays with a capacity of at most J64_BARR_SEG_MIN elements are stored
+ * contiguously after the header. Larger arrays are segmented: the header
+ * holds an index of fixed-size segments of J64_BARR_SEG_LEN elements, so
+ * growing them only allocates new segments and never copies the existing
+ * elements. Both layouts are handled transparently by the barr functions.
+ */
+
+#ifndef J64_BARR_SEG_SHIFT
+#define J64_BARR_SEG_SHIFT	16
+#endif /* J64_BARR_SEG_SHIFT */
+
+#ifndef J64_BARR_SEG_MIN
+#define J64_BARR_SEG_MIN	((size_t)1 << 20)
+#endif /* J64_BARR_SEG_MIN */
+
+#define J64_BARR_SEG_LEN	((size_t)1 << J64_BARR_SEG_SHIFT)
+
+struct j64__barr_hdr {
+	size_t	cap;
+	j64_t	buf;
+};
+
+struct j64__barr_seg_hdr {
+	size_t	 cap;
+	size_t	 nsegs_cap;
+	j64_t	*segs;
+};
+
+#define J64__BARR_HDR(j)	((struct j64__barr_hdr *)((j).p & (uintptr_t)J64__PTR_MASK))
+#define J64__BARR_HDR_SIZEOF	(offsetof(struct j64__barr_hdr, buf))
+#define J64__BARR_HDR_CAP_MAX	((SIZE_MAX - J64__BARR_HDR_SIZEOF) / sizeof(j64_t))
+
+#define J64__BARR_SEG_HDR(j)	((struct j64__barr_seg_hdr *)((j).p & (uintptr_t)J64__PTR_MASK))
+#define J64__BARR_SEG_HDR_SIZEOF	(offsetof(struct j64__barr_seg_hdr, segs))
+#define J64__BARR_SEG_MASK	(J64_BARR_SEG_LEN - 1)
+#define J64__BARR_SEG_SIZE	(J64_BARR_SEG_LEN * sizeof(j64_t))
+#define J64__BARR_NSEGS(cap)	(((cap) + J64__BARR_SEG_MASK) >> J64_BARR_SEG_SHIFT)
+
+#define J64__BARR_CAP(hdr)	J64__HDR_SIZE((hdr)->cap)
+#define J64__BARR_IS_SEG(hdr)	(((hdr)->cap & J64__HDR_SEG) != 0)
+#define J64__BARR_IS_STATIC(hdr)	(((hdr)->cap & J64__HDR_STATIC) != 0)
+
+#define J64_BARR_CAP_MAX	J64__BARR_HDR_CAP_MAX
+
+/*
+ * Static boxed arrays of immediate values live in read-only storage
+ * and need no allocation:
+ *
+ *	static J64_STATIC_BARR(defaults, 2) = {
+ *		J64_STATIC_CAP(2), { { J64_INT_W(80) }, { J64_TRUE_W } }
+ *	};
+ *	j64_t j = j64_barr_static(&defaults);
+ *
+ * Static arrays cannot be modified or reallocated, and freeing them is a no-op.
+ */
+#define J64_STATIC_BARR(name, n)						\
+	const struct { size_t cap; j64_t buf[n]; } name
+#define J64_STATIC_CAP(n)	((size_t)(n) | J64__HDR_STATIC)
+
+J64_API j64_t *
+j64__barr_seg_new(void)
+{
+	j64_t *seg;
+	size_t i;
+
+	seg = (j64_t *)J64_MALLOC(J64__BARR_SEG_SIZE);
+	if (seg == NULL)
+		return NULL;
+
+	for (i = 0; i < J64_BARR_SEG_LEN; i++)
+		seg[i] = j64_undef();
+
+	return seg;
+}
+
+J64_API struct j64__barr_seg_hdr *
+j64__barr_seg_hdr_alloc(size_t cap)
+{
+	struct j64__barr_seg_hdr *hdr;
+	size_t nsegs;
+	size_t i;
+
+	nsegs = J64__BARR_NSEGS(cap);
+	hdr = (struct j64__barr_seg_hdr *)j64__box_alloc(
+	    J64__BARR_SEG_HDR_SIZEOF + nsegs * sizeof(j64_t *));
+	if (hdr == NULL)
+		return NULL;
+
+	for (i = 0; i < nsegs; i++) {
+		(&hdr->segs)[i] = j64__barr_seg_new();
+		if ((&hdr->segs)[i] == NULL) {
+			while (i-- > 0)
+				J64_FREE((&hdr->segs)[i]);
+			j64__box_free(hdr);
+			return NULL;
+		}
+	}
+
+	hdr->cap = cap | J64__HDR_SEG;
+	hdr->nsegs_cap = nsegs;
+
+	return hdr;
+}
+
+J64_API j64_t *
+j64__barr_slot(struct j64__barr_hdr *hdr, size_t i)
+{
+	struct j64__barr_seg_hdr *seg_hdr;
+
+	if (!J64__BARR_IS_SEG(hdr))
+		return &(&hdr->buf)[i];
+
+	seg_hdr = (struct j64__barr_seg_hdr *)hdr;
+	return &(&seg_hdr->segs)[i >> J64_BARR_SEG_SHIFT][i & J64__BARR_SEG_MASK];
+}
+
+J64_API j64_t
+j64_barr_alloc(size_t cap)
+{
+	j64_t j = J64__INIT;
+	struct j64__barr_hdr *hdr;
+	size_t i;
+
+	/* Overflow check */
+	if (J64__BARR_HDR_CAP_MAX < cap)
+		return j64_undef();
+
+	if (J64_BARR_SEG_MIN < cap) {
+		hdr = (struct j64__barr_hdr *)j64__barr_seg_hdr_alloc(cap);
+		if (hdr == NULL)
+			return j64_undef();
+	} else {
+		hdr = (struct j64__barr_hdr *)j64__box_alloc(
+		    J64__BARR_HDR_SIZEOF + cap * sizeof(j64_t));
+		if (hdr == NULL)
+			return j64_undef();
+
+		hdr->cap = cap;
+		/* TODO: remove initialization? */
+		for (i = 0; i < cap; i++)
+			(&hdr->buf)[i] = j64_undef();
+	}
+
+	j.p = (uintptr_t)hdr;
+	j.w |= J64_TYPE_BARR;
+
+	return j;
+}
+
+J64_API j64_t
+j64_barr_static(const void *hdr)
+{
+	j64_t j = J64__INIT;
+
+	j64__assert(hdr != NULL);
+	j64__assert(J64__BARR_IS_STATIC((const struct j64__barr_hdr *)hdr));
+
+	j.p = (uintptr_t)hdr;
+	j.w |= J64_TYPE_BARR;
+
+	return j;
+}
+
+J64_API int
+j64_is_barr(j64_t j)
+{
+	return J64_TYPE_GET(j) == J64_TYPE_BARR;
+}
+
+/*
+ * Converts a contiguous array into a segmented one with a new capacity,
+ * moving the elements over and freeing the old array.
+ */
+J64_API struct j64__barr_seg_hdr *
+j64__barr_segment(struct j64__barr_hdr *hdr, size_t new_cap)
+{
+	struct j64__barr_seg_hdr *seg_hdr;
+	size_t cap, n, i;
+
+	seg_hdr = j64__barr_seg_hdr_alloc(new_cap);
+	if (seg_hdr == NULL)
+		return NULL;
+
+	cap = hdr->cap;
+	for (i = 0; i < cap; i += n) {
+		n = J64__MIN(cap - i, J64_BARR_SEG_LEN);
+		memcpy((&seg_hdr->segs)[i >> J64_BARR_SEG_SHIFT], &(&hdr->buf)[i],
+		    n * sizeof(j64_t));
+	}
+
+	j64__box_free(hdr);
+
+	return seg_hdr;
+}
+
+/*
+ * Resizes the segment index of a segmented array at *HDRP, allocating or
+ * freeing whole segments as needed. The index grows geometrically, so
+ * growing an array one element at a time takes amortized constant time.
+ *
+ * Returns 1 on success, 0 if out of memory. *HDRP is updated even on
+ * failure, since the index may have moved before a segment failed.
+ */
+J64_API int
+j64__barr_seg_realloc(struct j64__barr_seg_hdr **hdrp, size_t new_cap)
+{
+	struct j64__barr_seg_hdr *hdr = *hdrp, *new_hdr;
+	size_t cap, nsegs, new_nsegs, nsegs_cap;
+	size_t i;
+
+	cap = J64__BARR_CAP(hdr);
+	nsegs = J64__BARR_NSEGS(cap);
+	new_nsegs = J64__BARR_NSEGS(new_cap);
+
+	if (hdr->nsegs_cap < new_nsegs) {
+		nsegs_cap = J64__MIN(J64__BARR_NSEGS(J64__BARR_HDR_CAP_MAX),
+		    hdr->nsegs_cap * 2);
+		if (nsegs_cap < new_nsegs)
+			nsegs_cap = new_nsegs;
+
+		new_hdr = (struct j64__barr_seg_hdr *)j64__box_realloc(hdr,
+		    J64__BARR_SEG_HDR_SIZEOF + nsegs_cap * sizeof(j64_t *));
+		if (new_hdr == NULL)
+			return 0;
+
+		hdr = new_hdr;
+		hdr->nsegs_cap = nsegs_cap;
+		*hdrp = hdr;
+	}
+
+	for (i = nsegs; i < new_nsegs; i++) {
+		(&hdr->segs)[i] = j64__barr_seg_new();
+		if ((&hdr->segs)[i] == NULL) {
+			while (i-- > nsegs)
+				J64_FREE((&hdr->segs)[i]);
+			return 0;
+		}
+	}
+
+	for (i = new_nsegs; i < nsegs; i++)
+		J64_FREE((&hdr->segs)[i]);
+
+	/* Reinitialize slots left over from an earlier truncation */
+	for (i = cap; i < new_cap && i < nsegs * J64_BARR_SEG_LEN; i++)
+		(&hdr->segs)[i >> J64_BARR_SEG_SHIFT][i & J64__BARR_SEG_MASK] =
+		    j64_undef();
+
+	hdr->cap = new_cap | J64__HDR_SEG;
+
+	return 1;
+}
+
+/*
+ * Reallocates an array with a new capacity.
+ * If the new capacity is smaller than the old one,
+ * truncates the array WITHOUT freeing the values
+ * at the end of the old array.
+ *
+ * Arrays growing past J64_BARR_SEG_MIN are converted to
+ * the segmented layout and stay segmented afterwards.
+ * Shared arrays are copied at the new capacity, keeping references only
+ * to the elements that remain. Static arrays cannot be reallocated.
+ *
  * Returns 1 on success, 0 otherwise.
  */
+J64_API int j64__barr_copy(j64_t *, size_t);
+
 J64_API int
 j64_barr_realloc(j64_t *jp, size_t new_cap)
 {
+	struct j64__barr_seg_hdr *seg_hdr;
 	struct j64__barr_hdr *hdr, *new_hdr;
 	size_t cap;
 	size_t new_size;
 	size_t i;
+	int res;
 
 	j64__assert(jp != NULL);
 	j64__assert(j64_is_barr(*jp));
@@ -512,18 +1435,39 @@ j64_barr_realloc(j64_t *jp, size_t new_cap)
 	if (J64__BARR_HDR_CAP_MAX < new_cap)
 		return 0;
 
-	hdr = J64__BARR_HDR(*jp);
-	cap = hdr->cap;
-	new_size = J64__BARR_HDR_SIZEOF + new_cap * sizeof(j64_t);
-	new_hdr = realloc(hdr, new_size);
-	if (new_hdr == NULL)
+	if (J64__BARR_IS_STATIC(J64__BARR_HDR(*jp)))
 		return 0;
 
-	/* Initialize(TODO: remove?) the grown area if new capacity is greater */
-	for (i = cap; i < new_cap; i++)
-		(&new_hdr->buf)[i] = j64_undef();
+	if (j64_is_shared(*jp))
+		return j64__barr_copy(jp, new_cap);
+
+	hdr = J64__BARR_HDR(*jp);
+
+	if (J64__BARR_IS_SEG(hdr)) {
+		j64__cache_drop(hdr);
+		seg_hdr = (struct j64__barr_seg_hdr *)hdr;
+		res = j64__barr_seg_realloc(&seg_hdr, new_cap);
+		jp->p = (uintptr_t)seg_hdr;
+		jp->w |= J64_TYPE_BARR;
+		return res;
+	} else if (J64_BARR_SEG_MIN < new_cap) {
+		new_hdr = (struct j64__barr_hdr *)j64__barr_segment(hdr, new_cap);
+		if (new_hdr == NULL)
+			return 0;
+	} else {
+		cap = hdr->cap;
+		new_size = J64__BARR_HDR_SIZEOF + new_cap * sizeof(j64_t);
+		new_hdr = (struct j64__barr_hdr *)j64__box_realloc(hdr, new_size);
+		if (new_hdr == NULL)
+			return 0;
+
+		/* Initialize(TODO: remove?) the grown area if new capacity is greater */
+		for (i = cap; i < new_cap; i++)
+			(&new_hdr->buf)[i] = j64_undef();
+
+		new_hdr->cap = new_cap;
+	}
 
-	new_hdr->cap = new_cap;
 	jp->p = (uintptr_t)new_hdr;
 	jp->w |= J64_TYPE_BARR;
 
@@ -536,7 +1480,7 @@ j64_barr_cap(j64_t j)
 	struct j64__barr_hdr *hdr;
 	j64__assert(j64_is_barr(j));
 	hdr = J64__BARR_HDR(j);
-	return hdr->cap;
+	return J64__BARR_CAP(hdr);
 }
 
 J64_API j64_t
@@ -546,9 +1490,9 @@ j64_barr_get(j64_t j, size_t i)
 
 	j64__assert(j64_is_barr(j));
 	hdr = J64__BARR_HDR(j);
-	j64__assert(i < hdr->cap);
+	j64__assert(i < J64__BARR_CAP(hdr));
 
-	return (&hdr->buf)[i];
+	return *j64__barr_slot(hdr, i);
 }
 
 J64_API void
@@ -558,56 +1502,6386 @@ j64_barr_set(j64_t j, j64_t k, size_t i)
 
 	j64__assert(j64_is_barr(j));
 	hdr = J64__BARR_HDR(j);
-	j64__assert(i < hdr->cap);
-	(&hdr->buf)[i] = k;
+	j64__assert(!J64__BARR_IS_STATIC(hdr));
+	j64__assert(!j64__box_is_shared(hdr));
+	j64__assert(i < J64__BARR_CAP(hdr));
+	j64__cache_drop(hdr);
+	*j64__barr_slot(hdr, i) = k;
 }
 
 J64_API void
 j64_barr_set_free(j64_t j, j64_t k, size_t i)
 {
 	struct j64__barr_hdr *hdr;
+	j64_t *slot;
 
 	j64__assert(j64_is_barr(j));
 	hdr = J64__BARR_HDR(j);
-	j64__assert(i < hdr->cap);
-	j64_free((&hdr->buf)[i]);
-	(&hdr->buf)[i] = k;
+	j64__assert(!J64__BARR_IS_STATIC(hdr));
+	j64__assert(!j64__box_is_shared(hdr));
+	j64__assert(i < J64__BARR_CAP(hdr));
+	j64__cache_drop(hdr);
+	slot = j64__barr_slot(hdr, i);
+	j64_free(*slot);
+	*slot = k;
+}
+
+/*
+ * Frees the storage of an array without touching its elements.
+ */
+J64_API void
+j64__barr_dealloc(struct j64__barr_hdr *hdr)
+{
+	struct j64__barr_seg_hdr *seg_hdr;
+	size_t nsegs;
+	size_t i;
+
+	if (J64__BARR_IS_SEG(hdr)) {
+		seg_hdr = (struct j64__barr_seg_hdr *)hdr;
+		nsegs = J64__BARR_NSEGS(J64__BARR_CAP(seg_hdr));
+		for (i = 0; i < nsegs; i++)
+			J64_FREE((&seg_hdr->segs)[i]);
+	}
+
+	j64__box_free(hdr);
 }
 
 J64_API void
 j64_barr_free(j64_t j)
 {
 	j64__assert(j64_is_barr(j));
-	J64_FREE(J64__BARR_HDR(j));
+	if (j64__box_unref(J64__BARR_HDR(j)))
+		j64__barr_dealloc(J64__BARR_HDR(j));
 }
 
 /*
- * Polymorphic free
+ * Replaces an array with a copy of capacity CAP holding its own references
+ * to the elements that fit, and drops the reference to the original.
  */
-J64_API void
-j64_free(j64_t j)
+J64_API int
+j64__barr_copy(j64_t *jp, size_t cap)
 {
-	switch (J64_TYPE_GET(j)) {
-	case J64_TYPE_BSTR:
-		j64_bstr_free(j);
-		break;
-	case J64_TYPE_BARR:
-		j64_barr_free(j);
-		break;
+	j64_t copy;
+	size_t n;
+	size_t i;
+
+	copy = j64_barr_alloc(cap);
+	if (j64_is_undef(copy))
+		return 0;
+
+	n = J64__MIN(cap, j64_barr_cap(*jp));
+	for (i = 0; i < n; i++) {
+#ifdef J64_REFCOUNT
+		j64_barr_set(copy, j64_retain(j64_barr_get(*jp, i)), i);
+#else
+		j64_barr_set(copy, j64_barr_get(*jp, i), i);
+#endif /* J64_REFCOUNT */
 	}
+
+	j64_release(*jp);
+	*jp = copy;
+
+	return 1;
 }
 
 /*
- * misc
+ * Makes an array safe to modify, replacing it with a copy if it is
+ * static or shared. The copy holds its own references to the elements
+ * and the reference to the original array is dropped.
+ *
+ * Returns 1 on success, 0 otherwise.
  */
-
-#ifdef J64_DEBUG
-J64_API void
-j64_dbg(j64_t j)
+J64_API int
+j64_barr_unshare(j64_t *jp)
 {
-#include <stdio.h>
-#include <inttypes.h>
+	j64__assert(jp != NULL);
+	j64__assert(j64_is_barr(*jp));
+
+	if (!J64__BARR_IS_STATIC(J64__BARR_HDR(*jp)) && !j64_is_shared(*jp))
+		return 1;
+
+	return j64__barr_copy(jp, j64_barr_cap(*jp));
+}
+
+/*
+ * Boxed object
+ *
+ * Objects are hash tables of key-value pairs with linear probing. Keys
+ * are canonical strings owned by the object, and removed keys leave a
+ * J64_TYPE_LIT_DEL tombstone behind until the table is rebuilt.
+ *
+ * A sealed object has a fixed set of keys indexed by a minimal perfect
+ * hash: its pairs fill exactly as many slots as it has keys, and a lookup
+ * hashes the key once, reads the displacement of its bucket and compares
+ * a single slot, with no probing and no tombstone checks. Modifying a
+ * sealed object turns it back into a hash table.
+ */
+
+struct j64__obj_hdr {
+	size_t	cap;
+	size_t	len;
+	size_t	ndel;
+	j64_t	buf;
+};
+
+struct j64__obj_sealed_hdr {
+	size_t		cap;
+	size_t		len;
+	size_t		nbuckets;
+	uint64_t	seed;
+	j64_t		buf;
+};
 
+#define J64__OBJ_HDR(j)		((struct j64__obj_hdr *)((j).p & (uintptr_t)J64__PTR_MASK))
+#define J64__OBJ_HDR_SIZEOF	(offsetof(struct j64__obj_hdr, buf))
+#define J64__OBJ_SEALED_HDR(j)	((struct j64__obj_sealed_hdr *)((j).p & (uintptr_t)J64__PTR_MASK))
+#define J64__OBJ_SEALED_HDR_SIZEOF	(offsetof(struct j64__obj_sealed_hdr, buf))
+
+#define J64__OBJ_CAP(hdr)	J64__HDR_SIZE((hdr)->cap)
+#define J64__OBJ_IS_SEALED(hdr)	(((hdr)->cap & J64__HDR_SEALED) != 0)
+#define J64__OBJ_IS_STATIC(hdr)	(((hdr)->cap & J64__HDR_STATIC) != 0)
+
+/* Slot limit, keeping slot indices within 32 bits for the perfect hash */
+#define J64__OBJ_CAP_MAX	J64__MIN((SIZE_MAX - J64__OBJ_SEALED_HDR_SIZEOF) / \
+				    (4 * sizeof(j64_t)), (size_t)0x80000000UL)
+
+/* Average number of keys per perfect hash bucket */
+#define J64__OBJ_MPH_LAMBDA	4
+/* Number of seeds to try before giving up on a perfect hash */
+#define J64__OBJ_MPH_SEEDS	16
+
+#define J64__OBJ_MPH_NBUCKETS(n)	((n) / J64__OBJ_MPH_LAMBDA + 1)
+#define J64__OBJ_MPH_BUCKET(h, r)						\
+	((size_t)((((h) >> 32) * (uint64_t)(r)) >> 32))
+#define J64__OBJ_MPH_SLOT(h, d, n)						\
+	((size_t)(((j64__hash_mix((h) ^ ((uint64_t)(d) * J64__HASH_K1)) &	\
+	    0xffffffffU) * (uint64_t)(n)) >> 32))
+#define J64__OBJ_MPH_DISP(hdr)							\
+	((uint32_t *)(void *)(&(hdr)->buf + 2 * J64__OBJ_CAP(hdr)))
+#define J64__OBJ_SEALED_SIZE(n)							\
+	J64__ALIGN(J64__OBJ_SEALED_HDR_SIZEOF + 2 * (n) * sizeof(j64_t) +	\
+	    J64__OBJ_MPH_NBUCKETS(n) * sizeof(uint32_t))
+#define J64__OBJ_SEALED_HDR_SIZE(hdr)						\
+	((hdr)->nbuckets == 0 ?							\
+	    J64__OBJ_SEALED_HDR_SIZEOF + 2 * J64__OBJ_CAP(hdr) * sizeof(j64_t) :	\
+	    J64__OBJ_SEALED_SIZE(J64__OBJ_CAP(hdr)))
+
+#define J64__ALIGN(n)	(((n) + sizeof(j64_t) - 1) & ~(sizeof(j64_t) - 1))
+
+/*
+ * Returns the number of slots needed for LEN keys, or 0 on overflow.
+ * Tables are kept at most three quarters full, counting tombstones.
+ */
+J64_API size_t
+j64__obj_slots(size_t len)
+{
+	size_t cap = 4;
+
+	while (cap / 4 * 3 < len) {
+		if (J64__OBJ_CAP_MAX / 2 < cap)
+			return 0;
+		cap *= 2;
+	}
+
+	return cap;
+}
+
+J64_API j64_t
+j64__obj_new(size_t cap)
+{
+	j64_t j = J64__INIT;
+	struct j64__obj_hdr *hdr;
+
+	hdr = (struct j64__obj_hdr *)j64__box_alloc(
+	    J64__OBJ_HDR_SIZEOF + 2 * cap * sizeof(j64_t));
+	if (hdr == NULL)
+		return j64_undef();
+
+	hdr->cap = cap;
+	hdr->len = 0;
+	hdr->ndel = 0;
+	/* undefined is all zero */
+	memset(&hdr->buf, 0, 2 * cap * sizeof(j64_t));
+
+	j.p = (uintptr_t)hdr;
+	j.w |= J64_TYPE_OBJ;
+
+	return j;
+}
+
+/*
+ * Allocates an empty object with room for LEN keys.
+ */
+J64_API j64_t
+j64_obj_alloc(size_t len)
+{
+	size_t cap;
+
+	cap = j64__obj_slots(len);
+	if (cap == 0)
+		return j64_undef();
+
+	return j64__obj_new(cap);
+}
+
+J64_API int
+j64_is_obj(j64_t j)
+{
+	return J64_TYPE_GET(j) == J64_TYPE_OBJ;
+}
+
+J64_API int
+j64_obj_is_sealed(j64_t j)
+{
+	j64__assert(j64_is_obj(j));
+	return J64__OBJ_IS_SEALED(J64__OBJ_HDR(j));
+}
+
+/*
+ * Static objects of immediate keys and values live in read-only storage
+ * and need no allocation:
+ *
+ *	static J64_STATIC_OBJ(defaults, 2) = {
+ *		J64_STATIC_OBJ_HDR(2), {
+ *			{ J64_ISTR_W(4, 'p', 'o', 'r', 't', 0, 0, 0) }, { J64_INT_W(80) },
+ *			{ J64_ISTR_W(3, 't', 'l', 's', 0, 0, 0, 0) }, { J64_TRUE_W }
+ *		}
+ *	};
+ *	j64_t j = j64_obj_static(&defaults);
+ *
+ * Keys must be distinct canonical strings, that is J64_ESTR_W or
+ * immediate strings of one to seven bytes, listed in the order they are
+ * iterated. A static object has the sealed layout without a perfect
+ * hash, so lookups compare keys in order. Modifying it makes a mutable
+ * copy, and freeing it is a no-op.
+ */
+#define J64_STATIC_OBJ(name, n)							\
+	const struct {								\
+		size_t cap; size_t len; size_t nbuckets; uint64_t seed;		\
+		j64_t buf[2 * (n)];						\
+	} name
+#define J64_STATIC_OBJ_HDR(n)							\
+	((size_t)(n) | J64__HDR_SEALED | J64__HDR_STATIC), (size_t)(n), 0, 0
+
+J64_API j64_t
+j64_obj_static(const void *hdr)
+{
+	j64_t j = J64__INIT;
+
+	j64__assert(hdr != NULL);
+	j64__assert(J64__OBJ_IS_STATIC((const struct j64__obj_hdr *)hdr));
+	j64__assert(J64__OBJ_IS_SEALED((const struct j64__obj_hdr *)hdr));
+
+	j.p = (uintptr_t)hdr;
+	j.w |= J64_TYPE_OBJ;
+
+	return j;
+}
+
+J64_API size_t
+j64_obj_len(j64_t j)
+{
+	j64__assert(j64_is_obj(j));
+	return J64__OBJ_HDR(j)->len;
+}
+
+/* Returns the pairs of either object layout */
+J64_API j64_t *
+j64__obj_pairs(struct j64__obj_hdr *hdr)
+{
+	if (J64__OBJ_IS_SEALED(hdr))
+		return &((struct j64__obj_sealed_hdr *)(void *)hdr)->buf;
+
+	return &hdr->buf;
+}
+
+/*
+ * Finds the pair of a canonical key with hash H in a hash table.
+ * Returns a pointer to the pair, or NULL if the key is not present.
+ */
+J64_API j64_t *
+j64__obj_find(struct j64__obj_hdr *hdr, j64_t key, uint64_t h)
+{
+	j64_t *pairs;
+	size_t cap, mask;
+	size_t i, n;
+
+	pairs = &hdr->buf;
+	cap = J64__OBJ_CAP(hdr);
+	mask = cap - 1;
+
+	for (i = (size_t)h & mask, n = 0; n < cap; i = (i + 1) & mask, n++) {
+		if (j64_is_undef(pairs[2 * i]))
+			return NULL;
+		/* Tombstones never compare equal to a string */
+		if (j64__str_eq(pairs[2 * i], key))
+			return &pairs[2 * i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Finds the pair of a canonical key in a sealed object with one probe.
+ */
+J64_API j64_t *
+j64__obj_sealed_find(struct j64__obj_sealed_hdr *hdr, j64_t key)
+{
+	j64_t *pair;
+	uint64_t h;
+	size_t n, b;
+
+	n = J64__OBJ_CAP(hdr);
+	if (n == 0)
+		return NULL;
+
+	/* Static objects have no perfect hash and are searched in order */
+	if (hdr->nbuckets == 0) {
+		for (b = 0; b < n; b++) {
+			pair = &(&hdr->buf)[2 * b];
+			if (j64__str_eq(*pair, key))
+				return pair;
+		}
+		return NULL;
+	}
+
+	h = j64__str_hash(key, hdr->seed);
+	b = J64__OBJ_MPH_BUCKET(h, hdr->nbuckets);
+	pair = &(&hdr->buf)[2 * J64__OBJ_MPH_SLOT(h, J64__OBJ_MPH_DISP(hdr)[b], n)];
+
+	return j64__str_eq(*pair, key) ? pair : NULL;
+}
+
+/*
+ * Finds the pair of a canonical key whose table hash H is already known.
+ */
+J64_API j64_t *
+j64__obj_lookup_hashed(j64_t j, j64_t key, uint64_t h)
+{
+	struct j64__obj_hdr *hdr;
+
+	hdr = J64__OBJ_HDR(j);
+	if (J64__OBJ_IS_SEALED(hdr))
+		return j64__obj_sealed_find((struct j64__obj_sealed_hdr *)(void *)hdr, key);
+
+	return j64__obj_find(hdr, key, h);
+}
+
+J64_API j64_t *
+j64__obj_lookup(j64_t j, j64_t key)
+{
+	key = j64__str_canon(key);
+	return j64__obj_lookup_hashed(j, key, j64__str_hash(key, 0));
+}
+
+/*
+ * Returns the value of a key, or undefined if the key is not present.
+ */
+J64_API j64_t
+j64_obj_get(j64_t j, j64_t key)
+{
+	j64_t *pair;
+
+	j64__assert(j64_is_obj(j));
+	j64__assert(j64_is_str(key));
+
+	pair = j64__obj_lookup(j, key);
+
+	return pair != NULL ? pair[1] : j64_undef();
+}
+
+/*
+ * Rebuilds an object as a hash table with CAP slots. With RETAIN, the
+ * new table holds its own references to the keys and values and the
+ * reference to the old object is dropped; otherwise they are moved over
+ * and the old storage is freed.
+ *
+ * Returns 1 on success, 0 otherwise.
+ */
+J64_API int
+j64__obj_rebuild(j64_t *jp, size_t cap, int retain)
+{
+	struct j64__obj_hdr *hdr, *new_hdr;
+	j64_t *pairs, *new_pairs;
+	j64_t new_j, k, v;
+	size_t old_cap, mask;
+	size_t i, n;
+
+	new_j = j64__obj_new(cap);
+	if (j64_is_undef(new_j))
+		return 0;
+
+	hdr = J64__OBJ_HDR(*jp);
+	pairs = j64__obj_pairs(hdr);
+	old_cap = J64__OBJ_CAP(hdr);
+	new_hdr = J64__OBJ_HDR(new_j);
+	new_pairs = &new_hdr->buf;
+	mask = cap - 1;
+
+	for (i = 0; i < old_cap; i++) {
+		k = pairs[2 * i];
+		v = pairs[2 * i + 1];
+		if (!j64_is_str(k))
+			continue;
+#ifdef J64_REFCOUNT
+		if (retain) {
+			k = j64_retain(k);
+			v = j64_retain(v);
+		}
+#endif /* J64_REFCOUNT */
+		n = (size_t)j64__str_hash(k, 0) & mask;
+		while (!j64_is_undef(new_pairs[2 * n]))
+			n = (n + 1) & mask;
+		new_pairs[2 * n] = k;
+		new_pairs[2 * n + 1] = v;
+		new_hdr->len++;
+	}
+
+	if (retain)
+		j64_release(*jp);
+	else
+		j64__box_free(hdr);
+
+	*jp = new_j;
+
+	return 1;
+}
+
+/*
+ * Makes an object safe to modify, replacing it with a copy if it is
+ * static or shared. The copy holds its own references to the keys and
+ * values and the reference to the original object is dropped.
+ *
+ * Returns 1 on success, 0 otherwise.
+ */
+J64_API int
+j64_obj_unshare(j64_t *jp)
+{
+	struct j64__obj_hdr *hdr;
+
+	j64__assert(jp != NULL);
+	j64__assert(j64_is_obj(*jp));
+
+	hdr = J64__OBJ_HDR(*jp);
+	if (!J64__OBJ_IS_STATIC(hdr) && !j64__box_is_shared(hdr))
+		return 1;
+
+	return j64__obj_rebuild(jp, j64__obj_slots(hdr->len), 1);
+}
+
+/* Turns an object into a unique hash table before it is modified */
+J64_API int
+j64__obj_mut(j64_t *jp)
+{
+	struct j64__obj_hdr *hdr;
+
+	hdr = J64__OBJ_HDR(*jp);
+	if (J64__OBJ_IS_STATIC(hdr) || j64__box_is_shared(hdr))
+		return j64_obj_unshare(jp);
+	if (J64__OBJ_IS_SEALED(hdr))
+		return j64__obj_rebuild(jp, j64__obj_slots(hdr->len), 0);
+
+	return 1;
+}
+
+J64_API int
+j64__obj_set(j64_t *jp, j64_t key, j64_t val, int free_old)
+{
+	struct j64__obj_hdr *hdr;
+	j64_t *pairs, *pair;
+	j64_t ckey;
+	uint64_t h;
+	size_t cap, mask, i;
+
+	j64__assert(jp != NULL);
+	j64__assert(j64_is_obj(*jp));
+	j64__assert(j64_is_str(key));
+
+	if (!j64__obj_mut(jp))
+		return 0;
+
+	ckey = j64__str_canon(key);
+	h = j64__str_hash(ckey, 0);
+	hdr = J64__OBJ_HDR(*jp);
+	j64__cache_drop(hdr);
+
+	pair = j64__obj_find(hdr, ckey, h);
+	if (pair != NULL) {
+		if (pair[0].w != key.w)
+			j64_free(key);
+		if (free_old)
+			j64_free(pair[1]);
+		pair[1] = val;
+		return 1;
+	}
+
+	cap = J64__OBJ_CAP(hdr);
+	if (cap / 4 * 3 < hdr->len + hdr->ndel + 1) {
+		cap = j64__obj_slots(hdr->len + 1);
+		if (cap == 0 || !j64__obj_rebuild(jp, cap, 0))
+			return 0;
+		hdr = J64__OBJ_HDR(*jp);
+	}
+
+	pairs = &hdr->buf;
+	mask = cap - 1;
+	for (i = (size_t)h & mask; j64_is_str(pairs[2 * i]); i = (i + 1) & mask)
+		;
+
+	if (pairs[2 * i].w == J64_TYPE_LIT_DEL)
+		hdr->ndel--;
+	pairs[2 * i] = ckey;
+	pairs[2 * i + 1] = val;
+	hdr->len++;
+
+	if (ckey.w != key.w)
+		j64_free(key);
+
+	return 1;
+}
+
+/*
+ * Sets the value of a key, taking ownership of both.
+ * The old value of an existing key is NOT freed.
+ *
+ * Returns 1 on success, 0 if out of memory, in which case
+ * the key and value still belong to the caller.
+ */
+J64_API int
+j64_obj_set(j64_t *jp, j64_t key, j64_t val)
+{
+	return j64__obj_set(jp, key, val, 0);
+}
+
+/*
+ * Like j64_obj_set, but frees the old value of an existing key.
+ */
+J64_API int
+j64_obj_set_free(j64_t *jp, j64_t key, j64_t val)
+{
+	return j64__obj_set(jp, key, val, 1);
+}
+
+/*
+ * Removes a key from an object, freeing the key.
+ *
+ * Returns the value of the removed key, which now belongs to the caller,
+ * or undefined if the key was not present (or out of memory).
+ */
+J64_API j64_t
+j64_obj_del(j64_t *jp, j64_t key)
+{
+	struct j64__obj_hdr *hdr;
+	j64_t *pair;
+	j64_t val;
+	size_t cap, i;
+
+	j64__assert(jp != NULL);
+	j64__assert(j64_is_obj(*jp));
+	j64__assert(j64_is_str(key));
+
+	if (j64__obj_lookup(*jp, key) == NULL || !j64__obj_mut(jp))
+		return j64_undef();
+
+	hdr = J64__OBJ_HDR(*jp);
+	j64__cache_drop(hdr);
+	pair = j64__obj_lookup(*jp, key);
+	val = pair[1];
+	j64_free(pair[0]);
+
+	/* A tombstone is only needed if a probe sequence continues past it */
+	cap = J64__OBJ_CAP(hdr);
+	i = ((size_t)(pair - &hdr->buf) / 2 + 1) & (cap - 1);
+	if (j64_is_undef((&hdr->buf)[2 * i])) {
+		pair[0] = j64_undef();
+	} else {
+		pair[0].w = J64_TYPE_LIT_DEL;
+		hdr->ndel++;
+	}
+	pair[1] = j64_undef();
+	hdr->len--;
+
+	return val;
+}
+
+/*
+ * Iterates over the keys and values of an object. Start with *IP set to 0.
+ *
+ * Returns 1 and stores the next key and value, or 0 at the end.
+ */
+J64_API int
+j64_obj_next(j64_t j, size_t *ip, j64_t *kp, j64_t *vp)
+{
+	struct j64__obj_hdr *hdr;
+	j64_t *pairs;
+	size_t cap;
+	size_t i;
+
+	j64__assert(j64_is_obj(j));
+	j64__assert(ip != NULL);
+
+	hdr = J64__OBJ_HDR(j);
+	pairs = j64__obj_pairs(hdr);
+	cap = J64__OBJ_CAP(hdr);
+
+	for (i = *ip; i < cap; i++) {
+		if (!j64_is_str(pairs[2 * i]))
+			continue;
+		if (kp != NULL)
+			*kp = pairs[2 * i];
+		if (vp != NULL)
+			*vp = pairs[2 * i + 1];
+		*ip = i + 1;
+		return 1;
+	}
+
+	*ip = cap;
+
+	return 0;
+}
+
+/*
+ * Builds the minimal perfect hash of a sealed object whose N pairs are
+ * stored, in any order, at the start of its slots, and moves each pair
+ * to its slot. Keys are grouped into buckets, and from the largest bucket
+ * down, each bucket gets the first displacement that maps all of its keys
+ * to free slots (hash and displace).
+ *
+ * Returns 1 on success, 0 otherwise.
+ */
+J64_API int
+j64__obj_mph_build(struct j64__obj_sealed_hdr *hdr, size_t n)
+{
+	j64_t *pairs, tmp;
+	uint32_t *disp;
+	uint64_t *h;
+	size_t *slot, *order, *bstart, *border, *cnt;
+	uint8_t *taken, *buf;
+	size_t r, b, bb, d, dmax, s, sz, maxsz, pos;
+	size_t i, k;
+	unsigned int attempt;
+
+	r = J64__OBJ_MPH_NBUCKETS(n);
+	hdr->len = n;
+	hdr->nbuckets = r;
+	hdr->seed = 0;
+	pairs = &hdr->buf;
+	disp = J64__OBJ_MPH_DISP(hdr);
+	for (b = 0; b < r; b++)
+		disp[b] = 0;
+	if (n == 0)
+		return 1;
+
+	buf = (uint8_t *)J64_MALLOC(n * sizeof(uint64_t) +
+	    (3 * n + 2 * r + 3) * sizeof(size_t) + n);
+	if (buf == NULL)
+		return 0;
+
+	h = (uint64_t *)(void *)buf;
+	slot = (size_t *)(void *)(h + n);
+	order = slot + n;
+	cnt = order + n;
+	bstart = cnt + n + 2;
+	border = bstart + r + 1;
+	taken = (uint8_t *)(border + r);
+
+	dmax = J64__MIN(64 * n + 1024, (size_t)0xffffffffUL);
+
+	for (attempt = 0; attempt < J64__OBJ_MPH_SEEDS; attempt++) {
+		hdr->seed = j64__hash_mix(J64__HASH_K1 * (attempt + 1));
+
+		/* Group keys by bucket */
+		memset(bstart, 0, (r + 1) * sizeof(size_t));
+		for (i = 0; i < n; i++) {
+			h[i] = j64__str_hash(pairs[2 * i], hdr->seed);
+			bstart[J64__OBJ_MPH_BUCKET(h[i], r) + 1]++;
+		}
+		maxsz = 0;
+		for (b = 0; b < r; b++) {
+			maxsz = bstart[b + 1] > maxsz ? bstart[b + 1] : maxsz;
+			bstart[b + 1] += bstart[b];
+			border[b] = bstart[b];
+		}
+		for (i = 0; i < n; i++)
+			order[border[J64__OBJ_MPH_BUCKET(h[i], r)]++] = i;
+
+		/* Order buckets from largest to smallest */
+		memset(cnt, 0, (maxsz + 1) * sizeof(size_t));
+		for (b = 0; b < r; b++)
+			cnt[bstart[b + 1] - bstart[b]]++;
+		for (pos = 0, sz = maxsz + 1; sz-- > 0; ) {
+			k = cnt[sz];
+			cnt[sz] = pos;
+			pos += k;
+		}
+		for (b = 0; b < r; b++)
+			border[cnt[bstart[b + 1] - bstart[b]]++] = b;
+
+		/* Find a displacement for each bucket */
+		memset(taken, 0, n);
+		for (bb = 0; bb < r; bb++) {
+			b = border[bb];
+			sz = bstart[b + 1] - bstart[b];
+			if (sz == 0)
+				break;
+			for (d = 0; d < dmax; d++) {
+				for (k = 0; k < sz; k++) {
+					i = order[bstart[b] + k];
+					s = J64__OBJ_MPH_SLOT(h[i], d, n);
+					if (taken[s])
+						break;
+					taken[s] = 1;
+					slot[i] = s;
+				}
+				if (k == sz)
+					break;
+				while (k-- > 0)
+					taken[slot[order[bstart[b] + k]]] = 0;
+			}
+			if (d == dmax)
+				break;
+			disp[b] = (uint32_t)d;
+		}
+		if (bb == r || bstart[border[bb] + 1] == bstart[border[bb]])
+			break;
+		for (b = 0; b < r; b++)
+			disp[b] = 0;
+	}
+
+	if (attempt == J64__OBJ_MPH_SEEDS) {
+		J64_FREE(buf);
+		return 0;
+	}
+
+	/* Move each pair to its slot */
+	for (i = 0; i < n; i++) {
+		while (slot[i] != i) {
+			s = slot[i];
+			tmp = pairs[2 * i];
+			pairs[2 * i] = pairs[2 * s];
+			pairs[2 * s] = tmp;
+			tmp = pairs[2 * i + 1];
+			pairs[2 * i + 1] = pairs[2 * s + 1];
+			pairs[2 * s + 1] = tmp;
+			slot[i] = slot[s];
+			slot[s] = s;
+		}
+	}
+
+	J64_FREE(buf);
+
+	return 1;
+}
+
+/*
+ * Seals an object, indexing its keys with a minimal perfect hash so that
+ * every lookup takes a single probe. Meant for objects that are read
+ * much more often than they change.
+ *
+ * Returns 1 on success, 0 otherwise.
+ */
+J64_API int
+j64_obj_seal(j64_t *jp)
+{
+	struct j64__obj_hdr *hdr;
+	struct j64__obj_sealed_hdr *sealed_hdr;
+	j64_t *pairs;
+	size_t cap, n;
+	size_t i, k;
+
+	j64__assert(jp != NULL);
+	j64__assert(j64_is_obj(*jp));
+
+	hdr = J64__OBJ_HDR(*jp);
+	if (J64__OBJ_IS_SEALED(hdr))
+		return 1;
+	if (j64__box_is_shared(hdr) && !j64_obj_unshare(jp))
+		return 0;
+
+	hdr = J64__OBJ_HDR(*jp);
+	n = hdr->len;
+	sealed_hdr = (struct j64__obj_sealed_hdr *)j64__box_alloc(J64__OBJ_SEALED_SIZE(n));
+	if (sealed_hdr == NULL)
+		return 0;
+
+	sealed_hdr->cap = n | J64__HDR_SEALED;
+	pairs = &hdr->buf;
+	cap = J64__OBJ_CAP(hdr);
+	for (i = 0, k = 0; i < cap; i++) {
+		if (!j64_is_str(pairs[2 * i]))
+			continue;
+		(&sealed_hdr->buf)[2 * k] = pairs[2 * i];
+		(&sealed_hdr->buf)[2 * k + 1] = pairs[2 * i + 1];
+		k++;
+	}
+
+	if (!j64__obj_mph_build(sealed_hdr, n)) {
+		j64__box_free(sealed_hdr);
+		return 0;
+	}
+
+	j64__box_free(hdr);
+	jp->p = (uintptr_t)sealed_hdr;
+	jp->w |= J64_TYPE_OBJ;
+
+	return 1;
+}
+
+/*
+ * Frees an object along with its keys, but not its values.
+ */
+J64_API void
+j64_obj_free(j64_t j)
+{
+	struct j64__obj_hdr *hdr;
+	j64_t *pairs;
+	size_t cap;
+	size_t i;
+
+	j64__assert(j64_is_obj(j));
+
+	hdr = J64__OBJ_HDR(j);
+	if (!j64__box_unref(hdr))
+		return;
+
+	pairs = j64__obj_pairs(hdr);
+	cap = J64__OBJ_CAP(hdr);
+	for (i = 0; i < cap; i++)
+		j64_free(pairs[2 * i]);
+
+	j64__box_free(hdr);
+}
+
+/*
+ * Tree iteration
+ *
+ * j64_iter walks a whole tree depth-first, parents before children, with
+ * an explicit stack instead of recursion:
+ *
+ *	struct j64_iter it;
+ *	size_t depth;
+ *	j64_t k, v;
+ *
+ *	j64_iter_init(&it, j);
+ *	while (j64_iter_next(&it, &depth, &k, &v))
+ *		...
+ *	j64_iter_fini(&it);
+ *
+ * The root comes first at depth 0 with an undefined key. Object members
+ * come with their keys, and array elements with their indices as integer
+ * keys; unset elements are undefined. While the caller handles a node,
+ * the boxes of the children a few slots ahead are being prefetched.
+ */
+
+#define J64__ITER_STACK_LEN	16
+/* Number of slots to prefetch ahead of the current child */
+#define J64__ITER_AHEAD		4
+
+struct j64__iter_frame {
+	j64_t	j;
+	size_t	i;
+	size_t	cap;
+};
+
+struct j64_iter {
+	j64_t			root;
+	size_t			depth;
+	size_t			stack_cap;
+	struct j64__iter_frame	*stack;
+	struct j64__iter_frame	stack_buf[J64__ITER_STACK_LEN];
+	int			error;		/* out of memory */
+};
+
+J64_API void
+j64_iter_init(struct j64_iter *it, j64_t j)
+{
+	it->root = j;
+	it->depth = 0;
+	it->stack_cap = J64__ITER_STACK_LEN;
+	it->stack = it->stack_buf;
+	it->error = 0;
+}
+
+J64_API void
+j64_iter_fini(struct j64_iter *it)
+{
+	if (it->stack != it->stack_buf)
+		J64_FREE(it->stack);
+}
+
+J64_API void
+j64__iter_prefetch(j64_t j)
+{
+	if (j64__is_box(j))
+		J64__PREFETCH(J64__BOX_PTR(j));
+}
+
+/* Pushes a non-empty container, prefetching its first children */
+J64_API int
+j64__iter_push(struct j64_iter *it, j64_t j)
+{
+	struct j64__iter_frame *f;
+	j64_t *pairs;
+	void *tmp;
+	size_t i;
+
+	if (it->depth == it->stack_cap) {
+		if (SIZE_MAX / 2 / sizeof(*f) < it->stack_cap)
+			return 0;
+		if (it->stack == it->stack_buf) {
+			tmp = J64_MALLOC(2 * it->stack_cap * sizeof(*f));
+			if (tmp != NULL)
+				memcpy(tmp, it->stack_buf, sizeof(it->stack_buf));
+		} else {
+			tmp = J64_REALLOC(it->stack, 2 * it->stack_cap * sizeof(*f));
+		}
+		if (tmp == NULL)
+			return 0;
+		it->stack = (struct j64__iter_frame *)tmp;
+		it->stack_cap *= 2;
+	}
+
+	f = &it->stack[it->depth++];
+	f->j = j;
+	f->i = 0;
+	if (j64_is_barr(j)) {
+		f->cap = J64__BARR_CAP(J64__BARR_HDR(j));
+		for (i = 0; i < J64__MIN(f->cap, J64__ITER_AHEAD); i++)
+			j64__iter_prefetch(*j64__barr_slot(J64__BARR_HDR(j), i));
+	} else {
+		f->cap = J64__OBJ_CAP(J64__OBJ_HDR(j));
+		pairs = j64__obj_pairs(J64__OBJ_HDR(j));
+		for (i = 0; i < J64__MIN(f->cap, J64__ITER_AHEAD); i++)
+			j64__iter_prefetch(pairs[2 * i + 1]);
+	}
+
+	return 1;
+}
+
+/* Returns the next child of a frame, or 0 if there are no more */
+J64_API int
+j64__iter_child(struct j64__iter_frame *f, j64_t *kp, j64_t *vp)
+{
+	j64_t *pairs;
+	size_t i;
+
+	if (j64_is_barr(f->j)) {
+		if (f->i == f->cap)
+			return 0;
+		i = f->i++;
+		if (i + J64__ITER_AHEAD < f->cap)
+			j64__iter_prefetch(*j64__barr_slot(J64__BARR_HDR(f->j), i + J64__ITER_AHEAD));
+		*kp = j64_int((int64_t)i);
+		*vp = *j64__barr_slot(J64__BARR_HDR(f->j), i);
+		return 1;
+	}
+
+	pairs = j64__obj_pairs(J64__OBJ_HDR(f->j));
+	while (f->i < f->cap) {
+		i = f->i++;
+		if (i + J64__ITER_AHEAD < f->cap)
+			j64__iter_prefetch(pairs[2 * (i + J64__ITER_AHEAD) + 1]);
+		if (!j64_is_str(pairs[2 * i]))
+			continue;
+		*kp = pairs[2 * i];
+		*vp = pairs[2 * i + 1];
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns 1 and stores the depth, key and value of the next node, or 0
+ * at the end of the tree or if out of memory, setting the error flag in
+ * the latter case.
+ */
+J64_API int
+j64_iter_next(struct j64_iter *it, size_t *depthp, j64_t *kp, j64_t *vp)
+{
+	j64_t k, v;
+	size_t depth;
+
+	if (it->error)
+		return 0;
+
+	if (!j64_is_undef(it->root)) {
+		k = j64_undef();
+		v = it->root;
+		it->root = j64_undef();
+		depth = 0;
+		goto found;
+	}
+
+	while (it->depth > 0) {
+		if (j64__iter_child(&it->stack[it->depth - 1], &k, &v)) {
+			depth = it->depth;
+			goto found;
+		}
+		it->depth--;
+	}
+
+	return 0;
+
+found:
+	if ((j64_is_barr(v) || j64_is_obj(v)) && !j64__iter_push(it, v)) {
+		it->error = 1;
+		return 0;
+	}
+	if (depthp != NULL)
+		*depthp = depth;
+	if (kp != NULL)
+		*kp = k;
+	if (vp != NULL)
+		*vp = v;
+
+	return 1;
+}
+
+/*
+ * Compiled paths
+ *
+ * A path is compiled once from a JSON Pointer (RFC 6901), such as
+ * "/users/0/name", or from a dotted path, such as "users.0.name". Each
+ * step holds the canonical string key with its precomputed hash and, if
+ * the step is a valid array index, the index. Evaluating a compiled path
+ * against a document does no string handling at all.
+ */
+
+#define J64_PATH_NOIDX	SIZE_MAX
+
+struct j64_path_step {
+	j64_t		key;
+	uint64_t	hash;
+	size_t		idx;
+};
+
+struct j64_path {
+	size_t			len;
+	struct j64_path_step	step;
+};
+
+#define J64__PATH_SIZEOF	(offsetof(struct j64_path, step))
+#define J64__PATH_LEN_MAX	((SIZE_MAX - J64__PATH_SIZEOF) / sizeof(struct j64_path_step))
+
+J64_API void
+j64_path_free(struct j64_path *path)
+{
+	size_t i;
+
+	if (path == NULL)
+		return;
+
+	for (i = 0; i < path->len; i++)
+		j64_free((&path->step)[i].key);
+
+	J64_FREE(path);
+}
+
+/* Parses an array index, or returns J64_PATH_NOIDX */
+J64_API size_t
+j64__path_idx(const uint8_t *buf, size_t len)
+{
+	size_t idx = 0;
+	size_t i;
+
+	if (len == 0 || (buf[0] == '0' && len > 1))
+		return J64_PATH_NOIDX;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] < '0' || '9' < buf[i])
+			return J64_PATH_NOIDX;
+		if ((J64_PATH_NOIDX - 1 - (size_t)(buf[i] - '0')) / 10 < idx)
+			return J64_PATH_NOIDX;
+		idx = idx * 10 + (size_t)(buf[i] - '0');
+	}
+
+	return idx;
+}
+
+/*
+ * Compiles a JSON Pointer, if the path is empty or starts with '/',
+ * or a dotted path otherwise. Pointer segments may use the ~0 and ~1
+ * escapes for '~' and '/'; dotted path segments may not be empty.
+ *
+ * Returns the compiled path, to be freed with j64_path_free,
+ * or NULL if the path is invalid or out of memory.
+ */
+J64_API struct j64_path *
+j64_path_compile(const char *buf, size_t len)
+{
+	struct j64_path *path;
+	struct j64_path_step *step;
+	const uint8_t *p, *end, *seg_end;
+	uint8_t *tmp;
+	size_t nsteps, n;
+	size_t i;
+	int pointer;
+	uint8_t sep;
+
+	j64__assert(buf != NULL || len == 0);
+
+	p = (const uint8_t *)buf;
+	end = p + len;
+	pointer = len == 0 || p[0] == '/';
+	sep = pointer ? '/' : '.';
+	if (pointer && len != 0)
+		p++;
+
+	/* Every separator starts a new step */
+	nsteps = len == 0 ? 0 : 1;
+	for (i = pointer ? 1 : 0; i < len; i++)
+		nsteps += buf[i] == (char)sep;
+
+	path = (struct j64_path *)J64_MALLOC(J64__PATH_SIZEOF +
+	    J64__MIN(nsteps, J64__PATH_LEN_MAX) * sizeof(struct j64_path_step));
+	if (path == NULL)
+		return NULL;
+	path->len = 0;
+
+	tmp = (uint8_t *)J64_MALLOC(len + 1);
+	if (tmp == NULL || J64__PATH_LEN_MAX < nsteps)
+		goto fail;
+
+	while (path->len < nsteps) {
+		seg_end = (const uint8_t *)memchr(p, sep, (size_t)(end - p));
+		if (seg_end == NULL)
+			seg_end = end;
+
+		/* Unescape the segment */
+		for (n = 0; p < seg_end; p++) {
+			if (!pointer || *p != '~') {
+				tmp[n++] = *p;
+			} else if (p + 1 < seg_end && (p[1] == '0' || p[1] == '1')) {
+				tmp[n++] = p[1] == '0' ? '~' : '/';
+				p++;
+			} else {
+				goto fail;
+			}
+		}
+		if (!pointer && n == 0)
+			goto fail;
+
+		step = &(&path->step)[path->len];
+		step->key = j64_str(tmp, n);
+		if (j64_is_undef(step->key))
+			goto fail;
+		step->hash = j64__str_hash(step->key, 0);
+		step->idx = j64__path_idx(tmp, n);
+		path->len++;
+		p = seg_end + 1;
+	}
+
+	J64_FREE(tmp);
+
+	return path;
+
+fail:
+	j64_path_free(path);
+	if (tmp != NULL)
+		J64_FREE(tmp);
+
+	return NULL;
+}
+
+J64_API size_t
+j64_path_len(const struct j64_path *path)
+{
+	j64__assert(path != NULL);
+	return path->len;
+}
+
+/*
+ * Evaluates a compiled path against a document.
+ *
+ * Returns the value at the path, or undefined if there is none.
+ */
+J64_API j64_t
+j64_path_get(const struct j64_path *path, j64_t j)
+{
+	const struct j64_path_step *step;
+	j64_t *pair;
+	size_t i;
+
+	j64__assert(path != NULL);
+
+	for (i = 0; i < path->len; i++) {
+		step = &(&path->step)[i];
+		switch (J64_TYPE_GET(j)) {
+		case J64_TYPE_OBJ:
+			pair = j64__obj_lookup_hashed(j, step->key, step->hash);
+			if (pair == NULL)
+				return j64_undef();
+			j = pair[1];
+			break;
+		case J64_TYPE_BARR:
+			if (j64_barr_cap(j) <= step->idx)
+				return j64_undef();
+			j = j64_barr_get(j, step->idx);
+			break;
+		default:
+			return j64_undef();
+		}
+	}
+
+	return j;
+}
+
+/*
+ * Decoding
+ *
+ * JSON text (RFC 8259) is read by a tokenizer that checks the grammar
+ * with a bit stack of open containers instead of recursion. Strings and
+ * numbers are scanned and checked in place, and turning a token into a
+ * value is a separate step, which lets values be skipped without
+ * allocating anything.
+ */
+
+/* Token types */
+#define J64_TOK_ERROR		0
+#define J64_TOK_END		1
+#define J64_TOK_VALUE		2
+#define J64_TOK_KEY		3
+#define J64_TOK_ARR_BEGIN	4
+#define J64_TOK_ARR_END		5
+#define J64_TOK_OBJ_BEGIN	6
+#define J64_TOK_OBJ_END		7
+
+/* The input ran out within a token, only when parsing incrementally */
+#define J64__TOK_MORE		(-1)
+
+/* Tokenizer states, named by what is expected next */
+#define J64__LEX_VALUE		0
+#define J64__LEX_VALUE_OR_END	1
+#define J64__LEX_KEY		2
+#define J64__LEX_KEY_OR_END	3
+#define J64__LEX_COLON		4
+#define J64__LEX_NEXT		5
+#define J64__LEX_DONE		6
+#define J64__LEX_ERROR		7
+
+/* Kinds of scalar tokens */
+#define J64__LEX_LIT		0
+#define J64__LEX_STR		1
+#define J64__LEX_NUM		2
+
+#define J64__LEX_STACK_WORDS	8
+
+#define J64__IS_WS(c)		((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+#define J64__IS_DIGIT(c)	('0' <= (c) && (c) <= '9')
+
+struct j64__lex {
+	const uint8_t	*p;
+	const uint8_t	*end;
+	const uint8_t	*tok;		/* first byte of the last token */
+	size_t		tok_len;	/* its length, with quotes for strings */
+	int		tok_kind;
+	int		tok_flag;	/* string has escapes, number is integral */
+	j64_t		tok_lit;
+	int		state;
+	int		partial;	/* more input may follow END */
+	size_t		depth;
+	size_t		depth_max;
+	size_t		stack_cap;	/* in bits */
+	uint64_t	*stack;		/* one bit per open container, set for objects */
+	int		stack_alloc;	/* the stack was allocated */
+	uint64_t	stack_buf[J64__LEX_STACK_WORDS];
+};
+
+/*
+ * Grows a stack of SIZE byte elements that is full at *CAPP elements.
+ * Returns the new buffer, or NULL if out of memory, leaving BUF intact.
+ */
+J64_API void *
+j64__grow(void *buf, size_t *capp, size_t size)
+{
+	uint64_t t0;
+	size_t cap;
+
+	if (SIZE_MAX / 2 / size < *capp)
+		return NULL;
+
+	cap = *capp < 8 ? 8 : 2 * *capp;
+	J64__TRACE_BEGIN(t0);
+	buf = J64_REALLOC(buf, cap * size);
+	J64__TRACE_END(grow, t0, cap * size);
+	if (buf != NULL)
+		*capp = cap;
+
+	return buf;
+}
+
+J64_API void
+j64__lex_init(struct j64__lex *lex, const void *buf, size_t len)
+{
+	lex->p = (const uint8_t *)buf;
+	lex->end = lex->p + len;
+	lex->tok = lex->p;
+	lex->tok_len = 0;
+	lex->tok_kind = J64__LEX_LIT;
+	lex->tok_flag = 0;
+	lex->tok_lit = j64_undef();
+	lex->state = J64__LEX_VALUE;
+	lex->partial = 0;
+	lex->depth = 0;
+	lex->depth_max = SIZE_MAX;
+	lex->stack_cap = 64 * J64__LEX_STACK_WORDS;
+	lex->stack = lex->stack_buf;
+	lex->stack_alloc = 0;
+}
+
+/* Like j64__lex_init, but keeps a grown stack for the next text */
+J64_API void
+j64__lex_reset(struct j64__lex *lex, const void *buf, size_t len)
+{
+	uint64_t *stack = lex->stack;
+	size_t stack_cap = lex->stack_cap;
+	int stack_alloc = lex->stack_alloc;
+
+	j64__lex_init(lex, buf, len);
+	lex->stack = stack;
+	lex->stack_cap = stack_cap;
+	lex->stack_alloc = stack_alloc;
+}
+
+J64_API void
+j64__lex_fini(struct j64__lex *lex)
+{
+	if (lex->stack_alloc)
+		J64_FREE(lex->stack);
+}
+
+/* Returns 1 if the innermost open container is an object */
+J64_API int
+j64__lex_top(const struct j64__lex *lex)
+{
+	size_t i = lex->depth - 1;
+
+	return (lex->stack[i / 64] >> (i % 64)) & 1;
+}
+
+J64_API int
+j64__lex_push(struct j64__lex *lex, int obj)
+{
+	uint64_t *stack;
+	size_t i = lex->depth;
+
+	if (i == lex->depth_max)
+		return 0;
+	if (i == lex->stack_cap) {
+		if (SIZE_MAX / 2 / sizeof(uint64_t) < i / 64)
+			return 0;
+		stack = (uint64_t *)J64_MALLOC(i / 64 * 2 * sizeof(uint64_t));
+		if (stack == NULL)
+			return 0;
+		memcpy(stack, lex->stack, i / 64 * sizeof(uint64_t));
+		j64__lex_fini(lex);
+		lex->stack = stack;
+		lex->stack_cap = 2 * i;
+		lex->stack_alloc = 1;
+	}
+
+	if (obj)
+		lex->stack[i / 64] |= (uint64_t)1 << (i % 64);
+	else
+		lex->stack[i / 64] &= ~((uint64_t)1 << (i % 64));
+	lex->depth++;
+
+	return 1;
+}
+
+J64_API int
+j64__hex(uint8_t c)
+{
+	if (J64__IS_DIGIT(c))
+		return c - '0';
+	if ('a' <= (c | 0x20) && (c | 0x20) <= 'f')
+		return (c | 0x20) - 'a' + 10;
+	return -1;
+}
+
+/*
+ * Scans a string token after its opening quote, setting *ESCP if it has
+ * escape sequences. Returns a pointer past the closing quote, or NULL if
+ * the string is invalid or unterminated, setting *TRUNCP in the latter
+ * case.
+ */
+J64_API const uint8_t *
+j64__lex_str(const uint8_t *p, const uint8_t *end, int *escp, int *truncp)
+{
+	int i;
+
+	*escp = 0;
+	*truncp = 1;
+	while (p < end) {
+		if (*p == '"')
+			return p + 1;
+		if (*p < 0x20)
+			goto fail;
+		if (*p != '\\') {
+			p++;
+			continue;
+		}
+
+		*escp = 1;
+		if (end - p < 2)
+			return NULL;
+		switch (p[1]) {
+		case '"': case '\\': case '/':
+		case 'b': case 'f': case 'n': case 'r': case 't':
+			p += 2;
+			break;
+		case 'u':
+			for (i = 2; i < 6; i++) {
+				if (p + i == end)
+					return NULL;
+				if (j64__hex(p[i]) < 0)
+					goto fail;
+			}
+			p += 6;
+			break;
+		default:
+			goto fail;
+		}
+	}
+
+	return NULL;
+
+fail:
+	*truncp = 0;
+	return NULL;
+}
+
+/*
+ * Scans a number token, setting *INTP if it has no fraction or exponent.
+ * Returns a pointer past the number, or NULL if it is invalid, setting
+ * *TRUNCP if it only lacks digits at the end of the input.
+ */
+J64_API const uint8_t *
+j64__lex_num(const uint8_t *p, const uint8_t *end, int *intp, int *truncp)
+{
+	*intp = 1;
+	if (p < end && *p == '-')
+		p++;
+	if (p == end || !J64__IS_DIGIT(*p))
+		goto fail;
+	if (*p++ != '0')
+		while (p < end && J64__IS_DIGIT(*p))
+			p++;
+
+	if (p < end && *p == '.') {
+		*intp = 0;
+		if (++p == end || !J64__IS_DIGIT(*p))
+			goto fail;
+		while (p < end && J64__IS_DIGIT(*p))
+			p++;
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		*intp = 0;
+		if (++p < end && (*p == '+' || *p == '-'))
+			p++;
+		if (p == end || !J64__IS_DIGIT(*p))
+			goto fail;
+		while (p < end && J64__IS_DIGIT(*p))
+			p++;
+	}
+
+	return p;
+
+fail:
+	*truncp = p == end;
+	return NULL;
+}
+
+J64_API const uint8_t *
+j64__lex_lit(const uint8_t *p, const uint8_t *end, const char *lit, size_t len,
+    int *truncp)
+{
+	size_t n = (size_t)(end - p);
+
+	if (n < len || memcmp(p, lit, len) != 0) {
+		*truncp = n < len && memcmp(p, lit, n) == 0;
+		return NULL;
+	}
+
+	return p + len;
+}
+
+/*
+ * Reads the next token. Commas and colons are consumed as separators,
+ * and for values and keys the scanned token is left for j64__lex_value.
+ *
+ * Returns the token type; J64_TOK_END once the document is complete
+ * and only whitespace follows it.
+ */
+J64_API int
+j64__lex_next(struct j64__lex *lex)
+{
+	const uint8_t *p = lex->p;
+	const uint8_t *end = lex->end;
+	const uint8_t *q;
+	uint8_t c;
+	int trunc = 0;
+
+	for (;;) {
+		while (p < end && J64__IS_WS(*p))
+			p++;
+		lex->tok = p;
+		if (p == end) {
+			lex->p = p;
+			if (lex->partial && lex->state != J64__LEX_ERROR)
+				return J64__TOK_MORE;
+			return lex->state == J64__LEX_DONE ? J64_TOK_END : J64_TOK_ERROR;
+		}
+
+		c = *p;
+		switch (lex->state) {
+		case J64__LEX_COLON:
+			if (c != ':')
+				goto fail;
+			p++;
+			lex->state = J64__LEX_VALUE;
+			continue;
+		case J64__LEX_NEXT:
+			if (c == ',') {
+				p++;
+				lex->state = j64__lex_top(lex) ? J64__LEX_KEY : J64__LEX_VALUE;
+				continue;
+			}
+			if (c == (j64__lex_top(lex) ? '}' : ']'))
+				goto close;
+			goto fail;
+		case J64__LEX_KEY_OR_END:
+			if (c == '}')
+				goto close;
+			/* FALLTHROUGH */
+		case J64__LEX_KEY:
+			if (c != '"')
+				goto fail;
+			q = j64__lex_str(p + 1, end, &lex->tok_flag, &trunc);
+			if (q == NULL)
+				goto fail;
+			lex->tok_kind = J64__LEX_STR;
+			lex->tok_len = (size_t)(q - p);
+			lex->p = q;
+			lex->state = J64__LEX_COLON;
+			return J64_TOK_KEY;
+		case J64__LEX_VALUE_OR_END:
+			if (c == ']')
+				goto close;
+			/* FALLTHROUGH */
+		case J64__LEX_VALUE:
+			break;
+		default:
+			goto fail;
+		}
+
+		switch (c) {
+		case '[':
+		case '{':
+			if (!j64__lex_push(lex, c == '{'))
+				goto fail;
+			lex->tok_len = 1;
+			lex->p = p + 1;
+			lex->state = c == '{' ? J64__LEX_KEY_OR_END : J64__LEX_VALUE_OR_END;
+			return c == '{' ? J64_TOK_OBJ_BEGIN : J64_TOK_ARR_BEGIN;
+		case '"':
+			q = j64__lex_str(p + 1, end, &lex->tok_flag, &trunc);
+			lex->tok_kind = J64__LEX_STR;
+			break;
+		case 't':
+			q = j64__lex_lit(p, end, "true", 4, &trunc);
+			lex->tok_kind = J64__LEX_LIT;
+			lex->tok_lit = j64_true();
+			break;
+		case 'f':
+			q = j64__lex_lit(p, end, "false", 5, &trunc);
+			lex->tok_kind = J64__LEX_LIT;
+			lex->tok_lit = j64_false();
+			break;
+		case 'n':
+			q = j64__lex_lit(p, end, "null", 4, &trunc);
+			lex->tok_kind = J64__LEX_LIT;
+			lex->tok_lit = j64_null();
+			break;
+		default:
+			q = j64__lex_num(p, end, &lex->tok_flag, &trunc);
+			lex->tok_kind = J64__LEX_NUM;
+			break;
+		}
+		if (q == NULL)
+			goto fail;
+
+		/* A number at the end of a chunk may continue in the next one */
+		if (q == end && lex->partial && lex->tok_kind == J64__LEX_NUM)
+			goto more;
+
+		lex->tok_len = (size_t)(q - p);
+		lex->p = q;
+		lex->state = lex->depth == 0 ? J64__LEX_DONE : J64__LEX_NEXT;
+		return J64_TOK_VALUE;
+	}
+
+close:
+	lex->depth--;
+	lex->tok_len = 1;
+	lex->p = p + 1;
+	lex->state = lex->depth == 0 ? J64__LEX_DONE : J64__LEX_NEXT;
+	return c == '}' ? J64_TOK_OBJ_END : J64_TOK_ARR_END;
+
+fail:
+	lex->p = p;
+	if (trunc && lex->partial)
+		return J64__TOK_MORE;
+	lex->state = J64__LEX_ERROR;
+	return J64_TOK_ERROR;
+
+more:
+	lex->p = p;
+	return J64__TOK_MORE;
+}
+
+/*
+ * Skips the rest of a container whose opening token was just read,
+ * balancing brackets and quotes without checking anything else.
+ *
+ * Returns 1 on success, 0 if the container is unterminated.
+ */
+J64_API int
+j64__lex_skip(struct j64__lex *lex)
+{
+	const uint8_t *p = lex->p;
+	const uint8_t *end = lex->end;
+	size_t depth = 1;
+
+	while (p < end) {
+		switch (*p++) {
+		case '"':
+			while (p < end && *p != '"') {
+				/* A trailing backslash must not step past the end */
+				if (*p == '\\' && end - p < 2)
+					goto fail;
+				p += *p == '\\' ? 2 : 1;
+			}
+			if (p == end)
+				goto fail;
+			p++;
+			break;
+		case '[':
+		case '{':
+			depth++;
+			break;
+		case ']':
+		case '}':
+			if (--depth != 0)
+				break;
+			lex->p = p;
+			lex->depth--;
+			lex->state = lex->depth == 0 ? J64__LEX_DONE : J64__LEX_NEXT;
+			return 1;
+		}
+	}
+
+fail:
+	lex->p = end;
+	lex->state = J64__LEX_ERROR;
+	return 0;
+}
+
+/* Encodes a code point as UTF-8, returning the number of bytes written */
+J64_API size_t
+j64__utf8_put(uint8_t *buf, unsigned long u)
+{
+	if (u < 0x80) {
+		buf[0] = (uint8_t)u;
+		return 1;
+	}
+	if (u < 0x800) {
+		buf[0] = (uint8_t)(0xc0 | (u >> 6));
+		buf[1] = (uint8_t)(0x80 | (u & 0x3f));
+		return 2;
+	}
+	if (u < 0x10000) {
+		buf[0] = (uint8_t)(0xe0 | (u >> 12));
+		buf[1] = (uint8_t)(0x80 | ((u >> 6) & 0x3f));
+		buf[2] = (uint8_t)(0x80 | (u & 0x3f));
+		return 3;
+	}
+	buf[0] = (uint8_t)(0xf0 | (u >> 18));
+	buf[1] = (uint8_t)(0x80 | ((u >> 12) & 0x3f));
+	buf[2] = (uint8_t)(0x80 | ((u >> 6) & 0x3f));
+	buf[3] = (uint8_t)(0x80 | (u & 0x3f));
+	return 4;
+}
+
+J64_API unsigned long
+j64__hex4(const uint8_t *p)
+{
+	return (unsigned long)(j64__hex(p[0]) << 12 | j64__hex(p[1]) << 8 |
+	    j64__hex(p[2]) << 4 | j64__hex(p[3]));
+}
+
+/*
+ * Unescapes the contents of a scanned string into BUF, which needs room
+ * for LEN bytes, since escape sequences never decode to more bytes than
+ * they take. Unpaired surrogates are replaced with U+FFFD.
+ *
+ * Returns the number of bytes written.
+ */
+J64_API size_t
+j64__str_unescape(uint8_t *buf, const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+	unsigned long u, v;
+	size_t n = 0;
+
+	while (p < end) {
+		if (*p != '\\') {
+			buf[n++] = *p++;
+			continue;
+		}
+
+		switch (p[1]) {
+		case 'b':
+			buf[n++] = '\b';
+			break;
+		case 'f':
+			buf[n++] = '\f';
+			break;
+		case 'n':
+			buf[n++] = '\n';
+			break;
+		case 'r':
+			buf[n++] = '\r';
+			break;
+		case 't':
+			buf[n++] = '\t';
+			break;
+		case 'u':
+			u = j64__hex4(p + 2);
+			p += 6;
+			if (0xd800 <= u && u < 0xdc00 && end - p >= 6 &&
+			    p[0] == '\\' && p[1] == 'u' &&
+			    (v = j64__hex4(p + 2)) >= 0xdc00 && v < 0xe000) {
+				u = 0x10000 + ((u - 0xd800) << 10) + (v - 0xdc00);
+				p += 6;
+			} else if (0xd800 <= u && u < 0xe000) {
+				u = 0xfffd;
+			}
+			n += j64__utf8_put(&buf[n], u);
+			continue;
+		default:
+			buf[n++] = p[1];
+			break;
+		}
+		p += 2;
+	}
+
+	return n;
+}
+
+/*
+ * Decodes the contents of a scanned string, which has escape sequences
+ * if ESC.
+ *
+ * Returns the string, or undefined if out of memory.
+ */
+J64_API j64_t
+j64__str_decode(const uint8_t *p, size_t len, int esc)
+{
+	uint8_t sbuf[256], *buf;
+	j64_t j;
+
+	if (!esc)
+		return j64_str(p, len);
+
+	buf = len <= sizeof(sbuf) ? sbuf : (uint8_t *)J64_MALLOC(len);
+	if (buf == NULL)
+		return j64_undef();
+
+	j = j64_str(buf, j64__str_unescape(buf, p, len));
+	if (buf != sbuf)
+		J64_FREE(buf);
+
+	return j;
+}
+
+/*
+ * Decodes a scanned number, which is integral if INT. Integers between
+ * J64_INT_MIN and J64_INT_MAX become integers, everything else floats.
+ *
+ * Returns the number, or undefined if out of memory.
+ */
+J64_API j64_t
+j64__num_decode(const uint8_t *p, size_t len, int is_int)
+{
+	char sbuf[64], *buf;
+	uint64_t u = 0;
+	size_t neg, i;
+	double f;
+
+	neg = p[0] == '-';
+	if (is_int && len - neg <= 19) {
+		for (i = neg; i < len; i++)
+			u = 10 * u + (uint64_t)(p[i] - '0');
+		if (u <= (uint64_t)J64_INT_MAX + neg)
+			return j64_int(neg ? -(int64_t)u : (int64_t)u);
+	}
+
+	buf = len < sizeof(sbuf) ? sbuf : (char *)J64_MALLOC(len + 1);
+	if (buf == NULL)
+		return j64_undef();
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	f = strtod(buf, NULL);
+	if (buf != sbuf)
+		J64_FREE(buf);
+
+	return j64_float(f);
+}
+
+/*
+ * Turns the last scanned scalar or key into a value.
+ * Returns the value, or undefined if out of memory.
+ */
+J64_API j64_t
+j64__lex_value(const struct j64__lex *lex)
+{
+	switch (lex->tok_kind) {
+	case J64__LEX_STR:
+		return j64__str_decode(lex->tok + 1, lex->tok_len - 2, lex->tok_flag);
+	case J64__LEX_NUM:
+		return j64__num_decode(lex->tok, lex->tok_len, lex->tok_flag);
+	default:
+		return lex->tok_lit;
+	}
+}
+
+/*
+ * Tree building
+ *
+ * Values are built bottom-up from tokens: scalars, keys and finished
+ * containers go on a value stack, and closing a container moves its
+ * elements from the stack into a new array or object.
+ */
+
+struct j64__build {
+	j64_t	*vals;
+	size_t	nvals;
+	size_t	vals_cap;
+	size_t	*starts;	/* value stack index of each open container */
+	size_t	nstarts;
+	size_t	starts_cap;
+};
+
+J64_API void
+j64__build_init(struct j64__build *b)
+{
+	b->vals = NULL;
+	b->nvals = 0;
+	b->vals_cap = 0;
+	b->starts = NULL;
+	b->nstarts = 0;
+	b->starts_cap = 0;
+}
+
+J64_API void
+j64__build_fini(struct j64__build *b)
+{
+	while (b->nvals > 0)
+		j64_release(b->vals[--b->nvals]);
+	if (b->vals != NULL)
+		J64_FREE(b->vals);
+	if (b->starts != NULL)
+		J64_FREE(b->starts);
+}
+
+J64_API j64_t
+j64__build_arr(struct j64__build *b)
+{
+	size_t start, n, i;
+	j64_t j;
+
+	start = b->starts[b->nstarts - 1];
+	n = b->nvals - start;
+	if (n == 0) {
+		j = j64_earr();
+	} else {
+		j = j64_barr_alloc(n);
+		if (j64_is_undef(j))
+			return j;
+		for (i = 0; i < n; i++)
+			j64_barr_set(j, b->vals[start + i], i);
+	}
+
+	b->nstarts--;
+	b->nvals = start;
+
+	return j;
+}
+
+J64_API j64_t
+j64__build_obj(struct j64__build *b)
+{
+	size_t start, n, i;
+	j64_t *kv, *pair;
+	j64_t j;
+
+	start = b->starts[b->nstarts - 1];
+	n = (b->nvals - start) / 2;
+	if (n == 0) {
+		j = j64_eobj();
+	} else {
+		j = j64_obj_alloc(n);
+		if (j64_is_undef(j))
+			return j;
+
+		/* Later duplicates replace earlier ones */
+		kv = &b->vals[start];
+		for (i = 0; i < n; i++) {
+			pair = j64__obj_lookup(j, kv[2 * i]);
+			if (pair != NULL) {
+				j64_release(pair[1]);
+				pair[1] = kv[2 * i + 1];
+				j64_free(kv[2 * i]);
+			} else if (!j64_obj_set(&j, kv[2 * i], kv[2 * i + 1])) {
+				j64__assert(0);
+			}
+		}
+	}
+
+	b->nstarts--;
+	b->nvals = start;
+
+	return j;
+}
+
+/*
+ * Feeds a token to the builder.
+ * Returns 1 on success, 0 on a token error or if out of memory.
+ */
+J64_API int
+j64__build_tok(struct j64__build *b, const struct j64__lex *lex, int tok)
+{
+	void *tmp;
+	j64_t j;
+
+	switch (tok) {
+	case J64_TOK_ARR_BEGIN:
+	case J64_TOK_OBJ_BEGIN:
+		if (b->nstarts == b->starts_cap) {
+			tmp = j64__grow(b->starts, &b->starts_cap, sizeof(size_t));
+			if (tmp == NULL)
+				return 0;
+			b->starts = (size_t *)tmp;
+		}
+		b->starts[b->nstarts++] = b->nvals;
+		return 1;
+	case J64_TOK_ARR_END:
+		j = j64__build_arr(b);
+		break;
+	case J64_TOK_OBJ_END:
+		j = j64__build_obj(b);
+		break;
+	case J64_TOK_VALUE:
+	case J64_TOK_KEY:
+		j = j64__lex_value(lex);
+		break;
+	default:
+		return 0;
+	}
+	if (j64_is_undef(j))
+		return 0;
+
+	if (b->nvals == b->vals_cap) {
+		tmp = j64__grow(b->vals, &b->vals_cap, sizeof(j64_t));
+		if (tmp == NULL) {
+			j64_release(j);
+			return 0;
+		}
+		b->vals = (j64_t *)tmp;
+	}
+	b->vals[b->nvals++] = j;
+
+	return 1;
+}
+
+/*
+ * Builds the value of a text from its tokens, leaving both stacks empty
+ * for the next text. Returns undefined on failure.
+ */
+J64_API j64_t
+j64__decode(struct j64__lex *lex, struct j64__build *b)
+{
+	size_t len = (size_t)(lex->end - lex->p);
+	uint64_t t0;
+	int tok;
+
+	J64__TRACE_BEGIN(t0);
+	while ((tok = j64__lex_next(lex)) != J64_TOK_END) {
+		if (!j64__build_tok(b, lex, tok)) {
+			while (b->nvals > 0)
+				j64_release(b->vals[--b->nvals]);
+			b->nstarts = 0;
+			J64__TRACE_END(parse, t0, len);
+			return j64_undef();
+		}
+	}
+	J64__TRACE_END(parse, t0, len);
+
+	return b->vals[--b->nvals];
+}
+
+/*
+ * Decodes a JSON text. Duplicate keys keep their last value.
+ *
+ * Returns the value, or undefined on a syntax error or if out of memory.
+ */
+J64_API j64_t
+j64_decode(const void *buf, size_t len)
+{
+	struct j64__lex lex;
+	struct j64__build b;
+	j64_t j;
+
+	j64__assert(buf != NULL || len == 0);
+
+	j64__lex_init(&lex, buf, len);
+	j64__build_init(&b);
+	j = j64__decode(&lex, &b);
+	j64__build_fini(&b);
+	j64__lex_fini(&lex);
+
+	return j;
+}
+
+/*
+ * Decodes N texts, the Ith of LENS[I] bytes at BUFS[I], into OUT[I].
+ * The tokenizer and builder stacks are set up once and reused, which
+ * matters for many small texts, and the next text is prefetched while
+ * the current one is decoded. Texts that fail to decode get undefined.
+ *
+ * Returns the number of texts decoded.
+ */
+J64_API size_t
+j64_decode_batch(const void *const *bufs, const size_t *lens, size_t n, j64_t *out)
+{
+	struct j64__lex lex;
+	struct j64__build b;
+	size_t i, ok = 0;
+
+	j64__assert(n == 0 || (bufs != NULL && lens != NULL && out != NULL));
+
+	j64__lex_init(&lex, "", 0);
+	j64__build_init(&b);
+	for (i = 0; i < n; i++) {
+		j64__assert(bufs[i] != NULL || lens[i] == 0);
+		if (i + 1 < n && lens[i + 1] > 0)
+			J64__PREFETCH(bufs[i + 1]);
+		j64__lex_reset(&lex, bufs[i], lens[i]);
+		out[i] = j64__decode(&lex, &b);
+		ok += !j64_is_undef(out[i]);
+	}
+	j64__build_fini(&b);
+	j64__lex_fini(&lex);
+
+	return ok;
+}
+
+/*
+ * Validation
+ *
+ * j64_validate runs the tokenizer alone, building no values. Nesting is
+ * tracked in a bit stack of J64_VALIDATE_STACK_WORDS words on the C
+ * stack, so nothing is allocated below 64 levels per word. Deeper texts
+ * grow the stack as decoding does, so that validation accepts whatever
+ * j64_decode accepts.
+ */
+
+#ifndef J64_VALIDATE_STACK_WORDS
+#define J64_VALIDATE_STACK_WORDS	512
+#endif /* J64_VALIDATE_STACK_WORDS */
+
+#define J64_VALIDATE_UTF8	0x1	/* strings must be valid UTF-8 */
+
+/*
+ * Returns 1 if LEN bytes at P are valid UTF-8, without overlong forms,
+ * surrogates or code points past U+10FFFF.
+ */
+J64_API int
+j64__utf8_valid(const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+	uint64_t w;
+	uint8_t c;
+
+	while (p < end) {
+		/* Skip ASCII a word at a time */
+		if (end - p >= 8) {
+			memcpy(&w, p, 8);
+			if ((w & 0x8080808080808080ULL) == 0) {
+				p += 8;
+				continue;
+			}
+		}
+
+		c = *p++;
+		if (c < 0x80)
+			continue;
+		if (c < 0xc2)
+			return 0;
+		if (c < 0xe0) {
+			if (p == end || (p[0] & 0xc0) != 0x80)
+				return 0;
+			p++;
+		} else if (c < 0xf0) {
+			if (end - p < 2 || (p[0] & 0xc0) != 0x80 || (p[1] & 0xc0) != 0x80 ||
+			    (c == 0xe0 && p[0] < 0xa0) || (c == 0xed && p[0] > 0x9f))
+				return 0;
+			p += 2;
+		} else if (c < 0xf5) {
+			if (end - p < 3 || (p[0] & 0xc0) != 0x80 || (p[1] & 0xc0) != 0x80 ||
+			    (p[2] & 0xc0) != 0x80 ||
+			    (c == 0xf0 && p[0] < 0x90) || (c == 0xf4 && p[0] > 0x8f))
+				return 0;
+			p += 3;
+		} else {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Checks that LEN bytes at BUF are a single well-formed JSON text nested
+ * at most MAX_DEPTH levels deep, or to any depth if MAX_DEPTH is 0.
+ * FLAGS may include J64_VALIDATE_UTF8.
+ *
+ * Returns 1 if the text is valid, 0 otherwise or if out of memory.
+ */
+J64_API int
+j64_validate(const void *buf, size_t len, size_t max_depth, int flags)
+{
+	struct j64__lex lex;
+	uint64_t stack[J64_VALIDATE_STACK_WORDS];
+	int tok;
+
+	j64__assert(buf != NULL || len == 0);
+
+	j64__lex_init(&lex, buf, len);
+	lex.stack = stack;
+	lex.stack_cap = 64 * J64_VALIDATE_STACK_WORDS;
+	if (max_depth != 0)
+		lex.depth_max = max_depth;
+
+	while ((tok = j64__lex_next(&lex)) > J64_TOK_END) {
+		if ((flags & J64_VALIDATE_UTF8) && lex.tok_kind == J64__LEX_STR &&
+		    (tok == J64_TOK_VALUE || tok == J64_TOK_KEY) &&
+		    !j64__utf8_valid(lex.tok + 1, lex.tok_len - 2)) {
+			tok = J64_TOK_ERROR;
+			break;
+		}
+	}
+	j64__lex_fini(&lex);
+
+	return tok == J64_TOK_END;
+}
+
+/*
+ * Readers
+ *
+ * The tokenizer is also exposed directly, for consumers that need no
+ * tree. A pull reader returns one token at a time:
+ *
+ *	struct j64_reader r;
+ *	j64_t j;
+ *	int tok;
+ *
+ *	j64_reader_init(&r, buf, len);
+ *	while ((tok = j64_reader_next(&r, &j)) > J64_TOK_END)
+ *		...
+ *	j64_reader_fini(&r);
+ *
+ * Scalars and keys come back as values, owned by the caller: numbers,
+ * literals and strings up to 7 bytes are immediate, and only longer
+ * strings are boxed. Passing NULL for the value leaves the token
+ * undecoded, and j64_reader_raw then gives its bytes in the input.
+ */
+
+struct j64_reader {
+	struct j64__lex	lex;
+};
+
+J64_API void
+j64_reader_init(struct j64_reader *r, const void *buf, size_t len)
+{
+	j64__assert(r != NULL);
+	j64__assert(buf != NULL || len == 0);
+
+	j64__lex_init(&r->lex, buf, len);
+}
+
+J64_API void
+j64_reader_fini(struct j64_reader *r)
+{
+	j64__lex_fini(&r->lex);
+}
+
+/*
+ * Reads the next token, storing the value of a J64_TOK_VALUE or
+ * J64_TOK_KEY token in *JP unless JP is NULL.
+ *
+ * Returns the token type, J64_TOK_END after the document, or
+ * J64_TOK_ERROR on a syntax error or if out of memory.
+ */
+J64_API int
+j64_reader_next(struct j64_reader *r, j64_t *jp)
+{
+	int tok;
+
+	tok = j64__lex_next(&r->lex);
+	if (jp == NULL)
+		return tok;
+
+	*jp = j64_undef();
+	if (tok == J64_TOK_VALUE || tok == J64_TOK_KEY) {
+		*jp = j64__lex_value(&r->lex);
+		if (j64_is_undef(*jp)) {
+			r->lex.state = J64__LEX_ERROR;
+			return J64_TOK_ERROR;
+		}
+	}
+
+	return tok;
+}
+
+/*
+ * Returns the bytes of the last token in the input, and its length in
+ * *LENP. Strings are given without quotes and with escapes intact.
+ */
+J64_API const uint8_t *
+j64_reader_raw(const struct j64_reader *r, size_t *lenp)
+{
+	j64__assert(lenp != NULL);
+
+	if (r->lex.tok_kind == J64__LEX_STR && *r->lex.tok == '"') {
+		*lenp = r->lex.tok_len - 2;
+		return r->lex.tok + 1;
+	}
+	*lenp = r->lex.tok_len;
+
+	return r->lex.tok;
+}
+
+/*
+ * Skips the rest of a container whose J64_TOK_ARR_BEGIN or
+ * J64_TOK_OBJ_BEGIN token was just read. Like projection, this only
+ * balances brackets and quotes, so the skipped text is not checked.
+ *
+ * Returns 1 on success, 0 if the container is unterminated.
+ */
+J64_API int
+j64_reader_skip(struct j64_reader *r)
+{
+	j64__assert(r->lex.tok < r->lex.end &&
+	    (*r->lex.tok == '[' || *r->lex.tok == '{'));
+
+	return j64__lex_skip(&r->lex);
+}
+
+/* Returns the number of containers open at the current token */
+J64_API size_t
+j64_reader_depth(const struct j64_reader *r)
+{
+	return r->lex.depth;
+}
+
+/*
+ * Push parsing
+ *
+ * j64_parse calls a function with each token and, for scalars and keys,
+ * its value, which the function owns. Returning 0 from it stops parsing.
+ */
+
+typedef int (*j64_token_fn)(void *, int, j64_t);
+
+/*
+ * Parses a JSON text, passing every token to FN with ARG.
+ * Returns 1 on success, 0 on a syntax error, if out of memory,
+ * or if FN returned 0.
+ */
+J64_API int
+j64_parse(const void *buf, size_t len, j64_token_fn fn, void *arg)
+{
+	struct j64_reader r;
+	uint64_t t0;
+	j64_t j;
+	int tok, res = 0;
+
+	J64__TRACE_BEGIN(t0);
+	j64_reader_init(&r, buf, len);
+	while ((tok = j64_reader_next(&r, &j)) > J64_TOK_END) {
+		if (!fn(arg, tok, j))
+			goto out;
+	}
+	res = tok == J64_TOK_END;
+
+out:
+	j64_reader_fini(&r);
+	J64__TRACE_END(parse, t0, len);
+
+	return res;
+}
+
+/*
+ * Incremental parsing
+ *
+ * A parser builds a tree from input fed in chunks of any size, such as
+ * network reads, so parsing overlaps with the transfer and no chunk has
+ * to be kept once fed. A token split between chunks is carried over in a
+ * small buffer of its own; everything else is parsed straight from the
+ * chunks.
+ *
+ *	struct j64_parser ps;
+ *
+ *	j64_parser_init(&ps);
+ *	while ((n = read(fd, buf, sizeof(buf))) > 0)
+ *		if (!j64_parser_feed(&ps, buf, n))
+ *			break;
+ *	j = j64_parser_end(&ps);
+ *
+ * A parser must not be moved in memory while in use.
+ */
+
+struct j64_parser {
+	struct j64__lex		lex;
+	struct j64__build	build;
+	uint8_t			*carry;		/* start of a split token */
+	size_t			carry_len;
+	size_t			carry_cap;
+};
+
+J64_API void
+j64_parser_init(struct j64_parser *ps)
+{
+	j64__assert(ps != NULL);
+
+	j64__lex_init(&ps->lex, "", 0);
+	ps->lex.partial = 1;
+	j64__build_init(&ps->build);
+	ps->carry = NULL;
+	ps->carry_len = 0;
+	ps->carry_cap = 0;
+}
+
+/* Frees a parser without finishing the document */
+J64_API void
+j64_parser_fini(struct j64_parser *ps)
+{
+	j64__build_fini(&ps->build);
+	j64__lex_fini(&ps->lex);
+	if (ps->carry != NULL)
+		J64_FREE(ps->carry);
+}
+
+J64_API int
+j64__parser_carry(struct j64_parser *ps, const uint8_t *buf, size_t len)
+{
+	size_t cap;
+	void *tmp;
+
+	if (len == 0)
+		return 1;
+	if (ps->carry_cap - ps->carry_len < len) {
+		if (SIZE_MAX / 2 < ps->carry_cap || SIZE_MAX - ps->carry_len < len)
+			return 0;
+		cap = J64__MAX(2 * ps->carry_cap, ps->carry_len + len);
+		tmp = J64_REALLOC(ps->carry, cap);
+		if (tmp == NULL)
+			return 0;
+		ps->carry = (uint8_t *)tmp;
+		ps->carry_cap = cap;
+	}
+	memcpy(&ps->carry[ps->carry_len], buf, len);
+	ps->carry_len += len;
+
+	return 1;
+}
+
+/* Builds from tokens until the input runs out, returning the last token */
+J64_API int
+j64__parser_run(struct j64_parser *ps)
+{
+	int tok;
+
+	while ((tok = j64__lex_next(&ps->lex)) > J64_TOK_END) {
+		if (!j64__build_tok(&ps->build, &ps->lex, tok)) {
+			ps->lex.state = J64__LEX_ERROR;
+			return J64_TOK_ERROR;
+		}
+	}
+
+	return tok;
+}
+
+/*
+ * Feeds the next chunk of input.
+ * Returns 1 on success, 0 on a syntax error or if out of memory,
+ * after which the parser only accepts j64_parser_end or _fini.
+ */
+J64_API int
+j64_parser_feed(struct j64_parser *ps, const void *buf, size_t len)
+{
+	const uint8_t *p, *end;
+	uint64_t t0;
+	size_t n;
+	int tok;
+
+	j64__assert(ps != NULL);
+	j64__assert(buf != NULL || len == 0);
+
+	if (ps->lex.state == J64__LEX_ERROR)
+		return 0;
+	if (len == 0)
+		return 1;
+
+	J64__TRACE_BEGIN(t0);
+	p = (const uint8_t *)buf;
+	end = p + len;
+
+	/*
+	 * Complete a split token, taking bytes in growing steps so that it
+	 * is scanned again only a logarithmic number of times. Strings are
+	 * not scanned again until a quote arrives.
+	 */
+	while (ps->carry_len > 0 && p < end) {
+		n = J64__MIN((size_t)(end - p), J64__MAX(ps->carry_len, 64));
+		if (!j64__parser_carry(ps, p, n))
+			goto fail;
+		p += n;
+		if (ps->carry[0] == '"' && memchr(p - n, '"', n) == NULL)
+			continue;
+
+		ps->lex.p = ps->carry;
+		ps->lex.end = ps->carry + ps->carry_len;
+		tok = j64__lex_next(&ps->lex);
+		if (tok == J64__TOK_MORE)
+			continue;
+		if (!j64__build_tok(&ps->build, &ps->lex, tok))
+			goto fail;
+
+		/* Hand the bytes past the token back to the chunk */
+		p -= ps->lex.end - ps->lex.p;
+		ps->carry_len = 0;
+	}
+
+	if (ps->carry_len == 0) {
+		ps->lex.p = p;
+		ps->lex.end = end;
+		if (j64__parser_run(ps) == J64_TOK_ERROR ||
+		    !j64__parser_carry(ps, ps->lex.p, (size_t)(end - ps->lex.p)))
+			goto fail;
+	}
+
+	/* Nothing may point into the chunk once it is fed */
+	ps->lex.p = ps->lex.end = ps->lex.tok = ps->carry;
+	J64__TRACE_END(parse, t0, len);
+
+	return 1;
+
+fail:
+	ps->lex.state = J64__LEX_ERROR;
+	ps->lex.p = ps->lex.end = ps->lex.tok = ps->carry;
+	J64__TRACE_END(parse, t0, len);
+
+	return 0;
+}
+
+/*
+ * Ends the input, completing a number at the end of the last chunk,
+ * and frees the parser.
+ *
+ * Returns the document, or undefined if it is invalid or incomplete,
+ * or if out of memory.
+ */
+J64_API j64_t
+j64_parser_end(struct j64_parser *ps)
+{
+	j64_t j = j64_undef();
+
+	j64__assert(ps != NULL);
+
+	ps->lex.partial = 0;
+	ps->lex.p = ps->carry;
+	ps->lex.end = ps->carry_len > 0 ? ps->carry + ps->carry_len : ps->carry;
+	if (ps->lex.state != J64__LEX_ERROR && j64__parser_run(ps) == J64_TOK_END)
+		j = ps->build.vals[--ps->build.nvals];
+	j64_parser_fini(ps);
+
+	return j;
+}
+
+#ifdef J64_FILE_IO
+/*
+ * File ingestion
+ *
+ * j64_file_read reads a file descriptor to its end in chunks, handing
+ * them in order to a function; j64_file_decode feeds them to a parser.
+ * NDJSON and other framings can be split in the function as chunks come.
+ *
+ * With J64_IO_URING on Linux, a regular file is read through an io_uring
+ * with J64_FILE_QUEUE reads in flight, so the disk fetches the next
+ * chunks while the current one is parsed. Descriptors that cannot seek,
+ * such as pipes, kernels without io_uring and files whose first read the
+ * ring refuses are read synchronously with read() instead.
+ *
+ * Both need POSIX, and J64_IO_URING needs syscall(), which strict C
+ * modes hide unless _DEFAULT_SOURCE is defined before any include.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef J64_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif /* J64_IO_URING */
+
+/* Bytes per read unless given */
+#define J64_FILE_CHUNK	(64 * 1024)
+
+/* Reads kept in flight with J64_IO_URING */
+#define J64_FILE_QUEUE	4
+
+/* Takes the next LEN bytes of a file at BUF, returning 1 to go on, 0 to stop */
+typedef int (*j64_chunk_fn)(void *, const void *, size_t);
+
+J64_API int
+j64__file_read_sync(int fd, char *buf, size_t chunk, j64_chunk_fn fn, void *arg)
+{
+	ssize_t n;
+
+	for (;;) {
+		n = read(fd, buf, chunk);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n == 0;
+		if (!fn(arg, buf, (size_t)n))
+			return 0;
+	}
+}
+
+#ifdef J64_IO_URING
+/*
+ * A minimal io_uring set up with raw system calls, so that liburing is
+ * not needed: one submission and one completion ring, mapped separately
+ * unless the kernel maps both at once.
+ */
+struct j64__uring {
+	int			fd;
+	unsigned		*sq_tail;
+	unsigned		sq_mask;
+	unsigned		*sq_array;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ring;
+	size_t			sq_ring_len;
+	void			*cq_ring;
+	size_t			cq_ring_len;
+	size_t			sqes_len;
+	unsigned		pending;	/* queued but not submitted */
+};
+
+J64_API void
+j64__uring_fini(struct j64__uring *u)
+{
+	if (u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_len);
+	if (u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_len);
+	close(u->fd);
+}
+
+/* Returns 1 on success, 0 if the kernel offers no ring */
+J64_API int
+j64__uring_init(struct j64__uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return 0;
+
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->sq_ring_len = u->cq_ring_len = J64__MAX(u->sq_ring_len, u->cq_ring_len);
+
+	u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ring = u->sq_ring;
+	if (u->sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+		u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, u->fd, IORING_OFF_CQ_RING);
+	u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_len,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED ||
+	    u->sqes == MAP_FAILED) {
+		j64__uring_fini(u);
+		return 0;
+	}
+
+	sq = (char *)u->sq_ring;
+	cq = (char *)u->cq_ring;
+	u->sq_tail = (unsigned *)(void *)(sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)(void *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(void *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(void *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(void *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(void *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(void *)(cq + p.cq_off.cqes);
+	u->pending = 0;
+
+	return 1;
+}
+
+/* Queues a read of IOV from offset OFF of FD, tagged with DATA */
+J64_API void
+j64__uring_readv(struct j64__uring *u, int fd, const struct iovec *iov, uint64_t off, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, i;
+
+	tail = *u->sq_tail;
+	i = tail & u->sq_mask;
+	sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = 1;
+	sqe->off = off;
+	sqe->user_data = data;
+	u->sq_array[i] = i;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->pending++;
+}
+
+/* Submits queued reads and waits for at least MIN completions */
+J64_API int
+j64__uring_enter(struct j64__uring *u, unsigned min)
+{
+	long n;
+
+	do {
+		n = syscall(__NR_io_uring_enter, u->fd, u->pending, min,
+		    min > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return 0;
+	u->pending -= (unsigned)n;
+
+	return 1;
+}
+
+/* Takes a completion, returning 0 if there is none */
+J64_API int
+j64__uring_reap(struct j64__uring *u, uint64_t *datap, int *resp)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+
+	head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	cqe = &u->cqes[head & u->cq_mask];
+	*datap = cqe->user_data;
+	*resp = cqe->res;
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+struct j64__file_slot {
+	char		*buf;
+	struct iovec	iov;		/* the part of BUF being read */
+	uint64_t	off;		/* file offset of the read */
+	int		res;
+	int		busy;
+};
+
+/* Offset of the slots after the chunks, and the size of both */
+#define J64__FILE_SLOTS_OFFS(chunk)	J64__ALIGN(J64_FILE_QUEUE * (chunk))
+#define J64__FILE_BUF_SIZE(chunk)						\
+	(J64__FILE_SLOTS_OFFS(chunk) + J64_FILE_QUEUE * sizeof(struct j64__file_slot))
+
+/*
+ * Reads FD from its current offset with J64_FILE_QUEUE chunk reads in
+ * flight, each into its own CHUNK bytes of BUF. Chunks are handed on in
+ * file order as they complete, and a chunk is read again as soon as it
+ * is handed on, so at most J64_FILE_QUEUE chunks are ahead of FN. BUF
+ * holds J64__FILE_BUF_SIZE(CHUNK) bytes, ending with the read slots so
+ * that their I/O vectors live as long as the buffer.
+ *
+ * Returns 1 at the end of the file, 0 on an error, -1 if no ring is
+ * available or it failed before any data, in which case FD is intact,
+ * or -2 if the ring broke with reads in flight, so that BUF must not be
+ * freed.
+ */
+J64_API int
+j64__file_read_uring(int fd, char *buf, size_t chunk, j64_chunk_fn fn, void *arg)
+{
+	struct j64__file_slot *slots, *s;
+	struct j64__uring u;
+	uint64_t off, pos, data;
+	size_t i, next = 0, inflight;
+	int stop = 0, res = 1, r;
+	off_t start;
+
+	start = lseek(fd, 0, SEEK_CUR);
+	if (start < 0 || !j64__uring_init(&u, J64_FILE_QUEUE))
+		return -1;
+
+	slots = (struct j64__file_slot *)(void *)&buf[J64__FILE_SLOTS_OFFS(chunk)];
+
+	pos = off = (uint64_t)start;
+	for (i = 0; i < J64_FILE_QUEUE; i++) {
+		s = &slots[i];
+		s->buf = &buf[i * chunk];
+		s->iov.iov_base = s->buf;
+		s->iov.iov_len = chunk;
+		s->off = off;
+		s->busy = 1;
+		off += chunk;
+		j64__uring_readv(&u, fd, &s->iov, s->off, i);
+	}
+	if (!j64__uring_enter(&u, 0)) {
+		j64__uring_fini(&u);
+		return -1;
+	}
+	inflight = J64_FILE_QUEUE;
+
+	for (;;) {
+		/* Wait for the next chunk, or for every read once stopping */
+		while (inflight > 0 && (stop || slots[next].busy)) {
+			if (j64__uring_reap(&u, &data, &r)) {
+				slots[data].busy = 0;
+				slots[data].res = r;
+				inflight--;
+			} else if (!j64__uring_enter(&u, 1)) {
+				/* The kernel keeps the rings until the reads end */
+				j64__uring_fini(&u);
+				return -2;
+			}
+		}
+		if (stop)
+			break;
+
+		s = &slots[next];
+		if (s->res < 0 && s->res != -EINTR && s->res != -EAGAIN) {
+			res = pos == (uint64_t)start ? -1 : 0;
+			stop = 1;
+			continue;
+		}
+		if (s->res == 0) {
+			stop = 1;
+			continue;
+		}
+		if (s->res > 0) {
+			if (!fn(arg, s->iov.iov_base, (size_t)s->res)) {
+				res = 0;
+				stop = 1;
+				continue;
+			}
+			pos += (uint64_t)s->res;
+
+			/* Read the rest of a short chunk, or the next chunk */
+			if ((size_t)s->res < s->iov.iov_len) {
+				s->iov.iov_base = (char *)s->iov.iov_base + s->res;
+				s->iov.iov_len -= (size_t)s->res;
+				s->off += (uint64_t)s->res;
+			} else {
+				s->iov.iov_base = s->buf;
+				s->iov.iov_len = chunk;
+				s->off = off;
+				off += chunk;
+				next = (next + 1) % J64_FILE_QUEUE;
+			}
+		}
+
+		s->busy = 1;
+		j64__uring_readv(&u, fd, &s->iov, s->off, (uint64_t)(s - slots));
+		inflight++;
+		if (!j64__uring_enter(&u, 0)) {
+			res = 0;
+			stop = 1;
+		}
+	}
+
+	j64__uring_fini(&u);
+	if (res == 1)
+		lseek(fd, (off_t)pos, SEEK_SET);
+
+	return res;
+}
+#endif /* J64_IO_URING */
+
+/*
+ * Reads FD to its end, passing every chunk of at most CHUNK bytes, or
+ * J64_FILE_CHUNK if 0, to FN with ARG. Chunks are only valid during the
+ * call, like those fed to a parser.
+ *
+ * Returns 1 at the end of the file, 0 on a read error, if out of memory
+ * or if FN returned 0.
+ */
+J64_API int
+j64_file_read(int fd, size_t chunk, j64_chunk_fn fn, void *arg)
+{
+	size_t nbufs = 1;
+	char *buf;
+	int res = -1;
+
+	if (chunk == 0)
+		chunk = J64_FILE_CHUNK;
+#ifdef J64_IO_URING
+	/* One more chunk leaves room for the read slots after the chunks */
+	nbufs = J64_FILE_QUEUE + 1;
+#endif /* J64_IO_URING */
+	if (chunk > SIZE_MAX / nbufs)
+		return 0;
+#ifdef J64_IO_URING
+	buf = (char *)J64_MALLOC(J64__FILE_BUF_SIZE(chunk));
+#else
+	buf = (char *)J64_MALLOC(chunk);
+#endif /* J64_IO_URING */
+	if (buf == NULL)
+		return 0;
+
+#ifdef J64_IO_URING
+	res = j64__file_read_uring(fd, buf, chunk, fn, arg);
+	if (res == -2)
+		return 0;	/* the kernel may still write to BUF */
+#endif /* J64_IO_URING */
+	if (res < 0)
+		res = j64__file_read_sync(fd, buf, chunk, fn, arg);
+	J64_FREE(buf);
+
+	return res;
+}
+
+J64_API int
+j64__file_feed(void *arg, const void *buf, size_t len)
+{
+	return j64_parser_feed((struct j64_parser *)arg, buf, len);
+}
+
+/*
+ * Decodes the JSON text in FD, read to its end by j64_file_read.
+ *
+ * Returns the value, or undefined on a syntax or read error, or if out
+ * of memory.
+ */
+J64_API j64_t
+j64_file_decode(int fd)
+{
+	struct j64_parser ps;
+
+	j64_parser_init(&ps);
+	if (!j64_file_read(fd, 0, j64__file_feed, &ps)) {
+		j64_parser_fini(&ps);
+		return j64_undef();
+	}
+
+	return j64_parser_end(&ps);
+}
+#endif /* J64_FILE_IO */
+
+#if defined(J64_GZIP) || defined(J64_ZSTD)
+/*
+ * Compressed input
+ *
+ * j64_inflate_read reads a file that may be compressed and passes the
+ * text to a function in chunks, as j64_file_read does. A thread reads
+ * the file with j64_file_read and decompresses it into a ring of
+ * J64_INFLATE_BUFS buffers. The calling thread passes each full buffer
+ * on, so decompression overlaps with parsing and the text is not copied
+ * again.
+ *
+ * The format is told by its magic number: gzip with J64_GZIP, which
+ * needs zlib, and zstd with J64_ZSTD, which needs libzstd. Other input
+ * passes through unchanged. Concatenated gzip members and zstd frames
+ * are decompressed one after another. Both also need POSIX threads.
+ */
+
+#include <pthread.h>
+
+#ifdef J64_GZIP
+#include <zlib.h>
+#endif /* J64_GZIP */
+
+#ifdef J64_ZSTD
+#include <zstd.h>
+#endif /* J64_ZSTD */
+
+/* Buffers in the ring and the bytes in each */
+#define J64_INFLATE_BUFS	4
+#define J64_INFLATE_CHUNK	(64 * 1024)
+
+#define J64__INFLATE_MAGIC	4
+
+enum {
+	J64__INFLATE_UNKNOWN,
+	J64__INFLATE_PLAIN,
+	J64__INFLATE_GZIP,
+	J64__INFLATE_ZSTD
+};
+
+struct j64__inflate {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	char		*bufs;
+	size_t		lens[J64_INFLATE_BUFS];
+	size_t		head;		/* next full buffer, for the reader */
+	size_t		count;		/* full buffers */
+	int		done;		/* no more buffers will be filled */
+	int		error;
+	int		stop;		/* the reader stopped */
+
+	/* Owned by the decompressing thread */
+	int		fd;
+	size_t		tail;		/* buffer being filled */
+	size_t		fill;
+	int		format;
+	int		ended;		/* at the end of a member or frame */
+	uint8_t		magic[J64__INFLATE_MAGIC];
+	size_t		nmagic;
+#ifdef J64_GZIP
+	z_stream	z;
+#endif /* J64_GZIP */
+#ifdef J64_ZSTD
+	ZSTD_DStream	*zs;
+#endif /* J64_ZSTD */
+};
+
+/*
+ * Hands the buffer being filled to the reader and waits until the next
+ * one is free. Returns 1 on success, 0 if the reader stopped.
+ */
+J64_API int
+j64__inflate_put(struct j64__inflate *c)
+{
+	int res;
+
+	pthread_mutex_lock(&c->lock);
+	c->lens[c->tail] = c->fill;
+	c->count++;
+	pthread_cond_broadcast(&c->cond);
+	while (c->count == J64_INFLATE_BUFS && !c->stop)
+		pthread_cond_wait(&c->cond, &c->lock);
+	res = !c->stop;
+	pthread_mutex_unlock(&c->lock);
+
+	c->tail = (c->tail + 1) % J64_INFLATE_BUFS;
+	c->fill = 0;
+
+	return res;
+}
+
+J64_API char *
+j64__inflate_buf(struct j64__inflate *c)
+{
+	return &c->bufs[c->tail * J64_INFLATE_CHUNK];
+}
+
+/* Decompresses LEN bytes of input into the ring, returning 0 on errors */
+J64_API int
+j64__inflate_data(struct j64__inflate *c, const uint8_t *p, size_t len)
+{
+	size_t n;
+#ifdef J64_GZIP
+	int r;
+#endif /* J64_GZIP */
+#ifdef J64_ZSTD
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t zr;
+#endif /* J64_ZSTD */
+
+	switch (c->format) {
+#ifdef J64_GZIP
+	case J64__INFLATE_GZIP:
+		c->z.next_in = (Bytef *)(uintptr_t)p;
+		c->z.avail_in = (uInt)len;
+		do {
+			c->z.next_out = (Bytef *)j64__inflate_buf(c) + c->fill;
+			c->z.avail_out = (uInt)(J64_INFLATE_CHUNK - c->fill);
+			r = inflate(&c->z, Z_NO_FLUSH);
+			if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+				return 0;
+			n = J64_INFLATE_CHUNK - c->fill - c->z.avail_out;
+			if (r == Z_BUF_ERROR && n == 0 && c->z.avail_in > 0)
+				return 0;
+			c->fill += n;
+			c->ended = r == Z_STREAM_END;
+			if (c->ended && c->z.avail_in > 0 && inflateReset(&c->z) != Z_OK)
+				return 0;
+			if (c->fill == J64_INFLATE_CHUNK && !j64__inflate_put(c))
+				return 0;
+		} while (c->z.avail_in > 0 || c->z.avail_out == 0);
+		return 1;
+#endif /* J64_GZIP */
+#ifdef J64_ZSTD
+	case J64__INFLATE_ZSTD:
+		in.src = p;
+		in.size = len;
+		in.pos = 0;
+		do {
+			out.dst = j64__inflate_buf(c);
+			out.size = J64_INFLATE_CHUNK;
+			out.pos = c->fill;
+			zr = ZSTD_decompressStream(c->zs, &out, &in);
+			if (ZSTD_isError(zr))
+				return 0;
+			c->fill = out.pos;
+			c->ended = zr == 0;
+			if (c->fill == J64_INFLATE_CHUNK && !j64__inflate_put(c))
+				return 0;
+		} while (in.pos < in.size || out.pos == out.size);
+		return 1;
+#endif /* J64_ZSTD */
+	default:
+		while (len > 0) {
+			n = J64__MIN(len, J64_INFLATE_CHUNK - c->fill);
+			memcpy(j64__inflate_buf(c) + c->fill, p, n);
+			c->fill += n;
+			p += n;
+			len -= n;
+			if (c->fill == J64_INFLATE_CHUNK && !j64__inflate_put(c))
+				return 0;
+		}
+		return 1;
+	}
+}
+
+/* Tells the format by the magic number and sets up its decompressor */
+J64_API int
+j64__inflate_start(struct j64__inflate *c)
+{
+	const uint8_t *m = c->magic;
+
+	c->format = J64__INFLATE_PLAIN;
+	c->ended = 1;
+#ifdef J64_GZIP
+	if (c->nmagic >= 2 && m[0] == 0x1f && m[1] == 0x8b) {
+		memset(&c->z, 0, sizeof(c->z));
+		if (inflateInit2(&c->z, 15 + 16) != Z_OK)
+			return 0;
+		c->format = J64__INFLATE_GZIP;
+		c->ended = 0;
+	}
+#endif /* J64_GZIP */
+#ifdef J64_ZSTD
+	if (c->nmagic >= 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f && m[3] == 0xfd) {
+		c->zs = ZSTD_createDStream();
+		if (c->zs == NULL || ZSTD_isError(ZSTD_initDStream(c->zs)))
+			return 0;
+		c->format = J64__INFLATE_ZSTD;
+		c->ended = 0;
+	}
+#endif /* J64_ZSTD */
+	(void)m;
+
+	return j64__inflate_data(c, c->magic, c->nmagic);
+}
+
+/* Takes a chunk of the file, holding back the magic number until whole */
+J64_API int
+j64__inflate_in(void *arg, const void *buf, size_t len)
+{
+	struct j64__inflate *c = (struct j64__inflate *)arg;
+	const uint8_t *p = (const uint8_t *)buf;
+	size_t n;
+
+	if (c->format == J64__INFLATE_UNKNOWN) {
+		n = J64__MIN(len, J64__INFLATE_MAGIC - c->nmagic);
+		memcpy(&c->magic[c->nmagic], p, n);
+		c->nmagic += n;
+		p += n;
+		len -= n;
+		if (c->nmagic < J64__INFLATE_MAGIC)
+			return 1;
+		if (!j64__inflate_start(c))
+			return 0;
+	}
+
+	return j64__inflate_data(c, p, len);
+}
+
+/* The decompressing thread */
+J64_API void *
+j64__inflate_main(void *arg)
+{
+	struct j64__inflate *c = (struct j64__inflate *)arg;
+	int res;
+
+	res = j64_file_read(c->fd, 0, j64__inflate_in, c);
+	if (res && c->format == J64__INFLATE_UNKNOWN)
+		res = j64__inflate_start(c);
+	res = res && c->ended && (c->fill == 0 || j64__inflate_put(c));
+
+	pthread_mutex_lock(&c->lock);
+	c->done = 1;
+	c->error = !res;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+/*
+ * Reads FD to its end, decompressing it if it is compressed, and passes
+ * every chunk of text to FN with ARG. Chunks are only valid during the
+ * call.
+ *
+ * Returns 1 at the end of the file, 0 on a read or decompression error,
+ * on truncated input, if out of memory or if FN returned 0.
+ */
+J64_API int
+j64_inflate_read(int fd, j64_chunk_fn fn, void *arg)
+{
+	struct j64__inflate c;
+	pthread_t thread;
+	size_t i;
+	int res = 1;
+
+	memset(&c, 0, sizeof(c));
+	c.fd = fd;
+	c.format = J64__INFLATE_UNKNOWN;
+	c.bufs = (char *)J64_MALLOC(J64_INFLATE_BUFS * J64_INFLATE_CHUNK);
+	if (c.bufs == NULL)
+		return 0;
+	pthread_mutex_init(&c.lock, NULL);
+	pthread_cond_init(&c.cond, NULL);
+	if (pthread_create(&thread, NULL, j64__inflate_main, &c) != 0) {
+		res = 0;
+		goto out;
+	}
+
+	pthread_mutex_lock(&c.lock);
+	for (;;) {
+		while (c.count == 0 && !c.done)
+			pthread_cond_wait(&c.cond, &c.lock);
+		if (c.count == 0)
+			break;
+		i = c.head;
+		pthread_mutex_unlock(&c.lock);
+
+		res = fn(arg, &c.bufs[i * J64_INFLATE_CHUNK], c.lens[i]);
+
+		pthread_mutex_lock(&c.lock);
+		if (!res) {
+			c.stop = 1;
+			pthread_cond_broadcast(&c.cond);
+			break;
+		}
+		c.head = (c.head + 1) % J64_INFLATE_BUFS;
+		c.count--;
+		pthread_cond_broadcast(&c.cond);
+	}
+	pthread_mutex_unlock(&c.lock);
+
+	pthread_join(thread, NULL);
+	res = res && !c.error;
+
+out:
+#ifdef J64_GZIP
+	if (c.format == J64__INFLATE_GZIP)
+		inflateEnd(&c.z);
+#endif /* J64_GZIP */
+#ifdef J64_ZSTD
+	if (c.zs != NULL)
+		ZSTD_freeDStream(c.zs);
+#endif /* J64_ZSTD */
+	pthread_cond_destroy(&c.cond);
+	pthread_mutex_destroy(&c.lock);
+	J64_FREE(c.bufs);
+
+	return res;
+}
+
+/*
+ * Decodes the JSON text in FD, which may be compressed.
+ *
+ * Returns the value, or undefined on a syntax, read or decompression
+ * error, or if out of memory.
+ */
+J64_API j64_t
+j64_inflate_decode(int fd)
+{
+	struct j64_parser ps;
+
+	j64_parser_init(&ps);
+	if (!j64_inflate_read(fd, j64__file_feed, &ps)) {
+		j64_parser_fini(&ps);
+		return j64_undef();
+	}
+
+	return j64_parser_end(&ps);
+}
+#endif /* J64_GZIP || J64_ZSTD */
+
+/*
+ * Projection
+ *
+ * Decodes only the values at a set of compiled paths. Everything else is
+ * skipped: scalars are scanned but never decoded, and containers that no
+ * path enters are passed over by balancing brackets and quotes, so their
+ * contents are not checked.
+ */
+
+#define J64_PROJECT_MAX		64
+
+#define J64__BIT(i)		((uint64_t)1 << (i))
+
+struct j64__proj_frame {
+	uint64_t	mask;	/* paths that continue into this container */
+	size_t		idx;	/* index of the next array element */
+	int		obj;
+};
+
+/*
+ * Receives the value of path I: the last scanned scalar of LEX if BUF is
+ * NULL, or else the container text of LEN bytes at BUF. Returns 1 on
+ * success, 0 to stop with an error.
+ */
+typedef int (*j64__proj_fn)(void *, size_t, const struct j64__lex *,
+    const uint8_t *, size_t);
+
+/* Returns 1 if the last key token equals the canonical key K */
+J64_API int
+j64__lex_key_eq(const struct j64__lex *lex, j64_t k)
+{
+	j64_t key;
+	int eq;
+
+	if (!lex->tok_flag)
+		return lex->tok_len - 2 == j64_str_len(k) &&
+		    memcmp(lex->tok + 1, j64_str_ptr(&k), lex->tok_len - 2) == 0;
+
+	key = j64__lex_value(lex);
+	eq = j64__str_eq(key, k);
+	j64_free(key);
+
+	return eq;
+}
+
+/*
+ * Passes the values of the paths in MASK, whose first D0 steps lead to
+ * the value in BUF, to FN. Returns 1 on success, 0 otherwise.
+ */
+J64_API int
+j64__project(const uint8_t *buf, size_t len, struct j64_path *const *paths,
+    uint64_t mask, size_t d0, j64__proj_fn fn, void *arg)
+{
+	struct j64__lex lex;
+	struct j64__proj_frame *frames = NULL, *f;
+	const struct j64_path_step *step;
+	const uint8_t *start;
+	size_t nframes = 0, frames_cap = 0;
+	uint64_t m = mask, done;
+	size_t d, i;
+	void *tmp;
+	int tok, res = 0;
+
+	j64__lex_init(&lex, buf, len);
+
+	for (;;) {
+		tok = j64__lex_next(&lex);
+		if (tok == J64_TOK_END) {
+			res = 1;
+			break;
+		}
+		if (tok == J64_TOK_ERROR)
+			break;
+		if (tok == J64_TOK_ARR_END || tok == J64_TOK_OBJ_END) {
+			nframes--;
+			continue;
+		}
+
+		/* Narrow down the paths leading to the next value */
+		d = d0 + nframes;
+		f = nframes > 0 ? &frames[nframes - 1] : NULL;
+		if (f != NULL && (tok == J64_TOK_KEY || !f->obj)) {
+			m = 0;
+			for (i = 0; i < J64_PROJECT_MAX && (f->mask >> i) != 0; i++) {
+				if ((f->mask & J64__BIT(i)) == 0)
+					continue;
+				step = &(&paths[i]->step)[d - 1];
+				if (tok == J64_TOK_KEY ? j64__lex_key_eq(&lex, step->key) :
+				    step->idx == f->idx)
+					m |= J64__BIT(i);
+			}
+			if (tok == J64_TOK_KEY)
+				continue;
+			f->idx++;
+		}
+
+		done = 0;
+		for (i = 0; i < J64_PROJECT_MAX && (m >> i) != 0; i++)
+			if ((m & J64__BIT(i)) != 0 && paths[i]->len == d)
+				done |= J64__BIT(i);
+
+		if (tok == J64_TOK_VALUE) {
+			for (i = 0; i < J64_PROJECT_MAX && (done >> i) != 0; i++)
+				if ((done & J64__BIT(i)) != 0 &&
+				    !fn(arg, i, &lex, NULL, 0))
+					goto out;
+			continue;
+		}
+
+		if (m != 0 && done == 0) {
+			if (nframes == frames_cap) {
+				tmp = j64__grow(frames, &frames_cap, sizeof(*frames));
+				if (tmp == NULL)
+					goto out;
+				frames = (struct j64__proj_frame *)tmp;
+			}
+			f = &frames[nframes++];
+			f->mask = m;
+			f->idx = 0;
+			f->obj = tok == J64_TOK_OBJ_BEGIN;
+			continue;
+		}
+
+		start = lex.tok;
+		if (!j64__lex_skip(&lex))
+			goto out;
+		for (i = 0; i < J64_PROJECT_MAX && (done >> i) != 0; i++)
+			if ((done & J64__BIT(i)) != 0 &&
+			    !fn(arg, i, &lex, start, (size_t)(lex.p - start)))
+				goto out;
+		if ((m & ~done) != 0 &&
+		    !j64__project(start, (size_t)(lex.p - start), paths, m & ~done, d, fn, arg))
+			goto out;
+	}
+
+out:
+	if (frames != NULL)
+		J64_FREE(frames);
+	j64__lex_fini(&lex);
+
+	return res;
+}
+
+/* Stores a projected value in an array, replacing a duplicate key's value */
+J64_API int
+j64__proj_out(void *arg, size_t i, const struct j64__lex *lex,
+    const uint8_t *buf, size_t len)
+{
+	j64_t *out = (j64_t *)arg;
+
+	j64_release(out[i]);
+	out[i] = buf == NULL ? j64__lex_value(lex) : j64_decode(buf, len);
+
+	return !j64_is_undef(out[i]);
+}
+
+/*
+ * Decodes the values at NPATHS compiled paths in a JSON text, storing the
+ * value of PATHS[i] in OUT[i], or undefined if there is none. At most
+ * J64_PROJECT_MAX paths can be given.
+ *
+ * Returns 1 on success, or 0 on a syntax error or if out of memory,
+ * in which case every OUT[i] is undefined.
+ */
+J64_API int
+j64_project(const void *buf, size_t len, struct j64_path *const *paths,
+    size_t npaths, j64_t *out)
+{
+	uint64_t mask;
+	size_t i;
+
+	j64__assert(buf != NULL || len == 0);
+	j64__assert(npaths <= J64_PROJECT_MAX);
+
+	for (i = 0; i < npaths; i++)
+		out[i] = j64_undef();
+	if (npaths == 0)
+		return 1;
+
+	mask = ~(uint64_t)0 >> (J64_PROJECT_MAX - npaths);
+	if (j64__project((const uint8_t *)buf, len, paths, mask, 0, j64__proj_out, out))
+		return 1;
+
+	for (i = 0; i < npaths; i++) {
+		j64_release(out[i]);
+		out[i] = j64_undef();
+	}
+
+	return 0;
+}
+
+/*
+ * Shredding
+ *
+ * Splits a stream of newline-delimited JSON documents into columns, one
+ * per compiled path, without building a tree for any document. Each
+ * column holds one row per document in a typed buffer, with a validity
+ * bitmap whose bit is clear where the path is missing or its value does
+ * not have the column type:
+ *
+ *	J64_COL_INT	integers between J64_INT_MIN and J64_INT_MAX in INTS
+ *	J64_COL_FLOAT	any number in FLOATS
+ *	J64_COL_STR	strings, row i in DATA from OFFS[i] to OFFS[i + 1]
+ *
+ * Null rows are zero and empty. Numbers and strings are decoded like
+ * j64_decode does, except that strings are unescaped straight into the
+ * column.
+ */
+
+#define J64_COL_INT	0
+#define J64_COL_FLOAT	1
+#define J64_COL_STR	2
+
+struct j64_col {
+	int		type;
+	size_t		len;		/* number of rows */
+	size_t		cap;
+	uint64_t	*valid;		/* bit i % 64 of word i / 64 for row i */
+	int64_t		*ints;
+	double		*floats;
+	size_t		*offs;		/* LEN + 1 offsets */
+	uint8_t		*data;
+	size_t		data_cap;
+};
+
+struct j64_shred {
+	struct j64_path	*const *paths;
+	struct j64_col	*cols;
+	size_t		ncols;
+	size_t		nrows;
+};
+
+J64_API int
+j64_col_is_valid(const struct j64_col *col, size_t row)
+{
+	j64__assert(row < col->len);
+	return (col->valid[row / 64] >> (row % 64)) & 1;
+}
+
+J64_API const uint8_t *
+j64_col_str(const struct j64_col *col, size_t row, size_t *lenp)
+{
+	j64__assert(col->type == J64_COL_STR);
+	j64__assert(row < col->len);
+	*lenp = col->offs[row + 1] - col->offs[row];
+	return &col->data[col->offs[row]];
+}
+
+/*
+ * Sets up a shredder for NCOLS columns, the values of PATHS[i] going into
+ * a column of TYPES[i]. The paths must outlive the shredder, and at most
+ * J64_PROJECT_MAX can be given.
+ *
+ * Returns 1 on success, 0 if out of memory.
+ */
+J64_API int
+j64_shred_init(struct j64_shred *sh, struct j64_path *const *paths,
+    const int *types, size_t ncols)
+{
+	size_t i;
+
+	j64__assert(sh != NULL);
+	j64__assert(ncols <= J64_PROJECT_MAX);
+
+	sh->paths = paths;
+	sh->ncols = ncols;
+	sh->nrows = 0;
+	sh->cols = (struct j64_col *)J64_MALLOC(J64__MAX(ncols, 1) * sizeof(struct j64_col));
+	if (sh->cols == NULL)
+		return 0;
+
+	for (i = 0; i < ncols; i++) {
+		memset(&sh->cols[i], 0, sizeof(struct j64_col));
+		sh->cols[i].type = types[i];
+	}
+
+	return 1;
+}
+
+J64_API void
+j64_shred_free(struct j64_shred *sh)
+{
+	struct j64_col *col;
+	size_t i;
+
+	for (i = 0; i < sh->ncols; i++) {
+		col = &sh->cols[i];
+		/* A failed first growth can leave some buffers allocated */
+		if (col->valid != NULL)
+			J64_FREE(col->valid);
+		if (col->ints != NULL)
+			J64_FREE(col->ints);
+		if (col->floats != NULL)
+			J64_FREE(col->floats);
+		if (col->offs != NULL)
+			J64_FREE(col->offs);
+		if (col->data != NULL)
+			J64_FREE(col->data);
+	}
+	J64_FREE(sh->cols);
+}
+
+/* Drops all rows, keeping the column buffers for reuse */
+J64_API void
+j64_shred_clear(struct j64_shred *sh)
+{
+	size_t i;
+
+	for (i = 0; i < sh->ncols; i++)
+		sh->cols[i].len = 0;
+	sh->nrows = 0;
+}
+
+J64_API int
+j64__col_grow(struct j64_col *col)
+{
+	size_t cap, nwords;
+	void *tmp;
+
+	if (SIZE_MAX / 2 / sizeof(size_t) - 1 < col->cap)
+		return 0;
+	cap = col->cap < 64 ? 64 : 2 * col->cap;
+
+	/* Each buffer is grown on its own, so a failure leaves a usable column */
+	nwords = (cap + 63) / 64;
+	if ((tmp = J64_REALLOC(col->valid, nwords * sizeof(uint64_t))) == NULL)
+		return 0;
+	col->valid = (uint64_t *)tmp;
+
+	switch (col->type) {
+	case J64_COL_INT:
+		if ((tmp = J64_REALLOC(col->ints, cap * sizeof(int64_t))) == NULL)
+			return 0;
+		col->ints = (int64_t *)tmp;
+		break;
+	case J64_COL_FLOAT:
+		if ((tmp = J64_REALLOC(col->floats, cap * sizeof(double))) == NULL)
+			return 0;
+		col->floats = (double *)tmp;
+		break;
+	default:
+		if ((tmp = J64_REALLOC(col->offs, (cap + 1) * sizeof(size_t))) == NULL)
+			return 0;
+		col->offs = (size_t *)tmp;
+		if (col->cap == 0)
+			col->offs[0] = 0;
+		break;
+	}
+	col->cap = cap;
+
+	return 1;
+}
+
+/* Appends a null row */
+J64_API int
+j64__col_push(struct j64_col *col)
+{
+	size_t row = col->len;
+
+	if (row == col->cap && !j64__col_grow(col))
+		return 0;
+
+	col->valid[row / 64] &= ~J64__BIT(row % 64);
+	switch (col->type) {
+	case J64_COL_INT:
+		col->ints[row] = 0;
+		break;
+	case J64_COL_FLOAT:
+		col->floats[row] = 0.0;
+		break;
+	default:
+		col->offs[row + 1] = col->offs[row];
+		break;
+	}
+	col->len++;
+
+	return 1;
+}
+
+/* Stores a projected value in the current row of its column */
+J64_API int
+j64__shred_emit(void *arg, size_t i, const struct j64__lex *lex,
+    const uint8_t *buf, size_t len)
+{
+	struct j64_shred *sh = (struct j64_shred *)arg;
+	struct j64_col *col = &sh->cols[i];
+	size_t row = sh->nrows;
+	size_t off, n, cap;
+	void *tmp;
+	j64_t j;
+
+	(void)len;
+
+	/* A duplicate key overwrites the row */
+	if (col->len > row)
+		col->len = row;
+	if (!j64__col_push(col))
+		return 0;
+	if (buf != NULL)
+		return 1;
+
+	switch (col->type) {
+	case J64_COL_INT:
+		if (lex->tok_kind != J64__LEX_NUM || !lex->tok_flag)
+			return 1;
+		j = j64__lex_value(lex);
+		if (!j64_is_int(j))
+			return 1;
+		col->ints[row] = j64_int_get(j);
+		break;
+	case J64_COL_FLOAT:
+		if (lex->tok_kind != J64__LEX_NUM)
+			return 1;
+		j = j64__lex_value(lex);
+		if (j64_is_undef(j))
+			return 0;
+		col->floats[row] = j64_is_int(j) ? (double)j64_int_get(j) : j64_float_get(j);
+		break;
+	default:
+		if (lex->tok_kind != J64__LEX_STR)
+			return 1;
+		off = col->offs[row];
+		n = lex->tok_len - 2;
+		if (col->data_cap - off < n) {
+			if (SIZE_MAX / 2 < col->data_cap || SIZE_MAX - off < n)
+				return 0;
+			cap = J64__MAX(2 * col->data_cap, off + n);
+			tmp = J64_REALLOC(col->data, cap);
+			if (tmp == NULL)
+				return 0;
+			col->data = (uint8_t *)tmp;
+			col->data_cap = cap;
+		}
+		if (lex->tok_flag)
+			n = j64__str_unescape(&col->data[off], lex->tok + 1, n);
+		else
+			memcpy(&col->data[off], lex->tok + 1, n);
+		col->offs[row + 1] = off + n;
+		break;
+	}
+	col->valid[row / 64] |= J64__BIT(row % 64);
+
+	return 1;
+}
+
+/*
+ * Shreds a document into a new row, filling columns whose path it lacks
+ * with nulls. On failure, the partial row is dropped.
+ */
+J64_API int
+j64__shred_doc(struct j64_shred *sh, const uint8_t *buf, size_t len)
+{
+	struct j64_col *col;
+	size_t i;
+
+	if (sh->ncols == 0 ||
+	    j64__project(buf, len, sh->paths, ~(uint64_t)0 >> (J64_PROJECT_MAX - sh->ncols),
+	    0, j64__shred_emit, sh)) {
+		for (i = 0; i < sh->ncols; i++)
+			if (sh->cols[i].len == sh->nrows && !j64__col_push(&sh->cols[i]))
+				goto fail;
+		sh->nrows++;
+		return 1;
+	}
+
+fail:
+	for (i = 0; i < sh->ncols; i++) {
+		col = &sh->cols[i];
+		col->len = J64__MIN(col->len, sh->nrows);
+	}
+
+	return 0;
+}
+
+/*
+ * Shreds the newline-delimited JSON documents in BUF, one row each, into
+ * the columns. Blank lines are skipped, and the last line need not end
+ * with a newline, so BUF must end at a document boundary.
+ *
+ * Returns 1 on success, or 0 on a syntax error or if out of memory, in
+ * which case the rows of the documents before the failing one are kept.
+ */
+J64_API int
+j64_shred_feed(struct j64_shred *sh, const void *buf, size_t len)
+{
+	const uint8_t *p, *end, *nl, *q;
+
+	j64__assert(sh != NULL);
+	j64__assert(buf != NULL || len == 0);
+
+	p = (const uint8_t *)buf;
+	end = p + len;
+	for (; p < end; p = nl + 1) {
+		nl = (const uint8_t *)memchr(p, '\n', (size_t)(end - p));
+		if (nl == NULL)
+			nl = end;
+		for (q = p; q < nl && J64__IS_WS(*q); q++)
+			;
+		if (q < nl && !j64__shred_doc(sh, p, (size_t)(nl - p)))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Encoding
+ *
+ * A writer emits JSON text incrementally into a fixed buffer, calling a
+ * flush function whenever the buffer fills up, so output of any size can
+ * be produced from a bounded amount of memory:
+ *
+ *	struct j64_writer w;
+ *	char buf[4096];
+ *
+ *	j64_writer_init(&w, buf, sizeof(buf), flush, fp);
+ *	j64_writer_arr_begin(&w);
+ *	while (cursor_next(c, &row))
+ *		j64_writer_value(&w, row);
+ *	j64_writer_arr_end(&w);
+ *	j64_writer_flush(&w);
+ *
+ * Scalars are formatted by the same encoders as j64_null_encode and
+ * j64_int_encode. Every function returns 1 on success and 0 once a flush
+ * has failed, after which the writer stays failed.
+ */
+
+/* Smallest buffer for a writer, enough for any scalar but a string */
+#define J64_WRITER_BUF_MIN	32
+
+/* Writes LEN bytes from BUF somewhere, returning 1 on success, 0 otherwise */
+typedef int (*j64_flush_fn)(void *, const char *, size_t);
+
+struct j64_writer {
+	char		*buf;
+	size_t		cap;
+	size_t		len;
+	j64_flush_fn	flush;
+	void		*arg;
+	size_t		depth;
+	int		comma;		/* the next value needs a comma */
+	int		error;
+};
+
+J64_API void
+j64_writer_init(struct j64_writer *w, char *buf, size_t cap, j64_flush_fn flush, void *arg)
+{
+	j64__assert(w != NULL);
+	j64__assert(buf != NULL);
+
+	w->buf = buf;
+	w->cap = cap;
+	w->len = 0;
+	w->flush = flush;
+	w->arg = arg;
+	w->depth = 0;
+	w->comma = 0;
+	w->error = 0;
+}
+
+/* Hands the buffered text to the flush function */
+J64_API int
+j64_writer_flush(struct j64_writer *w)
+{
+	if (w->error)
+		return 0;
+	if (w->len == 0)
+		return 1;
+	if (w->flush == NULL || !w->flush(w->arg, w->buf, w->len)) {
+		w->error = 1;
+		return 0;
+	}
+	w->len = 0;
+
+	return 1;
+}
+
+J64_API int
+j64__writer_put(struct j64_writer *w, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	size_t n;
+
+	for (;;) {
+		n = J64__MIN(len, w->cap - w->len);
+		memcpy(&w->buf[w->len], p, n);
+		w->len += n;
+		p += n;
+		len -= n;
+		if (len == 0)
+			return !w->error;
+		if (!j64_writer_flush(w))
+			return 0;
+	}
+}
+
+/* Makes room for LEN contiguous bytes, at most J64_WRITER_BUF_MIN */
+J64_API char *
+j64__writer_reserve(struct j64_writer *w, size_t len)
+{
+	j64__assert(len <= J64_WRITER_BUF_MIN);
+
+	if (w->cap - w->len < len && !j64_writer_flush(w))
+		return NULL;
+	if (w->error || w->cap - w->len < len) {
+		w->error = 1;
+		return NULL;
+	}
+
+	return &w->buf[w->len];
+}
+
+J64_API int
+j64__writer_sep(struct j64_writer *w)
+{
+	if (!w->comma)
+		return !w->error;
+	w->comma = 0;
+
+	return j64__writer_put(w, ",", 1);
+}
+
+/* Writes a quoted string, escaping quotes, backslashes and control bytes */
+J64_API int
+j64__writer_str(struct j64_writer *w, const uint8_t *p, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const uint8_t *end = p + len;
+	const uint8_t *q;
+	char esc[6];
+	size_t n;
+
+	if (!j64__writer_put(w, "\"", 1))
+		return 0;
+
+	while (p < end) {
+		for (q = p; q < end && *q >= 0x20 && *q != '"' && *q != '\\'; q++)
+			;
+		if (q != p && !j64__writer_put(w, p, (size_t)(q - p)))
+			return 0;
+		if (q == end)
+			break;
+
+		esc[0] = '\\';
+		n = 2;
+		switch (*q) {
+		case '"': esc[1] = '"'; break;
+		case '\\': esc[1] = '\\'; break;
+		case '\b': esc[1] = 'b'; break;
+		case '\f': esc[1] = 'f'; break;
+		case '\n': esc[1] = 'n'; break;
+		case '\r': esc[1] = 'r'; break;
+		case '\t': esc[1] = 't'; break;
+		default:
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hex[*q >> 4];
+			esc[5] = hex[*q & 0xf];
+			n = 6;
+			break;
+		}
+		if (!j64__writer_put(w, esc, n))
+			return 0;
+		p = q + 1;
+	}
+
+	return j64__writer_put(w, "\"", 1);
+}
+
+J64_API int
+j64__writer_begin(struct j64_writer *w, const char *c)
+{
+	if (!j64__writer_sep(w) || !j64__writer_put(w, c, 1))
+		return 0;
+	w->depth++;
+
+	return 1;
+}
+
+J64_API int
+j64__writer_end(struct j64_writer *w, const char *c)
+{
+	j64__assert(w->depth > 0);
+
+	w->depth--;
+	w->comma = 1;
+
+	return j64__writer_put(w, c, 1);
+}
+
+J64_API int
+j64_writer_arr_begin(struct j64_writer *w)
+{
+	return j64__writer_begin(w, "[");
+}
+
+J64_API int
+j64_writer_arr_end(struct j64_writer *w)
+{
+	return j64__writer_end(w, "]");
+}
+
+J64_API int
+j64_writer_obj_begin(struct j64_writer *w)
+{
+	return j64__writer_begin(w, "{");
+}
+
+J64_API int
+j64_writer_obj_end(struct j64_writer *w)
+{
+	return j64__writer_end(w, "}");
+}
+
+/* Writes an object key, to be followed by its value */
+J64_API int
+j64_writer_key(struct j64_writer *w, j64_t key)
+{
+	j64__assert(j64_is_str(key));
+
+	return j64__writer_sep(w) &&
+	    j64__writer_str(w, j64_str_ptr(&key), j64_str_len(key)) &&
+	    j64__writer_put(w, ":", 1);
+}
+
+J64_API int j64_writer_value(struct j64_writer *, j64_t);
+
+/* Writes a value after its separator, bypassing the encoding cache */
+J64_API int
+j64__writer_encode(struct j64_writer *w, j64_t j)
+{
+	j64_t k, v;
+	size_t cap, i;
+	char *p;
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_ISTR:
+	case J64_TYPE_BSTR:
+		w->comma = 1;
+		return j64__writer_str(w, j64_str_ptr(&j), j64_str_len(j));
+	case J64_TYPE_BARR:
+		if (!j64_writer_arr_begin(w))
+			return 0;
+		cap = j64_barr_cap(j);
+		for (i = 0; i < cap; i++)
+			if (!j64_writer_value(w, j64_barr_get(j, i)))
+				return 0;
+		return j64_writer_arr_end(w);
+	case J64_TYPE_OBJ:
+		if (!j64_writer_obj_begin(w))
+			return 0;
+		for (i = 0; j64_obj_next(j, &i, &k, &v); )
+			if (!j64_writer_key(w, k) || !j64_writer_value(w, v))
+				return 0;
+		return j64_writer_obj_end(w);
+	default:
+		break;
+	}
+
+	p = j64__writer_reserve(w, J64_WRITER_BUF_MIN);
+	if (p == NULL)
+		return 0;
+	w->comma = 1;
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_FLOAT:
+		w->len += j64_float_encode(j, p, J64_WRITER_BUF_MIN);
+		break;
+	case J64_TYPE_INT0:
+	case J64_TYPE_INT1:
+		w->len += j64_int_encode(j, p, J64_WRITER_BUF_MIN);
+		break;
+	default:
+		switch (J64_TYPE_LIT_GET(j)) {
+		case J64_TYPE_LIT_TRUE:
+			w->len += j64_true_encode(p, J64_WRITER_BUF_MIN);
+			break;
+		case J64_TYPE_LIT_FALSE:
+			w->len += j64_false_encode(p, J64_WRITER_BUF_MIN);
+			break;
+		case J64_TYPE_LIT_ESTR:
+			w->len += j64_estr_encode(p, J64_WRITER_BUF_MIN);
+			break;
+		case J64_TYPE_LIT_EARR:
+			w->len += j64_earr_encode(p, J64_WRITER_BUF_MIN);
+			break;
+		case J64_TYPE_LIT_EOBJ:
+			w->len += j64_eobj_encode(p, J64_WRITER_BUF_MIN);
+			break;
+		default:
+			w->len += j64_null_encode(p, J64_WRITER_BUF_MIN);
+			break;
+		}
+		break;
+	}
+
+	return 1;
+}
+
+struct j64__encode_buf {
+	char	*buf;
+	size_t	len;
+	size_t	cap;
+};
+
+J64_API int
+j64__encode_flush(void *arg, const char *buf, size_t len)
+{
+	struct j64__encode_buf *eb = (struct j64__encode_buf *)arg;
+	void *tmp;
+
+	if (eb->cap - eb->len <= len) {
+		if (SIZE_MAX / 2 - len <= eb->cap)
+			return 0;
+		tmp = J64_REALLOC(eb->buf, 2 * eb->cap + len + 1);
+		if (tmp == NULL)
+			return 0;
+		eb->buf = (char *)tmp;
+		eb->cap = 2 * eb->cap + len + 1;
+	}
+	memcpy(&eb->buf[eb->len], buf, len);
+	eb->len += len;
+
+	return 1;
+}
+
+#ifdef J64_ENCODE_CACHE
+/* Returns the last modification time of a box */
+J64_API uint64_t
+j64__cache_mtime(void *hdr)
+{
+	uint64_t w = J64__CACHE_LOAD(J64__CACHE(hdr));
+
+	if (w == 0 || J64__CACHE_IS_TIME(w))
+		return w >> 1;
+
+	return J64__CACHE_PTR(w)->mtime;
+}
+
+/* Returns 1 if no box below J was modified at or after time MADE */
+J64_API int
+j64__cache_fresh(j64_t j, uint64_t made)
+{
+	j64_t k, v;
+	size_t cap, i;
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BARR:
+		cap = j64_barr_cap(j);
+		for (i = 0; i < cap; i++) {
+			v = j64_barr_get(j, i);
+			if (j64__is_box(v) && !J64__BOX_IS_STATIC(J64__BOX_PTR(v)) &&
+			    (made <= j64__cache_mtime(J64__BOX_PTR(v)) ||
+			    !j64__cache_fresh(v, made)))
+				return 0;
+		}
+		return 1;
+	case J64_TYPE_OBJ:
+		/* Keys are never modified in place */
+		for (i = 0; j64_obj_next(j, &i, &k, &v); ) {
+			if (j64__is_box(v) && !J64__BOX_IS_STATIC(J64__BOX_PTR(v)) &&
+			    (made <= j64__cache_mtime(J64__BOX_PTR(v)) ||
+			    !j64__cache_fresh(v, made)))
+				return 0;
+		}
+		return 1;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Writes a box from its cached encoding after its separator, encoding
+ * and caching it first if there is no fresh one.
+ */
+J64_API int
+j64__writer_cached(struct j64_writer *w, j64_t j)
+{
+	struct j64__encode_buf eb;
+	struct j64__cache *c;
+	struct j64_writer cw;
+	uint64_t old, made;
+	void *hdr, *tmp;
+	char buf[256];
+	int res;
+
+	hdr = J64__BOX_PTR(j);
+	if (J64__BOX_IS_STATIC(hdr) || J64_ENCODE_CACHE_DEPTH <= w->depth)
+		return j64__writer_encode(w, j);
+
+	old = J64__CACHE_LOAD(J64__CACHE(hdr));
+	if (old != 0 && !J64__CACHE_IS_TIME(old)) {
+		c = J64__CACHE_PTR(old);
+		if (j64__cache_fresh(j, c->made)) {
+			w->comma = 1;
+			return j64__writer_put(w, c->buf, c->len);
+		}
+	}
+
+	/* Encode the box behind room for the cache header */
+	made = J64__CACHE_NOW() + 1;
+	eb.buf = NULL;
+	eb.len = 0;
+	eb.cap = 0;
+	j64_writer_init(&cw, buf, sizeof(buf), j64__encode_flush, &eb);
+	cw.depth = w->depth;
+	memset(buf, 0, offsetof(struct j64__cache, buf));
+	if (!j64__encode_flush(&eb, buf, offsetof(struct j64__cache, buf)) ||
+	    !j64__writer_encode(&cw, j) || !j64_writer_flush(&cw)) {
+		if (eb.buf != NULL)
+			J64_FREE(eb.buf);
+		return 0;
+	}
+	tmp = J64_REALLOC(eb.buf, eb.len);
+	c = (struct j64__cache *)(tmp != NULL ? tmp : eb.buf);
+	c->made = made;
+	c->mtime = j64__cache_mtime(hdr);
+	c->len = eb.len - offsetof(struct j64__cache, buf);
+
+	w->comma = 1;
+	res = j64__writer_put(w, c->buf, c->len);
+
+	if (c->len < J64_ENCODE_CACHE_MIN) {
+		J64_FREE(c);
+		return res;
+	}
+#ifdef J64_REFCOUNT_ATOMIC
+	/* Other threads may still be reading a stale text */
+	if (old != 0 && !J64__CACHE_IS_TIME(old)) {
+		J64_FREE(c);
+		return res;
+	}
+#endif /* J64_REFCOUNT_ATOMIC */
+	if (J64__CACHE_CAS(J64__CACHE(hdr), old, (uint64_t)(uintptr_t)c)) {
+		if (old != 0 && !J64__CACHE_IS_TIME(old))
+			J64_FREE(J64__CACHE_PTR(old));
+	} else {
+		/* Another thread cached the box first */
+		J64_FREE(c);
+	}
+
+	return res;
+}
+#endif /* J64_ENCODE_CACHE */
+
+/*
+ * Writes a value. Arrays and objects are written whole, and undefined
+ * values, such as unset array elements, as null. With J64_ENCODE_CACHE,
+ * boxes are written from their cached encodings.
+ */
+J64_API int
+j64_writer_value(struct j64_writer *w, j64_t j)
+{
+	if (!j64__writer_sep(w))
+		return 0;
+
+#ifdef J64_ENCODE_CACHE
+	if (j64__is_box(j))
+		return j64__writer_cached(w, j);
+#endif /* J64_ENCODE_CACHE */
+
+	return j64__writer_encode(w, j);
+}
+
+/*
+ * Encodes a string, quoted and escaped, into at most LEN bytes of BUF.
+ * Returns the number of bytes written.
+ */
+J64_API size_t
+j64_str_encode(j64_t j, char *buf, size_t len)
+{
+	struct j64_writer w;
+
+	j64_writer_init(&w, buf, len, NULL, NULL);
+	j64__writer_str(&w, j64_str_ptr(&j), j64_str_len(j));
+
+	return w.len;
+}
+
+/* Encodes a value with a writer function into a growing buffer */
+J64_API char *
+j64__encode(j64_t j, size_t *lenp, int (*value)(struct j64_writer *, j64_t))
+{
+	struct j64__encode_buf eb;
+	struct j64_writer w;
+	uint64_t t0;
+	char buf[1024];
+
+	eb.buf = NULL;
+	eb.len = 0;
+	eb.cap = 0;
+
+	J64__TRACE_BEGIN(t0);
+	j64_writer_init(&w, buf, sizeof(buf), j64__encode_flush, &eb);
+	if (!value(&w, j) || !j64_writer_flush(&w) ||
+	    !j64__encode_flush(&eb, "", 1)) {
+		J64__TRACE_END(encode, t0, 0);
+		if (eb.buf != NULL)
+			J64_FREE(eb.buf);
+		return NULL;
+	}
+	J64__TRACE_END(encode, t0, eb.len - 1);
+
+	if (lenp != NULL)
+		*lenp = eb.len - 1;
+
+	return eb.buf;
+}
+
+/*
+ * Encodes a value as JSON text.
+ *
+ * Returns the text, NUL-terminated and to be freed with J64_FREE, storing
+ * its length in *LENP unless LENP is NULL, or NULL if out of memory.
+ */
+J64_API char *
+j64_encode(j64_t j, size_t *lenp)
+{
+	return j64__encode(j, lenp, j64_writer_value);
+}
+
+/*
+ * Canonical encoding
+ *
+ * j64_writer_canonical writes the canonical form of RFC 8785 (JCS), so
+ * that equal documents encode to equal bytes for hashing and signing:
+ * object keys are sorted by their UTF-16 code units, numbers are written
+ * as ECMAScript would write the same double, and strings are escaped as
+ * little as JSON allows, which j64__writer_str already does. Integers
+ * beyond 2^53 are written as the double they convert to. Infinities and NaNs
+ * have no canonical form and fail the writer.
+ *
+ * The encoding cache holds plain encodings and is not used here.
+ */
+
+/* Keys sorted on the stack before falling back to the heap */
+#define J64__CANON_PAIRS	8
+
+/* Largest integer that every double around it can represent, 2^53 */
+#define J64__CANON_INT_MAX	9007199254740992LL
+
+/* High bits of the characters of an immediate string */
+#define J64__CANON_ISTR_HIGH	0x8080808080808000ULL
+
+J64_API uint64_t
+j64__bswap64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_bswap64(x);
+#else
+	x = (x & 0x00000000ffffffffULL) << 32 | x >> 32;
+	x = (x & 0x0000ffff0000ffffULL) << 16 | (x >> 16 & 0x0000ffff0000ffffULL);
+	return (x & 0x00ff00ff00ff00ffULL) << 8 | (x >> 8 & 0x00ff00ff00ff00ffULL);
+#endif /* __GNUC__ || __clang__ */
+}
+
+/*
+ * Orders UTF-8 lead bytes as the UTF-16 code units they become. Only
+ * U+E000 to U+FFFF, led by 0xee and 0xef, change places: they sort after
+ * the surrogate pairs of U+10000 and up, led by 0xf0 to 0xf4.
+ */
+#define J64__CANON_UNIT(c)	((c) == 0xee || (c) == 0xef ? (c) + 0x10 : (c))
+
+/*
+ * Compares the keys of two pairs. Two ASCII immediate strings compare
+ * as integers, their characters byte-swapped into most significant
+ * first; other keys compare a byte at a time.
+ */
+J64_API int
+j64__canon_cmp(const void *a, const void *b)
+{
+	j64_t ka = *(const j64_t *)a;
+	j64_t kb = *(const j64_t *)b;
+	const uint8_t *pa, *pb;
+	size_t la, lb, i, n;
+	uint64_t wa, wb;
+
+	la = j64_str_len(ka);
+	lb = j64_str_len(kb);
+
+	if (j64_is_istr(ka) && j64_is_istr(kb) &&
+	    ((ka.w | kb.w) & J64__CANON_ISTR_HIGH) == 0) {
+		wa = j64__bswap64(ka.w & ~0xffULL);
+		wb = j64__bswap64(kb.w & ~0xffULL);
+		if (wa != wb)
+			return wa < wb ? -1 : 1;
+		return la < lb ? -1 : la > lb;
+	}
+
+	pa = j64_str_ptr(&ka);
+	pb = j64_str_ptr(&kb);
+	n = J64__MIN(la, lb);
+	for (i = 0; i < n; i++)
+		if (pa[i] != pb[i])
+			return J64__CANON_UNIT(pa[i]) < J64__CANON_UNIT(pb[i]) ? -1 : 1;
+
+	return la < lb ? -1 : la > lb;
+}
+
+/*
+ * Rounds F to PREC significant digits, stored without trailing zeros in
+ * DIGITS along with the position of the decimal point in *EP. With
+ * LOSSY, the digits need only decode back to the same j64 float.
+ *
+ * Returns the number of digits, or 0 if they do not decode back to F.
+ */
+J64_API size_t
+j64__canon_digits(double f, int prec, int lossy, char *digits, int *ep)
+{
+	char tmp[32];
+	char *p;
+	size_t k;
+	double g;
+
+	sprintf(tmp, "%.*e", prec - 1, f);
+	g = strtod(tmp, NULL);
+	if (lossy ? j64_float(g).w != j64_float(f).w : g != f)
+		return 0;
+
+	p = tmp;
+	digits[0] = *p++;
+	k = 1;
+	if (*p == '.')
+		for (p++; *p != 'e'; p++)
+			digits[k++] = *p;
+	*ep = atoi(p + 1) + 1;
+	while (k > 1 && digits[k - 1] == '0')
+		k--;
+
+	return k;
+}
+
+/*
+ * Formats a double as ECMAScript's Number.prototype.toString would: the
+ * fewest digits that decode back to the same value, in plain notation
+ * for decimal exponents from -7 to 20 and in exponential notation
+ * otherwise. With LOSSY, F is a j64 float and the digits need only decode
+ * back to the same j64 float. BUF must hold at least J64_WRITER_BUF_MIN
+ * bytes.
+ *
+ * Returns the length, or 0 for infinities and NaNs.
+ */
+J64_API size_t
+j64__canon_float(double f, int lossy, char *buf)
+{
+	char digits[17], shorter[17];
+	size_t k, m, n = 0;
+	int prec, e, e2;
+
+	if (f - f != 0.0)
+		return 0;
+	if (f == 0.0) {
+		buf[0] = '0';
+		return 1;
+	}
+	if (f < 0.0) {
+		buf[n++] = '-';
+		f = -f;
+	}
+
+	for (prec = 15; prec < 17; prec++)
+		if ((k = j64__canon_digits(f, prec, lossy, digits, &e)) != 0)
+			break;
+	if (prec == 17)
+		k = j64__canon_digits(f, prec, lossy, digits, &e);
+
+	/* Floats lack the lowest mantissa bits, so fewer digits may do */
+	while (lossy && prec <= 15 && (int)k == prec && prec > 1 &&
+	    (m = j64__canon_digits(f, prec - 1, lossy, shorter, &e2)) != 0) {
+		memcpy(digits, shorter, m);
+		k = m;
+		e = e2;
+		prec--;
+	}
+
+	if ((int)k <= e && e <= 21) {
+		memcpy(&buf[n], digits, k);
+		n += k;
+		for (; (int)k < e; k++)
+			buf[n++] = '0';
+	} else if (0 < e && e <= 21) {
+		memcpy(&buf[n], digits, (size_t)e);
+		n += (size_t)e;
+		buf[n++] = '.';
+		memcpy(&buf[n], &digits[e], k - (size_t)e);
+		n += k - (size_t)e;
+	} else if (-6 < e && e <= 0) {
+		buf[n++] = '0';
+		buf[n++] = '.';
+		for (; e < 0; e++)
+			buf[n++] = '0';
+		memcpy(&buf[n], digits, k);
+		n += k;
+	} else {
+		buf[n++] = digits[0];
+		if (k > 1) {
+			buf[n++] = '.';
+			memcpy(&buf[n], &digits[1], k - 1);
+			n += k - 1;
+		}
+		n += (size_t)sprintf(&buf[n], "e%c%d", e > 0 ? '+' : '-', e > 0 ? e - 1 : 1 - e);
+	}
+
+	return n;
+}
+
+J64_API int
+j64__writer_canon_num(struct j64_writer *w, j64_t j)
+{
+	int64_t i;
+	size_t n;
+	char *p;
+
+	p = j64__writer_reserve(w, J64_WRITER_BUF_MIN);
+	if (p == NULL)
+		return 0;
+
+	if (j64_is_float(j)) {
+		n = j64__canon_float(j64_float_get(j), 1, p);
+	} else {
+		i = j64_int_get(j);
+		if (-J64__CANON_INT_MAX <= i && i <= J64__CANON_INT_MAX)
+			n = j64_int_encode(j, p, J64_WRITER_BUF_MIN);
+		else
+			n = j64__canon_float((double)i, 0, p);
+	}
+	if (n == 0) {
+		w->error = 1;
+		return 0;
+	}
+	w->len += n;
+	w->comma = 1;
+
+	return 1;
+}
+
+J64_API int j64_writer_canonical(struct j64_writer *, j64_t);
+
+J64_API int
+j64__writer_canon_obj(struct j64_writer *w, j64_t j)
+{
+	j64_t buf[2 * J64__CANON_PAIRS];
+	j64_t *pairs = buf;
+	size_t i, n;
+	int res;
+
+	n = j64_obj_len(j);
+	if (n > J64__CANON_PAIRS) {
+		if (n > SIZE_MAX / (2 * sizeof(*pairs)) ||
+		    (pairs = (j64_t *)J64_MALLOC(2 * n * sizeof(*pairs))) == NULL) {
+			w->error = 1;
+			return 0;
+		}
+	}
+
+	for (i = 0, n = 0; j64_obj_next(j, &i, &pairs[2 * n], &pairs[2 * n + 1]); n++)
+		;
+	qsort(pairs, n, 2 * sizeof(*pairs), j64__canon_cmp);
+
+	res = j64_writer_obj_begin(w);
+	for (i = 0; res && i < n; i++)
+		res = j64_writer_key(w, pairs[2 * i]) &&
+		    j64_writer_canonical(w, pairs[2 * i + 1]);
+	res = res && j64_writer_obj_end(w);
+
+	if (pairs != buf)
+		J64_FREE(pairs);
+
+	return res;
+}
+
+/*
+ * Writes a value in canonical form. Undefined values are written as null,
+ * as by j64_writer_value.
+ */
+J64_API int
+j64_writer_canonical(struct j64_writer *w, j64_t j)
+{
+	size_t cap, i;
+
+	if (!j64__writer_sep(w))
+		return 0;
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BARR:
+		if (!j64_writer_arr_begin(w))
+			return 0;
+		cap = j64_barr_cap(j);
+		for (i = 0; i < cap; i++)
+			if (!j64_writer_canonical(w, j64_barr_get(j, i)))
+				return 0;
+		return j64_writer_arr_end(w);
+	case J64_TYPE_OBJ:
+		return j64__writer_canon_obj(w, j);
+	case J64_TYPE_FLOAT:
+	case J64_TYPE_INT0:
+	case J64_TYPE_INT1:
+		return j64__writer_canon_num(w, j);
+	default:
+		return j64__writer_encode(w, j);
+	}
+}
+
+/*
+ * Encodes a value as canonical JSON text, as j64_encode does otherwise.
+ * Also returns NULL if the value holds an infinity or a NaN.
+ */
+J64_API char *
+j64_encode_canonical(j64_t j, size_t *lenp)
+{
+	return j64__encode(j, lenp, j64_writer_canonical);
+}
+
+/*
+ * Binary formats
+ *
+ * CBOR (RFC 8949) and MessagePack map onto j64 values without going
+ * through JSON text. Encoding writes through a j64_writer like JSON does:
+ *
+ *	null, false, true	simple values, nil and booleans
+ *	integers		the smallest integer encoding
+ *	floats			64-bit floats
+ *	strings			text strings, UTF-8 as stored
+ *	arrays, objects		definite-length arrays and maps
+ *
+ * Decoding accepts the same kinds plus their smaller variants: 16- and
+ * 32-bit floats, CBOR's undefined as null, and CBOR tags, which are
+ * skipped. Integers beyond J64_INT_MIN and J64_INT_MAX become floats, as
+ * in JSON, and duplicate keys keep their last value. Byte strings,
+ * MessagePack extensions, indefinite lengths, map keys other than text
+ * and nesting beyond J64_BIN_DEPTH_MAX levels are rejected.
+ */
+
+/* Decoding recurses, so nesting is limited */
+#define J64_BIN_DEPTH_MAX	512
+
+/* Stores the N low bytes of U big-endian at P */
+J64_API void
+j64__bin_put(uint8_t *p, uint64_t u, size_t n)
+{
+	while (n-- > 0) {
+		p[n] = (uint8_t)u;
+		u >>= 8;
+	}
+}
+
+/* Writes byte C followed by the N low bytes of U big-endian */
+J64_API int
+j64__bin_head(struct j64_writer *w, uint8_t c, uint64_t u, size_t n)
+{
+	uint8_t *p;
+
+	p = (uint8_t *)j64__writer_reserve(w, 1 + n);
+	if (p == NULL)
+		return 0;
+	p[0] = c;
+	j64__bin_put(&p[1], u, n);
+	w->len += 1 + n;
+
+	return 1;
+}
+
+J64_API uint64_t
+j64__bin_float_bits(j64_t j)
+{
+	double f = j64_float_get(j);
+	uint64_t u;
+
+	memcpy(&u, &f, sizeof(u));
+	return u;
+}
+
+/* Writes the head of a CBOR data item of major type MT with argument U */
+J64_API int
+j64__cbor_head(struct j64_writer *w, unsigned mt, uint64_t u)
+{
+	uint8_t c = (uint8_t)(mt << 5);
+
+	if (u < 24)
+		return j64__bin_head(w, (uint8_t)(c | u), 0, 0);
+	if (u <= 0xff)
+		return j64__bin_head(w, c | 24, u, 1);
+	if (u <= 0xffff)
+		return j64__bin_head(w, c | 25, u, 2);
+	if (u <= 0xffffffffULL)
+		return j64__bin_head(w, c | 26, u, 4);
+	return j64__bin_head(w, c | 27, u, 8);
+}
+
+/*
+ * Writes a value as CBOR. Undefined values, such as unset array
+ * elements, are written as null.
+ */
+J64_API int
+j64_writer_cbor(struct j64_writer *w, j64_t j)
+{
+	j64_t k, v;
+	size_t cap, i;
+	int64_t n;
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_INT0:
+	case J64_TYPE_INT1:
+		n = j64_int_get(j);
+		if (n < 0)
+			return j64__cbor_head(w, 1, (uint64_t)-(n + 1));
+		return j64__cbor_head(w, 0, (uint64_t)n);
+	case J64_TYPE_FLOAT:
+		return j64__bin_head(w, 0xfb, j64__bin_float_bits(j), 8);
+	case J64_TYPE_ISTR:
+	case J64_TYPE_BSTR:
+		return j64__cbor_head(w, 3, j64_str_len(j)) &&
+		    j64__writer_put(w, j64_str_ptr(&j), j64_str_len(j));
+	case J64_TYPE_BARR:
+		cap = j64_barr_cap(j);
+		if (!j64__cbor_head(w, 4, cap))
+			return 0;
+		for (i = 0; i < cap; i++)
+			if (!j64_writer_cbor(w, j64_barr_get(j, i)))
+				return 0;
+		return 1;
+	case J64_TYPE_OBJ:
+		if (!j64__cbor_head(w, 5, j64_obj_len(j)))
+			return 0;
+		for (i = 0; j64_obj_next(j, &i, &k, &v); )
+			if (!j64_writer_cbor(w, k) || !j64_writer_cbor(w, v))
+				return 0;
+		return 1;
+	default:
+		switch (J64_TYPE_LIT_GET(j)) {
+		case J64_TYPE_LIT_TRUE:
+			return j64__bin_head(w, 0xf5, 0, 0);
+		case J64_TYPE_LIT_FALSE:
+			return j64__bin_head(w, 0xf4, 0, 0);
+		case J64_TYPE_LIT_ESTR:
+			return j64__cbor_head(w, 3, 0);
+		case J64_TYPE_LIT_EARR:
+			return j64__cbor_head(w, 4, 0);
+		case J64_TYPE_LIT_EOBJ:
+			return j64__cbor_head(w, 5, 0);
+		default:
+			return j64__bin_head(w, 0xf6, 0, 0);
+		}
+	}
+}
+
+/*
+ * Writes the head of a MessagePack string, array or map of N elements,
+ * given the fixed-size type byte FIX for up to FIX_MAX elements and the
+ * type byte BIG of the 16-bit form, followed by the 32-bit one.
+ */
+J64_API int
+j64__msgpack_head(struct j64_writer *w, uint8_t fix, size_t fix_max, uint8_t big, uint64_t n)
+{
+	if (n <= fix_max)
+		return j64__bin_head(w, (uint8_t)(fix | n), 0, 0);
+	if (n <= 0xffff)
+		return j64__bin_head(w, big, n, 2);
+	if (n <= 0xffffffffULL)
+		return j64__bin_head(w, (uint8_t)(big + 1), n, 4);
+
+	w->error = 1;
+	return 0;
+}
+
+/*
+ * Writes a value as MessagePack. Undefined values, such as unset array
+ * elements, are written as nil. Strings, arrays and objects beyond
+ * 2^32 - 1 elements fail the writer.
+ */
+J64_API int
+j64_writer_msgpack(struct j64_writer *w, j64_t j)
+{
+	j64_t k, v;
+	size_t cap, len, i;
+	int64_t n;
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_INT0:
+	case J64_TYPE_INT1:
+		n = j64_int_get(j);
+		if (-32 <= n && n <= 127)
+			return j64__bin_head(w, (uint8_t)n, 0, 0);
+		if (n > 0)
+			return n <= 0xff ? j64__bin_head(w, 0xcc, (uint64_t)n, 1) :
+			    n <= 0xffff ? j64__bin_head(w, 0xcd, (uint64_t)n, 2) :
+			    n <= 0xffffffffLL ? j64__bin_head(w, 0xce, (uint64_t)n, 4) :
+			    j64__bin_head(w, 0xcf, (uint64_t)n, 8);
+		return n >= -0x80 ? j64__bin_head(w, 0xd0, (uint64_t)n, 1) :
+		    n >= -0x8000 ? j64__bin_head(w, 0xd1, (uint64_t)n, 2) :
+		    n >= -0x80000000LL ? j64__bin_head(w, 0xd2, (uint64_t)n, 4) :
+		    j64__bin_head(w, 0xd3, (uint64_t)n, 8);
+	case J64_TYPE_FLOAT:
+		return j64__bin_head(w, 0xcb, j64__bin_float_bits(j), 8);
+	case J64_TYPE_ISTR:
+	case J64_TYPE_BSTR:
+		len = j64_str_len(j);
+		if (len <= 31)
+			return j64__bin_head(w, (uint8_t)(0xa0 | len), 0, 0) &&
+			    j64__writer_put(w, j64_str_ptr(&j), len);
+		return (len <= 0xff ? j64__bin_head(w, 0xd9, len, 1) :
+		    j64__msgpack_head(w, 0, 0, 0xda, len)) &&
+		    j64__writer_put(w, j64_str_ptr(&j), len);
+	case J64_TYPE_BARR:
+		cap = j64_barr_cap(j);
+		if (!j64__msgpack_head(w, 0x90, 15, 0xdc, cap))
+			return 0;
+		for (i = 0; i < cap; i++)
+			if (!j64_writer_msgpack(w, j64_barr_get(j, i)))
+				return 0;
+		return 1;
+	case J64_TYPE_OBJ:
+		if (!j64__msgpack_head(w, 0x80, 15, 0xde, j64_obj_len(j)))
+			return 0;
+		for (i = 0; j64_obj_next(j, &i, &k, &v); )
+			if (!j64_writer_msgpack(w, k) || !j64_writer_msgpack(w, v))
+				return 0;
+		return 1;
+	default:
+		switch (J64_TYPE_LIT_GET(j)) {
+		case J64_TYPE_LIT_TRUE:
+			return j64__bin_head(w, 0xc3, 0, 0);
+		case J64_TYPE_LIT_FALSE:
+			return j64__bin_head(w, 0xc2, 0, 0);
+		case J64_TYPE_LIT_ESTR:
+			return j64__bin_head(w, 0xa0, 0, 0);
+		case J64_TYPE_LIT_EARR:
+			return j64__bin_head(w, 0x90, 0, 0);
+		case J64_TYPE_LIT_EOBJ:
+			return j64__bin_head(w, 0x80, 0, 0);
+		default:
+			return j64__bin_head(w, 0xc0, 0, 0);
+		}
+	}
+}
+
+/*
+ * Encodes a value as CBOR or MessagePack.
+ *
+ * Returns the encoding, to be freed with J64_FREE, storing its length in
+ * *LENP unless LENP is NULL, or NULL if out of memory.
+ */
+J64_API char *
+j64_cbor_encode(j64_t j, size_t *lenp)
+{
+	return j64__encode(j, lenp, j64_writer_cbor);
+}
+
+J64_API char *
+j64_msgpack_encode(j64_t j, size_t *lenp)
+{
+	return j64__encode(j, lenp, j64_writer_msgpack);
+}
+
+struct j64__bin {
+	const uint8_t	*p;
+	const uint8_t	*end;
+	size_t		depth;
+};
+
+typedef j64_t (*j64__bin_item_fn)(struct j64__bin *);
+
+/*
+ * Reads N bytes big-endian into *UP.
+ * Returns 1 on success, 0 if the input ends first.
+ */
+J64_API int
+j64__bin_get(struct j64__bin *b, size_t n, uint64_t *up)
+{
+	uint64_t u = 0;
+
+	if ((size_t)(b->end - b->p) < n)
+		return 0;
+	while (n-- > 0)
+		u = u << 8 | *b->p++;
+	*up = u;
+
+	return 1;
+}
+
+J64_API j64_t
+j64__bin_uint(uint64_t u)
+{
+	if (u <= (uint64_t)J64_INT_MAX)
+		return j64_int((int64_t)u);
+	return j64_float((double)u);
+}
+
+J64_API j64_t
+j64__bin_int(int64_t i)
+{
+	if (J64_INT_MIN <= i && i <= J64_INT_MAX)
+		return j64_int(i);
+	return j64_float((double)i);
+}
+
+/* Decodes the bits of a float of N bytes: 2, 4 or 8 */
+J64_API j64_t
+j64__bin_float(uint64_t u, size_t n)
+{
+	uint64_t e, m;
+	uint32_t u32;
+	double f;
+	float f32;
+
+	switch (n) {
+	case 2:
+		/* Widen the half into a double: subnormals scale exactly */
+		e = u >> 10 & 0x1f;
+		m = u & 0x3ff;
+		if (e == 0) {
+			f = (double)m / 16777216.0;
+			return j64_float(u >> 15 ? -f : f);
+		}
+		u = (u >> 15) << 63 | (e == 0x1f ? 0x7ff : e - 15 + 1023) << 52 | m << 42;
+		memcpy(&f, &u, sizeof(f));
+		return j64_float(f);
+	case 4:
+		u32 = (uint32_t)u;
+		memcpy(&f32, &u32, sizeof(f32));
+		return j64_float(f32);
+	default:
+		memcpy(&f, &u, sizeof(f));
+		return j64_float(f);
+	}
+}
+
+/* Reads a string of N bytes */
+J64_API j64_t
+j64__bin_str(struct j64__bin *b, uint64_t n)
+{
+	j64_t j;
+
+	if ((uint64_t)(b->end - b->p) < n)
+		return j64_undef();
+	j = j64_str(b->p, (size_t)n);
+	b->p += n;
+
+	return j;
+}
+
+/* Reads an array of N items */
+J64_API j64_t
+j64__bin_arr(struct j64__bin *b, uint64_t n, j64__bin_item_fn item)
+{
+	j64_t j, v;
+	size_t i;
+
+	if (n == 0)
+		return j64_earr();
+	if ((uint64_t)(b->end - b->p) < n || b->depth == J64_BIN_DEPTH_MAX)
+		return j64_undef();
+
+	j = j64_barr_alloc((size_t)n);
+	if (j64_is_undef(j))
+		return j;
+	b->depth++;
+	for (i = 0; i < n; i++) {
+		v = item(b);
+		if (j64_is_undef(v)) {
+			j64_release(j);
+			return v;
+		}
+		j64_barr_set(j, v, i);
+	}
+	b->depth--;
+
+	return j;
+}
+
+/* Reads a map of N pairs with text keys */
+J64_API j64_t
+j64__bin_obj(struct j64__bin *b, uint64_t n, j64__bin_item_fn item)
+{
+	j64_t j, k, v, *pair;
+	size_t i;
+
+	if (n == 0)
+		return j64_eobj();
+	if ((uint64_t)(b->end - b->p) / 2 < n || b->depth == J64_BIN_DEPTH_MAX)
+		return j64_undef();
+
+	j = j64_obj_alloc((size_t)n);
+	if (j64_is_undef(j))
+		return j;
+	b->depth++;
+	for (i = 0; i < n; i++) {
+		k = item(b);
+		v = j64_is_str(k) ? item(b) : j64_undef();
+		if (j64_is_undef(v)) {
+			j64_release(k);
+			j64_release(j);
+			return v;
+		}
+
+		/* Later duplicates replace earlier ones */
+		pair = j64__obj_lookup(j, k);
+		if (pair != NULL) {
+			j64_release(pair[1]);
+			pair[1] = v;
+			j64_free(k);
+		} else if (!j64_obj_set(&j, k, v)) {
+			j64_free(k);
+			j64_release(v);
+			j64_release(j);
+			return j64_undef();
+		}
+	}
+	b->depth--;
+
+	return j;
+}
+
+/* Reads a CBOR data item */
+J64_API j64_t
+j64__cbor_item(struct j64__bin *b)
+{
+	uint64_t u;
+	unsigned c, ai;
+
+	/* Tags are skipped in a loop, since any number of them may nest */
+	do {
+		if (b->p == b->end)
+			return j64_undef();
+		c = *b->p++;
+		ai = c & 0x1f;
+
+		if (ai < 24)
+			u = ai;
+		else if (ai > 27 || !j64__bin_get(b, (size_t)1 << (ai - 24), &u))
+			return j64_undef();
+	} while (c >> 5 == 6);
+
+	switch (c >> 5) {
+	case 0:
+		return j64__bin_uint(u);
+	case 1:
+		if (u <= (uint64_t)J64_INT_MAX)
+			return j64_int(-1 - (int64_t)u);
+		return j64_float(-1.0 - (double)u);
+	case 3:
+		return j64__bin_str(b, u);
+	case 4:
+		return j64__bin_arr(b, u, j64__cbor_item);
+	case 5:
+		return j64__bin_obj(b, u, j64__cbor_item);
+	case 7:
+		switch (ai) {
+		case 20:
+			return j64_false();
+		case 21:
+			return j64_true();
+		case 22:
+		case 23:
+			return j64_null();
+		case 25:
+		case 26:
+		case 27:
+			return j64__bin_float(u, (size_t)1 << (ai - 24));
+		}
+		return j64_undef();
+	default:
+		return j64_undef();
+	}
+}
+
+/* Reads a MessagePack object */
+J64_API j64_t
+j64__msgpack_item(struct j64__bin *b)
+{
+	uint64_t u;
+	unsigned c;
+
+	if (b->p == b->end)
+		return j64_undef();
+	c = *b->p++;
+
+	if (c <= 0x7f)
+		return j64_int((int64_t)c);
+	if (c >= 0xe0)
+		return j64_int((int64_t)c - 0x100);
+	if (c <= 0x8f)
+		return j64__bin_obj(b, c & 0xf, j64__msgpack_item);
+	if (c <= 0x9f)
+		return j64__bin_arr(b, c & 0xf, j64__msgpack_item);
+	if (c <= 0xbf)
+		return j64__bin_str(b, c & 0x1f);
+
+	switch (c) {
+	case 0xc0:
+		return j64_null();
+	case 0xc2:
+		return j64_false();
+	case 0xc3:
+		return j64_true();
+	case 0xca:
+		return j64__bin_get(b, 4, &u) ? j64__bin_float(u, 4) : j64_undef();
+	case 0xcb:
+		return j64__bin_get(b, 8, &u) ? j64__bin_float(u, 8) : j64_undef();
+	case 0xcc:
+	case 0xcd:
+	case 0xce:
+	case 0xcf:
+		return j64__bin_get(b, (size_t)1 << (c - 0xcc), &u) ?
+		    j64__bin_uint(u) : j64_undef();
+	case 0xd0:
+		return j64__bin_get(b, 1, &u) ? j64_int((int8_t)u) : j64_undef();
+	case 0xd1:
+		return j64__bin_get(b, 2, &u) ? j64_int((int16_t)u) : j64_undef();
+	case 0xd2:
+		return j64__bin_get(b, 4, &u) ? j64_int((int32_t)u) : j64_undef();
+	case 0xd3:
+		return j64__bin_get(b, 8, &u) ? j64__bin_int((int64_t)u) : j64_undef();
+	case 0xd9:
+	case 0xda:
+	case 0xdb:
+		return j64__bin_get(b, (size_t)1 << (c - 0xd9), &u) ?
+		    j64__bin_str(b, u) : j64_undef();
+	case 0xdc:
+	case 0xdd:
+		return j64__bin_get(b, (size_t)2 << (c - 0xdc), &u) ?
+		    j64__bin_arr(b, u, j64__msgpack_item) : j64_undef();
+	case 0xde:
+	case 0xdf:
+		return j64__bin_get(b, (size_t)2 << (c - 0xde), &u) ?
+		    j64__bin_obj(b, u, j64__msgpack_item) : j64_undef();
+	default:
+		return j64_undef();
+	}
+}
+
+J64_API j64_t
+j64__bin_decode(const void *buf, size_t len, j64__bin_item_fn item)
+{
+	struct j64__bin b;
+	uint64_t t0;
+	j64_t j;
+
+	j64__assert(buf != NULL || len == 0);
+
+	J64__TRACE_BEGIN(t0);
+	b.p = (const uint8_t *)buf;
+	b.end = b.p + len;
+	b.depth = 0;
+	j = len == 0 ? j64_undef() : item(&b);
+	if (b.p != b.end) {
+		j64_release(j);
+		j = j64_undef();
+	}
+	J64__TRACE_END(parse, t0, len);
+
+	return j;
+}
+
+/*
+ * Decodes a single CBOR data item or MessagePack object filling all LEN
+ * bytes of BUF.
+ *
+ * Returns the value, or undefined if malformed, unsupported or out of
+ * memory.
+ */
+J64_API j64_t
+j64_cbor_decode(const void *buf, size_t len)
+{
+	return j64__bin_decode(buf, len, j64__cbor_item);
+}
+
+J64_API j64_t
+j64_msgpack_decode(const void *buf, size_t len)
+{
+	return j64__bin_decode(buf, len, j64__msgpack_item);
+}
+
+/*
+ * Polymorphic free
+ */
+J64_API void
+j64_free(j64_t j)
+{
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BSTR:
+		j64_bstr_free(j);
+		break;
+	case J64_TYPE_BARR:
+		j64_barr_free(j);
+		break;
+	case J64_TYPE_OBJ:
+		j64_obj_free(j);
+		break;
+	}
+}
+
+/*
+ * Drops a reference to a value. When it was the last one, frees the
+ * value and releases its elements recursively.
+ */
+J64_API void
+j64_release(j64_t j)
+{
+	struct j64__barr_hdr *hdr;
+	struct j64__obj_hdr *obj_hdr;
+	j64_t *pairs;
+	size_t cap;
+	size_t i;
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BSTR:
+		j64_bstr_free(j);
+		break;
+	case J64_TYPE_BARR:
+		hdr = J64__BARR_HDR(j);
+		if (!j64__box_unref(hdr))
+			break;
+		cap = J64__BARR_CAP(hdr);
+		for (i = 0; i < cap; i++)
+			j64_release(*j64__barr_slot(hdr, i));
+		j64__barr_dealloc(hdr);
+		break;
+	case J64_TYPE_OBJ:
+		obj_hdr = J64__OBJ_HDR(j);
+		if (!j64__box_unref(obj_hdr))
+			break;
+		pairs = j64__obj_pairs(obj_hdr);
+		cap = J64__OBJ_CAP(obj_hdr);
+		for (i = 0; i < 2 * cap; i++)
+			j64_release(pairs[i]);
+		j64__box_free(obj_hdr);
+		break;
+	}
+}
+
+/*
+ * Frozen documents
+ *
+ * j64_freeze copies a document into a single allocation, laying out its
+ * boxes depth-first and marking all of them static. Objects are frozen
+ * sealed. A frozen document is never modified, so any number of threads
+ * can read it concurrently without synchronization. Unsharing a frozen
+ * array or object returns a mutable copy of it.
+ */
+
+/* Adds sizes, saturating at SIZE_MAX on overflow */
+J64_API size_t
+j64__size_add(size_t a, size_t b)
+{
+	return SIZE_MAX - a < b ? SIZE_MAX : a + b;
+}
+
+J64_API size_t
+j64__freeze_size(j64_t j)
+{
+	j64_t k, v;
+	size_t size;
+	size_t cap;
+	size_t i;
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BSTR:
+		return J64__ALIGN(J64__BSTR_HDR_SIZEOF + j64_bstr_len(j));
+	case J64_TYPE_BARR:
+		cap = j64_barr_cap(j);
+		size = J64__BARR_HDR_SIZEOF + cap * sizeof(j64_t);
+		for (i = 0; i < cap; i++)
+			size = j64__size_add(size, j64__freeze_size(j64_barr_get(j, i)));
+		return size;
+	case J64_TYPE_OBJ:
+		size = J64__OBJ_SEALED_SIZE(j64_obj_len(j));
+		for (i = 0; j64_obj_next(j, &i, &k, &v); ) {
+			size = j64__size_add(size, j64__freeze_size(k));
+			size = j64__size_add(size, j64__freeze_size(v));
+		}
+		return size;
+	default:
+		return 0;
+	}
+}
+
+J64_API j64_t
+j64__freeze_copy(j64_t j, uint8_t **pp, int *okp)
+{
+	j64_t k = J64__INIT;
+	struct j64__bstr_hdr *bstr_hdr;
+	struct j64__barr_hdr *barr_hdr;
+	struct j64__obj_sealed_hdr *obj_hdr;
+	j64_t *pairs;
+	j64_t kk, vv;
+	size_t len, cap;
+	size_t i, n;
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BSTR:
+		bstr_hdr = (struct j64__bstr_hdr *)(void *)*pp;
+		len = j64_bstr_len(j);
+		bstr_hdr->len = len | J64__HDR_STATIC;
+		memcpy(&bstr_hdr->buf, &J64__BSTR_HDR(j)->buf, len);
+		*pp += J64__ALIGN(J64__BSTR_HDR_SIZEOF + len);
+		k.p = (uintptr_t)bstr_hdr;
+		k.w |= J64_TYPE_BSTR;
+		return k;
+	case J64_TYPE_BARR:
+		barr_hdr = (struct j64__barr_hdr *)(void *)*pp;
+		cap = j64_barr_cap(j);
+		barr_hdr->cap = cap | J64__HDR_STATIC;
+		*pp += J64__BARR_HDR_SIZEOF + cap * sizeof(j64_t);
+		for (i = 0; i < cap; i++)
+			(&barr_hdr->buf)[i] = j64__freeze_copy(j64_barr_get(j, i), pp, okp);
+		k.p = (uintptr_t)barr_hdr;
+		k.w |= J64_TYPE_BARR;
+		return k;
+	case J64_TYPE_OBJ:
+		obj_hdr = (struct j64__obj_sealed_hdr *)(void *)*pp;
+		len = j64_obj_len(j);
+		obj_hdr->cap = len | J64__HDR_SEALED | J64__HDR_STATIC;
+		*pp += J64__OBJ_SEALED_SIZE(len);
+		pairs = &obj_hdr->buf;
+		for (i = 0, n = 0; j64_obj_next(j, &i, &kk, &vv); n++) {
+			pairs[2 * n] = j64__freeze_copy(kk, pp, okp);
+			pairs[2 * n + 1] = j64__freeze_copy(vv, pp, okp);
+		}
+		if (!j64__obj_mph_build(obj_hdr, len))
+			*okp = 0;
+		k.p = (uintptr_t)obj_hdr;
+		k.w |= J64_TYPE_OBJ;
+		return k;
+	default:
+		return j;
+	}
+}
+
+/*
+ * Copies a document into a single read-only allocation.
+ * The original document is left untouched.
+ *
+ * Returns the frozen document, which must be freed with
+ * j64_frozen_free, or undefined if out of memory.
+ */
+J64_API j64_t
+j64_freeze(j64_t j)
+{
+	uint8_t *buf, *p;
+	size_t size;
+	int ok = 1;
+
+	if (!j64__is_box(j))
+		return j;
+
+	size = j64__freeze_size(j);
+	if (size == SIZE_MAX)
+		return j64_undef();
+
+	buf = (uint8_t *)J64_MALLOC(size);
+	if (buf == NULL)
+		return j64_undef();
+
+	p = buf;
+	j = j64__freeze_copy(j, &p, &ok);
+	j64__assert(p == buf + size);
+
+	if (!ok) {
+		J64_FREE(buf);
+		return j64_undef();
+	}
+
+	return j;
+}
+
+J64_API void
+j64_frozen_free(j64_t j)
+{
+	if (!j64__is_box(j))
+		return;
+
+	j64__assert(J64__BOX_IS_STATIC(J64__BOX_PTR(j)));
+	J64_FREE(J64__BOX_PTR(j));
+}
+
+/*
+ * Cloning
+ *
+ * j64_clone also copies a document into a single allocation, but from
+ * any allocator and without sealing objects: boxes are copied as they
+ * are and relocated into the block, and immediates are copied as words.
+ * Like a frozen document, a clone is made of static boxes, so changing
+ * one of its arrays or objects changes a mutable copy instead.
+ */
+
+typedef void *(*j64_alloc_fn)(void *, size_t);
+
+/* Returns the size of the header and slots of a box */
+J64_API size_t
+j64__clone_box_size(j64_t j)
+{
+	struct j64__obj_hdr *hdr;
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BSTR:
+		return J64__ALIGN(J64__BSTR_HDR_SIZEOF + j64_bstr_len(j));
+	case J64_TYPE_BARR:
+		return J64__BARR_HDR_SIZEOF + j64_barr_cap(j) * sizeof(j64_t);
+	default:
+		hdr = J64__OBJ_HDR(j);
+		if (J64__OBJ_IS_SEALED(hdr))
+			return J64__OBJ_SEALED_HDR_SIZE(
+			    (struct j64__obj_sealed_hdr *)(void *)hdr);
+		return J64__OBJ_HDR_SIZEOF + 2 * J64__OBJ_CAP(hdr) * sizeof(j64_t);
+	}
+}
+
+J64_API size_t
+j64__clone_size(j64_t j)
+{
+	j64_t *pairs;
+	size_t size;
+	size_t cap;
+	size_t i;
+
+	if (!j64__is_box(j))
+		return 0;
+
+	size = j64__clone_box_size(j);
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BARR:
+		cap = j64_barr_cap(j);
+		for (i = 0; i < cap; i++)
+			size = j64__size_add(size, j64__clone_size(j64_barr_get(j, i)));
+		break;
+	case J64_TYPE_OBJ:
+		pairs = j64__obj_pairs(J64__OBJ_HDR(j));
+		cap = J64__OBJ_CAP(J64__OBJ_HDR(j));
+		for (i = 0; i < 2 * cap; i++)
+			size = j64__size_add(size, j64__clone_size(pairs[i]));
+		break;
+	}
+
+	return size;
+}
+
+J64_API j64_t
+j64__clone_copy(j64_t j, uint8_t **pp)
+{
+	j64_t k = J64__INIT;
+	struct j64__bstr_hdr *bstr_hdr;
+	struct j64__barr_hdr *barr_hdr;
+	struct j64__obj_hdr *obj_hdr;
+	j64_t *pairs;
+	size_t len, cap;
+	size_t i;
+	uint8_t *p;
+
+	if (!j64__is_box(j))
+		return j;
+
+	p = *pp;
+	*pp += j64__clone_box_size(j);
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BSTR:
+		bstr_hdr = (struct j64__bstr_hdr *)(void *)p;
+		len = j64_bstr_len(j);
+		bstr_hdr->len = len | J64__HDR_STATIC;
+		memcpy(&bstr_hdr->buf, &J64__BSTR_HDR(j)->buf, len);
+		break;
+	case J64_TYPE_BARR:
+		barr_hdr = (struct j64__barr_hdr *)(void *)p;
+		cap = j64_barr_cap(j);
+		barr_hdr->cap = cap | J64__HDR_STATIC;
+		for (i = 0; i < cap; i++)
+			(&barr_hdr->buf)[i] = j64__clone_copy(j64_barr_get(j, i), pp);
+		break;
+	case J64_TYPE_OBJ:
+		obj_hdr = (struct j64__obj_hdr *)(void *)p;
+		memcpy(obj_hdr, J64__OBJ_HDR(j), j64__clone_box_size(j));
+		obj_hdr->cap |= J64__HDR_STATIC;
+		pairs = j64__obj_pairs(obj_hdr);
+		cap = J64__OBJ_CAP(obj_hdr);
+		for (i = 0; i < 2 * cap; i++)
+			pairs[i] = j64__clone_copy(pairs[i], pp);
+		break;
+	}
+
+	k.p = (uintptr_t)p;
+	k.w |= J64_TYPE_GET(j);
+
+	return k;
+}
+
+/*
+ * Deep-copies a document into a single block from ALLOC, called with ARG
+ * and the exact size needed, or from J64_MALLOC if ALLOC is NULL. The
+ * block must be aligned to 8 bytes, and starts with the box of the root.
+ *
+ * Returns the clone, or undefined if out of memory. A clone made with
+ * J64_MALLOC is freed with j64_frozen_free.
+ */
+J64_API j64_t
+j64_clone(j64_t j, j64_alloc_fn alloc, void *arg)
+{
+	uint8_t *buf, *p;
+	size_t size;
+
+	if (!j64__is_box(j))
+		return j;
+
+	size = j64__clone_size(j);
+	if (size == SIZE_MAX)
+		return j64_undef();
+
+	buf = (uint8_t *)(alloc != NULL ? alloc(arg, size) : J64_MALLOC(size));
+	if (buf == NULL)
+		return j64_undef();
+	j64__assert(((uintptr_t)buf & J64__TYPE_MASK) == 0);
+
+	p = buf;
+	j = j64__clone_copy(j, &p);
+	j64__assert(p == buf + size);
+
+	return j;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+/*
+ * Publishing frozen documents
+ *
+ * A slot holds the current version of a frozen document. Readers load it
+ * with j64_frozen_load and never block; a writer replaces it with
+ * j64_frozen_swap and gets the previous version back. Readers see either
+ * the old or the new document, never a partial one.
+ *
+ * The writer must not free the previous version until every reader that
+ * may have loaded it is done with it, for example after a grace period
+ * in which each reader thread has passed a quiescent point.
+ */
+
+J64_API j64_t
+j64_frozen_load(const j64_t *slot)
+{
+	j64_t j = J64__INIT;
+
+	j64__assert(slot != NULL);
+	j.w = __atomic_load_n(&slot->w, __ATOMIC_ACQUIRE);
+
+	return j;
+}
+
+J64_API j64_t
+j64_frozen_swap(j64_t *slot, j64_t j)
+{
+	j64_t old = J64__INIT;
+
+	j64__assert(slot != NULL);
+	j64__assert(!j64__is_box(j) || J64__BOX_IS_STATIC(J64__BOX_PTR(j)));
+	old.w = __atomic_exchange_n(&slot->w, j.w, __ATOMIC_ACQ_REL);
+
+	return old;
+}
+#endif /* __GNUC__ || __clang__ */
+
+/*
+ * Statistics
+ *
+ * j64_stats walks a tree and reports what it is made of and what it
+ * costs: nodes per type, heap bytes of its boxes including their prefix
+ * words, and the bytes lost to unset array slots and free object slots.
+ * Strings are counted by how close they come to the immediate limit.
+ * A box shared within the tree is counted each time it is reached, and
+ * static boxes, as in frozen documents, count as nodes but not as heap.
+ */
+
+struct j64_stats {
+	size_t	nlit;		/* null, booleans and empty values */
+	size_t	nint;
+	size_t	nfloat;
+	size_t	nistr;
+	size_t	nbstr;
+	size_t	nbarr;
+	size_t	nobj;
+	size_t	heap_bytes;
+	size_t	barr_slack;	/* bytes of unset array slots */
+	size_t	obj_slack;	/* bytes of free object slots */
+	size_t	bstr_short;	/* boxed strings short enough to be immediate */
+	size_t	bstr_near;	/* boxed strings up to J64_ISTR_LEN_MAX bytes longer */
+};
+
+/* Returns the heap bytes of a box, or 0 if it is static */
+J64_API size_t
+j64__stats_box_bytes(j64_t j)
+{
+	struct j64__barr_seg_hdr *seg_hdr;
+	size_t size;
+
+	if (J64__BOX_IS_STATIC(J64__BOX_PTR(j)))
+		return 0;
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BSTR:
+		size = J64__BSTR_HDR_SIZEOF + j64_bstr_len(j);
+		break;
+	case J64_TYPE_BARR:
+		if (!J64__BARR_IS_SEG(J64__BARR_HDR(j))) {
+			size = j64__clone_box_size(j);
+			break;
+		}
+		seg_hdr = J64__BARR_SEG_HDR(j);
+		size = J64__BARR_SEG_HDR_SIZEOF + seg_hdr->nsegs_cap * sizeof(j64_t *) +
+		    J64__BARR_NSEGS(J64__BARR_CAP(seg_hdr)) * J64__BARR_SEG_SIZE;
+		break;
+	default:
+		size = j64__clone_box_size(j);
+		break;
+	}
+
+	return J64__BOX_PREFIX + size;
+}
+
+J64_API void
+j64__stats_add(struct j64_stats *out, j64_t j)
+{
+	struct j64__obj_hdr *hdr;
+	size_t len;
+
+	if (j64__is_box(j))
+		out->heap_bytes += j64__stats_box_bytes(j);
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_LIT:
+		if (j64_is_undef(j))
+			out->barr_slack += sizeof(j64_t);
+		else
+			out->nlit++;
+		break;
+	case J64_TYPE_INT0:
+	case J64_TYPE_INT1:
+		out->nint++;
+		break;
+	case J64_TYPE_FLOAT:
+		out->nfloat++;
+		break;
+	case J64_TYPE_ISTR:
+		out->nistr++;
+		break;
+	case J64_TYPE_BSTR:
+		out->nbstr++;
+		len = j64_bstr_len(j);
+		if (len <= J64_ISTR_LEN_MAX)
+			out->bstr_short++;
+		else if (len <= 2 * J64_ISTR_LEN_MAX)
+			out->bstr_near++;
+		break;
+	case J64_TYPE_BARR:
+		out->nbarr++;
+		break;
+	case J64_TYPE_OBJ:
+		out->nobj++;
+		hdr = J64__OBJ_HDR(j);
+		out->obj_slack += (J64__OBJ_CAP(hdr) - hdr->len) * 2 * sizeof(j64_t);
+		break;
+	}
+}
+
+/*
+ * Fills *OUT with the statistics of a tree, counting object keys as
+ * string nodes. Returns 1 on success, 0 if out of memory.
+ */
+J64_API int
+j64_stats(j64_t j, struct j64_stats *out)
+{
+	struct j64_iter it;
+	j64_t k, v;
+
+	j64__assert(out != NULL);
+
+	memset(out, 0, sizeof(*out));
+	j64_iter_init(&it, j);
+	while (j64_iter_next(&it, NULL, &k, &v)) {
+		/* Array elements come with integer keys */
+		if (j64_is_str(k))
+			j64__stats_add(out, k);
+		j64__stats_add(out, v);
+	}
+	j64_iter_fini(&it);
+
+	return !it.error;
+}
+
+/*
+ * Patches
+ *
+ * j64_diff compares two documents and returns a JSON Patch (RFC 6902):
+ * an array of operations that turns the first document into the second.
+ * j64_patch_apply applies such a patch. Equal words are never looked
+ * into, so immediates compare in one step and a subtree that is still
+ * the same box, shared or untouched, is skipped whole. Arrays are
+ * compared index by index, with elements added or removed at the end.
+ */
+
+J64_API int
+j64__is_arr(j64_t j)
+{
+	return j64_is_barr(j) || j64_is_earr(j);
+}
+
+J64_API size_t
+j64__arr_len(j64_t j)
+{
+	return j64_is_barr(j) ? j64_barr_cap(j) : 0;
+}
+
+J64_API int
+j64__is_objv(j64_t j)
+{
+	return j64_is_obj(j) || j64_is_eobj(j);
+}
+
+/*
+ * Returns a copy of a value owned by the caller, or undefined if out of
+ * memory. With J64_REFCOUNT, heap boxes are shared instead of copied.
+ * Unset array elements become null.
+ */
+J64_API j64_t
+j64__dup(j64_t j)
+{
+	j64_t copy, k, v;
+	size_t cap, i;
+
+	if (j64_is_undef(j))
+		return j64_null();
+
+#ifdef J64_REFCOUNT
+	if (j64__is_box(j) && !J64__BOX_IS_STATIC(J64__BOX_PTR(j)))
+		return j64_retain(j);
+#endif /* J64_REFCOUNT */
+
+	switch (J64_TYPE_GET(j)) {
+	case J64_TYPE_BSTR:
+		return j64_bstr(j64_str_ptr(&j), j64_bstr_len(j));
+	case J64_TYPE_BARR:
+		cap = j64_barr_cap(j);
+		copy = j64_barr_alloc(cap);
+		for (i = 0; !j64_is_undef(copy) && i < cap; i++) {
+			v = j64__dup(j64_barr_get(j, i));
+			if (j64_is_undef(v)) {
+				j64_release(copy);
+				return v;
+			}
+			j64_barr_set(copy, v, i);
+		}
+		return copy;
+	case J64_TYPE_OBJ:
+		copy = j64_obj_alloc(j64_obj_len(j));
+		for (i = 0; !j64_is_undef(copy) && j64_obj_next(j, &i, &k, &v); ) {
+			k = j64__dup(k);
+			v = j64__dup(v);
+			if (j64_is_undef(k) || j64_is_undef(v) || !j64_obj_set(&copy, k, v)) {
+				j64_release(k);
+				j64_release(v);
+				j64_release(copy);
+				return j64_undef();
+			}
+		}
+		return copy;
+	default:
+		return j;
+	}
+}
+
+/* Returns null for an unset array element, as copies of it are null */
+J64_API j64_t
+j64__or_null(j64_t j)
+{
+	return j64_is_undef(j) ? j64_null() : j;
+}
+
+/*
+ * Returns 1 if two values are equal as JSON. Unset array elements
+ * equal null.
+ */
+J64_API int
+j64__equal(j64_t a, j64_t b)
+{
+	j64_t k, v, *pair;
+	size_t i, n;
+
+	if (a.w == b.w)
+		return 1;
+
+	if (j64_is_str(a) && j64_is_str(b)) {
+		n = j64_str_len(a);
+		return n == j64_str_len(b) &&
+		    memcmp(j64_str_ptr(&a), j64_str_ptr(&b), n) == 0;
+	}
+
+	if (j64__is_arr(a) && j64__is_arr(b)) {
+		n = j64__arr_len(a);
+		if (n != j64__arr_len(b))
+			return 0;
+		for (i = 0; i < n; i++)
+			if (!j64__equal(j64__or_null(j64_barr_get(a, i)),
+			    j64__or_null(j64_barr_get(b, i))))
+				return 0;
+		return 1;
+	}
+
+	if (j64__is_objv(a) && j64__is_objv(b)) {
+		if (j64_is_eobj(a) || j64_is_eobj(b))
+			return (j64_is_eobj(a) || j64_obj_len(a) == 0) &&
+			    (j64_is_eobj(b) || j64_obj_len(b) == 0);
+		if (j64_obj_len(a) != j64_obj_len(b))
+			return 0;
+		for (i = 0; j64_obj_next(a, &i, &k, &v); ) {
+			pair = j64__obj_lookup(b, k);
+			if (pair == NULL || !j64__equal(v, pair[1]))
+				return 0;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+struct j64__diff {
+	j64_t	*ops;
+	size_t	nops;
+	size_t	ops_cap;
+	char	*path;		/* JSON Pointer of the current value */
+	size_t	path_len;
+	size_t	path_cap;
+};
+
+J64_API int
+j64__diff_put(struct j64__diff *d, const void *buf, size_t len)
+{
+	void *tmp;
+	size_t cap;
+
+	if (d->path_cap - d->path_len < len) {
+		if (SIZE_MAX / 2 - len < d->path_len)
+			return 0;
+		cap = J64__MAX(2 * (d->path_len + len), 64);
+		tmp = J64_REALLOC(d->path, cap);
+		if (tmp == NULL)
+			return 0;
+		d->path = (char *)tmp;
+		d->path_cap = cap;
+	}
+	memcpy(d->path + d->path_len, buf, len);
+	d->path_len += len;
+
+	return 1;
+}
+
+/* Appends a key to the path, escaping '~' and '/' */
+J64_API int
+j64__diff_key(struct j64__diff *d, j64_t key)
+{
+	const uint8_t *p = j64_str_ptr(&key);
+	size_t len = j64_str_len(key);
+	size_t i;
+	int res;
+
+	res = j64__diff_put(d, "/", 1);
+	for (i = 0; res && i < len; i++) {
+		if (p[i] == '~')
+			res = j64__diff_put(d, "~0", 2);
+		else if (p[i] == '/')
+			res = j64__diff_put(d, "~1", 2);
+		else
+			res = j64__diff_put(d, &p[i], 1);
+	}
+
+	return res;
+}
+
+J64_API int
+j64__diff_idx(struct j64__diff *d, size_t idx)
+{
+	char buf[J64_INT_ENCODE_MAX + 1];
+	size_t n;
+
+	buf[0] = '/';
+	n = j64_int_encode(j64_int((int64_t)idx), buf + 1, sizeof(buf) - 1);
+
+	return j64__diff_put(d, buf, n + 1);
+}
+
+/*
+ * Appends an operation on the current path with a copy of VAL, or with
+ * no value if VAL is undefined. Returns 1 on success, 0 otherwise.
+ */
+J64_API int
+j64__diff_op(struct j64__diff *d, const char *op, j64_t val)
+{
+	j64_t o, path = j64_undef();
+	void *tmp;
+
+	o = j64_obj_alloc(3);
+	if (j64_is_undef(o) ||
+	    !j64_obj_set(&o, j64_istr("op", 2), j64_istr(op, strlen(op))))
+		goto fail;
+
+	path = j64_str(d->path, d->path_len);
+	if ((d->path_len > 0 && j64_is_undef(path)) ||
+	    !j64_obj_set(&o, j64_istr("path", 4), path))
+		goto fail;
+	path = j64_undef();
+
+	if (!j64_is_undef(val)) {
+		val = j64__dup(val);
+		if (j64_is_undef(val))
+			goto fail;
+		if (!j64_obj_set(&o, j64_istr("value", 5), val)) {
+			j64_release(val);
+			goto fail;
+		}
+	}
+
+	if (d->nops == d->ops_cap) {
+		tmp = j64__grow(d->ops, &d->ops_cap, sizeof(j64_t));
+		if (tmp == NULL)
+			goto fail;
+		d->ops = (j64_t *)tmp;
+	}
+	d->ops[d->nops++] = o;
+
+	return 1;
+
+fail:
+	j64_release(path);
+	j64_release(o);
+
+	return 0;
+}
+
+J64_API int j64__diff(struct j64__diff *, j64_t, j64_t);
+
+J64_API int
+j64__diff_arr(struct j64__diff *d, j64_t a, j64_t b)
+{
+	size_t na = j64__arr_len(a);
+	size_t nb = j64__arr_len(b);
+	size_t mark = d->path_len;
+	size_t i;
+	j64_t v;
+	int res = 1;
+
+	for (i = 0; res && i < J64__MIN(na, nb); i++) {
+		res = j64__diff_idx(d, i) &&
+		    j64__diff(d, j64_barr_get(a, i), j64_barr_get(b, i));
+		d->path_len = mark;
+	}
+	for (i = na; res && i < nb; i++) {
+		v = j64_barr_get(b, i);
+		res = j64__diff_idx(d, i) && j64__diff_op(d, "add", j64__or_null(v));
+		d->path_len = mark;
+	}
+	/* Remove from the end, so that the indices stay valid */
+	for (i = na; res && i-- > nb; ) {
+		res = j64__diff_idx(d, i) && j64__diff_op(d, "remove", j64_undef());
+		d->path_len = mark;
+	}
+
+	return res;
+}
+
+J64_API int
+j64__diff_obj(struct j64__diff *d, j64_t a, j64_t b)
+{
+	size_t mark = d->path_len;
+	size_t i;
+	j64_t k, v, *pair;
+	int res = 1;
+
+	for (i = 0; res && j64_is_obj(a) && j64_obj_next(a, &i, &k, &v); ) {
+		pair = j64_is_obj(b) ? j64__obj_lookup(b, k) : NULL;
+		res = j64__diff_key(d, k) && (pair == NULL ?
+		    j64__diff_op(d, "remove", j64_undef()) :
+		    j64__diff(d, v, pair[1]));
+		d->path_len = mark;
+	}
+	for (i = 0; res && j64_is_obj(b) && j64_obj_next(b, &i, &k, &v); ) {
+		if (j64_is_obj(a) && j64__obj_lookup(a, k) != NULL)
+			continue;
+		res = j64__diff_key(d, k) && j64__diff_op(d, "add", v);
+		d->path_len = mark;
+	}
+
+	return res;
+}
+
+J64_API int
+j64__diff(struct j64__diff *d, j64_t a, j64_t b)
+{
+	a = j64__or_null(a);
+	b = j64__or_null(b);
+	if (a.w == b.w)
+		return 1;
+	if (j64__is_arr(a) && j64__is_arr(b))
+		return j64__diff_arr(d, a, b);
+	if (j64__is_objv(a) && j64__is_objv(b))
+		return j64__diff_obj(d, a, b);
+	if (j64__equal(a, b))
+		return 1;
+
+	return j64__diff_op(d, "replace", b);
+}
+
+/*
+ * Compares two documents, neither of which is modified.
+ *
+ * Returns a patch turning A into B, owned by the caller,
+ * or undefined if out of memory.
+ */
+J64_API j64_t
+j64_diff(j64_t a, j64_t b)
+{
+	struct j64__diff d;
+	j64_t patch = j64_undef();
+	size_t i;
+
+	d.ops = NULL;
+	d.nops = 0;
+	d.ops_cap = 0;
+	d.path = NULL;
+	d.path_len = 0;
+	d.path_cap = 0;
+
+	if (!j64__diff(&d, a, b))
+		goto out;
+
+	if (d.nops == 0) {
+		patch = j64_earr();
+		goto out;
+	}
+	patch = j64_barr_alloc(d.nops);
+	if (j64_is_undef(patch))
+		goto out;
+	for (i = 0; i < d.nops; i++)
+		j64_barr_set(patch, d.ops[i], i);
+	d.nops = 0;
+
+out:
+	while (d.nops > 0)
+		j64_release(d.ops[--d.nops]);
+	if (d.ops != NULL)
+		J64_FREE(d.ops);
+	if (d.path != NULL)
+		J64_FREE(d.path);
+
+	return patch;
+}
+
+/*
+ * Returns the slot of a step in a container, after making the container
+ * safe to modify and dropping its cached encoding, or NULL if there is
+ * no such slot.
+ */
+J64_API j64_t *
+j64__patch_slot(j64_t *jp, const struct j64_path_step *step)
+{
+	j64_t *pair;
+
+	if (j64_is_barr(*jp)) {
+		if (j64_barr_cap(*jp) <= step->idx || !j64_barr_unshare(jp))
+			return NULL;
+		j64_cache_drop(*jp);
+		return j64__barr_slot(J64__BARR_HDR(*jp), step->idx);
+	}
+
+	if (j64_is_obj(*jp)) {
+		if (j64__obj_lookup_hashed(*jp, step->key, step->hash) == NULL ||
+		    !j64__obj_mut(jp))
+			return NULL;
+		j64_cache_drop(*jp);
+		pair = j64__obj_lookup_hashed(*jp, step->key, step->hash);
+		return &pair[1];
+	}
+
+	return NULL;
+}
+
+/* Returns the slot of the container that the last step of a path is in */
+J64_API j64_t *
+j64__patch_parent(j64_t *jp, const struct j64_path *path)
+{
+	size_t i;
+
+	for (i = 0; jp != NULL && i + 1 < path->len; i++)
+		jp = j64__patch_slot(jp, &(&path->step)[i]);
+
+	return jp;
+}
+
+/* Adds a value, which the document owns on success */
+J64_API int
+j64__patch_add(j64_t *jp, const struct j64_path *path, j64_t val)
+{
+	const struct j64_path_step *step;
+	j64_t key, old;
+	size_t cap, idx, i;
+
+	if (path->len == 0) {
+		j64_release(*jp);
+		*jp = val;
+		return 1;
+	}
+
+	step = &(&path->step)[path->len - 1];
+	jp = j64__patch_parent(jp, path);
+	if (jp == NULL)
+		return 0;
+
+	if (j64__is_objv(*jp)) {
+		if (j64_is_eobj(*jp)) {
+			old = j64_obj_alloc(1);
+			if (j64_is_undef(old))
+				return 0;
+			*jp = old;
+		}
+		key = j64__dup(step->key);
+		if (j64_is_undef(key))
+			return 0;
+		old = j64_obj_get(*jp, key);
+		if (!j64_obj_set(jp, key, val)) {
+			j64_free(key);
+			return 0;
+		}
+		j64_release(old);
+		return 1;
+	}
+
+	if (!j64__is_arr(*jp))
+		return 0;
+	cap = j64__arr_len(*jp);
+	idx = step->idx;
+	if (j64_str_len(step->key) == 1 && *j64_str_ptr(&step->key) == '-')
+		idx = cap;
+	if (cap < idx)
+		return 0;
+
+	if (j64_is_earr(*jp)) {
+		old = j64_barr_alloc(1);
+		if (j64_is_undef(old))
+			return 0;
+		*jp = old;
+	} else if (!j64_barr_unshare(jp) || !j64_barr_realloc(jp, cap + 1)) {
+		return 0;
+	}
+	for (i = cap; i > idx; i--)
+		j64_barr_set(*jp, j64_barr_get(*jp, i - 1), i);
+	j64_barr_set(*jp, val, idx);
+
+	return 1;
+}
+
+/* Removes a value and returns it, or undefined if there is none */
+J64_API j64_t
+j64__patch_take(j64_t *jp, const struct j64_path *path)
+{
+	const struct j64_path_step *step;
+	j64_t val;
+	size_t cap, i;
+
+	if (path->len == 0)
+		return j64_undef();
+
+	step = &(&path->step)[path->len - 1];
+	jp = j64__patch_parent(jp, path);
+	if (jp == NULL)
+		return j64_undef();
+
+	if (j64_is_obj(*jp)) {
+		val = j64_obj_del(jp, step->key);
+		if (!j64_is_undef(val) && j64_obj_len(*jp) == 0) {
+			j64_obj_free(*jp);
+			*jp = j64_eobj();
+		}
+		return val;
+	}
+
+	if (!j64_is_barr(*jp))
+		return j64_undef();
+	cap = j64_barr_cap(*jp);
+	if (cap <= step->idx || !j64_barr_unshare(jp))
+		return j64_undef();
+
+	val = j64_barr_get(*jp, step->idx);
+	for (i = step->idx; i + 1 < cap; i++)
+		j64_barr_set(*jp, j64_barr_get(*jp, i + 1), i);
+	j64_barr_set(*jp, j64_undef(), cap - 1);
+	if (cap == 1) {
+		j64_barr_free(*jp);
+		*jp = j64_earr();
+	} else if (!j64_barr_realloc(jp, cap - 1)) {
+		/* Put the value back where it was */
+		for (i = cap - 1; i > step->idx; i--)
+			j64_barr_set(*jp, j64_barr_get(*jp, i - 1), i);
+		j64_barr_set(*jp, val, step->idx);
+		return j64_undef();
+	}
+
+	return j64_is_undef(val) ? j64_null() : val;
+}
+
+/* Replaces an existing value, which the document owns on success */
+J64_API int
+j64__patch_replace(j64_t *jp, const struct j64_path *path, j64_t val)
+{
+	if (path->len > 0) {
+		jp = j64__patch_parent(jp, path);
+		if (jp != NULL)
+			jp = j64__patch_slot(jp, &(&path->step)[path->len - 1]);
+		if (jp == NULL)
+			return 0;
+	}
+	j64_release(*jp);
+	*jp = val;
+
+	return 1;
+}
+
+/* Adds or replaces a copy of a value */
+J64_API int
+j64__patch_put(j64_t *jp, const struct j64_path *path, j64_t val, int replace)
+{
+	val = j64__dup(val);
+	if (j64_is_undef(val))
+		return 0;
+	if (replace ? j64__patch_replace(jp, path, val) : j64__patch_add(jp, path, val))
+		return 1;
+	j64_release(val);
+
+	return 0;
+}
+
+/* Returns 1 if a string member of an operation is NAME */
+J64_API int
+j64__patch_is(j64_t s, const char *name)
+{
+	size_t len = strlen(name);
+
+	return j64_is_str(s) && j64_str_len(s) == len &&
+	    memcmp(j64_str_ptr(&s), name, len) == 0;
+}
+
+/* Returns 1 if PATH points inside the value at FROM */
+J64_API int
+j64__patch_inside(const struct j64_path *path, const struct j64_path *from)
+{
+	size_t i;
+
+	if (path->len <= from->len)
+		return 0;
+	for (i = 0; i < from->len; i++)
+		if (!j64__str_eq((&path->step)[i].key, (&from->step)[i].key))
+			return 0;
+
+	return 1;
+}
+
+/* Compiles the JSON Pointer in a member of an operation */
+J64_API struct j64_path *
+j64__patch_path(j64_t op, j64_t name)
+{
+	j64_t s = j64_obj_get(op, name);
+	const char *p;
+	size_t len;
+
+	if (!j64_is_str(s))
+		return NULL;
+	p = (const char *)j64_str_ptr(&s);
+	len = j64_str_len(s);
+	if (len > 0 && p[0] != '/')
+		return NULL;
+
+	return j64_path_compile(p, len);
+}
+
+J64_API int
+j64__patch_op(j64_t *jp, j64_t op)
+{
+	struct j64_path *path, *from = NULL;
+	j64_t name, val;
+	int res = 0;
+
+	if (!j64_is_obj(op))
+		return 0;
+	path = j64__patch_path(op, j64_istr("path", 4));
+	if (path == NULL)
+		return 0;
+	name = j64_obj_get(op, j64_istr("op", 2));
+	val = j64_obj_get(op, j64_istr("value", 5));
+
+	if (j64__patch_is(name, "add")) {
+		res = !j64_is_undef(val) && j64__patch_put(jp, path, val, 0);
+	} else if (j64__patch_is(name, "remove")) {
+		val = j64__patch_take(jp, path);
+		res = !j64_is_undef(val);
+		j64_release(val);
+	} else if (j64__patch_is(name, "replace")) {
+		/* The slot must exist, but may hold an unset array element */
+		res = !j64_is_undef(val) && j64__patch_put(jp, path, val, 1);
+	} else if (j64__patch_is(name, "move")) {
+		/* A value cannot be moved into itself */
+		from = j64__patch_path(op, j64_istr("from", 4));
+		val = from != NULL && !j64__patch_inside(path, from) ?
+		    j64__patch_take(jp, from) : j64_undef();
+		res = !j64_is_undef(val) && j64__patch_add(jp, path, val);
+		if (!res && !j64_is_undef(val) && !j64__patch_add(jp, from, val))
+			j64_release(val);
+	} else if (j64__patch_is(name, "copy")) {
+		from = j64__patch_path(op, j64_istr("from", 4));
+		val = from != NULL ? j64_path_get(from, *jp) : j64_undef();
+		res = !j64_is_undef(val) && j64__patch_put(jp, path, val, 0);
+	} else if (j64__patch_is(name, "test")) {
+		res = !j64_is_undef(val) && j64__equal(j64_path_get(path, *jp), val);
+	}
+
+	j64_path_free(from);
+	j64_path_free(path);
+
+	return res;
+}
+
+/*
+ * Applies a patch to the document at *JP, which may be replaced. The
+ * patch is not modified, and values are copied out of it. Arrays and
+ * objects left empty become the empty literals.
+ *
+ * Returns 1 on success, 0 if an operation is invalid or fails, or if out
+ * of memory. The operations before the one that failed stay applied.
+ */
+J64_API int
+j64_patch_apply(j64_t *jp, j64_t patch)
+{
+	size_t i, n;
+
+	j64__assert(jp != NULL);
+
+	if (!j64__is_arr(patch))
+		return 0;
+
+	n = j64__arr_len(patch);
+	for (i = 0; i < n; i++)
+		if (!j64__patch_op(jp, j64_barr_get(patch, i)))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Merge patches
+ *
+ * A merge patch (RFC 7396) is a partial document: its members replace
+ * those of the target, objects merge recursively and null removes a key.
+ * j64_merge_patch applies one in place. Objects of the target are kept
+ * and changed where they are, removed keys leave tombstones, and only
+ * the values that are replaced or removed are released.
+ */
+
+J64_API int
+j64__merge(j64_t *jp, j64_t patch)
+{
+	j64_t k, v, val, *pair;
+	size_t i;
+
+	if (!j64__is_objv(patch)) {
+		val = j64__dup(patch);
+		if (j64_is_undef(val))
+			return 0;
+		j64_release(*jp);
+		*jp = val;
+		return 1;
+	}
+
+	if (!j64__is_objv(*jp)) {
+		j64_release(*jp);
+		*jp = j64_eobj();
+	}
+	if (j64_is_eobj(patch))
+		return 1;
+	if (j64_is_eobj(*jp)) {
+		val = j64_obj_alloc(j64_obj_len(patch));
+		if (j64_is_undef(val))
+			return 0;
+		*jp = val;
+	} else if (!j64__obj_mut(jp)) {
+		return 0;
+	}
+	j64_cache_drop(*jp);
+
+	for (i = 0; j64_obj_next(patch, &i, &k, &v); ) {
+		pair = j64__obj_lookup(*jp, k);
+		if (j64_is_null(v)) {
+			if (pair != NULL)
+				j64_release(j64_obj_del(jp, k));
+			continue;
+		}
+		if (pair != NULL) {
+			if (!j64__merge(&pair[1], v))
+				return 0;
+			continue;
+		}
+
+		val = j64_undef();
+		if (!j64__merge(&val, v))
+			return 0;
+		k = j64__dup(k);
+		if (j64_is_undef(k) || !j64_obj_set(jp, k, val)) {
+			j64_free(k);
+			j64_release(val);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Applies a merge patch to the document at *JP, which may be replaced.
+ * The patch is not modified, and values are copied out of it.
+ *
+ * Returns 1 on success, 0 if out of memory, in which case the document
+ * may be partly patched.
+ */
+J64_API int
+j64_merge_patch(j64_t *jp, j64_t patch)
+{
+	j64__assert(jp != NULL);
+
+	return j64__merge(jp, patch);
+}
+
+/*
+ * misc
+ */
+
+#ifdef J64_DEBUG
+J64_API void
+j64_dbg(j64_t j)
+{
 	const char *lit;
 	char istr[J64_ISTR_LEN_MAX + 1];
 
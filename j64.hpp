@@ -0,0 +1,317 @@
+#ifndef J64__HPP
+#define J64__HPP
+
+/*
+ * C++ companion header for j64.h.
+ *
+ * Provides a move-only owning value type, non-owning views for strings
+ * and arrays, and constexpr helpers for constant words. Everything is
+ * inline and operates on the same 64-bit words as the C API, so the
+ * wrappers add no storage or indirection of their own.
+ *
+ * Requires C++11.
+ */
+
+#include "j64.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+namespace j64 {
+
+/*
+ * Constant words
+ */
+
+namespace detail {
+
+template <std::size_t N>
+constexpr uint64_t
+istr_chars(const char (&s)[N], std::size_t i)
+{
+	return i + 1 >= N ? 0 :
+	    J64__ISTR_C(s[i], i + 1) | istr_chars(s, i + 1);
+}
+
+} /* namespace detail */
+
+/*
+ * Constant word for an immediate string literal, the C++ counterpart of
+ * J64_ISTR_W:
+ *
+ *	constexpr j64_t key_id = j64::word(j64::istr_w("id"));
+ */
+template <std::size_t N>
+constexpr uint64_t
+istr_w(const char (&s)[N])
+{
+	static_assert(N - 1 <= J64_ISTR_LEN_MAX, "string too long for istr");
+	return detail::istr_chars(s, 0) |
+	    ((uint64_t(N - 1) << J64__ISTR_LEN_OFFS) & J64__ISTR_LEN_MASK) |
+	    J64_TYPE_ISTR;
+}
+
+constexpr j64_t
+word(uint64_t w)
+{
+	return j64_t{ w };
+}
+
+/*
+ * Non-owning view of a string value (immediate, boxed or empty).
+ *
+ * The view holds the word itself, so immediate strings stay valid for
+ * the lifetime of the view; boxed strings must outlive it.
+ */
+class str_view {
+public:
+	explicit str_view(j64_t j) noexcept : j_(j)
+	{
+		j64__assert(j64_is_istr(j) || j64_is_bstr(j) || j64_is_estr(j));
+	}
+
+	const char *
+	data() const noexcept
+	{
+		switch (J64_TYPE_GET(j_)) {
+		case J64_TYPE_ISTR:
+			return reinterpret_cast<const char *>(&j_.b[1]);
+		case J64_TYPE_BSTR:
+			return reinterpret_cast<const char *>(&J64__BSTR_HDR(j_)->buf);
+		default:
+			return "";
+		}
+	}
+
+	std::size_t
+	size() const noexcept
+	{
+		switch (J64_TYPE_GET(j_)) {
+		case J64_TYPE_ISTR:
+			return j64_istr_len(j_);
+		case J64_TYPE_BSTR:
+			return j64_bstr_len(j_);
+		default:
+			return 0;
+		}
+	}
+
+	bool empty() const noexcept { return size() == 0; }
+	const char *begin() const noexcept { return data(); }
+	const char *end() const noexcept { return data() + size(); }
+
+private:
+	j64_t	j_;
+};
+
+/*
+ * Non-owning view of an array value (boxed or empty).
+ */
+class arr_view {
+public:
+	class iterator {
+	public:
+		typedef std::input_iterator_tag	iterator_category;
+		typedef j64_t			value_type;
+		typedef std::ptrdiff_t		difference_type;
+		typedef const j64_t		*pointer;
+		typedef j64_t			reference;
+
+		iterator(j64_t j, std::size_t i) noexcept : j_(j), i_(i) {}
+
+		j64_t operator*() const noexcept { return j64_barr_get(j_, i_); }
+		iterator &operator++() noexcept { i_++; return *this; }
+		iterator operator++(int) noexcept { iterator it(*this); i_++; return it; }
+		bool operator==(const iterator &o) const noexcept { return i_ == o.i_; }
+		bool operator!=(const iterator &o) const noexcept { return i_ != o.i_; }
+
+	private:
+		j64_t		j_;
+		std::size_t	i_;
+	};
+
+	explicit arr_view(j64_t j) noexcept : j_(j)
+	{
+		j64__assert(j64_is_barr(j) || j64_is_earr(j));
+	}
+
+	std::size_t
+	size() const noexcept
+	{
+		return j64_is_barr(j_) ? j64_barr_cap(j_) : 0;
+	}
+
+	bool empty() const noexcept { return size() == 0; }
+	j64_t operator[](std::size_t i) const noexcept { return j64_barr_get(j_, i); }
+	iterator begin() const noexcept { return iterator(j_, 0); }
+	iterator end() const noexcept { return iterator(j_, size()); }
+
+private:
+	j64_t	j_;
+};
+
+/*
+ * Releases a value and, with the last reference, every element in it.
+ */
+inline void
+destroy(j64_t j) noexcept
+{
+	j64_release(j);
+}
+
+/*
+ * Move-only owning value.
+ *
+ * Owns a whole tree: destroying or reassigning a value frees all boxes
+ * reachable from it. Copies are not allowed, so a box can never be freed
+ * twice through two values; use get() for non-owning access and release()
+ * to hand the word back to C code. With J64_REFCOUNT, share() makes an
+ * O(1) copy that holds its own reference.
+ */
+class value {
+public:
+	value() noexcept : j_(j64_undef()) {}
+	explicit value(j64_t j) noexcept : j_(j) {}
+	value(value &&o) noexcept : j_(o.release()) {}
+	value(const value &) = delete;
+	~value() { destroy(j_); }
+
+	value &
+	operator=(value &&o) noexcept
+	{
+		if (this != &o)
+			reset(o.release());
+		return *this;
+	}
+
+	value &operator=(const value &) = delete;
+
+	static value null() noexcept { return value(j64_null()); }
+	static value boolean(bool b) noexcept { return value(j64_bool(b)); }
+	static value integer(int64_t i) noexcept { return value(j64_int(i)); }
+	static value number(double f) noexcept { return value(j64_float(f)); }
+
+	/* Picks the empty, immediate or boxed representation by length */
+	static value
+	string(const char *buf, std::size_t len) noexcept
+	{
+		if (len == 0)
+			return value(j64_estr());
+		if (len <= J64_ISTR_LEN_MAX)
+			return value(j64_istr(buf, len));
+		return value(j64_bstr(buf, len));
+	}
+
+	static value
+	array(std::size_t cap) noexcept
+	{
+		return value(cap == 0 ? j64_earr() : j64_barr_alloc(cap));
+	}
+
+	j64_t get() const noexcept { return j_; }
+
+#ifdef J64_REFCOUNT
+	value share() const noexcept { return value(j64_retain(j_)); }
+	bool is_shared() const noexcept { return j64_is_shared(j_); }
+
+	/* Makes an array safe to modify, copying it if it is shared */
+	bool unshare() noexcept { return !j64_is_barr(j_) || j64_barr_unshare(&j_); }
+#endif /* J64_REFCOUNT */
+
+	j64_t
+	release() noexcept
+	{
+		j64_t j = j_;
+		j_ = j64_undef();
+		return j;
+	}
+
+	void
+	reset(j64_t j = j64_undef()) noexcept
+	{
+		destroy(j_);
+		j_ = j;
+	}
+
+	explicit operator bool() const noexcept { return !j64_is_undef(j_); }
+
+	bool is_null() const noexcept { return j64_is_null(j_); }
+	bool is_bool() const noexcept { return j64_is_true(j_) || j64_is_false(j_); }
+	bool is_int() const noexcept { return j64_is_int(j_); }
+	bool is_float() const noexcept { return j64_is_float(j_); }
+	bool is_str() const noexcept { return j64_is_istr(j_) || j64_is_bstr(j_) || j64_is_estr(j_); }
+	bool is_arr() const noexcept { return j64_is_barr(j_) || j64_is_earr(j_); }
+
+	bool as_bool() const noexcept { return j64_is_true(j_); }
+	int64_t as_int() const noexcept { return j64_int_get(j_); }
+	double as_float() const noexcept { return j64_float_get(j_); }
+	str_view str() const noexcept { return str_view(j_); }
+	arr_view arr() const noexcept { return arr_view(j_); }
+
+	/*
+	 * Stores an element, taking ownership of it and freeing the old one.
+	 * A shared array is copied first; returns false if that fails, in
+	 * which case V is left untouched.
+	 */
+	bool
+	set(std::size_t i, value &&v) noexcept
+	{
+		if (!j64_barr_unshare(&j_))
+			return false;
+		destroy(j64_barr_get(j_, i));
+		j64_barr_set(j_, v.release(), i);
+		return true;
+	}
+
+	/*
+	 * Resizes an array, freeing truncated elements; returns false on
+	 * failure, leaving the array as it was.
+	 */
+	bool
+	resize(std::size_t cap) noexcept
+	{
+		j64_t j, tail = j64_undef();
+		std::size_t i, n;
+
+		if (j64_is_earr(j_)) {
+			if (cap == 0)
+				return true;
+			j = j64_barr_alloc(cap);
+			if (j64_is_undef(j))
+				return false;
+			j_ = j;
+			return true;
+		}
+		if (!j64_is_barr(j_) || !j64_barr_unshare(&j_))
+			return false;
+
+		/* Truncated elements are only freed once the array has shrunk */
+		n = j64_barr_cap(j_);
+		if (cap < n) {
+			tail = j64_barr_alloc(n - cap);
+			if (j64_is_undef(tail))
+				return false;
+			for (i = cap; i < n; i++) {
+				j64_barr_set(tail, j64_barr_get(j_, i), i - cap);
+				j64_barr_set(j_, j64_undef(), i);
+			}
+		}
+		if (!j64_barr_realloc(&j_, cap)) {
+			for (i = cap; i < n; i++)
+				j64_barr_set(j_, j64_barr_get(tail, i - cap), i);
+			if (!j64_is_undef(tail))
+				j64_barr_free(tail);
+			return false;
+		}
+		destroy(tail);
+		return true;
+	}
+
+private:
+	j64_t	j_;
+};
+
+} /* namespace j64 */
+
+#endif
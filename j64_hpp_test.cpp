@@ -0,0 +1,251 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+#include "j64.hpp"
+
+/* Test function type */
+typedef int (*test_fn)(void);
+
+/* Test type */
+struct test {
+	const char	*name;
+	const char	*descr;
+	test_fn		 fn;
+};
+
+/* Test constructor */
+#define TEST(fn, descr) { #fn, descr, fn }
+
+static int
+run_tests(const struct test *tests, size_t ntests)
+{
+	size_t i;
+	int nfail = 0;
+
+	for (i = 0; i < ntests; i++) {
+		if (!tests[i].fn()) {
+			fprintf(stderr, "failed: %s (%s)\n", tests[i].name, tests[i].descr);
+			nfail++;
+		}
+	}
+
+	if (nfail == 0) {
+		fprintf(stderr, "All %zu C++ tests passed!\n", ntests);
+		return 1;
+	} else {
+		fprintf(stderr, "%d out of %zu C++ tests failed.\n", nfail, ntests);
+		return 0;
+	}
+}
+
+/*
+ * Test definitions
+ */
+
+static int
+test_value_size(void)
+{
+	return sizeof(j64::value) == sizeof(j64_t) &&
+	    sizeof(j64::str_view) == sizeof(j64_t) &&
+	    sizeof(j64::arr_view) == sizeof(j64_t);
+}
+
+static int
+test_value_move_only(void)
+{
+	return !std::is_copy_constructible<j64::value>::value &&
+	    !std::is_copy_assignable<j64::value>::value &&
+	    std::is_nothrow_move_constructible<j64::value>::value &&
+	    std::is_nothrow_move_assignable<j64::value>::value;
+}
+
+static int
+test_value_move(void)
+{
+	j64::value a = j64::value::string("a boxed string", 14);
+	j64_t j = a.get();
+	j64::value b(std::move(a));
+	j64::value c;
+
+	c = std::move(b);
+	return !a && !b && c.get().w == j.w && j64_is_bstr(c.get());
+}
+
+static int
+test_value_release(void)
+{
+	j64::value a = j64::value::string("a boxed string", 14);
+	j64_t j = a.release();
+	int res = !a && j64_is_bstr(j);
+
+	j64_free(j);
+	return res;
+}
+
+static int
+test_value_scalars(void)
+{
+	return j64::value::null().is_null() &&
+	    j64::value::boolean(true).as_bool() &&
+	    j64::value::integer(-42).as_int() == -42 &&
+	    j64::value::number(0.5).as_float() == 0.5;
+}
+
+static int
+test_value_string(void)
+{
+	j64::value e = j64::value::string("", 0);
+	j64::value i = j64::value::string("istr", 4);
+	j64::value b = j64::value::string("boxed string", 12);
+
+	return j64_is_estr(e.get()) && e.str().empty() &&
+	    j64_is_istr(i.get()) && i.str().size() == 4 &&
+	    memcmp(i.str().data(), "istr", 4) == 0 &&
+	    j64_is_bstr(b.get()) && b.str().size() == 12 &&
+	    memcmp(b.str().data(), "boxed string", 12) == 0;
+}
+
+static int
+test_value_array(void)
+{
+	j64::value a = j64::value::array(3);
+	int64_t sum = 0;
+
+	a.set(0, j64::value::integer(1));
+	a.set(1, j64::value::integer(2));
+	a.set(2, j64::value::integer(3));
+	for (j64_t j : a.arr())
+		sum += j64_int_get(j);
+
+	return a.is_arr() && a.arr().size() == 3 && sum == 6;
+}
+
+static int
+test_value_array_nested(void)
+{
+	j64::value a = j64::value::array(2);
+	j64::value b = j64::value::array(1);
+
+	b.set(0, j64::value::string("nested boxed string", 19));
+	a.set(0, std::move(b));
+	a.set(1, j64::value::string("another boxed string", 20));
+	a.set(1, j64::value::string("replaced boxed string", 21));
+
+	return j64::str_view(a.arr()[1]).size() == 21 &&
+	    j64::arr_view(a.arr()[0]).size() == 1;
+}
+
+static int
+test_value_array_resize(void)
+{
+	j64::value a = j64::value::array(0);
+	int res = a.resize(2);
+
+	a.set(0, j64::value::string("a boxed string", 14));
+	a.set(1, j64::value::string("a boxed string", 14));
+	res = res && a.resize(1) && a.arr().size() == 1;
+	res = res && a.resize(4) && j64_is_undef(a.arr()[3]);
+
+	return res;
+}
+
+#ifdef J64_REFCOUNT
+static int
+test_value_share(void)
+{
+	j64::value a = j64::value::array(1);
+	int res;
+
+	a.set(0, j64::value::string("a boxed string", 14));
+	j64::value b = a.share();
+	res = a.is_shared() && b.get().w == a.get().w;
+	res = res && b.unshare() && !a.is_shared() && b.get().w != a.get().w;
+	b.set(0, j64::value::integer(1));
+	return res && j64_is_bstr(a.arr()[0]);
+}
+
+static int
+test_value_share_resize(void)
+{
+	j64::value a = j64::value::array(2);
+	int res;
+
+	a.set(0, j64::value::string("a boxed string", 14));
+	a.set(1, j64::value::string("another boxed string", 20));
+	j64::value b = a.share();
+	res = b.resize(1) && b.get().w != a.get().w && !a.is_shared();
+	res = res && a.arr().size() == 2 && j64_is_bstr(a.arr()[1]) &&
+	    !j64_is_shared(a.arr()[1]) && j64_is_shared(a.arr()[0]);
+	j64::value c = a.share();
+	res = res && c.set(1, j64::value::integer(1)) && j64_is_bstr(a.arr()[1]);
+	return res;
+}
+#endif /* J64_REFCOUNT */
+
+static int
+test_const_istr(void)
+{
+	constexpr j64_t k = j64::word(j64::istr_w("abcdefg"));
+	constexpr j64_t e = j64::word(j64::istr_w(""));
+
+	return k.w == j64_istr("abcdefg", 7).w && e.w == j64_istr("", 0).w;
+}
+
+static int
+test_const_switch(void)
+{
+	j64_t j = j64_istr("id", 2);
+
+	switch (j.w) {
+	case j64::istr_w("id"):
+		return 1;
+	case j64::istr_w("name"):
+	default:
+		return 0;
+	}
+}
+
+static J64_STATIC_BSTR(static_bstr, 12) = { J64_STATIC_LEN(12), "hello, world" };
+
+static int
+test_static_bstr(void)
+{
+	j64_t j = j64_bstr_static(&static_bstr);
+	char buf[12];
+
+	return j64_bstr_get(j, buf, sizeof(buf)) == 12 &&
+	    std::memcmp(buf, "hello, world", 12) == 0;
+}
+
+/* Test function and description list */
+static const struct test TESTS[] = {
+	TEST(test_value_size,		"wrapper sizes equal the word size"),
+	TEST(test_value_move_only,	"owning value is move-only"),
+	TEST(test_value_move,		"owning value move construction and assignment"),
+	TEST(test_value_release,	"owning value release"),
+	TEST(test_value_scalars,	"owning value scalar construction"),
+	TEST(test_value_string,		"owning value string construction and views"),
+	TEST(test_value_array,		"owning value array construction and iteration"),
+	TEST(test_value_array_nested,	"owning value nested array ownership"),
+	TEST(test_value_array_resize,	"owning value array resizing"),
+#ifdef J64_REFCOUNT
+	TEST(test_value_share,		"owning value sharing and copy-on-write"),
+	TEST(test_value_share_resize,	"owning value shared array resizing"),
+#endif /* J64_REFCOUNT */
+	TEST(test_const_istr,		"constexpr immediate string words"),
+	TEST(test_const_switch,		"constexpr immediate string case labels"),
+	TEST(test_static_bstr,		"static boxed string from a string literal")
+};
+
+#define NTESTS (sizeof(TESTS) / sizeof(TESTS[0]))
+
+int
+main(void)
+{
+	if (run_tests(TESTS, NTESTS))
+		return EXIT_SUCCESS;
+	else
+		return EXIT_FAILURE;
+}
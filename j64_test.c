@@ -1,6 +1,37 @@
+#if defined(J64_FILE_IO) || defined(J64_IO_URING) || defined(J64_GZIP) || \
+    defined(J64_ZSTD)
+#define _DEFAULT_SOURCE
+#endif /* J64_FILE_IO || J64_IO_URING || J64_GZIP || J64_ZSTD */
+
 #include <stdio.h>
 #include <stdlib.h>
 
+/* Allocations left before the next one fails, or -1 if none fails */
+static long alloc_budget = -1;
+
+static void *
+test_malloc(size_t size)
+{
+	if (alloc_budget == 0)
+		return NULL;
+	if (alloc_budget > 0)
+		alloc_budget--;
+	return malloc(size);
+}
+
+static void *
+test_realloc(void *ptr, size_t size)
+{
+	if (alloc_budget == 0)
+		return NULL;
+	if (alloc_budget > 0)
+		alloc_budget--;
+	return realloc(ptr, size);
+}
+
+#define J64_MALLOC	test_malloc
+#define J64_REALLOC	test_realloc
+
 #include "j64.h"
 
 /* Test function type */
@@ -131,6 +162,10 @@ int test_bstr_get_1(void);
 int test_bstr_get_8(void);
 int test_bstr_get_65536(void);
 
+int test_bstr_static_len(void);
+int test_bstr_static_get(void);
+int test_bstr_static_free(void);
+
 int test_barr_alloc_0(void);
 int test_barr_alloc_1(void);
 int test_barr_alloc_8(void);
@@ -156,6 +191,198 @@ int test_barr_set_get_65536(void);
 int test_barr_set_free_get_1(void);
 int test_barr_set_free_get_8(void);
 int test_barr_set_free_get_65536(void);
+int test_barr_seg_alloc(void);
+int test_barr_seg_alloc_cap(void);
+int test_barr_seg_set_get(void);
+int test_barr_seg_realloc_grow(void);
+int test_barr_seg_realloc_append(void);
+int test_barr_seg_realloc_shrink(void);
+int test_barr_seg_realloc_oom(void);
+int test_barr_static_cap(void);
+int test_barr_static_get(void);
+int test_barr_static_realloc(void);
+int test_barr_static_free(void);
+int test_obj_static_len(void);
+int test_obj_static_get(void);
+int test_obj_static_next(void);
+int test_obj_static_set(void);
+int test_obj_static_free(void);
+
+int test_release_nested(void);
+int test_barr_unshare_unique(void);
+int test_barr_unshare_static(void);
+#ifdef J64_REFCOUNT
+int test_retain_shared(void);
+int test_release_shared(void);
+int test_barr_unshare_shared(void);
+int test_barr_unshare_nested(void);
+int test_barr_realloc_shared(void);
+int test_barr_realloc_shared_shrink(void);
+#endif /* J64_REFCOUNT */
+
+int test_freeze_imm(void);
+int test_freeze_nested(void);
+int test_freeze_static(void);
+int test_freeze_seg(void);
+int test_freeze_unshare(void);
+int test_frozen_swap(void);
+
+int test_str_0(void);
+int test_str_7(void);
+int test_str_8(void);
+int test_obj_alloc(void);
+int test_obj_set_get_istr(void);
+int test_obj_set_get_bstr(void);
+int test_obj_set_get_canon(void);
+int test_obj_set_replace(void);
+int test_obj_get_missing(void);
+int test_obj_del(void);
+int test_obj_del_missing(void);
+int test_obj_del_reinsert(void);
+int test_obj_set_get_65536(void);
+int test_obj_next(void);
+int test_obj_seal_0(void);
+int test_obj_seal_1(void);
+int test_obj_seal_8(void);
+int test_obj_seal_1000(void);
+int test_obj_seal_65536(void);
+int test_obj_seal_missing(void);
+int test_obj_seal_set(void);
+int test_obj_seal_del(void);
+int test_obj_release_nested(void);
+int test_freeze_obj(void);
+#ifdef J64_REFCOUNT
+int test_obj_unshare_shared(void);
+#endif /* J64_REFCOUNT */
+
+int test_path_pointer(void);
+int test_path_pointer_escape(void);
+int test_path_dotted(void);
+int test_path_root(void);
+int test_path_missing(void);
+int test_path_sealed(void);
+int test_path_invalid(void);
+int test_path_oom(void);
+
+int test_decode_lit(void);
+int test_decode_int(void);
+int test_decode_float(void);
+int test_decode_str(void);
+int test_decode_str_esc(void);
+int test_decode_str_surrogate(void);
+int test_decode_arr(void);
+int test_decode_obj(void);
+int test_decode_obj_dup(void);
+int test_decode_deep(void);
+int test_decode_invalid(void);
+int test_project_fields(void);
+int test_project_overlap(void);
+int test_project_esc_key(void);
+int test_project_invalid(void);
+int test_project_dup(void);
+
+int test_reader_tokens(void);
+int test_reader_raw(void);
+int test_reader_skip(void);
+int test_reader_invalid(void);
+int test_parse_sum(void);
+int test_parse_stop(void);
+
+int test_parser_chunks(void);
+int test_parser_split(void);
+int test_parser_num(void);
+int test_parser_long_str(void);
+int test_parser_invalid(void);
+
+int test_int_encode(void);
+int test_float_encode(void);
+int test_str_encode(void);
+int test_encode_tree(void);
+int test_encode_roundtrip(void);
+int test_writer_stream(void);
+int test_writer_flush_fail(void);
+int test_cache_drop(void);
+int test_validate(void);
+int test_validate_depth(void);
+int test_validate_utf8(void);
+int test_decode_batch(void);
+int test_decode_batch_deep(void);
+int test_iter_order(void);
+int test_iter_deep(void);
+int test_clone_doc(void);
+int test_clone_seg(void);
+int test_clone_alloc(void);
+int test_stats_counts(void);
+int test_stats_frozen(void);
+int test_diff_roundtrip(void);
+int test_diff_ops(void);
+int test_diff_unset(void);
+int test_patch_apply(void);
+int test_patch_move(void);
+int test_patch_oom(void);
+int test_merge_patch_rfc(void);
+int test_merge_patch_in_place(void);
+int test_canonical_keys(void);
+int test_canonical_numbers(void);
+int test_canonical_strings(void);
+int test_cbor(void);
+int test_cbor_tags(void);
+int test_msgpack(void);
+int test_bin_roundtrip(void);
+#ifdef J64_ALLOC_STATS
+int test_alloc_stats(void);
+#endif /* J64_ALLOC_STATS */
+#ifdef J64_TRACE
+int test_trace_phases(void);
+#endif /* J64_TRACE */
+#ifdef J64_ENCODE_CACHE
+int test_cache_hit(void);
+int test_cache_small(void);
+int test_cache_barr_set(void);
+int test_cache_obj_set(void);
+int test_cache_nested(void);
+int test_cache_depth(void);
+#endif /* J64_ENCODE_CACHE */
+#ifdef J64_FILE_IO
+int test_file_read(void);
+int test_file_pipe(void);
+int test_file_decode(void);
+#endif /* J64_FILE_IO */
+#ifdef J64_GZIP
+int test_inflate_gzip(void);
+int test_inflate_plain(void);
+int test_inflate_invalid(void);
+int test_inflate_stop(void);
+#endif /* J64_GZIP */
+#ifdef J64_ZSTD
+int test_inflate_zstd(void);
+#endif /* J64_ZSTD */
+
+int test_shred_cols(void);
+int test_shred_dup(void);
+int test_shred_1000(void);
+int test_shred_invalid(void);
+int test_shred_oom(void);
+
+int test_const_undef(void);
+int test_const_null(void);
+int test_const_false(void);
+int test_const_true(void);
+int test_const_bool_false(void);
+int test_const_bool_true(void);
+int test_const_estr(void);
+int test_const_earr(void);
+int test_const_eobj(void);
+int test_const_int_zero(void);
+int test_const_int_one(void);
+int test_const_int_minus_one(void);
+int test_const_int_max(void);
+int test_const_int_min(void);
+int test_const_float_one(void);
+int test_const_float_neg_half(void);
+int test_const_istr_0(void);
+int test_const_istr_1(void);
+int test_const_istr_7(void);
 
 /* Test function and description list */
 static const struct test TESTS[] = {
@@ -235,6 +462,10 @@ static const struct test TESTS[] = {
 	TEST(test_bstr_get_1,			"boxed string storage with 8 character"),
 	TEST(test_bstr_get_65536,		"boxed string storage with 65536 characters"),
 
+	TEST(test_bstr_static_len,		"static boxed string length"),
+	TEST(test_bstr_static_get,		"static boxed string storage"),
+	TEST(test_bstr_static_free,		"static boxed string free"),
+
 	TEST(test_barr_alloc_0,			"empty boxed array construction"),
 	TEST(test_barr_alloc_1,			"boxed array construction of capacity 1"),
 	TEST(test_barr_alloc_8,			"boxed array construction of capacity 8"),
@@ -259,7 +490,199 @@ static const struct test TESTS[] = {
 	TEST(test_barr_set_get_65536,		"boxed array element storage with 65536 elements"),
 	TEST(test_barr_set_free_get_1,		"boxed array freed element storage with 1 element"),
 	TEST(test_barr_set_free_get_8,		"boxed array freed element storage with 8 elements"),
-	TEST(test_barr_set_free_get_65536,	"boxed array freed element storage with 65536 elements")
+	TEST(test_barr_set_free_get_65536,	"boxed array freed element storage with 65536 elements"),
+	TEST(test_barr_seg_alloc,		"segmented boxed array construction"),
+	TEST(test_barr_seg_alloc_cap,		"segmented boxed array capacity"),
+	TEST(test_barr_seg_set_get,		"segmented boxed array element storage"),
+	TEST(test_barr_seg_realloc_grow,	"boxed array reallocation into segmented array"),
+	TEST(test_barr_seg_realloc_append,	"segmented boxed array growth by one element"),
+	TEST(test_barr_seg_realloc_shrink,	"segmented boxed array truncation and regrowth"),
+	TEST(test_barr_seg_realloc_oom,		"segmented boxed array growth out of memory"),
+	TEST(test_barr_static_cap,		"static boxed array capacity"),
+	TEST(test_barr_static_get,		"static boxed array element storage"),
+	TEST(test_barr_static_realloc,		"static boxed array reallocation"),
+	TEST(test_barr_static_free,		"static boxed array free"),
+	TEST(test_obj_static_len,		"static object length"),
+	TEST(test_obj_static_get,		"static object lookup"),
+	TEST(test_obj_static_next,		"static object iteration order"),
+	TEST(test_obj_static_set,		"static object modification copies"),
+	TEST(test_obj_static_free,		"static object free"),
+
+	TEST(test_release_nested,		"recursive release of nested boxes"),
+	TEST(test_barr_unshare_unique,		"boxed array unsharing without copy"),
+	TEST(test_barr_unshare_static,		"static boxed array unsharing"),
+#ifdef J64_REFCOUNT
+	TEST(test_retain_shared,		"boxed value sharing"),
+	TEST(test_release_shared,		"shared boxed value release"),
+	TEST(test_barr_unshare_shared,		"shared boxed array copy-on-write"),
+	TEST(test_barr_unshare_nested,		"shared nested boxed array copy-on-write"),
+	TEST(test_barr_realloc_shared,		"shared boxed array reallocation"),
+	TEST(test_barr_realloc_shared_shrink,	"shared boxed array truncation"),
+#endif /* J64_REFCOUNT */
+
+	TEST(test_freeze_imm,			"immediate value freezing"),
+	TEST(test_freeze_nested,		"nested document freezing"),
+	TEST(test_freeze_static,		"frozen document immutability"),
+	TEST(test_freeze_seg,			"segmented boxed array freezing"),
+	TEST(test_freeze_unshare,		"frozen boxed array unsharing"),
+	TEST(test_frozen_swap,			"frozen document publishing"),
+
+	TEST(test_str_0,			"canonical empty string construction"),
+	TEST(test_str_7,			"canonical string construction with 7 characters"),
+	TEST(test_str_8,			"canonical string construction with 8 characters"),
+	TEST(test_obj_alloc,			"boxed object construction"),
+	TEST(test_obj_set_get_istr,		"boxed object storage with immediate keys"),
+	TEST(test_obj_set_get_bstr,		"boxed object storage with boxed keys"),
+	TEST(test_obj_set_get_canon,		"boxed object storage with short boxed keys"),
+	TEST(test_obj_set_replace,		"boxed object value replacement"),
+	TEST(test_obj_get_missing,		"boxed object missing key lookup"),
+	TEST(test_obj_del,			"boxed object key removal"),
+	TEST(test_obj_del_missing,		"boxed object missing key removal"),
+	TEST(test_obj_del_reinsert,		"boxed object key reinsertion after removal"),
+	TEST(test_obj_set_get_65536,		"boxed object storage with 65536 keys"),
+	TEST(test_obj_next,			"boxed object iteration"),
+	TEST(test_obj_seal_0,			"sealed empty boxed object lookup"),
+	TEST(test_obj_seal_1,			"sealed boxed object lookup with 1 key"),
+	TEST(test_obj_seal_8,			"sealed boxed object lookup with 8 keys"),
+	TEST(test_obj_seal_1000,		"sealed boxed object lookup with 1000 keys"),
+	TEST(test_obj_seal_65536,		"sealed boxed object lookup with 65536 keys"),
+	TEST(test_obj_seal_missing,		"sealed boxed object missing key lookup"),
+	TEST(test_obj_seal_set,			"sealed boxed object modification"),
+	TEST(test_obj_seal_del,			"sealed boxed object key removal"),
+	TEST(test_obj_release_nested,		"recursive release of boxed objects"),
+	TEST(test_freeze_obj,			"boxed object freezing"),
+#ifdef J64_REFCOUNT
+	TEST(test_obj_unshare_shared,		"shared boxed object copy-on-write"),
+#endif /* J64_REFCOUNT */
+
+	TEST(test_path_pointer,			"JSON Pointer path lookup"),
+	TEST(test_path_pointer_escape,		"JSON Pointer path lookup with escapes"),
+	TEST(test_path_dotted,			"dotted path lookup"),
+	TEST(test_path_root,			"empty path lookup"),
+	TEST(test_path_missing,			"path lookup with missing steps"),
+	TEST(test_path_sealed,			"path lookup in sealed boxed objects"),
+	TEST(test_path_invalid,			"invalid path compilation"),
+	TEST(test_path_oom,			"path compilation out of memory"),
+
+	TEST(test_decode_lit,			"literal decoding"),
+	TEST(test_decode_int,			"integer decoding"),
+	TEST(test_decode_float,			"floating-point decoding"),
+	TEST(test_decode_str,			"string decoding"),
+	TEST(test_decode_str_esc,		"string decoding with escapes"),
+	TEST(test_decode_str_surrogate,		"string decoding with unpaired surrogates"),
+	TEST(test_decode_arr,			"array decoding"),
+	TEST(test_decode_obj,			"object decoding"),
+	TEST(test_decode_obj_dup,		"object decoding with duplicate keys"),
+	TEST(test_decode_deep,			"deeply nested array decoding"),
+	TEST(test_decode_invalid,		"invalid JSON text decoding"),
+	TEST(test_project_fields,		"projection of selected fields"),
+	TEST(test_project_overlap,		"projection with overlapping paths"),
+	TEST(test_project_esc_key,		"projection with escaped keys"),
+	TEST(test_project_invalid,		"projection of invalid JSON text"),
+	TEST(test_project_dup,			"projection with duplicate keys"),
+
+	TEST(test_reader_tokens,		"pull reader token sequence"),
+	TEST(test_reader_raw,			"pull reader raw token access"),
+	TEST(test_reader_skip,			"pull reader container skipping"),
+	TEST(test_reader_invalid,		"pull reader syntax errors"),
+	TEST(test_parse_sum,			"push parser aggregation"),
+	TEST(test_parse_stop,			"push parser early stop"),
+
+	TEST(test_parser_chunks,		"incremental parsing in chunks of any size"),
+	TEST(test_parser_split,			"incremental parsing with tokens split at every byte"),
+	TEST(test_parser_num,			"incremental parsing of numbers at chunk ends"),
+	TEST(test_parser_long_str,		"incremental parsing of a long string byte by byte"),
+	TEST(test_parser_invalid,		"incremental parsing of invalid input"),
+
+	TEST(test_int_encode,			"integer encoding"),
+	TEST(test_float_encode,			"floating-point encoding"),
+	TEST(test_str_encode,			"string encoding with escapes"),
+	TEST(test_encode_tree,			"nested value encoding"),
+	TEST(test_encode_roundtrip,		"decoding of encoded values"),
+	TEST(test_writer_stream,		"streaming writer with a small buffer"),
+	TEST(test_writer_flush_fail,		"streaming writer flush failure"),
+	TEST(test_cache_drop,			"encoding cache drop on any value"),
+	TEST(test_validate,			"validation of well-formed and malformed texts"),
+	TEST(test_validate_depth,		"validation depth limits"),
+	TEST(test_validate_utf8,		"validation of UTF-8 in strings"),
+	TEST(test_decode_batch,			"batch decoding"),
+	TEST(test_decode_batch_deep,		"batch decoding of deep texts"),
+	TEST(test_iter_order,			"depth-first iteration order"),
+	TEST(test_iter_deep,			"depth-first iteration of deep trees"),
+	TEST(test_clone_doc,			"cloning of a document"),
+	TEST(test_clone_seg,			"cloning of a segmented array"),
+	TEST(test_clone_alloc,			"cloning with a custom allocator"),
+	TEST(test_stats_counts,			"tree statistics"),
+	TEST(test_stats_frozen,			"tree statistics of frozen documents"),
+	TEST(test_diff_roundtrip,		"diffs applied as patches"),
+	TEST(test_diff_ops,			"diff operations"),
+	TEST(test_diff_unset,			"diffs of unset array elements"),
+	TEST(test_patch_apply,			"JSON Patch operations"),
+	TEST(test_patch_move,			"JSON Patch moves that fail"),
+	TEST(test_patch_oom,			"JSON Patch out of memory"),
+	TEST(test_merge_patch_rfc,		"merge patches from RFC 7396"),
+	TEST(test_merge_patch_in_place,		"merge patches applied in place"),
+	TEST(test_canonical_keys,		"canonical encoding sorts keys"),
+	TEST(test_canonical_numbers,		"canonical encoding of numbers"),
+	TEST(test_canonical_strings,		"canonical encoding of strings"),
+	TEST(test_cbor,				"CBOR encoding and decoding"),
+	TEST(test_cbor_tags,			"CBOR decoding of deeply nested tags"),
+	TEST(test_msgpack,			"MessagePack encoding and decoding"),
+	TEST(test_bin_roundtrip,		"binary formats round-trip documents"),
+#ifdef J64_ALLOC_STATS
+	TEST(test_alloc_stats,			"allocation counters"),
+#endif /* J64_ALLOC_STATS */
+#ifdef J64_TRACE
+	TEST(test_trace_phases,			"trace counters"),
+#endif /* J64_TRACE */
+#ifdef J64_ENCODE_CACHE
+	TEST(test_cache_hit,			"encoding from the cache"),
+	TEST(test_cache_small,			"encoding cache size threshold"),
+	TEST(test_cache_barr_set,		"encoding cache invalidation by array setters"),
+	TEST(test_cache_obj_set,		"encoding cache invalidation by object setters"),
+	TEST(test_cache_nested,			"encoding cache invalidation by nested changes"),
+	TEST(test_cache_depth,			"encoding cache depth threshold"),
+#endif /* J64_ENCODE_CACHE */
+#ifdef J64_FILE_IO
+	TEST(test_file_read,			"file reading in chunks"),
+	TEST(test_file_pipe,			"file reading from a pipe"),
+	TEST(test_file_decode,			"file decoding"),
+#endif /* J64_FILE_IO */
+#ifdef J64_GZIP
+	TEST(test_inflate_gzip,			"decoding of gzip files"),
+	TEST(test_inflate_plain,		"decoding of uncompressed files"),
+	TEST(test_inflate_invalid,		"decoding of broken gzip files"),
+	TEST(test_inflate_stop,			"stopping decompression early"),
+#endif /* J64_GZIP */
+#ifdef J64_ZSTD
+	TEST(test_inflate_zstd,			"decoding of zstd files"),
+#endif /* J64_ZSTD */
+
+	TEST(test_shred_cols,			"shredding into typed columns"),
+	TEST(test_shred_dup,			"shredding with duplicate keys"),
+	TEST(test_shred_1000,			"shredding 1000 documents"),
+	TEST(test_shred_invalid,		"shredding of invalid documents"),
+	TEST(test_shred_oom,			"shredding out of memory"),
+
+	TEST(test_const_undef,			"undefined literal constant"),
+	TEST(test_const_null,			"null literal constant"),
+	TEST(test_const_false,			"false literal constant"),
+	TEST(test_const_true,			"true literal constant"),
+	TEST(test_const_bool_false,		"boolean literal constant with false"),
+	TEST(test_const_bool_true,		"boolean literal constant with true"),
+	TEST(test_const_estr,			"empty string literal constant"),
+	TEST(test_const_earr,			"empty array literal constant"),
+	TEST(test_const_eobj,			"empty object literal constant"),
+	TEST(test_const_int_zero,		"zero integer constant"),
+	TEST(test_const_int_one,		"positive integer constant"),
+	TEST(test_const_int_minus_one,		"negative integer constant"),
+	TEST(test_const_int_max,		"maximum integer constant"),
+	TEST(test_const_int_min,		"minimum integer constant"),
+	TEST(test_const_float_one,		"positive floating-point constant"),
+	TEST(test_const_float_neg_half,		"negative floating-point constant"),
+	TEST(test_const_istr_0,			"empty immediate string constant"),
+	TEST(test_const_istr_1,			"immediate string constant with 1 character"),
+	TEST(test_const_istr_7,			"immediate string constant with 7 characters")
 };
 
 #define NTESTS (sizeof(TESTS) / sizeof(TESTS[0]))
@@ -670,3 +1093,3202 @@ MK_BARR_SET_GET_TEST(65536, set)
 MK_BARR_SET_GET_TEST(1, set_free)
 MK_BARR_SET_GET_TEST(8, set_free)
 MK_BARR_SET_GET_TEST(65536, set_free)
+
+#define SEG_CAP (J64_BARR_SEG_MIN + 1)
+
+int
+test_barr_seg_alloc(void)
+{
+	int res;
+	j64_t j = j64_barr_alloc(SEG_CAP);
+	res = j64_is_barr(j);
+	j64_barr_free(j);
+	return res;
+}
+
+int
+test_barr_seg_alloc_cap(void)
+{
+	int res;
+	j64_t j = j64_barr_alloc(SEG_CAP);
+	res = j64_barr_cap(j) == SEG_CAP;
+	j64_barr_free(j);
+	return res;
+}
+
+int
+test_barr_seg_set_get(void)
+{
+	int res = 1;
+	size_t i;
+	j64_t k;
+	j64_t j = j64_barr_alloc(SEG_CAP);
+	for (i = 0; i < SEG_CAP; i++)
+		j64_barr_set(j, j64_int((int64_t)i), i);
+	for (i = 0; i < SEG_CAP; i++) {
+		k = j64_barr_get(j, i);
+		if (!j64_is_int(k) || j64_int_get(k) != (int64_t)i) {
+			res = 0;
+			break;
+		}
+	}
+	j64_barr_free(j);
+	return res;
+}
+
+int
+test_barr_seg_realloc_grow(void)
+{
+	int res = 1;
+	size_t i;
+	j64_t k;
+	j64_t j = j64_barr_alloc(65536);
+	for (i = 0; i < 65536; i++)
+		j64_barr_set(j, j64_int((int64_t)i), i);
+	if (!j64_barr_realloc(&j, SEG_CAP) || j64_barr_cap(j) != SEG_CAP)
+		res = 0;
+	for (i = 0; res && i < SEG_CAP; i++) {
+		k = j64_barr_get(j, i);
+		if (i < 65536 && j64_int_get(k) != (int64_t)i)
+			res = 0;
+		if (65536 <= i && !j64_is_undef(k))
+			res = 0;
+	}
+	j64_barr_free(j);
+	return res;
+}
+
+int
+test_barr_seg_realloc_append(void)
+{
+	int res = 1;
+	size_t i;
+	j64_t j = j64_barr_alloc(SEG_CAP);
+	for (i = SEG_CAP; res && i < SEG_CAP + 2 * J64_BARR_SEG_LEN; i++) {
+		if (!j64_barr_realloc(&j, i + 1))
+			res = 0;
+		else
+			j64_barr_set(j, j64_int((int64_t)i), i);
+	}
+	for (i = SEG_CAP; res && i < SEG_CAP + 2 * J64_BARR_SEG_LEN; i++)
+		if (j64_int_get(j64_barr_get(j, i)) != (int64_t)i)
+			res = 0;
+	j64_barr_free(j);
+	return res;
+}
+
+int
+test_barr_seg_realloc_shrink(void)
+{
+	int res = 1;
+	size_t i;
+	j64_t j = j64_barr_alloc(SEG_CAP);
+	for (i = 0; i < SEG_CAP; i++)
+		j64_barr_set(j, j64_int((int64_t)i), i);
+	res = j64_barr_realloc(&j, 1) && j64_barr_cap(j) == 1;
+	res = res && j64_barr_realloc(&j, SEG_CAP);
+	res = res && j64_int_get(j64_barr_get(j, 0)) == 0;
+	for (i = 1; res && i < SEG_CAP; i++)
+		if (!j64_is_undef(j64_barr_get(j, i)))
+			res = 0;
+	j64_barr_free(j);
+	return res;
+}
+
+int
+test_barr_seg_realloc_oom(void)
+{
+	int res;
+	j64_t j = j64_barr_alloc(SEG_CAP);
+	j64_barr_set(j, j64_int(7), SEG_CAP - 1);
+
+	/* The index moves, then the first new segment fails */
+	alloc_budget = 1;
+	res = !j64_barr_realloc(&j, SEG_CAP + 4 * J64_BARR_SEG_LEN);
+	alloc_budget = -1;
+	res = res && j64_barr_cap(j) == SEG_CAP &&
+	    j64_int_get(j64_barr_get(j, SEG_CAP - 1)) == 7;
+	res = res && j64_barr_realloc(&j, SEG_CAP + 4 * J64_BARR_SEG_LEN) &&
+	    j64_int_get(j64_barr_get(j, SEG_CAP - 1)) == 7 &&
+	    j64_is_undef(j64_barr_get(j, SEG_CAP));
+	j64_barr_free(j);
+	return res;
+}
+
+static J64_STATIC_BSTR(static_bstr, 12) = { J64_STATIC_LEN(12), "hello, world" };
+
+int
+test_bstr_static_len(void)
+{
+	j64_t j = j64_bstr_static(&static_bstr);
+	return j64_is_bstr(j) && j64_bstr_len(j) == 12;
+}
+
+int
+test_bstr_static_get(void)
+{
+	char buf[12];
+	j64_t j = j64_bstr_static(&static_bstr);
+	return j64_bstr_get(j, buf, sizeof(buf)) == 12 &&
+	    memcmp(buf, "hello, world", 12) == 0;
+}
+
+int
+test_bstr_static_free(void)
+{
+	j64_t j = j64_bstr_static(&static_bstr);
+	j64_free(j);
+	return j64_bstr_len(j) == 12;
+}
+
+static J64_STATIC_BARR(static_barr, 3) = {
+	J64_STATIC_CAP(3), { { J64_INT_W(80) }, { J64_TRUE_W }, { J64_NULL_W } }
+};
+
+int
+test_barr_static_cap(void)
+{
+	j64_t j = j64_barr_static(&static_barr);
+	return j64_is_barr(j) && j64_barr_cap(j) == 3;
+}
+
+int
+test_barr_static_get(void)
+{
+	j64_t j = j64_barr_static(&static_barr);
+	return j64_int_get(j64_barr_get(j, 0)) == 80 &&
+	    j64_is_true(j64_barr_get(j, 1)) &&
+	    j64_is_null(j64_barr_get(j, 2));
+}
+
+int
+test_barr_static_realloc(void)
+{
+	j64_t j = j64_barr_static(&static_barr);
+	return !j64_barr_realloc(&j, 4) && j64_barr_cap(j) == 3;
+}
+
+int
+test_barr_static_free(void)
+{
+	j64_t j = j64_barr_static(&static_barr);
+	j64_free(j);
+	return j64_barr_cap(j) == 3;
+}
+
+static J64_STATIC_OBJ(static_obj, 3) = {
+	J64_STATIC_OBJ_HDR(3), {
+		{ J64_ISTR_W(4, 'p', 'o', 'r', 't', 0, 0, 0) }, { J64_INT_W(80) },
+		{ J64_ISTR_W(3, 't', 'l', 's', 0, 0, 0, 0) }, { J64_TRUE_W },
+		{ J64_ESTR_W }, { J64_NULL_W }
+	}
+};
+
+int
+test_obj_static_len(void)
+{
+	j64_t j = j64_obj_static(&static_obj);
+	return j64_is_obj(j) && j64_obj_len(j) == 3 && j64_obj_is_sealed(j);
+}
+
+int
+test_obj_static_get(void)
+{
+	j64_t j = j64_obj_static(&static_obj);
+	j64_t key = j64_str("a long key", 10);
+	int res;
+
+	res = j64_int_get(j64_obj_get(j, j64_str("port", 4))) == 80 &&
+	    j64_is_true(j64_obj_get(j, j64_str("tls", 3))) &&
+	    j64_is_null(j64_obj_get(j, j64_estr())) &&
+	    j64_is_undef(j64_obj_get(j, j64_str("host", 4))) &&
+	    j64_is_undef(j64_obj_get(j, key));
+	j64_free(key);
+	return res;
+}
+
+int
+test_obj_static_next(void)
+{
+	j64_t j = j64_obj_static(&static_obj);
+	j64_t k, v;
+	size_t i = 0;
+	int res;
+
+	res = j64_obj_next(j, &i, &k, &v) && k.w == static_obj.buf[0].w &&
+	    j64_int_get(v) == 80;
+	res = res && j64_obj_next(j, &i, &k, &v) && k.w == static_obj.buf[2].w;
+	res = res && j64_obj_next(j, &i, &k, &v) && k.w == static_obj.buf[4].w;
+	return res && !j64_obj_next(j, &i, &k, &v);
+}
+
+int
+test_obj_static_set(void)
+{
+	j64_t s = j64_obj_static(&static_obj);
+	j64_t j = s;
+	int res;
+
+	res = j64_obj_set(&j, j64_str("port", 4), j64_int(8080)) &&
+	    j.w != s.w && !j64_obj_is_sealed(j) && j64_obj_len(j) == 3;
+	res = res && j64_int_get(j64_obj_get(j, j64_str("port", 4))) == 8080 &&
+	    j64_is_true(j64_obj_get(j, j64_str("tls", 3)));
+	res = res && j64_int_get(j64_obj_get(s, j64_str("port", 4))) == 80;
+	j64_release(j);
+	return res;
+}
+
+int
+test_obj_static_free(void)
+{
+	j64_t j = j64_obj_static(&static_obj);
+	j64_free(j);
+	j64_release(j);
+	return j64_obj_len(j) == 3;
+}
+
+#define MK_CONST_TEST(NAME, W, J)						\
+int										\
+test_const_ ## NAME(void)							\
+{										\
+	static const j64_t k = { W };						\
+	return k.w == (J).w;							\
+}
+
+MK_CONST_TEST(undef, J64_UNDEF_W, j64_undef())
+MK_CONST_TEST(null, J64_NULL_W, j64_null())
+MK_CONST_TEST(false, J64_FALSE_W, j64_false())
+MK_CONST_TEST(true, J64_TRUE_W, j64_true())
+MK_CONST_TEST(bool_false, J64_BOOL_W(0), j64_bool(0))
+MK_CONST_TEST(bool_true, J64_BOOL_W(1), j64_bool(1))
+MK_CONST_TEST(estr, J64_ESTR_W, j64_estr())
+MK_CONST_TEST(earr, J64_EARR_W, j64_earr())
+MK_CONST_TEST(eobj, J64_EOBJ_W, j64_eobj())
+MK_CONST_TEST(int_zero, J64_INT_W(0), j64_int(0))
+MK_CONST_TEST(int_one, J64_INT_W(1), j64_int(1))
+MK_CONST_TEST(int_minus_one, J64_INT_W(-1), j64_int(-1))
+MK_CONST_TEST(int_max, J64_INT_W(J64_INT_MAX), j64_int(J64_INT_MAX))
+MK_CONST_TEST(int_min, J64_INT_W(J64_INT_MIN), j64_int(J64_INT_MIN))
+MK_CONST_TEST(float_one, J64_FLOAT_BITS_W(0x3ff0000000000000ULL), j64_float(1.0))
+MK_CONST_TEST(float_neg_half, J64_FLOAT_BITS_W(0xbfe0000000000000ULL), j64_float(-0.5))
+MK_CONST_TEST(istr_0, J64_ISTR_W(0, 0, 0, 0, 0, 0, 0, 0), j64_istr("", 0))
+MK_CONST_TEST(istr_1, J64_ISTR_W(1, 'a', 0, 0, 0, 0, 0, 0), j64_istr("a", 1))
+MK_CONST_TEST(istr_7, J64_ISTR_W(7, 'a', 'b', 'c', 'd', 'e', 'f', 'g'), j64_istr("abcdefg", 7))
+
+/*
+ * Recursive release and sharing tests
+ */
+
+static j64_t
+mk_nested(void)
+{
+	j64_t j = j64_barr_alloc(2);
+	j64_t k = j64_barr_alloc(1);
+	j64_barr_set(k, j64_bstr("nested boxed string", 19), 0);
+	j64_barr_set(j, k, 0);
+	j64_barr_set(j, j64_bstr("boxed string", 12), 1);
+	return j;
+}
+
+int
+test_release_nested(void)
+{
+	j64_t j = mk_nested();
+	j64_release(j);
+	return 1;
+}
+
+int
+test_barr_unshare_unique(void)
+{
+	int res;
+	j64_t j = j64_barr_alloc(1);
+	j64_t k = j;
+	res = j64_barr_unshare(&j) && j.w == k.w && !j64_is_shared(j);
+	j64_barr_free(j);
+	return res;
+}
+
+int
+test_barr_unshare_static(void)
+{
+	int res;
+	j64_t j = j64_barr_static(&static_barr);
+	res = j64_barr_unshare(&j) && j.w != j64_barr_static(&static_barr).w;
+	res = res && j64_barr_cap(j) == 3 && j64_int_get(j64_barr_get(j, 0)) == 80;
+	res = res && j64_barr_realloc(&j, 4) && j64_barr_cap(j) == 4;
+	j64_barr_free(j);
+	return res;
+}
+
+#ifdef J64_REFCOUNT
+int
+test_retain_shared(void)
+{
+	int res;
+	j64_t j = j64_bstr("boxed string", 12);
+	res = !j64_is_shared(j);
+	res = res && j64_retain(j).w == j.w && j64_is_shared(j);
+	j64_release(j);
+	res = res && !j64_is_shared(j);
+	j64_release(j);
+	return res && !j64_is_shared(j64_int(1));
+}
+
+int
+test_release_shared(void)
+{
+	int res;
+	j64_t j = mk_nested();
+	j64_t k = j64_retain(j);
+	j64_release(j);
+	res = j64_bstr_len(j64_barr_get(k, 1)) == 12;
+	j64_release(k);
+	return res;
+}
+
+int
+test_barr_unshare_shared(void)
+{
+	int res;
+	j64_t base = mk_nested();
+	j64_t copy = j64_retain(base);
+	res = j64_barr_unshare(&copy) && copy.w != base.w;
+	res = res && !j64_is_shared(base) && !j64_is_shared(copy);
+	res = res && j64_is_shared(j64_barr_get(copy, 1));
+	j64_barr_set_free(copy, j64_int(1), 1);
+	res = res && j64_bstr_len(j64_barr_get(base, 1)) == 12;
+	res = res && !j64_is_shared(j64_barr_get(base, 1));
+	j64_release(copy);
+	j64_release(base);
+	return res;
+}
+
+int
+test_barr_unshare_nested(void)
+{
+	int res;
+	j64_t base = mk_nested();
+	j64_t copy = j64_retain(base);
+	j64_t child;
+	res = j64_barr_unshare(&copy);
+	child = j64_barr_get(copy, 0);
+	res = res && j64_barr_unshare(&child);
+	j64_barr_set(copy, child, 0);
+	j64_barr_set_free(child, j64_int(2), 0);
+	res = res && j64_int_get(j64_barr_get(j64_barr_get(copy, 0), 0)) == 2;
+	res = res && j64_is_bstr(j64_barr_get(j64_barr_get(base, 0), 0));
+	j64_release(copy);
+	j64_release(base);
+	return res;
+}
+
+int
+test_barr_realloc_shared(void)
+{
+	int res;
+	j64_t base = mk_nested();
+	j64_t copy = j64_retain(base);
+	res = j64_barr_realloc(&copy, 3) && copy.w != base.w;
+	res = res && j64_barr_cap(base) == 2 && j64_barr_cap(copy) == 3;
+	j64_release(copy);
+	j64_release(base);
+	return res;
+}
+
+int
+test_barr_realloc_shared_shrink(void)
+{
+	int res;
+	j64_t base = mk_nested();
+	j64_t copy = j64_retain(base);
+	res = j64_barr_realloc(&copy, 1) && copy.w != base.w;
+	res = res && j64_barr_cap(base) == 2 && j64_barr_cap(copy) == 1;
+	res = res && j64_is_shared(j64_barr_get(base, 0)) &&
+	    !j64_is_shared(j64_barr_get(base, 1));
+	j64_release(copy);
+	j64_release(base);
+	return res;
+}
+#endif /* J64_REFCOUNT */
+
+/*
+ * Frozen document tests
+ */
+
+int
+test_freeze_imm(void)
+{
+	j64_t j = j64_int(7);
+	j64_t k = j64_freeze(j);
+	j64_frozen_free(k);
+	return j.w == k.w;
+}
+
+int
+test_freeze_nested(void)
+{
+	int res;
+	char buf[19];
+	j64_t j = mk_nested();
+	j64_t k = j64_freeze(j);
+	j64_t l;
+	j64_release(j);
+	res = j64_is_barr(k) && j64_barr_cap(k) == 2;
+	l = j64_barr_get(k, 0);
+	res = res && j64_is_barr(l) && j64_barr_cap(l) == 1;
+	res = res && j64_bstr_get(j64_barr_get(l, 0), buf, sizeof(buf)) == 19;
+	res = res && memcmp(buf, "nested boxed string", 19) == 0;
+	res = res && j64_bstr_len(j64_barr_get(k, 1)) == 12;
+	j64_frozen_free(k);
+	return res;
+}
+
+int
+test_freeze_static(void)
+{
+	int res;
+	j64_t j = mk_nested();
+	j64_t k = j64_freeze(j);
+	j64_release(j);
+	res = !j64_barr_realloc(&k, 3) && !j64_is_shared(k);
+	j64_release(k);
+	j64_free(j64_barr_get(k, 1));
+	res = res && j64_bstr_len(j64_barr_get(k, 1)) == 12;
+	j64_frozen_free(k);
+	return res;
+}
+
+int
+test_freeze_seg(void)
+{
+	int res = 1;
+	size_t i;
+	j64_t j = j64_barr_alloc(SEG_CAP);
+	j64_t k;
+	for (i = 0; i < SEG_CAP; i++)
+		j64_barr_set(j, j64_int((int64_t)i), i);
+	k = j64_freeze(j);
+	j64_barr_free(j);
+	res = j64_barr_cap(k) == SEG_CAP;
+	for (i = 0; res && i < SEG_CAP; i++)
+		if (j64_int_get(j64_barr_get(k, i)) != (int64_t)i)
+			res = 0;
+	j64_frozen_free(k);
+	return res;
+}
+
+int
+test_freeze_unshare(void)
+{
+	int res;
+	j64_t j = mk_nested();
+	j64_t k = j64_freeze(j);
+	j64_t l = k;
+	j64_release(j);
+	res = j64_barr_unshare(&l) && l.w != k.w;
+	j64_barr_set(l, j64_int(1), 1);
+	res = res && j64_bstr_len(j64_barr_get(k, 1)) == 12;
+	j64_barr_free(l);
+	j64_frozen_free(k);
+	return res;
+}
+
+int
+test_frozen_swap(void)
+{
+	int res;
+	j64_t slot = J64__INIT;
+	j64_t j = mk_nested();
+	j64_t k = j64_freeze(j);
+	j64_t old;
+	j64_release(j);
+	old = j64_frozen_swap(&slot, k);
+	res = j64_is_undef(old) && j64_frozen_load(&slot).w == k.w;
+	old = j64_frozen_swap(&slot, j64_null());
+	res = res && old.w == k.w && j64_is_null(j64_frozen_load(&slot));
+	j64_frozen_free(old);
+	return res;
+}
+
+/*
+ * String and object tests
+ */
+
+#define MK_STR_TEST(LEN, TYPE)							\
+int										\
+test_str_ ## LEN(void)								\
+{										\
+	int res;								\
+	j64_t j = j64_str("abcdefgh", LEN);					\
+	res = j64_is_ ## TYPE(j) && j64_str_len(j) == LEN &&			\
+	    memcmp(j64_str_ptr(&j), "abcdefgh", LEN) == 0;			\
+	j64_free(j);								\
+	return res;								\
+}
+
+MK_STR_TEST(0, estr)
+MK_STR_TEST(7, istr)
+MK_STR_TEST(8, bstr)
+
+/* Makes the I:th test key, immediate or boxed depending on I */
+static j64_t
+mk_key(size_t i)
+{
+	char buf[32];
+	sprintf(buf, i % 2 ? "k%lu" : "a longer key %lu", (unsigned long)i);
+	return j64_str(buf, strlen(buf));
+}
+
+static j64_t
+mk_obj(size_t n)
+{
+	size_t i;
+	j64_t j = j64_obj_alloc(0);
+	for (i = 0; i < n; i++)
+		j64_obj_set(&j, mk_key(i), j64_int((int64_t)i));
+	return j;
+}
+
+/* Checks that the first N test keys map to their index */
+static int
+check_keys(j64_t j, size_t n)
+{
+	int res = 1;
+	size_t i;
+	j64_t k;
+	for (i = 0; res && i < n; i++) {
+		k = mk_key(i);
+		if (j64_int_get(j64_obj_get(j, k)) != (int64_t)i)
+			res = 0;
+		j64_free(k);
+	}
+	return res;
+}
+
+static int
+check_obj(j64_t j, size_t n)
+{
+	return j64_obj_len(j) == n && check_keys(j, n);
+}
+
+int
+test_obj_alloc(void)
+{
+	int res;
+	j64_t j = j64_obj_alloc(8);
+	res = j64_is_obj(j) && j64_obj_len(j) == 0 && !j64_obj_is_sealed(j);
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_set_get_istr(void)
+{
+	int res;
+	j64_t j = j64_obj_alloc(0);
+	res = j64_obj_set(&j, j64_istr("id", 2), j64_int(1));
+	res = res && j64_obj_set(&j, j64_istr("name", 4), j64_true());
+	res = res && j64_int_get(j64_obj_get(j, j64_istr("id", 2))) == 1;
+	res = res && j64_is_true(j64_obj_get(j, j64_istr("name", 4)));
+	res = res && j64_obj_len(j) == 2;
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_set_get_bstr(void)
+{
+	int res;
+	j64_t j = j64_obj_alloc(0);
+	j64_t k = j64_bstr("a boxed key", 11);
+	res = j64_obj_set(&j, j64_bstr("a boxed key", 11), j64_int(1));
+	res = res && j64_int_get(j64_obj_get(j, k)) == 1;
+	j64_bstr_free(k);
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_set_get_canon(void)
+{
+	int res;
+	j64_t j = j64_obj_alloc(0);
+	res = j64_obj_set(&j, j64_bstr("id", 2), j64_int(1));
+	res = res && j64_int_get(j64_obj_get(j, j64_istr("id", 2))) == 1;
+	res = res && j64_obj_set(&j, j64_bstr("", 0), j64_int(2));
+	res = res && j64_int_get(j64_obj_get(j, j64_estr())) == 2;
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_set_replace(void)
+{
+	int res;
+	j64_t k;
+	j64_t j = j64_obj_alloc(0);
+	res = j64_obj_set(&j, mk_key(0), j64_int(1));
+	res = res && j64_obj_set_free(&j, mk_key(0), j64_bstr("a boxed string", 14));
+	res = res && j64_obj_set_free(&j, mk_key(0), j64_int(3));
+	k = mk_key(0);
+	res = res && j64_obj_len(j) == 1 && j64_int_get(j64_obj_get(j, k)) == 3;
+	j64_free(k);
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_get_missing(void)
+{
+	int res;
+	j64_t j = mk_obj(8);
+	res = j64_is_undef(j64_obj_get(j, j64_istr("missing", 7)));
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_del(void)
+{
+	int res = 1;
+	size_t i;
+	j64_t k;
+	j64_t j = mk_obj(64);
+	for (i = 0; i < 64; i += 2) {
+		k = mk_key(i);
+		if (j64_int_get(j64_obj_del(&j, k)) != (int64_t)i)
+			res = 0;
+		j64_free(k);
+	}
+	res = res && j64_obj_len(j) == 32;
+	for (i = 0; res && i < 64; i++) {
+		k = mk_key(i);
+		if (j64_is_undef(j64_obj_get(j, k)) != (i % 2 == 0))
+			res = 0;
+		j64_free(k);
+	}
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_del_missing(void)
+{
+	int res;
+	j64_t j = mk_obj(8);
+	res = j64_is_undef(j64_obj_del(&j, j64_istr("missing", 7)));
+	res = res && j64_obj_len(j) == 8;
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_del_reinsert(void)
+{
+	int res = 1;
+	size_t i, n;
+	j64_t k;
+	j64_t j = mk_obj(8);
+	for (n = 0; n < 1000; n++) {
+		for (i = 0; i < 8; i++) {
+			k = mk_key(i);
+			j64_obj_del(&j, k);
+			j64_free(k);
+		}
+		for (i = 0; i < 8; i++)
+			j64_obj_set(&j, mk_key(i), j64_int((int64_t)i));
+	}
+	res = check_obj(j, 8) && J64__OBJ_CAP(J64__OBJ_HDR(j)) <= 16;
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_set_get_65536(void)
+{
+	int res;
+	j64_t j = mk_obj(65536);
+	res = check_obj(j, 65536);
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_next(void)
+{
+	int res = 1;
+	size_t i, n = 0;
+	int64_t sum = 0;
+	j64_t k, v;
+	j64_t j = mk_obj(100);
+	for (i = 0; j64_obj_next(j, &i, &k, &v); n++) {
+		if (!j64_is_str(k))
+			res = 0;
+		sum += j64_int_get(v);
+	}
+	j64_obj_free(j);
+	return res && n == 100 && sum == 4950;
+}
+
+#define MK_OBJ_SEAL_TEST(N)							\
+int										\
+test_obj_seal_ ## N(void)							\
+{										\
+	int res;								\
+	j64_t j = mk_obj(N);							\
+	res = j64_obj_seal(&j) && j64_obj_is_sealed(j);				\
+	res = res && check_obj(j, N);						\
+	j64_obj_free(j);							\
+	return res;								\
+}
+
+MK_OBJ_SEAL_TEST(0)
+MK_OBJ_SEAL_TEST(1)
+MK_OBJ_SEAL_TEST(8)
+MK_OBJ_SEAL_TEST(1000)
+MK_OBJ_SEAL_TEST(65536)
+
+int
+test_obj_seal_missing(void)
+{
+	int res = 1;
+	size_t i;
+	j64_t k;
+	j64_t j = mk_obj(1000);
+	j64_obj_seal(&j);
+	for (i = 1000; res && i < 2000; i++) {
+		k = mk_key(i);
+		if (!j64_is_undef(j64_obj_get(j, k)))
+			res = 0;
+		j64_free(k);
+	}
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_seal_set(void)
+{
+	int res;
+	j64_t j = mk_obj(100);
+	res = j64_obj_seal(&j);
+	res = res && j64_obj_set(&j, mk_key(100), j64_int(100));
+	res = res && !j64_obj_is_sealed(j) && check_obj(j, 101);
+	j64_obj_free(j);
+	return res;
+}
+
+int
+test_obj_seal_del(void)
+{
+	int res;
+	j64_t j = mk_obj(100);
+	j64_t k = mk_key(99);
+	res = j64_obj_seal(&j);
+	res = res && j64_int_get(j64_obj_del(&j, k)) == 99;
+	res = res && !j64_obj_is_sealed(j) && check_obj(j, 99);
+	j64_free(k);
+	j64_obj_free(j);
+	return res;
+}
+
+static j64_t
+mk_nested_obj(void)
+{
+	j64_t j = j64_obj_alloc(0);
+	j64_t k = mk_obj(10);
+	j64_obj_set(&k, j64_str("boxed value", 11), j64_str("a boxed string", 14));
+	j64_obj_set(&j, j64_str("child", 5), k);
+	j64_obj_set(&j, j64_str("array", 5), mk_nested());
+	j64_obj_set(&j, j64_str("a boxed key", 11), j64_null());
+	return j;
+}
+
+int
+test_obj_release_nested(void)
+{
+	j64_t j = mk_nested_obj();
+	j64_obj_seal(&j);
+	j64_release(j);
+	return 1;
+}
+
+int
+test_freeze_obj(void)
+{
+	int res;
+	j64_t j = mk_nested_obj();
+	j64_t k = j64_freeze(j);
+	j64_t key = j64_str("a boxed key", 11);
+	j64_t child;
+	j64_release(j);
+	res = j64_is_obj(k) && j64_obj_is_sealed(k) && j64_obj_len(k) == 3;
+	res = res && j64_is_null(j64_obj_get(k, key));
+	j64_free(key);
+	res = res && j64_barr_cap(j64_obj_get(k, j64_istr("array", 5))) == 2;
+	child = j64_obj_get(k, j64_istr("child", 5));
+	res = res && j64_obj_is_sealed(child) && j64_obj_len(child) == 11;
+	res = res && check_keys(child, 10);
+	res = res && j64_obj_unshare(&child) && !j64_obj_is_sealed(child);
+	res = res && j64_obj_set(&child, mk_key(10), j64_int(10));
+	res = res && j64_obj_len(child) == 12 && check_keys(child, 11);
+	j64_obj_free(child);
+	j64_frozen_free(k);
+	return res;
+}
+
+#ifdef J64_REFCOUNT
+int
+test_obj_unshare_shared(void)
+{
+	int res;
+	j64_t base = mk_nested_obj();
+	j64_t copy = j64_retain(base);
+	j64_t key = j64_str("a boxed key", 11);
+	res = j64_obj_set_free(&copy, j64_retain(key), j64_int(1));
+	res = res && copy.w != base.w && !j64_is_shared(base);
+	res = res && j64_is_null(j64_obj_get(base, key));
+	res = res && j64_int_get(j64_obj_get(copy, key)) == 1;
+	j64_release(key);
+	res = res && j64_is_shared(j64_obj_get(copy, j64_istr("child", 5)));
+	j64_release(copy);
+	j64_release(base);
+	return res;
+}
+#endif /* J64_REFCOUNT */
+
+/*
+ * Compiled path tests
+ */
+
+/* Compiles and evaluates a path in one go */
+static j64_t
+path_get(j64_t j, const char *s)
+{
+	struct j64_path *path = j64_path_compile(s, strlen(s));
+	j64_t v;
+	if (path == NULL)
+		return j64_undef();
+	v = j64_path_get(path, j);
+	j64_path_free(path);
+	return v;
+}
+
+static int
+path_is_bstr(j64_t j, const char *s, const char *str)
+{
+	j64_t v = path_get(j, s);
+	return j64_is_bstr(v) && j64_bstr_len(v) == strlen(str) &&
+	    memcmp(j64_str_ptr(&v), str, strlen(str)) == 0;
+}
+
+int
+test_path_pointer(void)
+{
+	int res;
+	j64_t j = mk_nested_obj();
+	res = j64_int_get(path_get(j, "/child/k3")) == 3;
+	res = res && j64_int_get(path_get(j, "/child/a longer key 4")) == 4;
+	res = res && j64_is_null(path_get(j, "/a boxed key"));
+	res = res && path_is_bstr(j, "/child/boxed value", "a boxed string");
+	res = res && path_is_bstr(j, "/array/0/0", "nested boxed string");
+	res = res && path_is_bstr(j, "/array/1", "boxed string");
+	j64_release(j);
+	return res;
+}
+
+int
+test_path_pointer_escape(void)
+{
+	int res;
+	struct j64_path *path = j64_path_compile("/a~1b~0c/", 9);
+	j64_t j = j64_obj_alloc(0);
+	j64_t k = j64_obj_alloc(0);
+	j64_obj_set(&k, j64_estr(), j64_int(7));
+	j64_obj_set(&j, j64_str("a/b~c", 5), k);
+	res = path != NULL && j64_path_len(path) == 2;
+	res = res && j64_int_get(j64_path_get(path, j)) == 7;
+	j64_path_free(path);
+	j64_release(j);
+	return res;
+}
+
+int
+test_path_dotted(void)
+{
+	int res;
+	j64_t j = mk_nested_obj();
+	res = j64_int_get(path_get(j, "child.k5")) == 5;
+	res = res && j64_int_get(path_get(j, "child.a longer key 8")) == 8;
+	res = res && path_is_bstr(j, "array.0.0", "nested boxed string");
+	res = res && path_is_bstr(j, "array.1", "boxed string");
+	j64_release(j);
+	return res;
+}
+
+int
+test_path_root(void)
+{
+	int res;
+	struct j64_path *path = j64_path_compile("", 0);
+	j64_t j = mk_nested();
+	res = path != NULL && j64_path_len(path) == 0;
+	res = res && j64_path_get(path, j).w == j.w;
+	j64_path_free(path);
+	j64_release(j);
+	return res;
+}
+
+int
+test_path_missing(void)
+{
+	int res;
+	j64_t j = mk_nested_obj();
+	res = j64_is_undef(path_get(j, "/child/k4"));
+	res = res && j64_is_undef(path_get(j, "/array/2"));
+	res = res && j64_is_undef(path_get(j, "/array/01"));
+	res = res && j64_is_undef(path_get(j, "/array/-"));
+	res = res && j64_is_undef(path_get(j, "/array/99999999999999999999999"));
+	res = res && j64_is_undef(path_get(j, "/child/k3/0"));
+	res = res && j64_is_undef(path_get(j, "/a boxed key/x"));
+	res = res && j64_is_undef(path_get(j, "/"));
+	j64_release(j);
+	return res;
+}
+
+int
+test_path_sealed(void)
+{
+	int res;
+	j64_t j = mk_nested_obj();
+	j64_t k = j64_freeze(j);
+	j64_release(j);
+	res = j64_int_get(path_get(k, "/child/k3")) == 3;
+	res = res && j64_int_get(path_get(k, "child.a longer key 4")) == 4;
+	res = res && path_is_bstr(k, "/array/0/0", "nested boxed string");
+	res = res && j64_is_undef(path_get(k, "/child/k4"));
+	j64_frozen_free(k);
+	return res;
+}
+
+int
+test_path_invalid(void)
+{
+	return j64_path_compile("/a~2", 4) == NULL &&
+	    j64_path_compile("/a~", 3) == NULL &&
+	    j64_path_compile("a..b", 4) == NULL &&
+	    j64_path_compile(".a", 2) == NULL &&
+	    j64_path_compile("a.", 2) == NULL;
+}
+
+int
+test_path_oom(void)
+{
+	struct j64_path *path;
+
+	/* The path allocation succeeds and the scratch buffer fails */
+	alloc_budget = 1;
+	path = j64_path_compile("/a/b", 4);
+	alloc_budget = -1;
+	return path == NULL;
+}
+
+/*
+ * Decoding tests
+ */
+
+static j64_t
+decode(const char *s)
+{
+	return j64_decode(s, strlen(s));
+}
+
+static int
+is_str(j64_t j, const char *buf, size_t len)
+{
+	return j64_is_str(j) && j64_str_len(j) == len &&
+	    memcmp(j64_str_ptr(&j), buf, len) == 0;
+}
+
+int
+test_decode_lit(void)
+{
+	return j64_is_null(decode("null")) &&
+	    j64_is_true(decode(" true ")) &&
+	    j64_is_false(decode("\r\n\tfalse"));
+}
+
+int
+test_decode_int(void)
+{
+	j64_t j = decode("2305843009213693952");
+	return j64_int_get(decode("0")) == 0 &&
+	    j64_int_get(decode("-12")) == -12 &&
+	    j64_int_get(decode("2305843009213693951")) == J64_INT_MAX &&
+	    j64_int_get(decode("-2305843009213693952")) == J64_INT_MIN &&
+	    j64_is_float(j) && j64_float_get(j) == 2305843009213693952.0 &&
+	    j64_is_float(decode("99999999999999999999"));
+}
+
+int
+test_decode_float(void)
+{
+	return j64_float_get(decode("1.5")) == 1.5 &&
+	    j64_float_get(decode("-2.5e3")) == -2500.0 &&
+	    j64_float_get(decode("0.25E+1")) == 2.5 &&
+	    j64_float_get(decode("4e-1")) > 0.39 &&
+	    j64_float_get(decode("4e-1")) < 0.41;
+}
+
+int
+test_decode_str(void)
+{
+	int res;
+	j64_t j = decode("\"a longer boxed string\"");
+	res = j64_is_bstr(j) && is_str(j, "a longer boxed string", 21);
+	res = res && j64_is_estr(decode("\"\""));
+	res = res && j64_is_istr(decode("\"abc\"")) && is_str(decode("\"abc\""), "abc", 3);
+	j64_free(j);
+	return res;
+}
+
+int
+test_decode_str_esc(void)
+{
+	int res;
+	j64_t j = decode("\"a\\n\\\"b\\/\\u00e9\\ud83d\\ude00\\\\\"");
+	res = is_str(j, "a\n\"b/\xc3\xa9\xf0\x9f\x98\x80\\", 12);
+	j64_free(j);
+	return res && is_str(decode("\"\\t\\u0041\""), "\tA", 2);
+}
+
+int
+test_decode_str_surrogate(void)
+{
+	int res;
+	j64_t j = decode("\"\\ud83dx\\ude00\"");
+	res = is_str(j, "\xef\xbf\xbdx\xef\xbf\xbd", 7);
+	j64_free(j);
+	return res;
+}
+
+int
+test_decode_arr(void)
+{
+	int res;
+	j64_t j = decode("[1, [2, \"a boxed string\"], {}, []]");
+	j64_t k;
+	res = j64_is_earr(decode("[ ]")) && j64_barr_cap(j) == 4;
+	res = res && j64_int_get(j64_barr_get(j, 0)) == 1;
+	k = j64_barr_get(j, 1);
+	res = res && j64_barr_cap(k) == 2 && j64_int_get(j64_barr_get(k, 0)) == 2;
+	res = res && is_str(j64_barr_get(k, 1), "a boxed string", 14);
+	res = res && j64_is_eobj(j64_barr_get(j, 2)) && j64_is_earr(j64_barr_get(j, 3));
+	j64_release(j);
+	return res;
+}
+
+int
+test_decode_obj(void)
+{
+	int res;
+	j64_t j = decode("{\"a\": 1, \"a longer key\": [true], \"c\": {\"d\": null}}");
+	j64_t key = j64_str("a longer key", 12);
+	res = j64_is_eobj(decode("{ }")) && j64_obj_len(j) == 3;
+	res = res && j64_int_get(j64_obj_get(j, j64_istr("a", 1))) == 1;
+	res = res && j64_is_true(j64_barr_get(j64_obj_get(j, key), 0));
+	res = res && j64_is_null(j64_obj_get(j64_obj_get(j, j64_istr("c", 1)), j64_istr("d", 1)));
+	j64_free(key);
+	j64_release(j);
+	return res;
+}
+
+int
+test_decode_obj_dup(void)
+{
+	int res;
+	j64_t j = decode("{\"a long key\": [1], \"b\": 2, \"a long key\": 3}");
+	j64_t key = j64_str("a long key", 10);
+	res = j64_obj_len(j) == 2 && j64_int_get(j64_obj_get(j, key)) == 3;
+	j64_free(key);
+	j64_release(j);
+	return res;
+}
+
+int
+test_decode_deep(void)
+{
+	int res;
+	size_t i, n = 10000;
+	char *buf = malloc(2 * n);
+	j64_t j, k;
+	memset(buf, '[', n);
+	memset(buf + n, ']', n);
+	j = j64_decode(buf, 2 * n);
+	res = j64_is_barr(j);
+	for (i = 0, k = j; res && i < n - 1; i++, k = j64_barr_get(k, 0))
+		res = j64_barr_cap(k) == 1;
+	res = res && j64_is_earr(k);
+	j64_release(j);
+	res = res && j64_is_undef(j64_decode(buf, 2 * n - 1));
+	free(buf);
+	return res;
+}
+
+int
+test_decode_invalid(void)
+{
+	static const char *const texts[] = {
+		"", " ", "[", "]", "[1]]", "[1,]", "[1 2]", "1 2", "{\"a\" 1}",
+		"{\"a\":1,}", "{1:2}", "{\"a\"}", "01", "1.", ".5", "-", "1e",
+		"+1", "tru", "nul", "falsy", "\"abc", "\"\\x\"", "\"a\x01\"",
+		"\"\\u12g4\"", "\"\\u12\"", "[\"a\\\"]"
+	};
+	size_t i;
+	for (i = 0; i < sizeof(texts) / sizeof(texts[0]); i++)
+		if (!j64_is_undef(decode(texts[i])))
+			return 0;
+	return 1;
+}
+
+/*
+ * Projection tests
+ */
+
+static int
+project(const char *s, const char *const *ptrs, size_t n, j64_t *out)
+{
+	struct j64_path *paths[8];
+	size_t i;
+	int res;
+	for (i = 0; i < n; i++)
+		paths[i] = j64_path_compile(ptrs[i], strlen(ptrs[i]));
+	res = j64_project(s, strlen(s), paths, n, out);
+	for (i = 0; i < n; i++)
+		j64_path_free(paths[i]);
+	return res;
+}
+
+int
+test_project_fields(void)
+{
+	static const char *const ptrs[] = {
+		"/b", "/c/d", "/e/1", "/e/2/f", "/missing", "/a/x"
+	};
+	const char *s = "{\"a\": [\"]}\\\"{\", {\"x\": [1, 2]}], \"b\": \"a boxed string\","
+	    " \"c\": {\"z\": 0, \"d\": [1, {}]}, \"e\": [0, 1.5, {\"f\": true}]}";
+	j64_t out[6];
+	int res;
+	size_t i;
+	res = project(s, ptrs, 6, out);
+	res = res && is_str(out[0], "a boxed string", 14);
+	res = res && j64_barr_cap(out[1]) == 2 && j64_is_eobj(j64_barr_get(out[1], 1));
+	res = res && j64_float_get(out[2]) == 1.5 && j64_is_true(out[3]);
+	res = res && j64_is_undef(out[4]) && j64_is_undef(out[5]);
+	for (i = 0; i < 6; i++)
+		j64_release(out[i]);
+	return res;
+}
+
+int
+test_project_overlap(void)
+{
+	static const char *const ptrs[] = { "/a", "", "/a/b", "/a" };
+	const char *s = "{\"a\": {\"b\": [1]}, \"c\": 2}";
+	j64_t out[4];
+	int res;
+	size_t i;
+	res = project(s, ptrs, 4, out);
+	res = res && j64_obj_len(out[0]) == 1 && j64_obj_len(out[1]) == 2;
+	res = res && j64_int_get(j64_barr_get(out[2], 0)) == 1;
+	res = res && j64_obj_len(out[3]) == 1 && out[0].w != out[3].w;
+	for (i = 0; i < 4; i++)
+		j64_release(out[i]);
+	return res;
+}
+
+int
+test_project_esc_key(void)
+{
+	static const char *const ptrs[] = { "/ab/0" };
+	j64_t out[1];
+	return project("{\"a\\u0062\": [7]}", ptrs, 1, out) &&
+	    j64_int_get(out[0]) == 7;
+}
+
+int
+test_project_invalid(void)
+{
+	static const char *const ptrs[] = { "/a" };
+	j64_t out[1];
+	return !project("{\"a\": \"a boxed string\", }", ptrs, 1, out) &&
+	    j64_is_undef(out[0]) &&
+	    !project("{\"b\": [1, 2}", ptrs, 1, out) && j64_is_undef(out[0]);
+}
+
+int
+test_project_dup(void)
+{
+	static const char *const ptrs[] = { "/a", "/b" };
+	const char *s = "{\"a\": \"a boxed string\", \"b\": [1], \"a\": \"another boxed string\","
+	    " \"b\": [2, 3]}";
+	j64_t out[2];
+	int res;
+	res = project(s, ptrs, 2, out);
+	res = res && is_str(out[0], "another boxed string", 20);
+	res = res && j64_barr_cap(out[1]) == 2;
+	j64_release(out[0]);
+	j64_release(out[1]);
+	return res;
+}
+
+/*
+ * Shredding tests
+ */
+
+static const char *const SHRED_PTRS[] = { "/id", "/m/v", "/name" };
+static const int SHRED_TYPES[] = { J64_COL_INT, J64_COL_FLOAT, J64_COL_STR };
+
+static struct j64_path *shred_paths[3];
+
+static int
+shred_init(struct j64_shred *sh)
+{
+	size_t i;
+	for (i = 0; i < 3; i++)
+		shred_paths[i] = j64_path_compile(SHRED_PTRS[i], strlen(SHRED_PTRS[i]));
+	return j64_shred_init(sh, shred_paths, SHRED_TYPES, 3);
+}
+
+static void
+shred_free(struct j64_shred *sh)
+{
+	size_t i;
+	j64_shred_free(sh);
+	for (i = 0; i < 3; i++)
+		j64_path_free(shred_paths[i]);
+}
+
+static int
+col_is_str(const struct j64_col *col, size_t row, const char *str)
+{
+	size_t len;
+	const uint8_t *p = j64_col_str(col, row, &len);
+	return j64_col_is_valid(col, row) && len == strlen(str) &&
+	    memcmp(p, str, len) == 0;
+}
+
+int
+test_shred_cols(void)
+{
+	const char *s =
+	    "{\"id\": 1, \"m\": {\"v\": 1.5}, \"name\": \"first\"}\n"
+	    "\n"
+	    "{\"name\": \"a \\\"quoted\\\" name\", \"id\": 2.5, \"m\": {\"v\": 3}}\n"
+	    "  {\"id\": \"3\", \"m\": [], \"other\": [1, {\"name\": 0}]}\r\n"
+	    "{\"id\": -4, \"m\": {\"v\": null}, \"name\": [\"x\"]}";
+	struct j64_shred sh;
+	int res;
+	res = shred_init(&sh) && j64_shred_feed(&sh, s, strlen(s));
+	res = res && sh.nrows == 4 && sh.cols[0].len == 4 && sh.cols[2].len == 4;
+	res = res && j64_col_is_valid(&sh.cols[0], 0) && sh.cols[0].ints[0] == 1;
+	res = res && !j64_col_is_valid(&sh.cols[0], 1) && sh.cols[0].ints[1] == 0;
+	res = res && !j64_col_is_valid(&sh.cols[0], 2);
+	res = res && j64_col_is_valid(&sh.cols[0], 3) && sh.cols[0].ints[3] == -4;
+	res = res && sh.cols[1].floats[0] == 1.5 && sh.cols[1].floats[1] == 3.0;
+	res = res && !j64_col_is_valid(&sh.cols[1], 2) && !j64_col_is_valid(&sh.cols[1], 3);
+	res = res && col_is_str(&sh.cols[2], 0, "first");
+	res = res && col_is_str(&sh.cols[2], 1, "a \"quoted\" name");
+	res = res && !j64_col_is_valid(&sh.cols[2], 2) && !j64_col_is_valid(&sh.cols[2], 3);
+	shred_free(&sh);
+	return res;
+}
+
+int
+test_shred_dup(void)
+{
+	const char *s = "{\"name\": \"old\", \"id\": 1, \"name\": \"new\", \"id\": true}";
+	struct j64_shred sh;
+	int res;
+	res = shred_init(&sh) && j64_shred_feed(&sh, s, strlen(s));
+	res = res && sh.nrows == 1 && col_is_str(&sh.cols[2], 0, "new");
+	res = res && sh.cols[2].offs[1] == 3 && !j64_col_is_valid(&sh.cols[0], 0);
+	shred_free(&sh);
+	return res;
+}
+
+int
+test_shred_1000(void)
+{
+	char line[64];
+	struct j64_shred sh;
+	size_t i;
+	int res;
+	res = shred_init(&sh);
+	for (i = 0; res && i < 1000; i++) {
+		sprintf(line, "{\"id\": %lu, \"name\": \"row %lu\"}\n", (unsigned long)i, (unsigned long)i);
+		res = j64_shred_feed(&sh, line, strlen(line));
+	}
+	res = res && sh.nrows == 1000;
+	for (i = 0; res && i < 1000; i++) {
+		sprintf(line, "row %lu", (unsigned long)i);
+		res = sh.cols[0].ints[i] == (int64_t)i && col_is_str(&sh.cols[2], i, line);
+		res = res && !j64_col_is_valid(&sh.cols[1], i);
+	}
+	j64_shred_clear(&sh);
+	res = res && sh.nrows == 0 && j64_shred_feed(&sh, "{}", 2) && sh.cols[2].len == 1;
+	shred_free(&sh);
+	return res;
+}
+
+int
+test_shred_invalid(void)
+{
+	const char *s = "{\"id\": 1}\n{\"id\": 2, \"name\": \"x\",}\n{\"id\": 3}\n";
+	struct j64_shred sh;
+	int res;
+	res = shred_init(&sh) && !j64_shred_feed(&sh, s, strlen(s));
+	res = res && sh.nrows == 1 && sh.cols[0].len == 1 && sh.cols[2].len == 1;
+	res = res && j64_shred_feed(&sh, "{\"id\": 3}", 9) && sh.nrows == 2;
+	res = res && sh.cols[0].ints[1] == 3 && sh.cols[2].offs[2] == 0;
+	shred_free(&sh);
+	return res;
+}
+
+int
+test_shred_oom(void)
+{
+	const char *s = "{\"id\": 1, \"m\": {\"v\": 1.5}, \"name\": \"first\"}";
+	struct j64_shred sh;
+	long n;
+	int res = 0;
+
+	/* Fail each allocation in turn, leaking nothing */
+	for (n = 0; !res && n < 64; n++) {
+		if (!shred_init(&sh))
+			return 0;
+		alloc_budget = n;
+		res = j64_shred_feed(&sh, s, strlen(s));
+		alloc_budget = -1;
+		res = res && sh.nrows == 1 && col_is_str(&sh.cols[2], 0, "first");
+		shred_free(&sh);
+	}
+	return res && 1 < n;
+}
+
+/*
+ * Reader tests
+ */
+
+int
+test_reader_tokens(void)
+{
+	static const int toks[] = {
+		J64_TOK_OBJ_BEGIN, J64_TOK_KEY, J64_TOK_ARR_BEGIN, J64_TOK_VALUE,
+		J64_TOK_VALUE, J64_TOK_VALUE, J64_TOK_ARR_END, J64_TOK_KEY,
+		J64_TOK_OBJ_BEGIN, J64_TOK_OBJ_END, J64_TOK_OBJ_END, J64_TOK_END
+	};
+	const char *s = "{\"a\": [1, \"a boxed string\", null], \"b\": {}}";
+	struct j64_reader r;
+	j64_t vals[12];
+	size_t i;
+	int res = 1;
+	j64_reader_init(&r, s, strlen(s));
+	for (i = 0; res && i < 12; i++) {
+		res = j64_reader_next(&r, &vals[i]) == toks[i];
+		if (i == 4)
+			res = res && j64_reader_depth(&r) == 2;
+	}
+	res = res && is_str(vals[1], "a", 1) && j64_int_get(vals[3]) == 1;
+	res = res && is_str(vals[4], "a boxed string", 14) && j64_is_null(vals[5]);
+	res = res && j64_is_undef(vals[6]) && j64_reader_depth(&r) == 0;
+	j64_free(vals[4]);
+	j64_reader_fini(&r);
+	return res;
+}
+
+int
+test_reader_raw(void)
+{
+	const char *s = "[\"a \\\"boxed\\\" string\", -1.5e3]";
+	struct j64_reader r;
+	const uint8_t *p;
+	size_t len;
+	int res;
+	j64_reader_init(&r, s, strlen(s));
+	res = j64_reader_next(&r, NULL) == J64_TOK_ARR_BEGIN;
+	res = res && j64_reader_next(&r, NULL) == J64_TOK_VALUE;
+	p = j64_reader_raw(&r, &len);
+	res = res && len == 18 && memcmp(p, "a \\\"boxed\\\" string", len) == 0;
+	res = res && j64_reader_next(&r, NULL) == J64_TOK_VALUE;
+	p = j64_reader_raw(&r, &len);
+	res = res && len == 6 && memcmp(p, "-1.5e3", len) == 0;
+	res = res && j64_reader_next(&r, NULL) == J64_TOK_ARR_END;
+	res = res && j64_reader_next(&r, NULL) == J64_TOK_END;
+	j64_reader_fini(&r);
+	return res;
+}
+
+int
+test_reader_skip(void)
+{
+	const char *s = "[{\"a\": [\"]\", {}]}, 2]";
+	struct j64_reader r;
+	j64_t j;
+	int res;
+	j64_reader_init(&r, s, strlen(s));
+	res = j64_reader_next(&r, &j) == J64_TOK_ARR_BEGIN;
+	res = res && j64_reader_next(&r, &j) == J64_TOK_OBJ_BEGIN;
+	res = res && j64_reader_skip(&r) && j64_reader_depth(&r) == 1;
+	res = res && j64_reader_next(&r, &j) == J64_TOK_VALUE && j64_int_get(j) == 2;
+	res = res && j64_reader_next(&r, &j) == J64_TOK_ARR_END;
+	res = res && j64_reader_next(&r, &j) == J64_TOK_END;
+	j64_reader_fini(&r);
+
+	/* Truncated after a backslash in a skipped string */
+	j64_reader_init(&r, "[{\"a\\", 5);
+	res = res && j64_reader_next(&r, &j) == J64_TOK_ARR_BEGIN;
+	res = res && j64_reader_next(&r, &j) == J64_TOK_OBJ_BEGIN;
+	res = res && !j64_reader_skip(&r);
+	j64_reader_fini(&r);
+	return res;
+}
+
+int
+test_reader_invalid(void)
+{
+	struct j64_reader r;
+	j64_t j;
+	int res;
+	j64_reader_init(&r, "[1,]", 4);
+	res = j64_reader_next(&r, &j) == J64_TOK_ARR_BEGIN;
+	res = res && j64_reader_next(&r, &j) == J64_TOK_VALUE;
+	res = res && j64_reader_next(&r, &j) == J64_TOK_ERROR;
+	res = res && j64_reader_next(&r, &j) == J64_TOK_ERROR;
+	j64_reader_fini(&r);
+	return res;
+}
+
+struct sum {
+	int64_t	sum;
+	size_t	ntoks;
+	size_t	stop;
+};
+
+static int
+sum_tok(void *arg, int tok, j64_t j)
+{
+	struct sum *sum = arg;
+	if (tok == J64_TOK_VALUE && j64_is_int(j))
+		sum->sum += j64_int_get(j);
+	j64_free(j);
+	return ++sum->ntoks != sum->stop;
+}
+
+int
+test_parse_sum(void)
+{
+	const char *s = "{\"xs\": [1, 2, 3], \"a long key\": {\"y\": -10, \"z\": \"a boxed string\"}}";
+	struct sum sum = { 0, 0, 0 };
+	return j64_parse(s, strlen(s), sum_tok, &sum) && sum.sum == -4 && sum.ntoks == 15;
+}
+
+int
+test_parse_stop(void)
+{
+	const char *s = "[1, 2, 3, 4]";
+	struct sum sum = { 0, 0, 3 };
+	return !j64_parse(s, strlen(s), sum_tok, &sum) && sum.sum == 3 &&
+	    !j64_parse("[1, 2", 5, sum_tok, &sum);
+}
+
+/*
+ * Incremental parsing tests
+ */
+
+/* Compares two values structurally */
+static int
+same(j64_t a, j64_t b)
+{
+	size_t i;
+	j64_t k, v;
+	if (j64_is_str(a) || j64_is_str(b))
+		return j64_is_str(a) && j64_is_str(b) &&
+		    is_str(a, (const char *)j64_str_ptr(&b), j64_str_len(b));
+	if (J64_TYPE_GET(a) != J64_TYPE_GET(b))
+		return 0;
+	switch (J64_TYPE_GET(a)) {
+	case J64_TYPE_BARR:
+		if (j64_barr_cap(a) != j64_barr_cap(b))
+			return 0;
+		for (i = 0; i < j64_barr_cap(a); i++)
+			if (!same(j64_barr_get(a, i), j64_barr_get(b, i)))
+				return 0;
+		return 1;
+	case J64_TYPE_OBJ:
+		if (j64_obj_len(a) != j64_obj_len(b))
+			return 0;
+		for (i = 0; j64_obj_next(a, &i, &k, &v); )
+			if (!same(v, j64_obj_get(b, k)))
+				return 0;
+		return 1;
+	default:
+		return a.w == b.w;
+	}
+}
+
+static j64_t
+parse_chunks(const char *s, size_t len, size_t chunk)
+{
+	struct j64_parser ps;
+	size_t i;
+	j64_parser_init(&ps);
+	for (i = 0; i < len; i += chunk)
+		if (!j64_parser_feed(&ps, s + i, J64__MIN(chunk, len - i)))
+			break;
+	return j64_parser_end(&ps);
+}
+
+static const char PARSER_DOC[] =
+    "{\"id\": 12345, \"name\": \"a \\\"quoted\\\" \\u00e9 name\",\n"
+    " \"tags\": [\"x\", \"a longer tag\", true, false, null],\n"
+    " \"m\": {\"v\": -1.25e-3, \"w\": [[], {}, [0, -0.5]]}, \"z\": 9876543210}  ";
+
+int
+test_parser_chunks(void)
+{
+	static const size_t sizes[] = { 1, 2, 3, 5, 7, 16, 64, 4096 };
+	size_t i, len = strlen(PARSER_DOC);
+	j64_t j = j64_decode(PARSER_DOC, len);
+	j64_t k;
+	int res = j64_is_obj(j);
+	for (i = 0; res && i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		k = parse_chunks(PARSER_DOC, len, sizes[i]);
+		res = same(j, k);
+		j64_release(k);
+	}
+	j64_release(j);
+	return res;
+}
+
+int
+test_parser_split(void)
+{
+	const char *s = "[\"a longer string with \\\\ and \\ud83d\\ude00\", 123.5e1, \"k\", true]";
+	struct j64_parser ps;
+	size_t i, len = strlen(s);
+	j64_t j = j64_decode(s, len);
+	j64_t k;
+	int res = j64_is_barr(j);
+	for (i = 1; res && i < len; i++) {
+		j64_parser_init(&ps);
+		res = j64_parser_feed(&ps, s, i) && j64_parser_feed(&ps, s + i, len - i);
+		k = j64_parser_end(&ps);
+		res = res && same(j, k);
+		j64_release(k);
+	}
+	j64_release(j);
+	return res;
+}
+
+int
+test_parser_num(void)
+{
+	struct j64_parser ps;
+	int res;
+	j64_t j;
+	j64_parser_init(&ps);
+	res = j64_parser_feed(&ps, "-1", 2) && j64_parser_feed(&ps, "2", 1);
+	res = res && j64_parser_feed(&ps, "3", 1);
+	res = res && j64_int_get(j64_parser_end(&ps)) == -123;
+	j64_parser_init(&ps);
+	res = res && j64_parser_feed(&ps, "1.", 2) && j64_is_undef(j64_parser_end(&ps));
+	j64_parser_init(&ps);
+	res = res && j64_parser_feed(&ps, "[1", 2) && j64_is_undef(j64_parser_end(&ps));
+	j = parse_chunks("[1e5]", 5, 1);
+	res = res && j64_float_get(j64_barr_get(j, 0)) == 1e5;
+	j64_release(j);
+	return res;
+}
+
+int
+test_parser_long_str(void)
+{
+	size_t len = 100000;
+	char *buf = malloc(len + 2);
+	j64_t j;
+	int res;
+	memset(buf, 'x', len + 2);
+	buf[0] = '"';
+	buf[len + 1] = '"';
+	j = parse_chunks(buf, len + 2, 1);
+	res = j64_is_bstr(j) && j64_bstr_len(j) == len;
+	j64_free(j);
+	free(buf);
+	return res;
+}
+
+int
+test_parser_invalid(void)
+{
+	struct j64_parser ps;
+	int res;
+	j64_parser_init(&ps);
+	res = j64_parser_feed(&ps, "[1,", 3) && !j64_parser_feed(&ps, ",2]", 3);
+	res = res && !j64_parser_feed(&ps, "]", 1) && j64_is_undef(j64_parser_end(&ps));
+	j64_parser_init(&ps);
+	res = res && j64_parser_feed(&ps, "[\"a long", 8) && !j64_parser_feed(&ps, "\x01\"]", 3);
+	j64_parser_fini(&ps);
+	res = res && j64_is_undef(parse_chunks("{\"a\": 1} x", 10, 3));
+	res = res && j64_is_undef(parse_chunks("[\"unterminated", 14, 4));
+	res = res && j64_is_undef(parse_chunks("[tru]", 5, 2));
+	return res && j64_is_undef(parse_chunks("", 0, 1));
+}
+
+/*
+ * Encoding tests
+ */
+
+static int
+encodes_to(size_t (*encode)(j64_t, char *, size_t), j64_t j, const char *s)
+{
+	char buf[64];
+	size_t len = encode(j, buf, sizeof(buf));
+	return len == strlen(s) && memcmp(buf, s, len) == 0;
+}
+
+int
+test_int_encode(void)
+{
+	char buf[2];
+	return encodes_to(j64_int_encode, j64_int(0), "0") &&
+	    encodes_to(j64_int_encode, j64_int(-1), "-1") &&
+	    encodes_to(j64_int_encode, j64_int(J64_INT_MAX), "2305843009213693951") &&
+	    encodes_to(j64_int_encode, j64_int(J64_INT_MIN), "-2305843009213693952") &&
+	    j64_int_encode(j64_int(-123), buf, 2) == 2 && memcmp(buf, "-1", 2) == 0;
+}
+
+int
+test_float_encode(void)
+{
+	double zero = 0.0;
+	char buf[J64_FLOAT_ENCODE_MAX];
+	j64_t j = j64_float(1e300);
+	size_t len = j64_float_encode(j, buf, sizeof(buf));
+	return j64_decode(buf, len).w == j.w &&
+	    encodes_to(j64_float_encode, j64_float(1.5), "1.5") &&
+	    encodes_to(j64_float_encode, j64_float(-2.0), "-2.0") &&
+	    encodes_to(j64_float_encode, j64_float(0.1), "0.1") &&
+	    encodes_to(j64_float_encode, j64_float(5e9), "5000000000.0") &&
+	    encodes_to(j64_float_encode, j64_float(1.0 / zero), "null") &&
+	    encodes_to(j64_float_encode, j64_float(zero / zero), "null");
+}
+
+int
+test_str_encode(void)
+{
+	char buf[4];
+	int res;
+	j64_t j = j64_str("a\"b\\\n\x01 and more", 15);
+	res = encodes_to(j64_str_encode, j, "\"a\\\"b\\\\\\n\\u0001 and more\"");
+	res = res && encodes_to(j64_str_encode, j64_estr(), "\"\"");
+	res = res && j64_str_encode(j, buf, 4) == 4 && memcmp(buf, "\"a\\\"", 4) == 0;
+	j64_free(j);
+	return res;
+}
+
+int
+test_encode_tree(void)
+{
+	const char *s = "[1,2.5,\"x\",null,true,false,\"\",[],{},{\"k\":\"a boxed string\"},null]";
+	j64_t j = j64_decode(s, strlen(s));
+	size_t len;
+	char *buf;
+	int res;
+	j64_barr_realloc(&j, 11);
+	buf = j64_encode(j, &len);
+	res = buf != NULL && len == strlen(s) && strcmp(buf, s) == 0;
+	free(buf);
+	j64_release(j);
+	return res;
+}
+
+int
+test_encode_roundtrip(void)
+{
+	j64_t j = j64_decode(PARSER_DOC, strlen(PARSER_DOC));
+	j64_t k;
+	size_t len;
+	char *buf = j64_encode(j, &len);
+	int res;
+	k = j64_decode(buf, len);
+	res = j64_is_obj(k) && same(j, k);
+	free(buf);
+	j64_release(j);
+	j64_release(k);
+	return res;
+}
+
+struct sink {
+	char	*buf;
+	size_t	len;
+	size_t	nflush;
+	size_t	fail_at;
+};
+
+static int
+sink_flush(void *arg, const char *buf, size_t len)
+{
+	struct sink *sink = arg;
+	if (++sink->nflush == sink->fail_at)
+		return 0;
+	sink->buf = realloc(sink->buf, sink->len + len);
+	memcpy(sink->buf + sink->len, buf, len);
+	sink->len += len;
+	return 1;
+}
+
+int
+test_writer_stream(void)
+{
+	struct sink sink = { NULL, 0, 0, 0 };
+	struct j64_writer w;
+	char buf[J64_WRITER_BUF_MIN];
+	j64_t name = j64_str("a boxed \"name\"", 14);
+	j64_t j, row;
+	size_t i;
+	int res;
+	j64_writer_init(&w, buf, sizeof(buf), sink_flush, &sink);
+	res = j64_writer_arr_begin(&w);
+	for (i = 0; res && i < 10000; i++) {
+		res = j64_writer_obj_begin(&w) &&
+		    j64_writer_key(&w, j64_istr("id", 2)) &&
+		    j64_writer_value(&w, j64_int((int64_t)i)) &&
+		    j64_writer_key(&w, j64_istr("name", 4)) &&
+		    j64_writer_value(&w, name) &&
+		    j64_writer_obj_end(&w);
+	}
+	res = res && j64_writer_arr_end(&w) && j64_writer_flush(&w);
+	res = res && sink.nflush > 1000;
+	j = j64_decode(sink.buf, sink.len);
+	res = res && j64_barr_cap(j) == 10000;
+	for (i = 0; res && i < 10000; i++) {
+		row = j64_barr_get(j, i);
+		res = j64_int_get(j64_obj_get(row, j64_istr("id", 2))) == (int64_t)i &&
+		    same(j64_obj_get(row, j64_istr("name", 4)), name);
+	}
+	j64_release(j);
+	j64_free(name);
+	free(sink.buf);
+	return res;
+}
+
+int
+test_writer_flush_fail(void)
+{
+	struct sink sink = { NULL, 0, 0, 2 };
+	struct j64_writer w;
+	char buf[J64_WRITER_BUF_MIN];
+	size_t i;
+	int res = 1;
+	j64_writer_init(&w, buf, sizeof(buf), sink_flush, &sink);
+	for (i = 0; res && i < 100; i++)
+		res = j64_writer_value(&w, j64_int(123456789));
+	res = !res && i < 10 && !j64_writer_value(&w, j64_null());
+	res = res && !j64_writer_flush(&w) && sink.nflush == 2;
+	free(sink.buf);
+	return res;
+}
+
+/*
+ * Encoding cache tests
+ */
+
+static int
+encoded(j64_t j, const char *s)
+{
+	size_t len;
+	char *buf = j64_encode(j, &len);
+	int res = buf != NULL && len == strlen(s) && strcmp(buf, s) == 0;
+	free(buf);
+	return res;
+}
+
+int
+test_cache_drop(void)
+{
+	const char *s = "[1,\"a boxed string\",{}]";
+	j64_t j = j64_decode(s, strlen(s));
+	int res = encoded(j, s);
+	j64_cache_drop(j64_int(1));
+	j64_cache_drop(j64_istr("a", 1));
+	j64_cache_drop(j64_barr_get(j, 1));
+	j64_cache_drop(j);
+	res = res && encoded(j, s);
+	j64_release(j);
+	return res;
+}
+
+#ifdef J64_ENCODE_CACHE
+/* A string whose encoding is long enough to be cached */
+#define CACHE_STR	"\"a string long enough for the arrays holding it to be worth caching\""
+
+static int
+cached(j64_t j)
+{
+	uint64_t w = *J64__CACHE(J64__BOX_PTR(j));
+	return w != 0 && !J64__CACHE_IS_TIME(w);
+}
+
+int
+test_cache_hit(void)
+{
+	const char *s = "{\"k\":[" CACHE_STR "]}";
+	j64_t j = decode(s);
+	j64_t arr = j64_obj_get(j, j64_istr("k", 1));
+	int res = !cached(j) && !cached(arr);
+	res = res && encoded(j, s) && cached(j) && cached(arr);
+	res = res && encoded(j, s);
+	j64_release(j);
+	return res;
+}
+
+int
+test_cache_small(void)
+{
+	j64_t j = decode("{\"k\":[1,2]}");
+	int res = encoded(j, "{\"k\":[1,2]}") && !cached(j);
+	j64_release(j);
+	return res;
+}
+
+int
+test_cache_barr_set(void)
+{
+	j64_t j = j64_decode("[1,2]", 5);
+	int res = encoded(j, "[1,2]");
+	j64_barr_set(j, j64_int(3), 0);
+	res = res && encoded(j, "[3,2]");
+	j64_barr_set_free(j, j64_bstr("a boxed string", 14), 1);
+	res = res && encoded(j, "[3,\"a boxed string\"]");
+	res = res && j64_barr_realloc(&j, 3) && encoded(j, "[3,\"a boxed string\",null]");
+	j64_release(j);
+	return res;
+}
+
+int
+test_cache_obj_set(void)
+{
+	j64_t j = j64_decode("{\"a\":1}", 7);
+	int res = encoded(j, "{\"a\":1}");
+	res = res && j64_obj_set(&j, j64_istr("b", 1), j64_int(2));
+	res = res && encoded(j, "{\"b\":2,\"a\":1}");
+	res = res && j64_obj_set_free(&j, j64_istr("a", 1), j64_true());
+	res = res && encoded(j, "{\"b\":2,\"a\":true}");
+	res = res && j64_is_true(j64_obj_del(&j, j64_istr("a", 1)));
+	res = res && encoded(j, "{\"b\":2}");
+	j64_release(j);
+	return res;
+}
+
+int
+test_cache_nested(void)
+{
+	j64_t j = decode("[[[1]," CACHE_STR "],2]");
+	j64_t child = j64_barr_get(j, 0);
+	j64_t leaf = j64_barr_get(child, 0);
+	int res = encoded(j, "[[[1]," CACHE_STR "],2]") && cached(j) && cached(child);
+	j64_barr_set(leaf, j64_int(5), 0);
+	res = res && encoded(j, "[[[5]," CACHE_STR "],2]") && cached(j);
+	res = res && encoded(child, "[[5]," CACHE_STR "]");
+	j64_barr_set(leaf, j64_int(6), 0);
+	res = res && encoded(child, "[[6]," CACHE_STR "]");
+	res = res && encoded(j, "[[[6]," CACHE_STR "],2]");
+	j64_release(j);
+	return res;
+}
+
+/* Wraps INNER in N arrays */
+static char *
+nest(char *buf, size_t n, const char *inner)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		buf[i] = '[';
+	strcpy(buf + n, inner);
+	for (i = 0; i < n; i++)
+		strcat(buf, "]");
+	return buf;
+}
+
+int
+test_cache_depth(void)
+{
+	char buf[256];
+	j64_t j, deep;
+	size_t i;
+	int res;
+
+	/* The innermost array is one level below the cached ones */
+	j = decode(nest(buf, J64_ENCODE_CACHE_DEPTH, "[" CACHE_STR "]"));
+	for (deep = j, i = 0; i < J64_ENCODE_CACHE_DEPTH; i++)
+		deep = j64_barr_get(deep, 0);
+	res = encoded(j, buf) && cached(j) && !cached(deep);
+	j64_barr_set_free(deep, j64_int(1), 0);
+	res = res && encoded(j, nest(buf, J64_ENCODE_CACHE_DEPTH, "[1]"));
+	j64_release(j);
+	return res;
+}
+#endif /* J64_ENCODE_CACHE */
+
+/*
+ * Validation tests
+ */
+
+static int
+valid(const char *s, size_t max_depth, int flags)
+{
+	return j64_validate(s, strlen(s), max_depth, flags);
+}
+
+int
+test_validate(void)
+{
+	return valid(PARSER_DOC, 0, 0) && valid(" [1, {\"a\": null}] ", 0, 0) &&
+	    valid("\"x\"", 0, 0) && valid("-1.5e3", 0, 0) &&
+	    !valid("", 0, 0) && !valid("[1,]", 0, 0) && !valid("{\"a\" 1}", 0, 0) &&
+	    !valid("[1] 2", 0, 0) && !valid("[\"\\x\"]", 0, 0) &&
+	    !valid("{\"a\":1", 0, 0) && !valid("01", 0, 0) && !valid("tru", 0, 0);
+}
+
+int
+test_validate_depth(void)
+{
+	size_t i, n = 64 * J64_VALIDATE_STACK_WORDS;
+	char *buf = (char *)malloc(4 * n + 2);
+	int res;
+	if (buf == NULL)
+		return 0;
+	for (i = 0; i < n; i++) {
+		buf[i] = '[';
+		buf[2 * n - 1 - i] = ']';
+	}
+
+	/* The whole fixed stack, without allocating */
+	alloc_budget = 0;
+	res = j64_validate(buf, 2 * n, 0, 0);
+	res = res && j64_validate(buf, 2 * n, n, 0) && !j64_validate(buf, 2 * n, n - 1, 0);
+	alloc_budget = -1;
+	res = res && valid("[[1]]", 2, 0) && !valid("[[1]]", 1, 0) && valid("1", 1, 0);
+
+	/* Deeper, as j64_decode accepts */
+	n *= 2;
+	for (i = 0; i < n; i++) {
+		buf[i] = '[';
+		buf[2 * n - 1 - i] = ']';
+	}
+	res = res && j64_validate(buf, 2 * n, 0, 0) && !j64_validate(buf, 2 * n, n - 1, 0);
+	buf[n] = '}';
+	res = res && !j64_validate(buf, 2 * n, 0, 0);
+	buf[n] = ']';
+	res = res && !j64_validate(buf, 2 * n - 1, 0, 0);
+	alloc_budget = 0;
+	res = res && !j64_validate(buf, 2 * n, 0, 0);
+	alloc_budget = -1;
+
+	free(buf);
+	return res;
+}
+
+int
+test_validate_utf8(void)
+{
+	return valid("[\"caf\xc3\xa9\", \"\xe2\x82\xac\xf0\x9f\x98\x80\"]", 0, J64_VALIDATE_UTF8) &&
+	    valid("{\"\xc3\xa9t\xc3\xa9\":\"a long ascii string value\"}", 0, J64_VALIDATE_UTF8) &&
+	    valid("\"\xff\"", 0, 0) &&
+	    !valid("\"\xff\"", 0, J64_VALIDATE_UTF8) &&
+	    !valid("{\"\xc3\":1}", 0, J64_VALIDATE_UTF8) &&
+	    !valid("\"\xc0\xaf\"", 0, J64_VALIDATE_UTF8) &&
+	    !valid("\"\xed\xa0\x80\"", 0, J64_VALIDATE_UTF8) &&
+	    !valid("\"\xf4\x90\x80\x80\"", 0, J64_VALIDATE_UTF8) &&
+	    !valid("\"aaaaaaaa\xe2\x82\"", 0, J64_VALIDATE_UTF8);
+}
+
+/*
+ * Batch decoding tests
+ */
+
+int
+test_decode_batch(void)
+{
+	const char *docs[] = {
+		PARSER_DOC, "[1,2", "\"a boxed string\"", "", "{\"a\":[{}]}", "[1,]", "7"
+	};
+	const void *bufs[7];
+	size_t lens[7], i;
+	j64_t out[7], j;
+	int res;
+	for (i = 0; i < 7; i++) {
+		bufs[i] = docs[i];
+		lens[i] = strlen(docs[i]);
+	}
+	res = j64_decode_batch(bufs, lens, 7, out) == 4;
+	for (i = 0; i < 7; i++) {
+		j = j64_decode(docs[i], lens[i]);
+		res = res && (j64_is_undef(j) ? j64_is_undef(out[i]) : same(j, out[i]));
+		j64_release(j);
+		j64_release(out[i]);
+	}
+	return res && j64_decode_batch(NULL, NULL, 0, NULL) == 0;
+}
+
+int
+test_decode_batch_deep(void)
+{
+	size_t n = 1000, lens[3], i;
+	char *deep = malloc(2 * n + 1);
+	const void *bufs[3];
+	j64_t out[3], j;
+	int res;
+	for (i = 0; i < n; i++) {
+		deep[i] = '[';
+		deep[2 * n - i] = ']';
+	}
+	deep[n] = '1';
+	bufs[0] = bufs[2] = deep;
+	lens[0] = lens[2] = 2 * n + 1;
+	bufs[1] = "[[[]]";
+	lens[1] = 5;
+	res = j64_decode_batch(bufs, lens, 3, out) == 2 && j64_is_undef(out[1]);
+	for (i = 0, j = out[2]; res && i < n; i++, j = j64_barr_get(j, 0))
+		res = j64_is_barr(j) && j64_barr_cap(j) == 1;
+	res = res && j64_int_get(j) == 1;
+	j64_release(out[0]);
+	j64_release(out[2]);
+	free(deep);
+	return res;
+}
+
+/*
+ * Tree iteration tests
+ */
+
+int
+test_iter_order(void)
+{
+	const char *s = "{\"a\":[1,{\"b\":null},[]],\"c\":\"a boxed string\"}";
+	j64_t j = j64_decode(s, strlen(s));
+	j64_t k, v, a;
+	struct j64_iter it;
+	size_t depth;
+	int res;
+	j64_iter_init(&it, j);
+	res = j64_iter_next(&it, &depth, &k, &v) && depth == 0 && j64_is_undef(k) && v.w == j.w;
+	/* Object order is unspecified, so find the array first */
+	res = res && j64_iter_next(&it, &depth, &k, &v) && depth == 1;
+	if (res && j64_is_bstr(v))
+		res = j64_iter_next(&it, &depth, &k, &v) && depth == 1;
+	a = v;
+	res = res && j64_is_barr(a) && j64_is_str(k);
+	res = res && j64_iter_next(&it, &depth, &k, &v) && depth == 2 &&
+	    j64_int_get(k) == 0 && j64_int_get(v) == 1;
+	res = res && j64_iter_next(&it, &depth, &k, &v) && depth == 2 &&
+	    j64_int_get(k) == 1 && j64_is_obj(v);
+	res = res && j64_iter_next(&it, &depth, &k, &v) && depth == 3 &&
+	    j64_is_str(k) && j64_is_null(v);
+	res = res && j64_iter_next(&it, &depth, &k, &v) && depth == 2 &&
+	    j64_int_get(k) == 2 && j64_is_earr(v);
+	if (res && j64_iter_next(&it, &depth, &k, &v))
+		res = depth == 1 && j64_is_bstr(v);
+	res = res && !j64_iter_next(&it, &depth, &k, &v) && !it.error;
+	j64_iter_fini(&it);
+	j64_iter_init(&it, j64_int(5));
+	res = res && j64_iter_next(&it, NULL, NULL, &v) && j64_int_get(v) == 5;
+	res = res && !j64_iter_next(&it, NULL, NULL, NULL);
+	j64_iter_fini(&it);
+	j64_release(j);
+	return res;
+}
+
+int
+test_iter_deep(void)
+{
+	j64_t j = j64_int(0), k, v;
+	struct j64_iter it;
+	size_t i, n = 1000, depth, nodes = 0, max = 0;
+	int res = 1;
+	for (i = 0; i < n; i++) {
+		k = j64_barr_alloc(2);
+		j64_barr_set(k, j, 0);
+		j64_barr_set(k, j64_int((int64_t)i), 1);
+		j = k;
+	}
+	j64_iter_init(&it, j);
+	while (j64_iter_next(&it, &depth, &k, &v)) {
+		nodes++;
+		max = J64__MAX(max, depth);
+		if (j64_is_int(v) && depth > 0 && j64_int_get(k) == 1)
+			res = res && j64_int_get(v) == (int64_t)(n - depth);
+	}
+	res = res && !it.error && nodes == 2 * n + 1 && max == n;
+	j64_iter_fini(&it);
+	j64_release(j);
+	return res;
+}
+
+/*
+ * Cloning tests
+ */
+
+int
+test_clone_doc(void)
+{
+	j64_t j = j64_decode(PARSER_DOC, strlen(PARSER_DOC));
+	const char *s = "{\"x\":\"a boxed string\",\"y\":[1]}";
+	j64_t sealed = j64_decode(s, strlen(s));
+	j64_t k, l;
+	int res = j64_obj_seal(&sealed) &&
+	    j64_obj_set(&j, j64_istr("sealed", 6), sealed);
+	k = j64_clone(j, NULL, NULL);
+	res = res && same(j, k) && j64_obj_len(k) == j64_obj_len(j);
+	l = j64_obj_get(k, j64_istr("sealed", 6));
+	res = res && j64_obj_is_sealed(l) && l.w != sealed.w &&
+	    j64_is_bstr(j64_obj_get(l, j64_istr("x", 1)));
+	j64_release(j);
+	/* Changing a clone changes a copy */
+	l = k;
+	res = res && j64_obj_set(&l, j64_istr("new", 3), j64_int(1)) && l.w != k.w;
+	res = res && j64_is_undef(j64_obj_get(k, j64_istr("new", 3)));
+	res = res && j64_int_get(j64_obj_get(l, j64_istr("new", 3))) == 1;
+	j64_release(l);
+	j64_frozen_free(k);
+	return res && j64_clone(j64_int(3), NULL, NULL).w == j64_int(3).w;
+}
+
+int
+test_clone_seg(void)
+{
+	int res = 1;
+	size_t i;
+	j64_t j = j64_barr_alloc(SEG_CAP);
+	j64_t k;
+	for (i = 0; i < SEG_CAP; i++)
+		j64_barr_set(j, j64_int((int64_t)i), i);
+	k = j64_clone(j, NULL, NULL);
+	j64_barr_free(j);
+	res = j64_barr_cap(k) == SEG_CAP;
+	for (i = 0; res && i < SEG_CAP; i++)
+		if (j64_int_get(j64_barr_get(k, i)) != (int64_t)i)
+			res = 0;
+	j64_frozen_free(k);
+	return res;
+}
+
+struct arena {
+	uint64_t	buf[512];
+	size_t		used;
+	size_t		nalloc;
+};
+
+static void *
+arena_alloc(void *arg, size_t size)
+{
+	struct arena *a = arg;
+	void *p;
+	a->nalloc++;
+	if (sizeof(a->buf) - a->used < size)
+		return NULL;
+	p = (char *)a->buf + a->used;
+	a->used += size;
+	return p;
+}
+
+int
+test_clone_alloc(void)
+{
+	struct arena a = { { 0 }, 0, 0 };
+	j64_t j = mk_nested_obj();
+	j64_t k = j64_clone(j, arena_alloc, &a);
+	int res = a.nalloc == 1 && J64__BOX_PTR(k) == (void *)a.buf && same(j, k);
+	j64_release(j);
+	j = j64_barr_alloc(1000);
+	res = res && j64_is_undef(j64_clone(j, arena_alloc, &a)) && a.nalloc == 2;
+	j64_release(j);
+	return res;
+}
+
+/*
+ * Statistics tests
+ */
+
+#define STATS_DOC "{\"a\":[1,2.5,null,true,\"\",\"short\"],\"b\":\"exactly 8\"," \
+	"\"c\":\"a string well past the limit\",\"d\":{}}"
+
+int
+test_stats_counts(void)
+{
+	j64_t j = j64_decode(STATS_DOC, strlen(STATS_DOC));
+	j64_t a = j64_obj_get(j, j64_istr("a", 1));
+	struct j64_stats st;
+	size_t heap;
+	int res = j64_barr_realloc(&a, 8) && j64_obj_set(&j, j64_istr("a", 1), a);
+	res = res && j64_obj_set(&j, j64_istr("e", 1), j64_bstr("tiny", 4));
+	res = res && j64_stats(j, &st);
+	res = res && st.nobj == 1 && st.nbarr == 1 && st.nint == 1 && st.nfloat == 1;
+	/* null, true, "" and {} are literals */
+	res = res && st.nlit == 4 && st.nistr == 6 && st.nbstr == 3;
+	res = res && st.bstr_short == 1 && st.bstr_near == 1;
+	res = res && st.barr_slack == 2 * sizeof(j64_t);
+	heap = j64__stats_box_bytes(j) + j64__stats_box_bytes(a) +
+	    j64__stats_box_bytes(j64_obj_get(j, j64_istr("b", 1))) +
+	    j64__stats_box_bytes(j64_obj_get(j, j64_istr("c", 1))) +
+	    j64__stats_box_bytes(j64_obj_get(j, j64_istr("e", 1)));
+	res = res && st.heap_bytes == heap && heap > 0;
+	res = res && st.obj_slack == (J64__OBJ_CAP(J64__OBJ_HDR(j)) - 5) * 2 * sizeof(j64_t);
+	j64_release(j);
+	res = res && j64_stats(j64_int(1), &st) && st.nint == 1 && st.heap_bytes == 0;
+	return res;
+}
+
+int
+test_stats_frozen(void)
+{
+	j64_t j = j64_decode(STATS_DOC, strlen(STATS_DOC));
+	j64_t k = j64_freeze(j);
+	struct j64_stats a, b;
+	int res = j64_stats(j, &a) && j64_stats(k, &b);
+	res = res && a.heap_bytes > 0 && b.heap_bytes == 0 && b.obj_slack == 0;
+	res = res && a.nbstr == b.nbstr && a.nistr == b.nistr && a.nlit == b.nlit;
+	j64_release(j);
+	j64_frozen_free(k);
+	return res;
+}
+
+#ifdef J64_ALLOC_STATS
+int
+test_alloc_stats(void)
+{
+	struct j64_alloc_stats st;
+	j64_t j;
+	int res;
+	j64_alloc_stats_reset();
+	j = j64_bstr("a boxed string", 14);
+	j64_alloc_stats_get(&st);
+	res = st.nmalloc == 1 && st.nfree == 0 && st.bytes >= 14;
+	j64_free(j);
+	j = j64_decode(STATS_DOC, strlen(STATS_DOC));
+	j64_release(j);
+	j64_alloc_stats_get(&st);
+	return res && st.nmalloc > 3 && st.nmalloc == st.nfree;
+}
+#endif /* J64_ALLOC_STATS */
+
+/*
+ * Tracing tests
+ */
+
+#ifdef J64_TRACE
+int
+test_trace_phases(void)
+{
+	struct j64_trace tr;
+	struct j64_parser ps;
+	j64_t j;
+	size_t len;
+	char *buf;
+	int res;
+	j64_trace_reset();
+	j = j64_decode(PARSER_DOC, strlen(PARSER_DOC));
+	buf = j64_encode(j, &len);
+	j64_trace_get(&tr);
+	res = tr.parse.calls == 1 && tr.parse.bytes == strlen(PARSER_DOC);
+	res = res && tr.encode.calls == 1 && tr.encode.bytes == len;
+	res = res && tr.alloc.calls > 0 && tr.alloc.bytes > 0 && tr.grow.calls > 0;
+	j64_release(j);
+	free(buf);
+	j64_parser_init(&ps);
+	res = res && j64_parser_feed(&ps, PARSER_DOC, 10) &&
+	    j64_parser_feed(&ps, PARSER_DOC + 10, strlen(PARSER_DOC) - 10);
+	j = j64_parser_end(&ps);
+	j64_release(j);
+	j64_trace_get(&tr);
+	res = res && tr.parse.calls == 3 && tr.parse.bytes == 2 * strlen(PARSER_DOC);
+	j64_trace_reset();
+	j64_trace_get(&tr);
+	return res && tr.parse.calls == 0 && tr.alloc.bytes == 0;
+}
+#endif /* J64_TRACE */
+
+/*
+ * Patch tests
+ */
+
+static int
+diff_applies(const char *from, const char *to)
+{
+	j64_t a = decode(from);
+	j64_t b = decode(to);
+	j64_t patch = j64_diff(a, b);
+	int res = j64__is_arr(patch) && j64_patch_apply(&a, patch) && same(a, b);
+	j64_release(patch);
+	j64_release(a);
+	j64_release(b);
+	return res;
+}
+
+int
+test_diff_roundtrip(void)
+{
+	return diff_applies(PARSER_DOC, "{}") && diff_applies("{}", PARSER_DOC) &&
+	    diff_applies("[1,2,3,4]", "[1,5]") && diff_applies("[1]", "[0,[1,2],{\"a\":\"a boxed string\"}]") &&
+	    diff_applies("{\"a/b\":1,\"c~d\":[1],\"e\":{\"f\":null}}", "{\"a/b\":2,\"c~d\":[],\"e\":{\"f\":[]}}") &&
+	    diff_applies("{\"x\":{\"y\":{\"z\":\"a boxed string\"}}}", "{\"x\":{\"y\":{\"z\":\"another boxed one\"}}}") &&
+	    diff_applies("1", "\"a boxed string\"") && diff_applies("[]", "{}") && diff_applies("{}", "[]");
+}
+
+int
+test_diff_ops(void)
+{
+	j64_t a = decode("{\"k\":[1,2,{\"v\":\"a boxed string\"}],\"same\":\"a boxed string\"}");
+	j64_t b = decode("{\"k\":[1,3,{\"v\":\"a boxed string\"}],\"same\":\"a boxed string\"}");
+	j64_t patch = j64_diff(a, b), op;
+	int res = j64_is_barr(patch) && j64_barr_cap(patch) == 1;
+	op = res ? j64_barr_get(patch, 0) : j64_undef();
+	res = res && is_str(j64_obj_get(op, j64_istr("op", 2)), "replace", 7) &&
+	    is_str(j64_obj_get(op, j64_istr("path", 4)), "/k/1", 4) &&
+	    j64_int_get(j64_obj_get(op, j64_istr("value", 5))) == 3;
+	j64_release(patch);
+	patch = j64_diff(a, a);
+	res = res && j64_is_earr(patch);
+	j64_release(a);
+	j64_release(b);
+	return res;
+}
+
+int
+test_diff_unset(void)
+{
+	j64_t a = j64_barr_alloc(2);
+	j64_t b = decode("[1,2]");
+	j64_t c = decode("[1,null]");
+	j64_t patch;
+	int res;
+
+	/* Unset slots are replaced, and equal null */
+	j64_barr_set(a, j64_int(1), 0);
+	patch = j64_diff(a, c);
+	res = j64_is_earr(patch) && j64__equal(a, c);
+	j64_release(patch);
+	patch = j64_diff(a, b);
+	res = res && j64_is_barr(patch) && j64_barr_cap(patch) == 1 &&
+	    j64_patch_apply(&a, patch) && same(a, b);
+	j64_release(patch);
+
+	j64_release(a);
+	j64_release(b);
+	j64_release(c);
+	return res;
+}
+
+int
+test_patch_apply(void)
+{
+	j64_t doc = decode("{\"a\":[1,2],\"b\":{\"c\":\"a boxed string\"}}");
+	j64_t patch = decode("["
+	    "{\"op\":\"add\",\"path\":\"/a/-\",\"value\":3},"
+	    "{\"op\":\"add\",\"path\":\"/a/0\",\"value\":0},"
+	    "{\"op\":\"remove\",\"path\":\"/a/1\"},"
+	    "{\"op\":\"copy\",\"from\":\"/b/c\",\"path\":\"/d\"},"
+	    "{\"op\":\"move\",\"from\":\"/b\",\"path\":\"/e\"},"
+	    "{\"op\":\"replace\",\"path\":\"/e/c\",\"value\":true},"
+	    "{\"op\":\"test\",\"path\":\"/a\",\"value\":[0,2,3]}]");
+	j64_t want = decode("{\"a\":[0,2,3],\"d\":\"a boxed string\",\"e\":{\"c\":true}}");
+	j64_t bad = decode("[{\"op\":\"test\",\"path\":\"/a/0\",\"value\":1}]");
+	j64_t missing = decode("[{\"op\":\"replace\",\"path\":\"/zz\",\"value\":1}]");
+	int res = j64_patch_apply(&doc, patch) && same(doc, want);
+	res = res && !j64_patch_apply(&doc, bad) && !j64_patch_apply(&doc, missing) && same(doc, want);
+	j64_release(bad);
+	bad = decode("[{\"op\":\"add\",\"path\":\"a\",\"value\":1}]");
+	res = res && !j64_patch_apply(&doc, bad);
+	j64_release(doc);
+	j64_release(patch);
+	j64_release(want);
+	j64_release(bad);
+	j64_release(missing);
+	return res;
+}
+
+static int
+patch_fails(const char *doc, const char *op)
+{
+	j64_t j = decode(doc);
+	j64_t p = decode(op);
+	j64_t want = decode(doc);
+	int res = !j64_patch_apply(&j, p) && same(j, want);
+	j64_release(j);
+	j64_release(p);
+	j64_release(want);
+	return res;
+}
+
+int
+test_patch_move(void)
+{
+	const char *doc = "{\"a\":{\"b\":1},\"x\":2,\"l\":[1,\"a boxed string\"]}";
+	return patch_fails(doc, "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/a/c\"}]") &&
+	    patch_fails(doc, "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/a/b/c\"}]") &&
+	    patch_fails(doc, "[{\"op\":\"move\",\"from\":\"/x\",\"path\":\"/y/z\"}]") &&
+	    patch_fails(doc, "[{\"op\":\"move\",\"from\":\"/a/b\",\"path\":\"/x/b\"}]") &&
+	    patch_fails(doc, "[{\"op\":\"move\",\"from\":\"/l/1\",\"path\":\"/l/2\"}]") &&
+	    patch_fails(doc, "[{\"op\":\"move\",\"from\":\"/l/0\",\"path\":\"/l/5\"}]");
+}
+
+int
+test_patch_oom(void)
+{
+	const char *doc = "{\"l\":[\"a boxed string\",2,3]}";
+	j64_t p = decode("[{\"op\":\"move\",\"from\":\"/l/0\",\"path\":\"/m\"}]");
+	j64_t before = decode(doc);
+	j64_t after = decode("{\"l\":[2,3],\"m\":\"a boxed string\"}");
+	j64_t j;
+	long n;
+	int ok = 0, res = 1;
+
+	/* Fail each allocation in turn: the move is done or not at all */
+	for (n = 0; res && !ok && n < 64; n++) {
+		j = decode(doc);
+		alloc_budget = n;
+		ok = j64_patch_apply(&j, p);
+		alloc_budget = -1;
+		res = same(j, ok ? after : before);
+		j64_release(j);
+	}
+	j64_release(p);
+	j64_release(before);
+	j64_release(after);
+	return res && ok && 1 < n;
+}
+
+/*
+ * Merge patch tests
+ */
+
+static int
+merges_to(const char *target, const char *patch, const char *want)
+{
+	j64_t j = decode(target);
+	j64_t p = decode(patch);
+	j64_t w = decode(want);
+	int res = j64_merge_patch(&j, p) && j64__equal(j, w);
+	j64_release(j);
+	j64_release(p);
+	j64_release(w);
+	return res;
+}
+
+int
+test_merge_patch_rfc(void)
+{
+	return merges_to("{\"a\":\"b\"}", "{\"a\":\"c\"}", "{\"a\":\"c\"}") &&
+	    merges_to("{\"a\":\"b\"}", "{\"b\":\"c\"}", "{\"a\":\"b\",\"b\":\"c\"}") &&
+	    merges_to("{\"a\":\"b\"}", "{\"a\":null}", "{}") &&
+	    merges_to("{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":null}", "{\"b\":\"c\"}") &&
+	    merges_to("{\"a\":[\"b\"]}", "{\"a\":\"c\"}", "{\"a\":\"c\"}") &&
+	    merges_to("{\"a\":\"c\"}", "{\"a\":[\"b\"]}", "{\"a\":[\"b\"]}") &&
+	    merges_to("{\"a\":{\"b\":\"c\"}}", "{\"a\":{\"b\":\"d\",\"c\":null}}", "{\"a\":{\"b\":\"d\"}}") &&
+	    merges_to("{\"a\":[{\"b\":\"c\"}]}", "{\"a\":[1]}", "{\"a\":[1]}") &&
+	    merges_to("[\"a\",\"b\"]", "[\"c\",\"d\"]", "[\"c\",\"d\"]") &&
+	    merges_to("{\"a\":\"b\"}", "[\"c\"]", "[\"c\"]") &&
+	    merges_to("{\"a\":\"foo\"}", "null", "null") &&
+	    merges_to("{\"a\":\"foo\"}", "\"bar\"", "\"bar\"") &&
+	    merges_to("{\"e\":null}", "{\"a\":1}", "{\"e\":null,\"a\":1}") &&
+	    merges_to("[1,2]", "{\"a\":\"b\",\"c\":null}", "{\"a\":\"b\"}") &&
+	    merges_to("{}", "{\"a\":{\"bb\":{\"ccc\":null}}}", "{\"a\":{\"bb\":{}}}");
+}
+
+int
+test_merge_patch_in_place(void)
+{
+	j64_t j = decode("{\"user\":{\"name\":\"a boxed string\",\"age\":30,\"tags\":[1]},\"n\":1}");
+	j64_t p = decode("{\"user\":{\"age\":31,\"tags\":null,\"nick\":\"x\"}}");
+	j64_t want = decode("{\"user\":{\"name\":\"a boxed string\",\"age\":31,\"nick\":\"x\"},\"n\":1}");
+	j64_t root = j, user = j64_obj_get(j, j64_istr("user", 4));
+	j64_t name = j64_obj_get(user, j64_istr("name", 4));
+	int res = j64_merge_patch(&j, p) && same(j, want);
+	res = res && j.w == root.w && j64_obj_get(j, j64_istr("user", 4)).w == user.w;
+	res = res && j64_obj_get(user, j64_istr("name", 4)).w == name.w;
+	j64_release(j);
+	j = j64_undef();
+	res = res && j64_merge_patch(&j, p) && j64_obj_len(j) == 1;
+	j64_release(j);
+	j64_release(p);
+	j64_release(want);
+	return res;
+}
+
+/*
+ * Canonical encoding tests
+ */
+
+static int
+canonical(j64_t j, const char *s)
+{
+	size_t len;
+	char *buf = j64_encode_canonical(j, &len);
+	int res = buf != NULL && len == strlen(s) && strcmp(buf, s) == 0;
+	free(buf);
+	return res;
+}
+
+static int
+canonical_of(const char *in, const char *s)
+{
+	j64_t j = decode(in);
+	int res = canonical(j, s);
+	j64_release(j);
+	return res;
+}
+
+int
+test_canonical_keys(void)
+{
+	return canonical_of("{\"b\":1,\"a\":2,\"aa\":3,\"B\":4,\"\":5}",
+	        "{\"\":5,\"B\":4,\"a\":2,\"aa\":3,\"b\":1}") &&
+	    canonical_of("{\"abcdefgh\":1,\"abcdefg\":2,\"abcdefgi\":3,\"abcdeff\":4}",
+	        "{\"abcdeff\":4,\"abcdefg\":2,\"abcdefgh\":1,\"abcdefgi\":3}") &&
+	    canonical_of("{\"\\u0000\":1,\"\":2,\"a\\u0000\":3,\"a\":4}",
+	        "{\"\":2,\"\\u0000\":1,\"a\":4,\"a\\u0000\":3}") &&
+	    /* U+FB01 sorts after U+1F600 in UTF-16, though not in UTF-8 */
+	    canonical_of("{\"\xef\xac\x81\":1,\"\xf0\x9f\x98\x80\":2,\"z\":3,\"\xc3\xa9\":4}",
+	        "{\"z\":3,\"\xc3\xa9\":4,\"\xf0\x9f\x98\x80\":2,\"\xef\xac\x81\":1}") &&
+	    canonical_of("{\"k\":{\"y\":[{\"b\":0,\"a\":1}],\"x\":null},\"j\":[]}",
+	        "{\"j\":[],\"k\":{\"x\":null,\"y\":[{\"a\":1,\"b\":0}]}}") &&
+	    canonical_of("{\"j\":1,\"i\":2,\"h\":3,\"g\":4,\"f\":5,\"e\":6,\"d\":7,\"c\":8,\"b\":9,\"a\":10}",
+	        "{\"a\":10,\"b\":9,\"c\":8,\"d\":7,\"e\":6,\"f\":5,\"g\":4,\"h\":3,\"i\":2,\"j\":1}");
+}
+
+int
+test_canonical_numbers(void)
+{
+	j64_t arr = j64_barr_alloc(1);
+	int res;
+
+	res = canonical_of("[1.0,4.50,-0.0,0,-7,100.0,1e20,1e21]",
+	        "[1,4.5,0,0,-7,100,100000000000000000000,1e+21]") &&
+	    canonical_of("[1e30,2e-3,1e-6,1e-7,-1.25e25,1.5e-300,0.1]",
+	        "[1e+30,0.002,0.000001,1e-7,-1.25e+25,1.5e-300,0.1]") &&
+	    canonical_of("[333333333.3333333,123456789012345680000]",
+	        "[333333333.333333,123456789012345700000]") &&
+	    canonical(j64_int(9007199254740992LL), "9007199254740992") &&
+	    canonical(j64_int(-9007199254740992LL), "-9007199254740992") &&
+	    canonical(j64_int(9007199254740993LL), "9007199254740992") &&
+	    canonical(j64_int(123456789012345678LL), "123456789012345680") &&
+	    canonical(j64_int(-123456789012345678LL), "-123456789012345680") &&
+	    canonical(j64_int(J64_INT_MAX), "2305843009213694000");
+
+	/* Infinities have no canonical form */
+	j64_barr_set(arr, j64_float(1e308 * 10.0), 0);
+	res = res && j64_encode_canonical(arr, NULL) == NULL;
+	j64_barr_set(arr, j64_float(-1e308 * 10.0), 0);
+	res = res && j64_encode_canonical(arr, NULL) == NULL;
+	j64_release(arr);
+
+	return res;
+}
+
+int
+test_canonical_strings(void)
+{
+	j64_t arr = j64_barr_alloc(2);
+	int res;
+
+	res = canonical_of("[\"\\u001f\\\"\\\\\\n\\t\\u007f\\/\",\"\\u00e9\"]",
+	        "[\"\\u001f\\\"\\\\\\n\\t\x7f/\",\"\xc3\xa9\"]") &&
+	    canonical_of("[\"a boxed string\",\"\",true,false,null,{},[]]",
+	        "[\"a boxed string\",\"\",true,false,null,{},[]]");
+
+	/* Unset elements are null, as in plain encoding */
+	res = res && canonical(arr, "[null,null]");
+	j64_release(arr);
+
+	return res;
+}
+
+/*
+ * Binary format tests
+ */
+
+static int
+bin_encodes_to(char *(*encode)(j64_t, size_t *), j64_t j, const char *s, size_t n)
+{
+	size_t len;
+	char *buf = encode(j, &len);
+	int res = buf != NULL && len == n && memcmp(buf, s, n) == 0;
+	free(buf);
+	return res;
+}
+
+int
+test_cbor(void)
+{
+	j64_t j = decode("{\"a\":[1,-1,true]}");
+	int res;
+
+	res = bin_encodes_to(j64_cbor_encode, j, "\xa1\x61\x61\x83\x01\x20\xf5", 7) &&
+	    bin_encodes_to(j64_cbor_encode, j64_int(23), "\x17", 1) &&
+	    bin_encodes_to(j64_cbor_encode, j64_int(24), "\x18\x18", 2) &&
+	    bin_encodes_to(j64_cbor_encode, j64_int(-1000), "\x39\x03\xe7", 3) &&
+	    bin_encodes_to(j64_cbor_encode, j64_int(J64_INT_MAX), "\x1b\x1f\xff\xff\xff\xff\xff\xff\xff", 9) &&
+	    bin_encodes_to(j64_cbor_encode, j64_float(1.5), "\xfb\x3f\xf8\0\0\0\0\0\0", 9) &&
+	    bin_encodes_to(j64_cbor_encode, j64_istr("abc", 3), "\x63" "abc", 4) &&
+	    bin_encodes_to(j64_cbor_encode, j64_null(), "\xf6", 1) &&
+	    bin_encodes_to(j64_cbor_encode, j64_eobj(), "\xa0", 1) &&
+	    bin_encodes_to(j64_cbor_encode, j64_earr(), "\x80", 1);
+	j64_release(j);
+
+	/* Smaller floats, tags, undefined and big integers */
+	res = res && j64_float_get(j64_cbor_decode("\xf9\x3e\x00", 3)) == 1.5 &&
+	    j64_float_get(j64_cbor_decode("\xf9\xc4\x00", 3)) == -4.0 &&
+	    j64_float_get(j64_cbor_decode("\xf9\x00\x01", 3)) == 1.0 / 16777216.0 &&
+	    j64_float_get(j64_cbor_decode("\xfa\x47\xc3\x50\x00", 5)) == 100000.0 &&
+	    j64_int_get(j64_cbor_decode("\xc1\x1a\x51\x4b\x67\xb0", 6)) == 1363896240 &&
+	    j64_is_null(j64_cbor_decode("\xf7", 1)) &&
+	    j64_int_get(j64_cbor_decode("\x3b\x1f\xff\xff\xff\xff\xff\xff\xff", 9)) == J64_INT_MIN &&
+	    j64_is_float(j64_cbor_decode("\x1b\x20\0\0\0\0\0\0\0", 9));
+
+	/* Truncated, trailing, byte strings, indefinite lengths, non-text keys */
+	res = res && j64_is_undef(j64_cbor_decode("", 0)) &&
+	    j64_is_undef(j64_cbor_decode("\x82\x01", 2)) &&
+	    j64_is_undef(j64_cbor_decode("\x63" "ab", 3)) &&
+	    j64_is_undef(j64_cbor_decode("\x01\x01", 2)) &&
+	    j64_is_undef(j64_cbor_decode("\x41\x00", 2)) &&
+	    j64_is_undef(j64_cbor_decode("\x9f\xff", 2)) &&
+	    j64_is_undef(j64_cbor_decode("\xa1\x01\x01", 3)) &&
+	    j64_is_undef(j64_cbor_decode("\x9b\xff\xff\xff\xff\xff\xff\xff\xff", 9));
+
+	return res;
+}
+
+int
+test_cbor_tags(void)
+{
+	size_t n = (size_t)1 << 24;
+	char *buf = (char *)malloc(n + 1);
+	int res;
+
+	if (buf == NULL)
+		return 0;
+
+	/* Millions of tags around a single item, then around nothing */
+	memset(buf, 0xc6, n);
+	buf[n] = 0x01;
+	res = j64_int_get(j64_cbor_decode(buf, n + 1)) == 1 &&
+	    j64_is_undef(j64_cbor_decode(buf, n));
+
+	/* Arrays nest only as deep as the validator allows */
+	memset(buf, 0x81, n);
+	res = res && j64_is_undef(j64_cbor_decode(buf, n + 1));
+	free(buf);
+	return res;
+}
+
+int
+test_msgpack(void)
+{
+	j64_t j = decode("{\"a\":[1,-1,true]}");
+	int res;
+
+	res = bin_encodes_to(j64_msgpack_encode, j, "\x81\xa1\x61\x93\x01\xff\xc3", 7) &&
+	    bin_encodes_to(j64_msgpack_encode, j64_int(127), "\x7f", 1) &&
+	    bin_encodes_to(j64_msgpack_encode, j64_int(128), "\xcc\x80", 2) &&
+	    bin_encodes_to(j64_msgpack_encode, j64_int(-33), "\xd0\xdf", 2) &&
+	    bin_encodes_to(j64_msgpack_encode, j64_int(65536), "\xce\0\x01\0\0", 5) &&
+	    bin_encodes_to(j64_msgpack_encode, j64_int(-40000), "\xd2\xff\xff\x63\xc0", 5) &&
+	    bin_encodes_to(j64_msgpack_encode, j64_float(1.5), "\xcb\x3f\xf8\0\0\0\0\0\0", 9) &&
+	    bin_encodes_to(j64_msgpack_encode, j64_false(), "\xc2", 1) &&
+	    bin_encodes_to(j64_msgpack_encode, j64_undef(), "\xc0", 1) &&
+	    bin_encodes_to(j64_msgpack_encode, j64_estr(), "\xa0", 1);
+	j64_release(j);
+
+	j = j64_bstr("a string of thirty-two bytes....", 32);
+	res = res && bin_encodes_to(j64_msgpack_encode, j, "\xd9\x20" "a string of thirty-two bytes....", 34);
+	j64_release(j);
+
+	res = res && j64_int_get(j64_msgpack_decode("\xe0", 1)) == -32 &&
+	    j64_int_get(j64_msgpack_decode("\xd1\x80\x00", 3)) == -32768 &&
+	    j64_int_get(j64_msgpack_decode("\xcd\xff\xff", 3)) == 65535 &&
+	    j64_float_get(j64_msgpack_decode("\xca\x3f\xc0\0\0", 5)) == 1.5 &&
+	    j64_is_float(j64_msgpack_decode("\xcf\xff\xff\xff\xff\xff\xff\xff\xff", 9)) &&
+	    j64_is_float(j64_msgpack_decode("\xd3\x80\0\0\0\0\0\0\0", 9)) &&
+	    j64_is_estr(j64_msgpack_decode("\xda\0\0", 3)) &&
+	    j64_is_earr(j64_msgpack_decode("\xdc\0\0", 3));
+
+	/* Truncated, trailing, bin, ext, reserved and non-text keys */
+	res = res && j64_is_undef(j64_msgpack_decode("\x92\x01", 2)) &&
+	    j64_is_undef(j64_msgpack_decode("\xcd\x01", 2)) &&
+	    j64_is_undef(j64_msgpack_decode("\xc0\xc0", 2)) &&
+	    j64_is_undef(j64_msgpack_decode("\xc4\x01\x00", 3)) &&
+	    j64_is_undef(j64_msgpack_decode("\xd4\x01\x00", 3)) &&
+	    j64_is_undef(j64_msgpack_decode("\xc1", 1)) &&
+	    j64_is_undef(j64_msgpack_decode("\x81\x01\x01", 3)) &&
+	    j64_is_undef(j64_msgpack_decode("\xdd\xff\xff\xff\xff", 5));
+
+	return res;
+}
+
+static int
+bin_roundtrips(char *(*encode)(j64_t, size_t *), j64_t (*dec)(const void *, size_t), j64_t j)
+{
+	size_t len;
+	char *buf = encode(j, &len);
+	j64_t k = buf != NULL ? dec(buf, len) : j64_undef();
+	int res = same(j, k);
+	free(buf);
+	j64_release(k);
+	return res;
+}
+
+int
+test_bin_roundtrip(void)
+{
+	const char *s = "{\"id\":12345678901,\"name\":\"a boxed string\",\"f\":-0.25,"
+	    "\"tags\":[\"x\",\"\",[],{},null,false],\"nested\":{\"k\":{\"k\":[1,2,3]}},"
+	    "\"big\":[-2305843009213693952,2305843009213693951,1e300],"
+	    "\"keys\":{\"a\":1,\"b\":2,\"c\":3,\"d\":4,\"e\":5,\"f\":6,\"g\":7,\"h\":8,"
+	    "\"i\":9,\"j\":10,\"k\":11,\"l\":12,\"m\":13,\"n\":14,\"o\":15,\"p\":16}}";
+	j64_t j = decode(s);
+	j64_t deep = j64_earr();
+	size_t i;
+	char *buf;
+	size_t len;
+	int res;
+
+	res = bin_roundtrips(j64_cbor_encode, j64_cbor_decode, j) &&
+	    bin_roundtrips(j64_msgpack_encode, j64_msgpack_decode, j);
+	j64_release(j);
+
+	/* Nesting is limited */
+	for (i = 0; i <= J64_BIN_DEPTH_MAX; i++) {
+		j = j64_barr_alloc(1);
+		j64_barr_set(j, deep, 0);
+		deep = j;
+	}
+	buf = j64_cbor_encode(deep, &len);
+	res = res && buf != NULL && j64_is_undef(j64_cbor_decode(buf, len));
+	free(buf);
+	buf = j64_msgpack_encode(deep, &len);
+	res = res && buf != NULL && j64_is_undef(j64_msgpack_decode(buf, len));
+	free(buf);
+	j64_release(deep);
+
+	return res;
+}
+
+/*
+ * File ingestion tests
+ */
+
+#ifdef J64_FILE_IO
+struct chunks {
+	char	*buf;
+	size_t	len;
+	size_t	max;	/* largest chunk allowed */
+	size_t	n;
+	size_t	stop;	/* chunks to take before stopping, or 0 */
+};
+
+static int
+chunks_put(void *arg, const void *buf, size_t len)
+{
+	struct chunks *c = (struct chunks *)arg;
+	if (len == 0 || len > c->max)
+		return 0;
+	memcpy(&c->buf[c->len], buf, len);
+	c->len += len;
+	c->n++;
+	return c->stop == 0 || c->n < c->stop;
+}
+
+/* Reads FD in chunks of MAX bytes, checking they make up S */
+static int
+reads_as(int fd, size_t max, const char *s, size_t len)
+{
+	struct chunks c;
+	int res;
+	c.buf = (char *)malloc(len + 1);
+	c.len = 0;
+	c.max = max != 0 ? max : J64_FILE_CHUNK;
+	c.n = 0;
+	c.stop = 0;
+	res = c.buf != NULL && j64_file_read(fd, max, chunks_put, &c) &&
+	    c.len == len && memcmp(c.buf, s, len) == 0 &&
+	    c.n >= len / c.max;
+	free(c.buf);
+	return res;
+}
+
+static FILE *
+temp_file(const char *s, size_t len)
+{
+	FILE *fp = tmpfile();
+	if (fp == NULL)
+		return NULL;
+	if (fwrite(s, 1, len, fp) != len || fflush(fp) != 0) {
+		fclose(fp);
+		return NULL;
+	}
+	lseek(fileno(fp), 0, SEEK_SET);
+	return fp;
+}
+
+static char *
+file_text(size_t len)
+{
+	char *s = (char *)malloc(len);
+	size_t i;
+	for (i = 0; s != NULL && i < len; i++)
+		s[i] = (char)('a' + (i * 7 + i / 13) % 26);
+	return s;
+}
+
+int
+test_file_read(void)
+{
+	const size_t len = 300000;
+	char *s = file_text(len);
+	FILE *fp = s != NULL ? temp_file(s, len) : NULL;
+	struct chunks c;
+	int fd, res;
+
+	if (fp == NULL) {
+		free(s);
+		return 0;
+	}
+	fd = fileno(fp);
+
+	res = reads_as(fd, 4096, s, len) &&
+	    lseek(fd, 0, SEEK_CUR) == (off_t)len &&
+	    reads_as(fd, 4096, "", 0);
+	lseek(fd, 0, SEEK_SET);
+	res = res && reads_as(fd, 999, s, len);
+	lseek(fd, 0, SEEK_SET);
+	res = res && reads_as(fd, 0, s, len);
+	lseek(fd, 12345, SEEK_SET);
+	res = res && reads_as(fd, 4096, s + 12345, len - 12345);
+
+	/* A function can stop the reading */
+	lseek(fd, 0, SEEK_SET);
+	c.buf = (char *)malloc(len);
+	c.len = 0;
+	c.max = 1000;
+	c.n = 0;
+	c.stop = 3;
+	res = res && c.buf != NULL && !j64_file_read(fd, 1000, chunks_put, &c) &&
+	    c.n == 3 && memcmp(c.buf, s, c.len) == 0;
+	free(c.buf);
+
+	res = res && !j64_file_read(-1, 0, chunks_put, &c);
+
+	fclose(fp);
+	free(s);
+	return res;
+}
+
+int
+test_file_pipe(void)
+{
+	const size_t len = 10000;
+	char *s = file_text(len);
+	int fds[2];
+	int res;
+
+	if (s == NULL || pipe(fds) != 0) {
+		free(s);
+		return 0;
+	}
+	res = write(fds[1], s, len) == (ssize_t)len;
+	close(fds[1]);
+	res = res && reads_as(fds[0], 7, s, len);
+	close(fds[0]);
+	free(s);
+	return res;
+}
+
+int
+test_file_decode(void)
+{
+	const size_t n = 50000;
+	char *s = (char *)malloc(16 * n + 2);
+	size_t i, len = 0;
+	FILE *fp;
+	j64_t j, k;
+	int res;
+
+	if (s == NULL)
+		return 0;
+	s[len++] = '[';
+	for (i = 0; i < n; i++)
+		len += (size_t)sprintf(&s[len], i % 3 ? "%lu," : "\"s%lu\",", (unsigned long)i);
+	s[len - 1] = ']';
+
+	fp = temp_file(s, len);
+	if (fp == NULL) {
+		free(s);
+		return 0;
+	}
+	j = j64_file_decode(fileno(fp));
+	k = j64_decode(s, len);
+	res = j64_barr_cap(j) == n && same(j, k);
+	j64_release(j);
+	j64_release(k);
+	fclose(fp);
+
+	/* Truncated text */
+	fp = temp_file(s, len - 1);
+	res = res && fp != NULL && j64_is_undef(j64_file_decode(fileno(fp)));
+	if (fp != NULL)
+		fclose(fp);
+
+	free(s);
+	return res;
+}
+#endif /* J64_FILE_IO */
+
+/*
+ * Compressed input tests
+ */
+
+#ifdef J64_GZIP
+/* Appends S compressed as a gzip member to BUF, which has room */
+static size_t
+gzip_to(char *buf, const char *s, size_t len)
+{
+	z_stream z;
+	size_t n;
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	z.next_in = (Bytef *)(uintptr_t)s;
+	z.avail_in = (uInt)len;
+	z.next_out = (Bytef *)buf;
+	z.avail_out = (uInt)deflateBound(&z, (uLong)len);
+	n = deflate(&z, Z_FINISH) == Z_STREAM_END ? z.total_out : 0;
+	deflateEnd(&z);
+	return n;
+}
+#endif /* J64_GZIP */
+
+#if defined(J64_GZIP) || defined(J64_ZSTD)
+/* A JSON array of N numbers and strings */
+static char *
+inflate_doc(size_t n, size_t *lenp)
+{
+	char *s = (char *)malloc(16 * n + 2);
+	size_t i, len = 0;
+	if (s == NULL)
+		return NULL;
+	s[len++] = '[';
+	for (i = 0; i < n; i++)
+		len += (size_t)sprintf(&s[len], i % 3 ? "%lu," : "\"s%lu\",", (unsigned long)i);
+	s[len - 1] = ']';
+	*lenp = len;
+	return s;
+}
+
+/* Decodes LEN bytes of BUF written to a file */
+static j64_t
+inflate_file(const char *buf, size_t len)
+{
+	FILE *fp = temp_file(buf, len);
+	j64_t j;
+	if (fp == NULL)
+		return j64_undef();
+	j = j64_inflate_decode(fileno(fp));
+	fclose(fp);
+	return j;
+}
+#endif /* J64_GZIP || J64_ZSTD */
+
+#ifdef J64_GZIP
+int
+test_inflate_gzip(void)
+{
+	size_t len, zlen, n;
+	char *s = inflate_doc(200000, &len);
+	char *z = s != NULL ? (char *)malloc(len + 1024) : NULL;
+	j64_t j, k;
+	int res;
+
+	if (z == NULL) {
+		free(s);
+		return 0;
+	}
+
+	/* Several ring buffers of text */
+	zlen = gzip_to(z, s, len);
+	j = inflate_file(z, zlen);
+	k = j64_decode(s, len);
+	res = zlen > 0 && len > 4 * J64_INFLATE_CHUNK && same(j, k);
+	j64_release(j);
+
+	/* Concatenated members, split inside a token */
+	n = len / 2 + 3;
+	zlen = gzip_to(z, s, n);
+	zlen += gzip_to(&z[zlen], &s[n], len - n);
+	j = inflate_file(z, zlen);
+	res = res && same(j, k);
+	j64_release(j);
+	j64_release(k);
+
+	free(z);
+	free(s);
+	return res;
+}
+
+int
+test_inflate_plain(void)
+{
+	size_t len;
+	char *s = inflate_doc(100000, &len);
+	j64_t j, k;
+	int res;
+
+	if (s == NULL)
+		return 0;
+	j = inflate_file(s, len);
+	k = j64_decode(s, len);
+	res = same(j, k);
+	j64_release(j);
+	j64_release(k);
+
+	/* Shorter than a magic number */
+	j = inflate_file("12", 2);
+	res = res && j64_int_get(j) == 12 && j64_is_undef(inflate_file("", 0));
+
+	free(s);
+	return res;
+}
+
+int
+test_inflate_invalid(void)
+{
+	const char *s = "{\"a\":[1,2,3],\"b\":\"a boxed string\"}";
+	char z[256];
+	size_t zlen = gzip_to(z, s, strlen(s));
+	int res = zlen > 20;
+	j64_t j;
+
+	/* Truncated, corrupt and followed by garbage */
+	res = res && j64_is_undef(inflate_file(z, zlen - 5));
+	z[zlen / 2] = (char)~z[zlen / 2];
+	res = res && j64_is_undef(inflate_file(z, zlen));
+	z[zlen / 2] = (char)~z[zlen / 2];
+	z[zlen] = 'x';
+	res = res && j64_is_undef(inflate_file(z, zlen + 1));
+	j = inflate_file(z, zlen);
+	res = res && j64_is_obj(j);
+	j64_release(j);
+
+	return res;
+}
+
+/* Counts chunks and stops after the given number */
+struct inflate_stop {
+	size_t	calls;
+	size_t	after;
+};
+
+static int
+inflate_stop_fn(void *arg, const void *buf, size_t len)
+{
+	struct inflate_stop *st = (struct inflate_stop *)arg;
+	(void)buf;
+	(void)len;
+	return ++st->calls < st->after;
+}
+
+int
+test_inflate_stop(void)
+{
+	size_t len, zlen;
+	char *s = inflate_doc(400000, &len);
+	char *z = s != NULL ? (char *)malloc(len + 1024) : NULL;
+	struct inflate_stop st;
+	FILE *fp;
+	int res;
+
+	if (z == NULL) {
+		free(s);
+		return 0;
+	}
+
+	/* The thread still has text to decompress when the reader stops */
+	zlen = gzip_to(z, s, len);
+	fp = temp_file(z, zlen);
+	res = zlen > 0 && len > 4 * J64_INFLATE_BUFS * J64_INFLATE_CHUNK && fp != NULL;
+	st.calls = 0;
+	st.after = 1;
+	res = res && !j64_inflate_read(fileno(fp), inflate_stop_fn, &st) && st.calls == 1;
+	if (fp != NULL)
+		fclose(fp);
+
+	/* The same for uncompressed input, after a few chunks */
+	fp = temp_file(s, len);
+	st.calls = 0;
+	st.after = 3;
+	res = res && fp != NULL &&
+	    !j64_inflate_read(fileno(fp), inflate_stop_fn, &st) && st.calls == 3;
+	if (fp != NULL)
+		fclose(fp);
+
+	free(z);
+	free(s);
+	return res;
+}
+#endif /* J64_GZIP */
+
+#ifdef J64_ZSTD
+int
+test_inflate_zstd(void)
+{
+	size_t len, zlen, n;
+	char *s = inflate_doc(200000, &len);
+	char *z = s != NULL ? (char *)malloc(2 * ZSTD_compressBound(len)) : NULL;
+	j64_t j, k;
+	int res;
+
+	if (z == NULL) {
+		free(s);
+		return 0;
+	}
+
+	/* Several ring buffers of text */
+	zlen = ZSTD_compress(z, ZSTD_compressBound(len), s, len, 3);
+	res = !ZSTD_isError(zlen) && len > 4 * J64_INFLATE_CHUNK;
+	j = res ? inflate_file(z, zlen) : j64_undef();
+	k = j64_decode(s, len);
+	res = res && same(j, k);
+	j64_release(j);
+
+	/* Concatenated frames, split inside a token */
+	n = len / 2 + 3;
+	zlen = ZSTD_compress(z, ZSTD_compressBound(n), s, n, 3);
+	res = res && !ZSTD_isError(zlen);
+	n = res ? ZSTD_compress(&z[zlen], ZSTD_compressBound(len - n), &s[n], len - n, 3) : 0;
+	res = res && !ZSTD_isError(n);
+	zlen += n;
+	j = res ? inflate_file(z, zlen) : j64_undef();
+	res = res && same(j, k);
+	j64_release(j);
+	j64_release(k);
+
+	/* Truncated */
+	res = res && j64_is_undef(inflate_file(z, zlen - 5));
+
+	free(z);
+	free(s);
+	return res;
+}
+#endif /* J64_ZSTD */